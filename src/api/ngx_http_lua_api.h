@@ -11,6 +11,20 @@
 
 /* Public API for other Nginx modules */
 
+
+typedef struct {
+    ngx_uint_t      keys;        /* items stored, including expired ones
+                                    not reclaimed yet */
+    ngx_uint_t      hits;
+    ngx_uint_t      misses;
+    ngx_uint_t      sets;
+    ngx_uint_t      evicted;     /* valid items removed by LRU */
+    ngx_uint_t      reclaimed;   /* expired items freed */
+    ngx_uint_t      pages;       /* total slab pages */
+    ngx_uint_t      free_pages;
+} ngx_http_lua_shared_dict_stats_t;
+
+
 lua_State * ngx_http_lua_get_global_state(ngx_conf_t *cf);
 
 ngx_http_request_t *ngx_http_lua_get_request(lua_State *L);
@@ -18,6 +32,11 @@ ngx_http_request_t *ngx_http_lua_get_request(lua_State *L);
 void ngx_http_lua_add_package_preload(ngx_conf_t *cf, const char *package,
     lua_CFunction func);
 
+ngx_shm_zone_t *ngx_http_lua_find_zone(u_char *name_data, size_t name_len);
+
+void ngx_http_lua_shared_dict_get_stats(ngx_shm_zone_t *zone,
+    ngx_http_lua_shared_dict_stats_t *stats);
+
 
 #endif /* NGX_HTTP_LUA_API_H */
 
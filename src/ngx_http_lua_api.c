@@ -5,6 +5,7 @@
 #include "ngx_http_lua_common.h"
 #include "api/ngx_http_lua_api.h"
 #include "ngx_http_lua_util.h"
+#include "ngx_http_lua_shdict.h"
 
 
 lua_State *
@@ -48,3 +49,33 @@ ngx_http_lua_add_package_preload(ngx_conf_t *cf, const char *package,
     lua_pop(L, 2);
 }
 
+
+ngx_shm_zone_t *
+ngx_http_lua_find_zone(u_char *name_data, size_t name_len)
+{
+    ngx_uint_t                   i;
+    ngx_shm_zone_t             **zone;
+    ngx_http_lua_shdict_ctx_t   *ctx;
+    ngx_http_lua_main_conf_t    *lmcf;
+
+    lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_lua_module);
+
+    if (lmcf == NULL || lmcf->shm_zones == NULL) {
+        return NULL;
+    }
+
+    zone = lmcf->shm_zones->elts;
+
+    for (i = 0; i < lmcf->shm_zones->nelts; i++) {
+        ctx = zone[i]->data;
+
+        if (ctx->name.len == name_len
+            && ngx_strncmp(ctx->name.data, name_data, name_len) == 0)
+        {
+            return zone[i];
+        }
+    }
+
+    return NULL;
+}
+
@@ -100,6 +100,8 @@ struct ngx_http_lua_main_conf_s {
 
     ngx_array_t     *shm_zones;  /* of ngx_shm_zone_t* */
 
+    ngx_msec_t       resolver_cache;
+
     ngx_flag_t       postponed_to_rewrite_phase_end;
     ngx_flag_t       postponed_to_access_phase_end;
 
@@ -171,6 +173,7 @@ typedef struct {
 
     ngx_msec_t                       keepalive_timeout;
     ngx_msec_t                       connect_timeout;
+    ngx_msec_t                       connect_cooldown;
     ngx_msec_t                       send_timeout;
     ngx_msec_t                       read_timeout;
 
@@ -201,7 +204,6 @@ typedef struct {
     ngx_chain_t             *out;  /* buffered output chain for HTTP 1.0 */
     ngx_chain_t             *free_bufs;
     ngx_chain_t             *busy_bufs;
-    ngx_chain_t             *free_recv_bufs;
     ngx_chain_t             *flush_buf;
 
     ngx_http_cleanup_pt     *cleanup;
@@ -46,6 +46,7 @@ ngx_http_lua_create_main_conf(ngx_conf_t *cf)
     lmcf->regex_cache_max_entries = NGX_CONF_UNSET;
 #endif
     lmcf->postponed_to_rewrite_phase_end = NGX_CONF_UNSET;
+    lmcf->resolver_cache = NGX_CONF_UNSET_MSEC;
 
     dd("nginx Lua module main config structure initialized!");
 
@@ -64,6 +65,10 @@ ngx_http_lua_init_main_conf(ngx_conf_t *cf, void *conf)
     }
 #endif
 
+    if (lmcf->resolver_cache == NGX_CONF_UNSET_MSEC) {
+        lmcf->resolver_cache = 0;
+    }
+
     return NGX_CONF_OK;
 }
 
@@ -108,6 +113,7 @@ ngx_http_lua_create_loc_conf(ngx_conf_t *cf)
 
     conf->keepalive_timeout = NGX_CONF_UNSET_MSEC;
     conf->connect_timeout = NGX_CONF_UNSET_MSEC;
+    conf->connect_cooldown = NGX_CONF_UNSET_MSEC;
     conf->send_timeout = NGX_CONF_UNSET_MSEC;
     conf->read_timeout = NGX_CONF_UNSET_MSEC;
     conf->send_lowat = NGX_CONF_UNSET_SIZE;
@@ -172,6 +178,9 @@ ngx_http_lua_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_msec_value(conf->connect_timeout,
                               prev->connect_timeout, 60000);
 
+    ngx_conf_merge_msec_value(conf->connect_cooldown,
+                              prev->connect_cooldown, 10000);
+
     ngx_conf_merge_msec_value(conf->send_timeout,
                               prev->send_timeout, 60000);
 
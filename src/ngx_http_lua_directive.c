@@ -35,6 +35,10 @@ ngx_http_lua_shared_dict(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_shm_zone_t            **zp;
     ngx_http_lua_shdict_ctx_t  *ctx;
     ssize_t                     size;
+    ngx_int_t                   stripes;
+    ngx_uint_t                  i, index;
+    ngx_msec_t                  sweep, threshold, persist_interval;
+    ngx_str_t                   s, persist;
 
     if (lmcf->shm_zones == NULL) {
         lmcf->shm_zones = ngx_palloc(cf->pool, sizeof(ngx_array_t));
@@ -65,12 +69,162 @@ ngx_http_lua_shared_dict(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    stripes = 1;
+    index = NGX_HTTP_LUA_SHDICT_INDEX_RBTREE;
+    sweep = 0;
+    threshold = 10;
+    persist.len = 0;
+    persist.data = NULL;
+    persist_interval = NGX_CONF_UNSET_MSEC;
+
+    for (i = 3; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "stripes=", 8) == 0) {
+
+            stripes = ngx_atoi(value[i].data + 8, value[i].len - 8);
+
+            if (stripes == NGX_ERROR || stripes < 1
+                || stripes > NGX_HTTP_LUA_SHDICT_MAX_STRIPES)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid number of stripes \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "sweep=", 6) == 0) {
+
+            s.len = value[i].len - 6;
+            s.data = value[i].data + 6;
+
+            sweep = ngx_parse_time(&s, 0);
+            if (sweep == (ngx_msec_t) NGX_ERROR || sweep == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid sweep interval \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "sweep_threshold=", 16) == 0) {
+
+            s.len = value[i].len - 16;
+            s.data = value[i].data + 16;
+
+            threshold = ngx_parse_time(&s, 0);
+            if (threshold == (ngx_msec_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid sweep threshold \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "persist=", 8) == 0) {
+
+            persist.len = value[i].len - 8;
+            persist.data = value[i].data + 8;
+
+            if (persist.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid persist file \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (ngx_conf_full_name(cf->cycle, &persist, 0) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "persist_interval=", 17) == 0) {
+
+            s.len = value[i].len - 17;
+            s.data = value[i].data + 17;
+
+            persist_interval = ngx_parse_time(&s, 0);
+            if (persist_interval == (ngx_msec_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid persist interval \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "index=rbtree") == 0) {
+            index = NGX_HTTP_LUA_SHDICT_INDEX_RBTREE;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "index=hash") == 0) {
+            index = NGX_HTTP_LUA_SHDICT_INDEX_HASH;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (stripes > 1) {
+#if !(NGX_HAVE_ATOMIC_OPS)
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "lua shared dict stripes require atomic "
+                           "operations support");
+        return NGX_CONF_ERROR;
+#else
+        if ((size_t) size / stripes < 8 * ngx_pagesize) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "lua shared dict size \"%V\" is too small "
+                               "for %i stripes", &value[2], stripes);
+            return NGX_CONF_ERROR;
+        }
+#endif
+    }
+
+    if (persist_interval != NGX_CONF_UNSET_MSEC && persist.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"persist_interval\" requires \"persist\"");
+        return NGX_CONF_ERROR;
+    }
+
     ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_lua_shdict_ctx_t));
     if (ctx == NULL) {
         return NGX_CONF_ERROR;
     }
 
+    if (persist.len) {
+        ctx->persist = persist;
+
+        ctx->persist_temp.len = persist.len + sizeof(".tmp") - 1;
+        ctx->persist_temp.data = ngx_pnalloc(cf->pool,
+                                             ctx->persist_temp.len + 1);
+        if (ctx->persist_temp.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_sprintf(ctx->persist_temp.data, "%V.tmp%Z", &persist);
+
+        ctx->persist_interval = persist_interval == NGX_CONF_UNSET_MSEC
+                                ? 60000 : persist_interval;
+    }
+
     ctx->name = name;
+    ctx->nstripes = (ngx_uint_t) stripes;
+    ctx->index = index;
+    ctx->sweep_interval = sweep;
+    ctx->sweep_threshold = threshold;
     ctx->main_conf = lmcf;
     ctx->log = &cf->cycle->new_log;
 
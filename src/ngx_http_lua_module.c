@@ -15,6 +15,7 @@
 #include "ngx_http_lua_headerfilterby.h"
 #include "ngx_http_lua_bodyfilterby.h"
 #include "ngx_http_lua_initby.h"
+#include "ngx_http_lua_shdict.h"
 
 
 #if !defined(nginx_version) || nginx_version < 8054
@@ -23,6 +24,8 @@
 
 
 static ngx_int_t ngx_http_lua_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_lua_init_process(ngx_cycle_t *cycle);
+static void ngx_http_lua_exit_master(ngx_cycle_t *cycle);
 static char * ngx_http_lua_lowat_check(ngx_conf_t *cf, void *post, void *data);
 
 
@@ -33,7 +36,7 @@ static ngx_conf_post_t  ngx_http_lua_lowat_post =
 static ngx_command_t ngx_http_lua_cmds[] = {
 
     { ngx_string("lua_shared_dict"),
-      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2,
+      NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
       ngx_http_lua_shared_dict,
       0,
       0,
@@ -244,6 +247,21 @@ static ngx_command_t ngx_http_lua_cmds[] = {
       offsetof(ngx_http_lua_loc_conf_t, connect_timeout),
       NULL },
 
+    { ngx_string("lua_socket_resolver_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_lua_main_conf_t, resolver_cache),
+      NULL },
+
+    { ngx_string("lua_socket_connect_cooldown"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF
+          |NGX_HTTP_LIF_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_lua_loc_conf_t, connect_cooldown),
+      NULL },
+
     { ngx_string("lua_socket_send_timeout"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF
           |NGX_HTTP_LIF_CONF|NGX_CONF_TAKE1,
@@ -317,11 +335,11 @@ ngx_module_t ngx_http_lua_module = {
     NGX_HTTP_MODULE,            /*  module type */
     NULL,                       /*  init master */
     NULL,                       /*  init module */
-    NULL,                       /*  init process */
+    ngx_http_lua_init_process,  /*  init process */
     NULL,                       /*  init thread */
     NULL,                       /*  exit thread */
     NULL,                       /*  exit process */
-    NULL,                       /*  exit master */
+    ngx_http_lua_exit_master,   /*  exit master */
     NGX_MODULE_V1_PADDING
 };
 
@@ -415,6 +433,34 @@ ngx_http_lua_init(ngx_conf_t *cf)
 }
 
 
+static ngx_int_t
+ngx_http_lua_init_process(ngx_cycle_t *cycle)
+{
+    ngx_http_lua_main_conf_t   *lmcf;
+
+    lmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_lua_module);
+    if (lmcf == NULL) {
+        return NGX_OK;
+    }
+
+    return ngx_http_lua_shdict_init_process(cycle, lmcf);
+}
+
+
+static void
+ngx_http_lua_exit_master(ngx_cycle_t *cycle)
+{
+    ngx_http_lua_main_conf_t   *lmcf;
+
+    lmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_lua_module);
+    if (lmcf == NULL) {
+        return;
+    }
+
+    ngx_http_lua_shdict_exit_master(cycle, lmcf);
+}
+
+
 static char *
 ngx_http_lua_lowat_check(ngx_conf_t *cf, void *post, void *data)
 {
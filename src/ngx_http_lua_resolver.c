@@ -0,0 +1,419 @@
+#ifndef DDEBUG
+#define DDEBUG 0
+#endif
+#include "ddebug.h"
+
+
+#include "ngx_http_lua_resolver.h"
+
+
+/*
+ * a per-worker cache of the host names resolved for the cosockets.
+ *
+ * a cached answer younger than lua_socket_resolver_cache is returned
+ * right away, and at most once in NGX_HTTP_LUA_RESOLVER_REFRESH the name
+ * is looked up again by nginx's resolver in the background, which in
+ * turn honours the TTL of the DNS records. so the requests only wait for
+ * the resolver when a name is not cached or has not been refreshed for
+ * too long.
+ *
+ * the answers are kept per resolver, as different locations may point
+ * to different resolvers that disagree about a name. the resolver does
+ * not pass the TTL of the records on to us, so an answer is used for at
+ * most lua_socket_resolver_cache after the last successful refresh,
+ * whatever its TTL was.
+ */
+
+
+#define NGX_HTTP_LUA_RESOLVER_REFRESH    1000
+
+#define NGX_HTTP_LUA_RESOLVER_MAX_NODES  1024
+
+
+typedef struct {
+    ngx_str_node_t                   sn;        /* the host name */
+    ngx_resolver_t                  *resolver;  /* the name is resolved by */
+    ngx_msec_t                       timeout;   /* of the resolver */
+    ngx_queue_t                      queue;     /* in LRU order */
+    in_addr_t                       *addrs;
+    ngx_uint_t                       naddrs;
+    ngx_msec_t                       updated;   /* last answer received */
+    ngx_msec_t                       refreshed; /* last query sent */
+    ngx_resolver_ctx_t              *refresh;   /* query in flight */
+} ngx_http_lua_resolver_node_t;
+
+
+static uint32_t ngx_http_lua_resolver_hash(ngx_resolver_t *resolver,
+    ngx_str_t *name);
+static ngx_http_lua_resolver_node_t *ngx_http_lua_resolver_lookup(
+    ngx_resolver_t *resolver, ngx_str_t *name, uint32_t hash);
+static void ngx_http_lua_resolver_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static void ngx_http_lua_resolver_refresh(ngx_http_request_t *r,
+    ngx_http_lua_resolver_node_t *rn);
+static void ngx_http_lua_resolver_refresh_handler(ngx_resolver_ctx_t *ctx);
+static ngx_int_t ngx_http_lua_resolver_set_addrs(ngx_log_t *log,
+    ngx_http_lua_resolver_node_t *rn, in_addr_t *addrs, ngx_uint_t naddrs);
+static void ngx_http_lua_resolver_evict(void);
+
+
+static ngx_rbtree_t          ngx_http_lua_resolver_rbtree;
+static ngx_rbtree_node_t     ngx_http_lua_resolver_sentinel;
+static ngx_queue_t           ngx_http_lua_resolver_queue;
+static ngx_uint_t            ngx_http_lua_resolver_nnodes = 0;
+static ngx_uint_t            ngx_http_lua_resolver_inited = 0;
+
+
+ngx_int_t
+ngx_http_lua_resolver_cache_lookup(ngx_http_request_t *r, ngx_str_t *name,
+    in_addr_t **addrs, ngx_uint_t *naddrs)
+{
+    uint32_t                         hash;
+    ngx_http_core_loc_conf_t        *clcf;
+    ngx_http_lua_main_conf_t        *lmcf;
+    ngx_http_lua_resolver_node_t    *rn;
+
+    lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
+
+    if (lmcf->resolver_cache == 0 || !ngx_http_lua_resolver_inited) {
+        return NGX_DECLINED;
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    hash = ngx_http_lua_resolver_hash(clcf->resolver, name);
+
+    rn = ngx_http_lua_resolver_lookup(clcf->resolver, name, hash);
+
+    if (rn == NULL) {
+        return NGX_DECLINED;
+    }
+
+    if ((ngx_msec_int_t) (ngx_current_msec - rn->updated)
+        > (ngx_msec_int_t) lmcf->resolver_cache)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "lua resolver cache expired: \"%V\"", name);
+
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua resolver cache hit: \"%V\", naddrs: %ui",
+                   name, rn->naddrs);
+
+    ngx_queue_remove(&rn->queue);
+    ngx_queue_insert_head(&ngx_http_lua_resolver_queue, &rn->queue);
+
+    if (rn->refresh == NULL
+        && (ngx_msec_int_t) (ngx_current_msec - rn->refreshed)
+           >= NGX_HTTP_LUA_RESOLVER_REFRESH)
+    {
+        ngx_http_lua_resolver_refresh(r, rn);
+    }
+
+    *addrs = rn->addrs;
+    *naddrs = rn->naddrs;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_lua_resolver_cache_update(ngx_http_request_t *r, ngx_str_t *name,
+    in_addr_t *addrs, ngx_uint_t naddrs)
+{
+    uint32_t                         hash;
+    ngx_http_core_loc_conf_t        *clcf;
+    ngx_http_lua_main_conf_t        *lmcf;
+    ngx_http_lua_resolver_node_t    *rn;
+
+    lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
+
+    if (lmcf->resolver_cache == 0 || naddrs == 0) {
+        return;
+    }
+
+    if (!ngx_http_lua_resolver_inited) {
+        ngx_rbtree_init(&ngx_http_lua_resolver_rbtree,
+                        &ngx_http_lua_resolver_sentinel,
+                        ngx_http_lua_resolver_insert_value);
+
+        ngx_queue_init(&ngx_http_lua_resolver_queue);
+
+        ngx_http_lua_resolver_inited = 1;
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    hash = ngx_http_lua_resolver_hash(clcf->resolver, name);
+
+    rn = ngx_http_lua_resolver_lookup(clcf->resolver, name, hash);
+
+    if (rn) {
+        if (ngx_http_lua_resolver_set_addrs(r->connection->log, rn, addrs,
+                                            naddrs)
+            != NGX_OK)
+        {
+            return;
+        }
+
+        ngx_queue_remove(&rn->queue);
+        ngx_queue_insert_head(&ngx_http_lua_resolver_queue, &rn->queue);
+
+        rn->updated = ngx_current_msec;
+        return;
+    }
+
+    if (ngx_http_lua_resolver_nnodes >= NGX_HTTP_LUA_RESOLVER_MAX_NODES) {
+        ngx_http_lua_resolver_evict();
+    }
+
+    rn = ngx_alloc(sizeof(ngx_http_lua_resolver_node_t) + name->len,
+                   r->connection->log);
+    if (rn == NULL) {
+        return;
+    }
+
+    rn->sn.node.key = hash;
+    rn->sn.str.len = name->len;
+    rn->sn.str.data = (u_char *) (rn + 1);
+    ngx_memcpy(rn->sn.str.data, name->data, name->len);
+
+    rn->resolver = clcf->resolver;
+    rn->timeout = clcf->resolver_timeout;
+    rn->addrs = NULL;
+    rn->naddrs = 0;
+    rn->refresh = NULL;
+
+    if (ngx_http_lua_resolver_set_addrs(r->connection->log, rn, addrs, naddrs)
+        != NGX_OK)
+    {
+        ngx_free(rn);
+        return;
+    }
+
+    rn->updated = ngx_current_msec;
+    rn->refreshed = ngx_current_msec;
+
+    ngx_rbtree_insert(&ngx_http_lua_resolver_rbtree, &rn->sn.node);
+    ngx_queue_insert_head(&ngx_http_lua_resolver_queue, &rn->queue);
+
+    ngx_http_lua_resolver_nnodes++;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua resolver cache add: \"%V\", naddrs: %ui",
+                   name, naddrs);
+}
+
+
+static uint32_t
+ngx_http_lua_resolver_hash(ngx_resolver_t *resolver, ngx_str_t *name)
+{
+    uint32_t         hash;
+
+    ngx_crc32_init(hash);
+    ngx_crc32_update(&hash, (u_char *) &resolver, sizeof(ngx_resolver_t *));
+    ngx_crc32_update(&hash, name->data, name->len);
+    ngx_crc32_final(hash);
+
+    return hash;
+}
+
+
+/* the nodes are ordered by the hash, the resolver, and then the name */
+
+static ngx_http_lua_resolver_node_t *
+ngx_http_lua_resolver_lookup(ngx_resolver_t *resolver, ngx_str_t *name,
+    uint32_t hash)
+{
+    ngx_int_t                        rc;
+    ngx_rbtree_node_t               *node, *sentinel;
+    ngx_http_lua_resolver_node_t    *rn;
+
+    node = ngx_http_lua_resolver_rbtree.root;
+    sentinel = ngx_http_lua_resolver_rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash != node->key) {
+            node = (hash < node->key) ? node->left : node->right;
+            continue;
+        }
+
+        rn = (ngx_http_lua_resolver_node_t *) node;
+
+        if (resolver != rn->resolver) {
+            node = ((uintptr_t) resolver < (uintptr_t) rn->resolver)
+                   ? node->left : node->right;
+            continue;
+        }
+
+        rc = ngx_memn2cmp(name->data, rn->sn.str.data, name->len,
+                          rn->sn.str.len);
+
+        if (rc == 0) {
+            return rn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_lua_resolver_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t               **p;
+    ngx_http_lua_resolver_node_t     *rn, *rnt;
+
+    for ( ;; ) {
+
+        if (node->key != temp->key) {
+            p = (node->key < temp->key) ? &temp->left : &temp->right;
+
+        } else {
+            rn = (ngx_http_lua_resolver_node_t *) node;
+            rnt = (ngx_http_lua_resolver_node_t *) temp;
+
+            if (rn->resolver != rnt->resolver) {
+                p = ((uintptr_t) rn->resolver < (uintptr_t) rnt->resolver)
+                    ? &temp->left : &temp->right;
+
+            } else {
+                p = (ngx_memn2cmp(rn->sn.str.data, rnt->sn.str.data,
+                                  rn->sn.str.len, rnt->sn.str.len)
+                     < 0) ? &temp->left : &temp->right;
+            }
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static void
+ngx_http_lua_resolver_refresh(ngx_http_request_t *r,
+    ngx_http_lua_resolver_node_t *rn)
+{
+    ngx_resolver_ctx_t          *rctx, temp;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua resolver cache refresh: \"%V\"", &rn->sn.str);
+
+    rn->refreshed = ngx_current_msec;
+
+    temp.name = rn->sn.str;
+
+    rctx = ngx_resolve_start(rn->resolver, &temp);
+    if (rctx == NULL || rctx == NGX_NO_RESOLVER) {
+        return;
+    }
+
+    rctx->name = rn->sn.str;
+    rctx->type = NGX_RESOLVE_A;
+    rctx->handler = ngx_http_lua_resolver_refresh_handler;
+    rctx->data = rn;
+    rctx->timeout = rn->timeout;
+
+    /* the handler may be called before ngx_resolve_name() returns */
+
+    rn->refresh = rctx;
+
+    if (ngx_resolve_name(rctx) != NGX_OK) {
+        rn->refresh = NULL;
+    }
+}
+
+
+static void
+ngx_http_lua_resolver_refresh_handler(ngx_resolver_ctx_t *ctx)
+{
+    ngx_http_lua_resolver_node_t    *rn = ctx->data;
+
+    rn->refresh = NULL;
+
+    if (ctx->state || ctx->naddrs == 0) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "lua resolver cache failed to refresh \"%V\": %s",
+                       &rn->sn.str, ngx_resolver_strerror(ctx->state));
+
+    } else if (ngx_http_lua_resolver_set_addrs(ngx_cycle->log, rn,
+                                               ctx->addrs, ctx->naddrs)
+               == NGX_OK)
+    {
+        rn->updated = ngx_current_msec;
+    }
+
+    ngx_resolve_name_done(ctx);
+}
+
+
+static ngx_int_t
+ngx_http_lua_resolver_set_addrs(ngx_log_t *log,
+    ngx_http_lua_resolver_node_t *rn, in_addr_t *addrs, ngx_uint_t naddrs)
+{
+    in_addr_t       *p;
+
+    if (rn->naddrs != naddrs) {
+        p = ngx_alloc(naddrs * sizeof(in_addr_t), log);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (rn->addrs) {
+            ngx_free(rn->addrs);
+        }
+
+        rn->addrs = p;
+        rn->naddrs = naddrs;
+    }
+
+    ngx_memcpy(rn->addrs, addrs, naddrs * sizeof(in_addr_t));
+
+    return NGX_OK;
+}
+
+
+/* removes the least recently used name without a query in flight */
+
+static void
+ngx_http_lua_resolver_evict(void)
+{
+    ngx_queue_t                     *q;
+    ngx_http_lua_resolver_node_t    *rn;
+
+    for (q = ngx_queue_last(&ngx_http_lua_resolver_queue);
+         q != ngx_queue_sentinel(&ngx_http_lua_resolver_queue);
+         q = ngx_queue_prev(q))
+    {
+        rn = ngx_queue_data(q, ngx_http_lua_resolver_node_t, queue);
+
+        if (rn->refresh) {
+            continue;
+        }
+
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&ngx_http_lua_resolver_rbtree, &rn->sn.node);
+
+        ngx_free(rn->addrs);
+        ngx_free(rn);
+
+        ngx_http_lua_resolver_nnodes--;
+
+        return;
+    }
+}
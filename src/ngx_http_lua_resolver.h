@@ -0,0 +1,15 @@
+#ifndef NGX_HTTP_LUA_RESOLVER_H
+#define NGX_HTTP_LUA_RESOLVER_H
+
+
+#include "ngx_http_lua_common.h"
+
+
+ngx_int_t ngx_http_lua_resolver_cache_lookup(ngx_http_request_t *r,
+    ngx_str_t *name, in_addr_t **addrs, ngx_uint_t *naddrs);
+
+void ngx_http_lua_resolver_cache_update(ngx_http_request_t *r,
+    ngx_str_t *name, in_addr_t *addrs, ngx_uint_t naddrs);
+
+
+#endif /* NGX_HTTP_LUA_RESOLVER_H */
@@ -7,26 +7,204 @@
 #include "ngx_http_lua_shdict.h"
 #include "ngx_http_lua_util.h"
 #include "ngx_http_lua_conf.h"
+#include "api/ngx_http_lua_api.h"
+
+
+typedef void (*ngx_http_lua_shdict_walk_pt)(
+    ngx_http_lua_shdict_stripe_t *stripe, ngx_rbtree_node_t *node,
+    void *data);
+
+
+typedef struct {
+    uint64_t                     now;
+    ngx_uint_t                   max;       /* 0 for no limit */
+    ngx_uint_t                   freed;
+} ngx_http_lua_shdict_sweep_ctx_t;
+
+
+typedef struct {
+    lua_State                   *lua;
+    uint64_t                     now;
+    ngx_uint_t                   count;
+} ngx_http_lua_shdict_get_keys_ctx_t;
+
+
+/*
+ * snapshot files are a header followed by one record per item, each
+ * record followed by the key and the value; the value of a list is
+ * stored as value_len elements, each an item record followed by its data.
+ * integers are in host byte order, which the header records
+ */
+
+typedef struct {
+    u_char                       magic[8];
+    uint32_t                     byte_order;
+    uint32_t                     reserved;
+} ngx_http_lua_shdict_file_header_t;
+
+
+typedef struct {
+    uint64_t                     expires;
+    uint32_t                     value_len;
+    uint32_t                     user_flags;
+    uint16_t                     key_len;
+    uint8_t                      value_type;
+    uint8_t                      reserved;
+} ngx_http_lua_shdict_file_record_t;
+
+
+typedef struct {
+    uint32_t                     value_len;
+    uint8_t                      value_type;
+    u_char                       reserved[3];
+} ngx_http_lua_shdict_file_item_t;
 
 
 static int ngx_http_lua_shdict_set(lua_State *L);
 static int ngx_http_lua_shdict_get(lua_State *L);
-static int ngx_http_lua_shdict_expire(ngx_http_lua_shdict_ctx_t *ctx,
+static ngx_int_t ngx_http_lua_shdict_init_stripes(ngx_shm_zone_t *shm_zone,
+    ngx_http_lua_shdict_ctx_t *ctx);
+static int ngx_http_lua_shdict_expire(ngx_http_lua_shdict_stripe_t *stripe,
     ngx_uint_t n);
-static ngx_int_t ngx_http_lua_shdict_lookup(ngx_shm_zone_t *shm_zone,
-    ngx_uint_t hash, u_char *kdata, size_t klen,
-    ngx_http_lua_shdict_node_t **sdp);
+static void ngx_http_lua_shdict_insert_node(
+    ngx_http_lua_shdict_stripe_t *stripe, ngx_rbtree_node_t *node);
+static void ngx_http_lua_shdict_delete_node(
+    ngx_http_lua_shdict_stripe_t *stripe, ngx_rbtree_node_t *node);
+static void ngx_http_lua_shdict_remove_node(
+    ngx_http_lua_shdict_stripe_t *stripe, ngx_http_lua_shdict_node_t *sd);
+static ngx_rbtree_node_t *ngx_http_lua_shdict_rbtree_lower_bound(
+    ngx_rbtree_t *tree, ngx_rbtree_key_t key);
+static ngx_rbtree_node_t *ngx_http_lua_shdict_rbtree_next(ngx_rbtree_t *tree,
+    ngx_rbtree_node_t *node);
+static ngx_int_t ngx_http_lua_shdict_walk(ngx_http_lua_shdict_stripe_t *stripe,
+    ngx_uint_t *cursor, ngx_uint_t max, ngx_http_lua_shdict_walk_pt handler,
+    void *data);
+static void ngx_http_lua_shdict_sweep_node(
+    ngx_http_lua_shdict_stripe_t *stripe, ngx_rbtree_node_t *node,
+    void *data);
+static void ngx_http_lua_shdict_unlock_stripes(
+    ngx_http_lua_shdict_ctx_t *ctx);
+static void ngx_http_lua_shdict_sweep_handler(ngx_event_t *ev);
+static void ngx_http_lua_shdict_persist_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_lua_shdict_persist(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_log_t *log);
+static ngx_int_t ngx_http_lua_shdict_persist_start(
+    ngx_http_lua_shdict_ctx_t *ctx, ngx_log_t *log);
+static ngx_int_t ngx_http_lua_shdict_persist_step(
+    ngx_http_lua_shdict_ctx_t *ctx, ngx_msec_t slice);
+static ngx_int_t ngx_http_lua_shdict_persist_finish(
+    ngx_http_lua_shdict_ctx_t *ctx, ngx_int_t rc);
+static void ngx_http_lua_shdict_persist_node(
+    ngx_http_lua_shdict_stripe_t *stripe, ngx_rbtree_node_t *node,
+    void *data);
+static ngx_int_t ngx_http_lua_shdict_persist_write(
+    ngx_http_lua_shdict_file_t *f, void *data, size_t len);
+static ngx_int_t ngx_http_lua_shdict_persist_flush(
+    ngx_http_lua_shdict_file_t *f);
+static ngx_int_t ngx_http_lua_shdict_load(ngx_http_lua_shdict_ctx_t *ctx);
+static ngx_int_t ngx_http_lua_shdict_load_record(
+    ngx_http_lua_shdict_ctx_t *ctx, ngx_http_lua_shdict_file_t *f,
+    u_char *key);
+static ngx_int_t ngx_http_lua_shdict_load_check(ngx_uint_t type, size_t len,
+    size_t max);
+static ngx_int_t ngx_http_lua_shdict_load_read(ngx_http_lua_shdict_file_t *f,
+    void *dst, size_t len);
+static ngx_int_t ngx_http_lua_shdict_lookup(
+    ngx_http_lua_shdict_stripe_t *stripe, ngx_uint_t hash, u_char *kdata,
+    size_t klen, ngx_http_lua_shdict_node_t **sdp);
 static int ngx_http_lua_shdict_set_helper(lua_State *L, int flags);
+static void *ngx_http_lua_shdict_alloc_locked(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_http_lua_shdict_stripe_t *stripe, size_t size, int *forcible);
+static ngx_int_t ngx_http_lua_shdict_set_locked(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_http_lua_shdict_stripe_t *stripe, uint32_t hash, ngx_str_t *key,
+    int value_type, ngx_str_t *value, lua_Number exptime,
+    uint32_t user_flags, int flags, int *forcible, char **err);
+static ngx_int_t ngx_http_lua_shdict_store_locked(
+    ngx_http_lua_shdict_ctx_t *ctx, ngx_http_lua_shdict_stripe_t *stripe,
+    uint32_t hash, ngx_str_t *key, ngx_http_lua_shdict_node_t *sd,
+    int value_type, ngx_str_t *value, lua_Number exptime,
+    uint32_t user_flags, int *forcible, char **err);
 static int ngx_http_lua_shdict_add(lua_State *L);
 static int ngx_http_lua_shdict_replace(lua_State *L);
 static int ngx_http_lua_shdict_incr(lua_State *L);
+static int ngx_http_lua_shdict_decr(lua_State *L);
+static int ngx_http_lua_shdict_min(lua_State *L);
+static int ngx_http_lua_shdict_max(lua_State *L);
+static int ngx_http_lua_shdict_arith_helper(lua_State *L, int op);
+static int ngx_http_lua_shdict_cas(lua_State *L);
+static ngx_int_t ngx_http_lua_shdict_check_value(lua_State *L, int index,
+    int *value_type, ngx_str_t *value, lua_Number *num, u_char *c);
 static int ngx_http_lua_shdict_delete(lua_State *L);
 static int ngx_http_lua_shdict_flush_all(lua_State *L);
+static int ngx_http_lua_shdict_flush_expired(lua_State *L);
+static int ngx_http_lua_shdict_get_multi(lua_State *L);
+static int ngx_http_lua_shdict_set_multi(lua_State *L);
+static int ngx_http_lua_shdict_stats(lua_State *L);
+static int ngx_http_lua_shdict_get_keys(lua_State *L);
+static void ngx_http_lua_shdict_get_keys_node(
+    ngx_http_lua_shdict_stripe_t *stripe, ngx_rbtree_node_t *node,
+    void *data);
+static int ngx_http_lua_shdict_lpush(lua_State *L);
+static int ngx_http_lua_shdict_rpush(lua_State *L);
+static int ngx_http_lua_shdict_push_helper(lua_State *L, int flags);
+static int ngx_http_lua_shdict_lpop(lua_State *L);
+static int ngx_http_lua_shdict_rpop(lua_State *L);
+static int ngx_http_lua_shdict_pop_helper(lua_State *L, int flags);
+static int ngx_http_lua_shdict_llen(lua_State *L);
+static ngx_int_t ngx_http_lua_shdict_push_value(lua_State *L,
+    ngx_http_lua_shdict_node_t *sd);
 
 
 #define NGX_HTTP_LUA_SHDICT_ADD         0x0001
 #define NGX_HTTP_LUA_SHDICT_REPLACE     0x0002
 
+#define NGX_HTTP_LUA_SHDICT_LEFT        0x0001
+#define NGX_HTTP_LUA_SHDICT_RIGHT       0x0002
+
+#define NGX_HTTP_LUA_SHDICT_GET_KEYS_MAX     1024
+#define NGX_HTTP_LUA_SHDICT_GET_KEYS_CHUNK   256
+
+
+#define NGX_HTTP_LUA_SHDICT_INCR        0
+#define NGX_HTTP_LUA_SHDICT_DECR        1
+#define NGX_HTTP_LUA_SHDICT_MIN         2
+#define NGX_HTTP_LUA_SHDICT_MAX         3
+
+
+#define NGX_HTTP_LUA_SHDICT_SWEEP_BATCH     100
+#define NGX_HTTP_LUA_SHDICT_SWEEP_SLEEP     50
+#define NGX_HTTP_LUA_SHDICT_SWEEP_STALE     60000
+
+#define NGX_HTTP_LUA_SHDICT_PERSIST_MAGIC   "NGXLSHD1"
+#define NGX_HTTP_LUA_SHDICT_PERSIST_BOM     0x01020304
+#define NGX_HTTP_LUA_SHDICT_PERSIST_BUFSIZE (1024 * 1024)
+#define NGX_HTTP_LUA_SHDICT_PERSIST_BATCH   1000
+#define NGX_HTTP_LUA_SHDICT_PERSIST_STALE   60000
+#define NGX_HTTP_LUA_SHDICT_PERSIST_SLICE   20
+#define NGX_HTTP_LUA_SHDICT_PERSIST_SLEEP   50
+
+
+/* flush_all() expires all the nodes of older generations */
+#define ngx_http_lua_shdict_expired(stripe, sd, now)                         \
+    ((sd)->generation != (stripe)->generation                                \
+     || ((sd)->expires != 0 && (sd)->expires <= (now)))
+
+#define ngx_http_lua_shdict_get_stripe(ctx, hash)                            \
+    (&(ctx)->sh->stripes[(hash) % (ctx)->sh->nstripes])
+
+/*
+ * the stripe is the hash modulo the number of stripes, which only
+ * depends on the lowest 8 bits when that number is a power of 2; the
+ * buckets skip those bits so that they are spread evenly in that case,
+ * and the higher bits are still evenly distributed otherwise
+ */
+#define ngx_http_lua_shdict_get_bucket(stripe, hash)                         \
+    (&(stripe)->buckets[((hash) >> 8) & ((stripe)->nbuckets - 1)])
+
+#define ngx_http_lua_shdict_hash(ctx, data, len)                             \
+    ((ctx)->sh->index == NGX_HTTP_LUA_SHDICT_INDEX_HASH                      \
+     ? ngx_murmur_hash2(data, len) : ngx_crc32_short(data, len))
+
 
 ngx_int_t
 ngx_http_lua_shdict_init_zone(ngx_shm_zone_t *shm_zone, void *data)
@@ -56,17 +234,17 @@ ngx_http_lua_shdict_init_zone(ngx_shm_zone_t *shm_zone, void *data)
         goto done;
     }
 
-    ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_http_lua_shdict_shctx_t));
+    len = offsetof(ngx_http_lua_shdict_shctx_t, stripes)
+          + ctx->nstripes * sizeof(ngx_http_lua_shdict_stripe_t);
+
+    ctx->sh = ngx_slab_alloc(ctx->shpool, len);
     if (ctx->sh == NULL) {
         return NGX_ERROR;
     }
 
-    ctx->shpool->data = ctx->sh;
-
-    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
-                    ngx_http_lua_shdict_rbtree_insert_value);
+    ngx_memzero(ctx->sh, len);
 
-    ngx_queue_init(&ctx->sh->queue);
+    ctx->shpool->data = ctx->sh;
 
     len = sizeof(" in lua_shared_dict zone \"\"") + shm_zone->shm.name.len;
 
@@ -78,7 +256,28 @@ ngx_http_lua_shdict_init_zone(ngx_shm_zone_t *shm_zone, void *data)
     ngx_sprintf(ctx->shpool->log_ctx, " in lua_shared_dict zone \"%V\"%Z",
                 &shm_zone->shm.name);
 
+    if (ngx_http_lua_shdict_init_stripes(shm_zone, ctx) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ctx->persist.len && ngx_http_lua_shdict_load(ctx) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
 done:
+    if (ctx->sh->nstripes != ctx->nstripes) {
+        ngx_log_error(NGX_LOG_WARN, ctx->log, 0,
+                      "lua_shared_dict \"%V\" keeps using %ui stripes "
+                      "instead of %ui until the zone is recreated",
+                      &ctx->name, ctx->sh->nstripes, ctx->nstripes);
+    }
+
+    if (ctx->sh->index != ctx->index) {
+        ngx_log_error(NGX_LOG_WARN, ctx->log, 0,
+                      "lua_shared_dict \"%V\" keeps using its old index "
+                      "type until the zone is recreated", &ctx->name);
+    }
+
     dd("get lmcf");
 
     lmcf = ctx->main_conf;
@@ -100,488 +299,3252 @@ done:
 }
 
 
-void
-ngx_http_lua_shdict_rbtree_insert_value(ngx_rbtree_node_t *temp,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+static ngx_int_t
+ngx_http_lua_shdict_init_stripes(ngx_shm_zone_t *shm_zone,
+    ngx_http_lua_shdict_ctx_t *ctx)
 {
-    ngx_rbtree_node_t          **p;
-    ngx_http_lua_shdict_node_t   *sdn, *sdnt;
+    size_t                         size, reserved;
+    ngx_uint_t                     i, n;
+    ngx_slab_pool_t               *sp;
+    ngx_http_lua_shdict_stripe_t  *stripe;
 
-    for ( ;; ) {
-
-        if (node->key < temp->key) {
+    ctx->sh->nstripes = ctx->nstripes;
+    ctx->sh->index = ctx->index;
 
-            p = &temp->left;
+    size = shm_zone->shm.size;
 
-        } else if (node->key > temp->key) {
+    if (ctx->nstripes > 1) {
+        /*
+         * split the free pages of the zone evenly, leaving room for the
+         * page descriptors of the main pool, its header and slots, the
+         * zone header, which grows with the number of stripes, the page
+         * holding log_ctx and the alignment of the first page
+         */
 
-            p = &temp->right;
+        reserved = offsetof(ngx_http_lua_shdict_shctx_t, stripes)
+                   + ctx->nstripes * sizeof(ngx_http_lua_shdict_stripe_t);
 
-        } else { /* node->key == temp->key */
+        reserved = ngx_align(reserved, ngx_pagesize) + 3 * ngx_pagesize
+                   + (shm_zone->shm.size / ngx_pagesize)
+                     * sizeof(ngx_slab_page_t);
 
-            sdn = (ngx_http_lua_shdict_node_t *) &node->color;
-            sdnt = (ngx_http_lua_shdict_node_t *) &temp->color;
+        size = 0;
 
-            p = (ngx_memn2cmp(sdn->data, sdnt->data, sdn->key_len,
-                sdnt->key_len) < 0) ? &temp->left : &temp->right;
+        if (shm_zone->shm.size > reserved) {
+            size = ((shm_zone->shm.size - reserved) / ctx->nstripes)
+                   & ~((size_t) ngx_pagesize - 1);
         }
 
-        if (*p == sentinel) {
-            break;
+        if (size < 2 * ngx_pagesize) {
+            ngx_log_error(NGX_LOG_EMERG, ctx->log, 0,
+                          "lua_shared_dict \"%V\" is too small for %ui "
+                          "stripes", &ctx->name, ctx->nstripes);
+            return NGX_ERROR;
         }
-
-        temp = *p;
     }
 
-    *p = node;
-    node->parent = temp;
-    node->left = sentinel;
-    node->right = sentinel;
-    ngx_rbt_red(node);
-}
+    for (i = 0; i < ctx->nstripes; i++) {
+        stripe = &ctx->sh->stripes[i];
 
+        if (ctx->nstripes == 1) {
+            sp = ctx->shpool;
 
-static ngx_int_t
-ngx_http_lua_shdict_lookup(ngx_shm_zone_t *shm_zone, ngx_uint_t hash,
-    u_char *kdata, size_t klen, ngx_http_lua_shdict_node_t **sdp)
-{
-    ngx_int_t                    rc;
-    ngx_time_t                  *tp;
-    uint64_t                     now;
-    int64_t                      ms;
-    ngx_rbtree_node_t           *node, *sentinel;
-    ngx_http_lua_shdict_ctx_t   *ctx;
-    ngx_http_lua_shdict_node_t  *sd;
+        } else {
+            sp = ngx_slab_alloc(ctx->shpool, size);
+            if (sp == NULL) {
+                return NGX_ERROR;
+            }
 
-    ctx = shm_zone->data;
+            sp->end = (u_char *) sp + size;
+            sp->min_shift = 3;
+            sp->addr = sp;
 
-    node = ctx->sh->rbtree.root;
-    sentinel = ctx->sh->rbtree.sentinel;
+            /* stripes are only enabled when NGX_HAVE_ATOMIC_OPS is set */
 
-    while (node != sentinel) {
+            if (ngx_shmtx_create(&sp->mutex, (void *) &sp->lock, NULL)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
 
-        if (hash < node->key) {
-            node = node->left;
-            continue;
+            ngx_slab_init(sp);
+
+            sp->log_ctx = ctx->shpool->log_ctx;
+            sp->data = stripe;
         }
 
-        if (hash > node->key) {
-            node = node->right;
+        stripe->shpool = sp;
+
+        ngx_rbtree_init(&stripe->rbtree, &stripe->sentinel,
+                        ngx_http_lua_shdict_rbtree_insert_value);
+
+        ngx_queue_init(&stripe->queue);
+
+        if (ctx->index != NGX_HTTP_LUA_SHDICT_INDEX_HASH) {
             continue;
         }
 
-        /* hash == node->key */
-
-        sd = (ngx_http_lua_shdict_node_t *) &node->color;
+        /* about one bucket per smallest possible node */
 
-        rc = ngx_memn2cmp(kdata, sd->data, klen, (size_t) sd->key_len);
+        n = size / 128;
 
-        if (rc == 0) {
-            ngx_queue_remove(&sd->queue);
-            ngx_queue_insert_head(&ctx->sh->queue, &sd->queue);
+        for (stripe->nbuckets = 16;
+             stripe->nbuckets * 2 <= n && stripe->nbuckets < (1 << 24);
+             stripe->nbuckets *= 2)
+        {
+            /* void */
+        }
 
-            *sdp = sd;
+        n = stripe->nbuckets * sizeof(ngx_rbtree_node_t *);
 
-            dd("node expires: %lld", (long long) sd->expires);
+        stripe->buckets = ngx_slab_alloc(sp, n);
+        if (stripe->buckets == NULL) {
+            return NGX_ERROR;
+        }
 
-            if (sd->expires != 0) {
-                tp = ngx_timeofday();
+        ngx_memzero(stripe->buckets, n);
+    }
 
-                now = (uint64_t) tp->sec * 1000 + tp->msec;
-                ms = sd->expires - now;
+    return NGX_OK;
+}
 
-                dd("time to live: %lld", (long long) ms);
 
-                if (ms < 0) {
-                    dd("node already expired");
-                    return NGX_DONE;
-                }
-            }
+static void
+ngx_http_lua_shdict_insert_node(ngx_http_lua_shdict_stripe_t *stripe,
+    ngx_rbtree_node_t *node)
+{
+    ngx_rbtree_node_t  **bucket;
 
-            return NGX_OK;
-        }
+    stripe->keys++;
 
-        node = (rc < 0) ? node->left : node->right;
+    if (stripe->buckets == NULL) {
+        ngx_rbtree_insert(&stripe->rbtree, node);
+        return;
     }
 
-    *sdp = NULL;
+    bucket = ngx_http_lua_shdict_get_bucket(stripe, node->key);
 
-    return NGX_DECLINED;
+    node->left = *bucket;
+    *bucket = node;
 }
 
 
-static int
-ngx_http_lua_shdict_expire(ngx_http_lua_shdict_ctx_t *ctx, ngx_uint_t n)
+static void
+ngx_http_lua_shdict_delete_node(ngx_http_lua_shdict_stripe_t *stripe,
+    ngx_rbtree_node_t *node)
 {
-    ngx_time_t                  *tp;
-    uint64_t                     now;
-    ngx_queue_t                 *q;
-    int64_t                      ms;
-    ngx_rbtree_node_t           *node;
-    ngx_http_lua_shdict_node_t  *sd;
-    int                          freed = 0;
+    ngx_rbtree_node_t  **p;
 
-    tp = ngx_timeofday();
+    stripe->keys--;
 
-    now = (uint64_t) tp->sec * 1000 + tp->msec;
+    if (stripe->buckets == NULL) {
+        ngx_rbtree_delete(&stripe->rbtree, node);
+        return;
+    }
 
-    /*
-     * n == 1 deletes one or two expired entries
-     * n == 0 deletes oldest entry by force
-     *        and one or two zero rate entries
-     */
+    for (p = ngx_http_lua_shdict_get_bucket(stripe, node->key);
+         *p;
+         p = &(*p)->left)
+    {
+        if (*p == node) {
+            *p = node->left;
+            return;
+        }
+    }
+}
 
-    while (n < 3) {
 
-        if (ngx_queue_empty(&ctx->sh->queue)) {
-            return freed;
+static void
+ngx_http_lua_shdict_remove_node(ngx_http_lua_shdict_stripe_t *stripe,
+    ngx_http_lua_shdict_node_t *sd)
+{
+    ngx_queue_t                      *q;
+    ngx_rbtree_node_t                *node;
+    ngx_http_lua_shdict_list_t       *list;
+    ngx_http_lua_shdict_list_node_t  *item;
+
+    if (sd->value_type == NGX_HTTP_LUA_SHDICT_TLIST) {
+        list = ngx_http_lua_shdict_get_list(sd);
+
+        while (!ngx_queue_empty(&list->items)) {
+            q = ngx_queue_head(&list->items);
+            ngx_queue_remove(q);
+
+            item = ngx_queue_data(q, ngx_http_lua_shdict_list_node_t, queue);
+            ngx_slab_free_locked(stripe->shpool, item);
         }
+    }
 
-        q = ngx_queue_last(&ctx->sh->queue);
+    ngx_queue_remove(&sd->queue);
 
-        sd = ngx_queue_data(q, ngx_http_lua_shdict_node_t, queue);
+    node = (ngx_rbtree_node_t *)
+               ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
 
-        if (n++ != 0) {
+    ngx_http_lua_shdict_delete_node(stripe, node);
 
-            if (sd->expires == 0) {
-                return freed;
-            }
+    ngx_slab_free_locked(stripe->shpool, node);
+}
 
-            ms = sd->expires - now;
-            if (ms > 0) {
-                return freed;
-            }
-        }
 
-        ngx_queue_remove(q);
+/* returns the first node in order whose hash is not less than "key" */
+
+static ngx_rbtree_node_t *
+ngx_http_lua_shdict_rbtree_lower_bound(ngx_rbtree_t *tree,
+    ngx_rbtree_key_t key)
+{
+    ngx_rbtree_node_t  *node, *sentinel, *found;
 
-        node = (ngx_rbtree_node_t *)
-                   ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
+    node = tree->root;
+    sentinel = tree->sentinel;
+    found = NULL;
 
-        ngx_rbtree_delete(&ctx->sh->rbtree, node);
+    while (node != sentinel) {
 
-        ngx_slab_free_locked(ctx->shpool, node);
+        if (node->key >= key) {
+            found = node;
+            node = node->left;
+            continue;
+        }
 
-        freed++;
+        node = node->right;
     }
 
-    return freed;
+    return found;
 }
 
 
-void
-ngx_http_lua_inject_shdict_api(ngx_http_lua_main_conf_t *lmcf, lua_State *L)
+static ngx_rbtree_node_t *
+ngx_http_lua_shdict_rbtree_next(ngx_rbtree_t *tree, ngx_rbtree_node_t *node)
 {
-    ngx_http_lua_shdict_ctx_t   *ctx;
-    ngx_uint_t                   i;
-    ngx_shm_zone_t             **zone;
+    ngx_rbtree_node_t  *sentinel, *parent;
 
-    if (lmcf->shm_zones != NULL) {
-        lua_createtable(L, 0, lmcf->shm_zones->nelts /* nrec */);
-                /* ngx.shared */
+    sentinel = tree->sentinel;
 
-        lua_createtable(L, 0 /* narr */, 8 /* nrec */); /* shared mt */
+    if (node->right != sentinel) {
+        node = node->right;
 
-        lua_pushcfunction(L, ngx_http_lua_shdict_get);
-        lua_setfield(L, -2, "get");
+        while (node->left != sentinel) {
+            node = node->left;
+        }
 
-        lua_pushcfunction(L, ngx_http_lua_shdict_set);
-        lua_setfield(L, -2, "set");
+        return node;
+    }
 
-        lua_pushcfunction(L, ngx_http_lua_shdict_add);
-        lua_setfield(L, -2, "add");
+    for ( ;; ) {
+        if (node == tree->root) {
+            return NULL;
+        }
 
-        lua_pushcfunction(L, ngx_http_lua_shdict_replace);
-        lua_setfield(L, -2, "replace");
+        parent = node->parent;
 
-        lua_pushcfunction(L, ngx_http_lua_shdict_incr);
-        lua_setfield(L, -2, "incr");
+        if (node == parent->left) {
+            return parent;
+        }
 
-        lua_pushcfunction(L, ngx_http_lua_shdict_delete);
-        lua_setfield(L, -2, "delete");
+        node = parent;
+    }
+}
 
-        lua_pushcfunction(L, ngx_http_lua_shdict_flush_all);
-        lua_setfield(L, -2, "flush_all");
 
-        lua_pushvalue(L, -1); /* shared mt mt */
-        lua_setfield(L, -2, "__index"); /* shared mt */
+/*
+ * visits the nodes of a locked stripe starting from *cursor, which is a
+ * bucket number for hash indexed zones and a hash value otherwise, and
+ * stops after about "max" nodes, but never within a bucket or between
+ * nodes of equal hashes, so that no node is visited twice across calls;
+ * the handler may remove the node it is given. returns NGX_DONE when the
+ * end of the stripe has been reached and NGX_AGAIN with *cursor updated
+ * otherwise
+ */
 
-        zone = lmcf->shm_zones->elts;
+static ngx_int_t
+ngx_http_lua_shdict_walk(ngx_http_lua_shdict_stripe_t *stripe,
+    ngx_uint_t *cursor, ngx_uint_t max, ngx_http_lua_shdict_walk_pt handler,
+    void *data)
+{
+    ngx_uint_t          n;
+    ngx_rbtree_key_t    key;
+    ngx_rbtree_node_t  *node, *next;
 
-        for (i = 0; i < lmcf->shm_zones->nelts; i++) {
-            ctx = zone[i]->data;
+    n = 0;
+    key = 0;
 
-            lua_pushlstring(L, (char *) ctx->name.data, ctx->name.len);
-                /* shared mt key */
+    if (stripe->buckets) {
 
-            lua_pushlightuserdata(L, zone[i]); /* shared mt key ud */
-            lua_pushvalue(L, -3); /* shared mt key ud mt */
-            lua_setmetatable(L, -2); /* shared mt key ud */
-            lua_rawset(L, -4); /* shared mt */
+        for ( /* void */ ; *cursor < stripe->nbuckets; (*cursor)++) {
+
+            if (n >= max) {
+                return NGX_AGAIN;
+            }
+
+            for (node = stripe->buckets[*cursor]; node; node = next) {
+                next = node->left;
+                handler(stripe, node, data);
+                n++;
+            }
         }
 
-        lua_pop(L, 1); /* shared */
+        return NGX_DONE;
+    }
 
-    } else {
-        lua_newtable(L);    /* ngx.shared */
+    node = ngx_http_lua_shdict_rbtree_lower_bound(&stripe->rbtree, *cursor);
+
+    while (node) {
+
+        if (n >= max && node->key != key) {
+            *cursor = node->key;
+            return NGX_AGAIN;
+        }
+
+        next = ngx_http_lua_shdict_rbtree_next(&stripe->rbtree, node);
+        key = node->key;
+        handler(stripe, node, data);
+        n++;
+
+        node = next;
     }
 
-    lua_setfield(L, -2, "shared");
+    return NGX_DONE;
 }
 
 
-static int
-ngx_http_lua_shdict_get(lua_State *L)
+ngx_int_t
+ngx_http_lua_shdict_init_process(ngx_cycle_t *cycle,
+    ngx_http_lua_main_conf_t *lmcf)
 {
-    int                          n;
-    ngx_str_t                    name;
-    ngx_str_t                    key;
-    uint32_t                     hash;
-    ngx_int_t                    rc;
+    ngx_uint_t                   i;
+    ngx_event_t                 *ev;
+    ngx_shm_zone_t             **zone;
     ngx_http_lua_shdict_ctx_t   *ctx;
-    ngx_http_lua_shdict_node_t  *sd;
-    ngx_str_t                    value;
-    int                          value_type;
-    lua_Number                   num;
-    u_char                       c;
-    ngx_shm_zone_t              *zone;
-    uint32_t                     user_flags = 0;
-
-    n = lua_gettop(L);
 
-    if (n != 2) {
-        return luaL_error(L, "expecting exactly two arguments, "
-                "but only seen %d", n);
+    if (lmcf->shm_zones == NULL) {
+        return NGX_OK;
     }
 
-    luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+    zone = lmcf->shm_zones->elts;
 
-    zone = lua_touserdata(L, 1);
-    if (zone == NULL) {
-        return luaL_error(L, "bad user data for the ngx_shm_zone_t pointer");
-    }
+    for (i = 0; i < lmcf->shm_zones->nelts; i++) {
+        ctx = zone[i]->data;
 
-    ctx = zone->data;
+        ngx_http_lua_shdict_unlock_stripes(ctx);
 
-    name = ctx->name;
+        if (ctx->sweep_interval) {
+            ev = &ctx->sweep_event;
 
-    key.data = (u_char *) luaL_checklstring(L, 2, &key.len);
+            ev->handler = ngx_http_lua_shdict_sweep_handler;
+            ev->data = zone[i];
+            ev->log = cycle->log;
 
-    if (key.len == 0) {
-        lua_pushnil(L);
-        return 1;
-    }
+            ngx_add_timer(ev, ngx_min(ctx->sweep_interval, 1000));
+        }
 
-    if (key.len > 65535) {
-        return luaL_error(L,
-                          "the key argument is more than 65535 bytes: \"%s\"",
-                          key.data);
-    }
+        if (ctx->persist.len && ctx->persist_interval) {
+            ev = &ctx->persist_event;
 
-    hash = ngx_crc32_short(key.data, key.len);
+            ev->handler = ngx_http_lua_shdict_persist_handler;
+            ev->data = zone[i];
+            ev->log = cycle->log;
 
-#if (NGX_DEBUG)
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                   "fetching key \"%V\" in shared dict \"%V\"", &key, &name);
-#endif /* NGX_DEBUG */
+            ngx_add_timer(ev, ngx_min(ctx->persist_interval, 1000));
+        }
+    }
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
+    return NGX_OK;
+}
 
-#if 1
-    ngx_http_lua_shdict_expire(ctx, 1);
-#endif
 
-    rc = ngx_http_lua_shdict_lookup(zone, hash, key.data, key.len,
-            &sd);
+/*
+ * nginx only force-unlocks the main slab pool of a zone when a worker
+ * dies, so the locks of the stripe pools held by a crashed worker are
+ * released here, by the worker started in its place
+ */
 
-    dd("shdict lookup returns %d", (int) rc);
+static void
+ngx_http_lua_shdict_unlock_stripes(ngx_http_lua_shdict_ctx_t *ctx)
+{
+    ngx_pid_t                 pid;
+    ngx_uint_t                i;
+    ngx_slab_pool_t          *sp;
 
-    if (rc == NGX_DECLINED || rc == NGX_DONE) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
-        lua_pushnil(L);
-        return 1;
+    if (ctx->sh->nstripes == 1) {
+        return;
     }
 
-    /* rc == NGX_OK */
+    for (i = 0; i < ctx->sh->nstripes; i++) {
+        sp = ctx->sh->stripes[i].shpool;
 
-    value_type = sd->value_type;
+        pid = (ngx_pid_t) *sp->mutex.lock;
 
-    dd("data: %p", sd->data);
+        if (pid == 0 || kill(pid, 0) == 0 || ngx_errno != NGX_ESRCH) {
+            continue;
+        }
+
+        if (ngx_shmtx_force_unlock(&sp->mutex, pid)) {
+            ngx_log_error(NGX_LOG_ALERT, ctx->log, 0,
+                          "lua_shared_dict \"%V\" stripe %ui was unlocked "
+                          "after the exit of process %P",
+                          &ctx->name, i, pid);
+        }
+    }
+}
+
+
+/*
+ * every worker runs the timer but only one of them at a time gets to
+ * sweep the zone, which is coordinated through sh->sweeper
+ */
+
+static void
+ngx_http_lua_shdict_sweep_handler(ngx_event_t *ev)
+{
+    uint64_t                          now;
+    ngx_int_t                         rc;
+    ngx_msec_t                        start, delay;
+    ngx_time_t                       *tp;
+    ngx_atomic_uint_t                 pid;
+    ngx_shm_zone_t                   *zone;
+    ngx_http_lua_shdict_ctx_t        *ctx;
+    ngx_http_lua_shdict_shctx_t      *sh;
+    ngx_http_lua_shdict_stripe_t     *stripe;
+    ngx_http_lua_shdict_sweep_ctx_t   sw;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    zone = ev->data;
+    ctx = zone->data;
+    sh = ctx->sh;
+
+    delay = ngx_min(ctx->sweep_interval, 1000);
+
+    tp = ngx_timeofday();
+    now = (uint64_t) tp->sec * 1000 + tp->msec;
+
+    if (!sh->sweep_unfinished && now - sh->sweep_start < ctx->sweep_interval) {
+        goto done;
+    }
+
+    pid = sh->sweeper;
+
+    if (pid != 0 && now - sh->sweep_time < NGX_HTTP_LUA_SHDICT_SWEEP_STALE) {
+        goto done;
+    }
+
+    /* the previous sweeper may have crashed in the middle of a pass */
+
+    if (!ngx_atomic_cmp_set(&sh->sweeper, pid, ngx_pid)) {
+        goto done;
+    }
+
+    sh->sweep_time = now;
+
+    if (!sh->sweep_unfinished) {
+        sh->sweep_start = now;
+        sh->sweep_stripe = 0;
+        sh->sweep_cursor = 0;
+        sh->sweep_unfinished = 1;
+    }
+
+    start = ngx_current_msec;
+
+    sw.now = now;
+    sw.max = 0;
+    sw.freed = 0;
+
+    while (sh->sweep_stripe < sh->nstripes) {
+        stripe = &sh->stripes[sh->sweep_stripe];
+
+        ngx_shmtx_lock(&stripe->shpool->mutex);
+
+        rc = ngx_http_lua_shdict_walk(stripe, &sh->sweep_cursor,
+                                      NGX_HTTP_LUA_SHDICT_SWEEP_BATCH,
+                                      ngx_http_lua_shdict_sweep_node, &sw);
+
+        ngx_shmtx_unlock(&stripe->shpool->mutex);
+
+        if (rc == NGX_DONE) {
+            sh->sweep_stripe++;
+            sh->sweep_cursor = 0;
+        }
+
+        ngx_time_update();
+
+        if (ngx_current_msec - start >= ctx->sweep_threshold) {
+            break;
+        }
+    }
+
+    if (sh->sweep_stripe == sh->nstripes) {
+        sh->sweep_unfinished = 0;
+
+    } else {
+        delay = NGX_HTTP_LUA_SHDICT_SWEEP_SLEEP;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "lua shared dict \"%V\" sweep took %M ms",
+                   &ctx->name, ngx_current_msec - start);
+
+    (void) ngx_atomic_cmp_set(&sh->sweeper, ngx_pid, 0);
+
+done:
+
+    ngx_add_timer(ev, delay);
+}
+
+
+static void
+ngx_http_lua_shdict_sweep_node(ngx_http_lua_shdict_stripe_t *stripe,
+    ngx_rbtree_node_t *node, void *data)
+{
+    ngx_http_lua_shdict_sweep_ctx_t  *sw = data;
+
+    ngx_http_lua_shdict_node_t  *sd;
+
+    if (sw->max && sw->freed >= sw->max) {
+        return;
+    }
+
+    sd = (ngx_http_lua_shdict_node_t *) &node->color;
+
+    if (!ngx_http_lua_shdict_expired(stripe, sd, sw->now)) {
+        return;
+    }
+
+    ngx_http_lua_shdict_remove_node(stripe, sd);
+
+    stripe->reclaimed++;
+    sw->freed++;
+}
+
+
+/*
+ * the workers take turns to write the periodic snapshots, coordinated
+ * through sh->persister like the sweeper. a snapshot is written in slices
+ * of about NGX_HTTP_LUA_SHDICT_PERSIST_SLICE ms, one per timer tick, so
+ * that the worker keeps serving its requests in between. the last
+ * snapshot is written by the master process once all the workers have
+ * exited
+ */
+
+static void
+ngx_http_lua_shdict_persist_handler(ngx_event_t *ev)
+{
+    uint64_t                      now;
+    ngx_int_t                     rc;
+    ngx_time_t                   *tp;
+    ngx_msec_t                    delay;
+    ngx_atomic_uint_t             pid;
+    ngx_shm_zone_t               *zone;
+    ngx_http_lua_shdict_ctx_t    *ctx;
+    ngx_http_lua_shdict_shctx_t  *sh;
+
+    zone = ev->data;
+    ctx = zone->data;
+    sh = ctx->sh;
+
+    if (ctx->persist_file && sh->persister != (ngx_atomic_uint_t) ngx_pid) {
+
+        /* another worker has taken over the snapshot file meanwhile */
+
+        ngx_log_error(NGX_LOG_WARN, ev->log, 0,
+                      "lua_shared_dict \"%V\": snapshot abandoned",
+                      &ctx->name);
+
+        (void) ngx_close_file(ctx->persist_file->fd);
+        ngx_free(ctx->persist_file);
+        ctx->persist_file = NULL;
+    }
+
+    if (ngx_exiting) {
+        if (ctx->persist_file) {
+            (void) ngx_http_lua_shdict_persist_finish(ctx, NGX_ABORT);
+            (void) ngx_atomic_cmp_set(&sh->persister, ngx_pid, 0);
+        }
+
+        return;
+    }
+
+    delay = ngx_min(ctx->persist_interval, 1000);
+
+    tp = ngx_timeofday();
+    now = (uint64_t) tp->sec * 1000 + tp->msec;
+
+    if (ctx->persist_file) {
+        goto write;
+    }
+
+    if (sh->persist_time == 0) {
+        /* the zone has just been created */
+        sh->persist_time = now;
+    }
+
+    if (now - sh->persist_time < ctx->persist_interval) {
+        goto done;
+    }
+
+    pid = sh->persister;
+
+    if (pid != 0 && now - sh->persist_beat < NGX_HTTP_LUA_SHDICT_PERSIST_STALE)
+    {
+        goto done;
+    }
+
+    /* the previous writer may have crashed in the middle of a snapshot */
+
+    if (!ngx_atomic_cmp_set(&sh->persister, pid, ngx_pid)) {
+        goto done;
+    }
+
+    /* another worker may have just finished a snapshot */
+
+    if (pid == 0 && now - sh->persist_time < ctx->persist_interval) {
+        (void) ngx_atomic_cmp_set(&sh->persister, ngx_pid, 0);
+        goto done;
+    }
+
+    sh->persist_time = now;
+
+    if (ngx_http_lua_shdict_persist_start(ctx, ev->log) != NGX_OK) {
+        (void) ngx_atomic_cmp_set(&sh->persister, ngx_pid, 0);
+        goto done;
+    }
+
+write:
+
+    sh->persist_beat = now;
+
+    rc = ngx_http_lua_shdict_persist_step(ctx,
+                                          NGX_HTTP_LUA_SHDICT_PERSIST_SLICE);
+
+    if (rc == NGX_AGAIN) {
+        delay = NGX_HTTP_LUA_SHDICT_PERSIST_SLEEP;
+        goto done;
+    }
+
+    (void) ngx_http_lua_shdict_persist_finish(ctx, rc);
+
+    (void) ngx_atomic_cmp_set(&sh->persister, ngx_pid, 0);
+
+done:
+
+    ngx_add_timer(ev, delay);
+}
+
+
+void
+ngx_http_lua_shdict_exit_master(ngx_cycle_t *cycle,
+    ngx_http_lua_main_conf_t *lmcf)
+{
+    ngx_uint_t                  i;
+    ngx_shm_zone_t            **zone;
+    ngx_http_lua_shdict_ctx_t  *ctx;
+
+    if (lmcf->shm_zones == NULL) {
+        return;
+    }
+
+    zone = lmcf->shm_zones->elts;
+
+    for (i = 0; i < lmcf->shm_zones->nelts; i++) {
+        ctx = zone[i]->data;
+
+        if (ctx->persist.len && ctx->sh) {
+            (void) ngx_http_lua_shdict_persist(ctx, cycle->log);
+        }
+    }
+}
+
+
+/*
+ * writes a whole snapshot at once, which is only done by the master
+ * process on exit
+ */
+
+static ngx_int_t
+ngx_http_lua_shdict_persist(ngx_http_lua_shdict_ctx_t *ctx, ngx_log_t *log)
+{
+    ngx_int_t  rc;
+
+    if (ngx_http_lua_shdict_persist_start(ctx, log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    rc = ngx_http_lua_shdict_persist_step(ctx, 0);
+
+    return ngx_http_lua_shdict_persist_finish(ctx, rc);
+}
+
+
+/*
+ * a snapshot holds all the unexpired items of the zone and is written to
+ * a temporary file which then replaces the snapshot file. the stripes are
+ * walked in batches and their mutexes are released between the batches,
+ * so the snapshot is not a consistent view of the whole zone but never
+ * blocks it for long
+ */
+
+static ngx_int_t
+ngx_http_lua_shdict_persist_start(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_log_t *log)
+{
+    ngx_time_t                         *tp;
+    ngx_http_lua_shdict_file_t         *f;
+    ngx_http_lua_shdict_file_header_t   header;
+
+    f = ngx_alloc(sizeof(ngx_http_lua_shdict_file_t)
+                  + NGX_HTTP_LUA_SHDICT_PERSIST_BUFSIZE, log);
+    if (f == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(f, sizeof(ngx_http_lua_shdict_file_t));
+
+    f->name = &ctx->persist_temp;
+    f->log = log;
+
+    f->start = (u_char *) f + sizeof(ngx_http_lua_shdict_file_t);
+    f->last = f->start;
+    f->end = f->start + NGX_HTTP_LUA_SHDICT_PERSIST_BUFSIZE;
+
+    f->fd = ngx_open_file(ctx->persist_temp.data, NGX_FILE_WRONLY,
+                          NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+
+    if (f->fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_open_file_n " \"%V\" failed", &ctx->persist_temp);
+        ngx_free(f);
+        return NGX_ERROR;
+    }
+
+    f->started = ngx_current_msec;
+
+    tp = ngx_timeofday();
+    f->now = (uint64_t) tp->sec * 1000 + tp->msec;
+
+    ngx_memzero(&header, sizeof(ngx_http_lua_shdict_file_header_t));
+    ngx_memcpy(header.magic, NGX_HTTP_LUA_SHDICT_PERSIST_MAGIC, 8);
+    header.byte_order = NGX_HTTP_LUA_SHDICT_PERSIST_BOM;
+
+    f->rc = ngx_http_lua_shdict_persist_write(f, &header, sizeof(header));
+
+    ctx->persist_file = f;
+
+    return NGX_OK;
+}
+
+
+/*
+ * continues the snapshot from its cursor for about slice ms, or until it
+ * is complete when slice is 0. returns NGX_AGAIN when there is more to
+ * write
+ */
+
+static ngx_int_t
+ngx_http_lua_shdict_persist_step(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_msec_t slice)
+{
+    ngx_int_t                      rc;
+    ngx_msec_t                     start;
+    ngx_http_lua_shdict_file_t    *f;
+    ngx_http_lua_shdict_stripe_t  *stripe;
+
+    f = ctx->persist_file;
+
+    start = ngx_current_msec;
+
+    while (f->rc == NGX_OK && f->stripe < ctx->sh->nstripes) {
+        stripe = &ctx->sh->stripes[f->stripe];
+
+        ngx_shmtx_lock(&stripe->shpool->mutex);
+
+        rc = ngx_http_lua_shdict_walk(stripe, &f->cursor,
+                                      NGX_HTTP_LUA_SHDICT_PERSIST_BATCH,
+                                      ngx_http_lua_shdict_persist_node, f);
+
+        ngx_shmtx_unlock(&stripe->shpool->mutex);
+
+        /* keep the disk writes out of the mutex whenever possible */
+
+        if (f->rc == NGX_OK && f->last - f->start > (f->end - f->start) / 2) {
+            f->rc = ngx_http_lua_shdict_persist_flush(f);
+        }
+
+        if (rc == NGX_DONE) {
+            f->stripe++;
+            f->cursor = 0;
+        }
+
+        if (slice) {
+            ngx_time_update();
+
+            if (ngx_current_msec - start >= slice) {
+                break;
+            }
+        }
+    }
+
+    if (f->rc != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return f->stripe < ctx->sh->nstripes ? NGX_AGAIN : NGX_OK;
+}
+
+
+/* completes the snapshot on NGX_OK and discards it otherwise */
+
+static ngx_int_t
+ngx_http_lua_shdict_persist_finish(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_int_t rc)
+{
+    ngx_log_t                   *log;
+    ngx_http_lua_shdict_file_t  *f;
+
+    f = ctx->persist_file;
+    ctx->persist_file = NULL;
+
+    log = f->log;
+
+    if (rc == NGX_OK) {
+        rc = ngx_http_lua_shdict_persist_flush(f);
+    }
+
+    if (ngx_close_file(f->fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &ctx->persist_temp);
+        rc = NGX_ERROR;
+    }
+
+    if (rc != NGX_OK) {
+        goto failed;
+    }
+
+    if (ngx_rename_file(ctx->persist_temp.data, ctx->persist.data)
+        == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_rename_file_n " \"%V\" to \"%V\" failed",
+                      &ctx->persist_temp, &ctx->persist);
+        goto failed;
+    }
+
+    ngx_time_update();
+
+    ngx_log_error(NGX_LOG_INFO, log, 0,
+                  "lua_shared_dict \"%V\": saved %ui items to \"%V\" "
+                  "in %M ms", &ctx->name, f->count, &ctx->persist,
+                  ngx_current_msec - f->started);
+
+    ngx_free(f);
+
+    return NGX_OK;
+
+failed:
+
+    if (ngx_delete_file(ctx->persist_temp.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_delete_file_n " \"%V\" failed", &ctx->persist_temp);
+    }
+
+    ngx_free(f);
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_http_lua_shdict_persist_node(ngx_http_lua_shdict_stripe_t *stripe,
+    ngx_rbtree_node_t *node, void *data)
+{
+    ngx_http_lua_shdict_file_t  *f = data;
+
+    ngx_queue_t                        *q;
+    ngx_http_lua_shdict_node_t         *sd;
+    ngx_http_lua_shdict_list_t         *list;
+    ngx_http_lua_shdict_list_node_t    *item;
+    ngx_http_lua_shdict_file_item_t     fi;
+    ngx_http_lua_shdict_file_record_t   record;
+
+    if (f->rc != NGX_OK) {
+        return;
+    }
+
+    sd = (ngx_http_lua_shdict_node_t *) &node->color;
+
+    if (ngx_http_lua_shdict_expired(stripe, sd, f->now)) {
+        return;
+    }
+
+    ngx_memzero(&record, sizeof(ngx_http_lua_shdict_file_record_t));
+
+    record.expires = sd->expires;
+    record.user_flags = sd->user_flags;
+    record.key_len = sd->key_len;
+    record.value_type = sd->value_type;
+
+    if (sd->value_type == NGX_HTTP_LUA_SHDICT_TLIST) {
+        list = ngx_http_lua_shdict_get_list(sd);
+        record.value_len = (uint32_t) list->nitems;
+
+    } else {
+        list = NULL;
+        record.value_len = sd->value_len;
+    }
+
+    f->rc = ngx_http_lua_shdict_persist_write(f, &record, sizeof(record));
+    if (f->rc != NGX_OK) {
+        return;
+    }
+
+    f->rc = ngx_http_lua_shdict_persist_write(f, sd->data, sd->key_len);
+    if (f->rc != NGX_OK) {
+        return;
+    }
+
+    f->count++;
+
+    if (list == NULL) {
+        f->rc = ngx_http_lua_shdict_persist_write(f, sd->data + sd->key_len,
+                                                  sd->value_len);
+        return;
+    }
+
+    ngx_memzero(&fi, sizeof(ngx_http_lua_shdict_file_item_t));
+
+    for (q = ngx_queue_head(&list->items);
+         q != ngx_queue_sentinel(&list->items);
+         q = ngx_queue_next(q))
+    {
+        item = ngx_queue_data(q, ngx_http_lua_shdict_list_node_t, queue);
+
+        fi.value_len = item->value_len;
+        fi.value_type = item->value_type;
+
+        f->rc = ngx_http_lua_shdict_persist_write(f, &fi, sizeof(fi));
+        if (f->rc != NGX_OK) {
+            return;
+        }
+
+        f->rc = ngx_http_lua_shdict_persist_write(f, item->data,
+                                                  item->value_len);
+        if (f->rc != NGX_OK) {
+            return;
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_lua_shdict_persist_write(ngx_http_lua_shdict_file_t *f, void *data,
+    size_t len)
+{
+    size_t   n;
+    u_char  *p = data;
+
+    while (len) {
+        if (f->last == f->end
+            && ngx_http_lua_shdict_persist_flush(f) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        n = ngx_min(len, (size_t) (f->end - f->last));
+
+        f->last = ngx_cpymem(f->last, p, n);
+
+        p += n;
+        len -= n;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_shdict_persist_flush(ngx_http_lua_shdict_file_t *f)
+{
+    ssize_t   n;
+    u_char   *p;
+
+    for (p = f->start; p < f->last; p += n) {
+        n = ngx_write_fd(f->fd, p, f->last - p);
+
+        if (n == -1) {
+            ngx_log_error(NGX_LOG_CRIT, f->log, ngx_errno,
+                          ngx_write_fd_n " to \"%V\" failed", f->name);
+            return NGX_ERROR;
+        }
+    }
+
+    f->last = f->start;
+
+    return NGX_OK;
+}
+
+
+/*
+ * streams a snapshot file into a newly created zone. a missing file is
+ * not an error, and neither is a damaged or truncated one: the items
+ * read so far are kept
+ */
+
+static ngx_int_t
+ngx_http_lua_shdict_load(ngx_http_lua_shdict_ctx_t *ctx)
+{
+    u_char                             *key;
+    ngx_int_t                           rc;
+    ngx_err_t                           err;
+    ngx_time_t                         *tp;
+    ngx_msec_t                          start;
+    ngx_http_lua_shdict_file_t          f;
+    ngx_http_lua_shdict_file_header_t   header;
+
+    ngx_memzero(&f, sizeof(ngx_http_lua_shdict_file_t));
+
+    f.name = &ctx->persist;
+    f.log = ctx->log;
+
+    f.fd = ngx_open_file(ctx->persist.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (f.fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        if (err == NGX_ENOENT) {
+            return NGX_OK;
+        }
+
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, err,
+                      ngx_open_file_n " \"%V\" failed", &ctx->persist);
+        return NGX_ERROR;
+    }
+
+    /* the read buffer is followed by room for the longest possible key */
+
+    f.start = ngx_alloc(NGX_HTTP_LUA_SHDICT_PERSIST_BUFSIZE + 65536, ctx->log);
+    if (f.start == NULL) {
+        (void) ngx_close_file(f.fd);
+        return NGX_ERROR;
+    }
+
+    f.pos = f.start;
+    f.last = f.start;
+    f.end = f.start + NGX_HTTP_LUA_SHDICT_PERSIST_BUFSIZE;
+
+    key = f.end;
+
+    start = ngx_current_msec;
+
+    tp = ngx_timeofday();
+    f.now = (uint64_t) tp->sec * 1000 + tp->msec;
+
+    rc = ngx_http_lua_shdict_load_read(&f, &header, sizeof(header));
+
+    if (rc == NGX_OK
+        && (ngx_memcmp(header.magic, NGX_HTTP_LUA_SHDICT_PERSIST_MAGIC, 8)
+            != 0
+            || header.byte_order != NGX_HTTP_LUA_SHDICT_PERSIST_BOM))
+    {
+        rc = NGX_DECLINED;
+    }
+
+    while (rc == NGX_OK) {
+        rc = ngx_http_lua_shdict_load_record(ctx, &f, key);
+    }
+
+    switch (rc) {
+
+    case NGX_DONE:
+        ngx_time_update();
+
+        ngx_log_error(NGX_LOG_INFO, ctx->log, 0,
+                      "lua_shared_dict \"%V\": loaded %ui items from \"%V\" "
+                      "in %M ms", &ctx->name, f.count, &ctx->persist,
+                      ngx_current_msec - start);
+        break;
+
+    case NGX_DECLINED:
+        ngx_log_error(NGX_LOG_WARN, ctx->log, 0,
+                      "lua_shared_dict \"%V\": snapshot \"%V\" is damaged, "
+                      "truncated or from another platform, loaded %ui "
+                      "items only", &ctx->name, &ctx->persist, f.count);
+        break;
+
+    case NGX_ABORT:
+        ngx_log_error(NGX_LOG_WARN, ctx->log, 0,
+                      "lua_shared_dict \"%V\" is too small for snapshot "
+                      "\"%V\", loaded %ui items only",
+                      &ctx->name, &ctx->persist, f.count);
+        break;
+
+    default: /* NGX_ERROR */
+        break;
+    }
+
+    ngx_free(f.start);
+
+    if (ngx_close_file(f.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ctx->log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &ctx->persist);
+    }
+
+    return rc == NGX_ERROR ? NGX_ERROR : NGX_OK;
+}
+
+
+/*
+ * returns NGX_OK when an item has been read, NGX_DONE at the end of the
+ * file, NGX_DECLINED for damaged or truncated data, NGX_ABORT when the
+ * zone is full and NGX_ERROR on read errors
+ */
+
+static ngx_int_t
+ngx_http_lua_shdict_load_record(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_http_lua_shdict_file_t *f, u_char *key)
+{
+    size_t                              size, max, total;
+    uint32_t                            hash, i;
+    ngx_int_t                           rc;
+    ngx_rbtree_node_t                  *node;
+    ngx_http_lua_shdict_node_t         *sd;
+    ngx_http_lua_shdict_list_t         *list;
+    ngx_http_lua_shdict_stripe_t       *stripe;
+    ngx_http_lua_shdict_list_node_t    *item;
+    ngx_http_lua_shdict_file_item_t     fi;
+    ngx_http_lua_shdict_file_record_t   record;
+
+    /* refill the buffer to tell the end of the file */
+
+    rc = ngx_http_lua_shdict_load_read(f, NULL, 0);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    if (f->pos == f->last) {
+        return NGX_DONE;
+    }
+
+    rc = ngx_http_lua_shdict_load_read(f, &record, sizeof(record));
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    if (record.key_len == 0) {
+        return NGX_DECLINED;
+    }
+
+    rc = ngx_http_lua_shdict_load_read(f, key, record.key_len);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    hash = ngx_http_lua_shdict_hash(ctx, key, record.key_len);
+
+    stripe = ngx_http_lua_shdict_get_stripe(ctx, hash);
+
+    /* nothing larger than the stripe can have been saved from it */
+
+    max = (size_t) (stripe->shpool->end - (u_char *) stripe->shpool);
+
+    if (record.value_type == NGX_HTTP_LUA_SHDICT_TLIST) {
+
+        /* empty lists are never stored, pop relies on it */
+
+        if (record.value_len == 0 || record.value_len > max) {
+            return NGX_DECLINED;
+        }
+
+    } else if (ngx_http_lua_shdict_load_check(record.value_type,
+                                              record.value_len, max)
+               != NGX_OK)
+    {
+        return NGX_DECLINED;
+    }
+
+    total = 0;
+
+    /* do not trust the file to hold unique keys */
+
+    if ((record.expires != 0 && record.expires <= f->now)
+        || ngx_http_lua_shdict_lookup(stripe, hash, key, record.key_len, &sd)
+           != NGX_DECLINED)
+    {
+        if (record.value_type != NGX_HTTP_LUA_SHDICT_TLIST) {
+            return ngx_http_lua_shdict_load_read(f, NULL, record.value_len);
+        }
+
+        for (i = 0; i < record.value_len; i++) {
+            rc = ngx_http_lua_shdict_load_read(f, &fi, sizeof(fi));
+            if (rc != NGX_OK) {
+                return rc;
+            }
+
+            total += fi.value_len;
+
+            if (fi.value_type == LUA_TBOOLEAN
+                || ngx_http_lua_shdict_load_check(fi.value_type,
+                                                  fi.value_len, max)
+                   != NGX_OK
+                || total > max)
+            {
+                return NGX_DECLINED;
+            }
+
+            rc = ngx_http_lua_shdict_load_read(f, NULL, fi.value_len);
+            if (rc != NGX_OK) {
+                return rc;
+            }
+        }
+
+        return NGX_OK;
+    }
+
+    size = offsetof(ngx_rbtree_node_t, color)
+           + offsetof(ngx_http_lua_shdict_node_t, data)
+           + record.key_len;
+
+    if (record.value_type == NGX_HTTP_LUA_SHDICT_TLIST) {
+        size += NGX_ALIGNMENT + sizeof(ngx_http_lua_shdict_list_t);
+
+    } else {
+        size += record.value_len;
+    }
+
+    node = ngx_slab_alloc_locked(stripe->shpool, size);
+    if (node == NULL) {
+        return NGX_ABORT;
+    }
+
+    sd = (ngx_http_lua_shdict_node_t *) &node->color;
+
+    node->key = hash;
+    sd->key_len = record.key_len;
+    sd->expires = record.expires;
+    sd->user_flags = record.user_flags;
+    sd->value_type = record.value_type;
+    sd->generation = stripe->generation;
+
+    ngx_memcpy(sd->data, key, record.key_len);
+
+    if (record.value_type != NGX_HTTP_LUA_SHDICT_TLIST) {
+        sd->value_len = record.value_len;
+
+        rc = ngx_http_lua_shdict_load_read(f, sd->data + record.key_len,
+                                           record.value_len);
+        if (rc != NGX_OK) {
+            ngx_slab_free_locked(stripe->shpool, node);
+            return rc;
+        }
+
+        ngx_http_lua_shdict_insert_node(stripe, node);
+        ngx_queue_insert_head(&stripe->queue, &sd->queue);
+
+        f->count++;
+
+        return NGX_OK;
+    }
+
+    sd->value_len = sizeof(ngx_http_lua_shdict_list_t);
+
+    list = ngx_http_lua_shdict_get_list(sd);
+
+    ngx_queue_init(&list->items);
+    list->nitems = 0;
+
+    /* insert the list first so that removing it frees the items read */
+
+    ngx_http_lua_shdict_insert_node(stripe, node);
+    ngx_queue_insert_head(&stripe->queue, &sd->queue);
+
+    for (i = 0; i < record.value_len; i++) {
+        rc = ngx_http_lua_shdict_load_read(f, &fi, sizeof(fi));
+
+        if (rc == NGX_OK) {
+            total += fi.value_len;
+
+            if (fi.value_type == LUA_TBOOLEAN
+                || ngx_http_lua_shdict_load_check(fi.value_type,
+                                                  fi.value_len, max)
+                   != NGX_OK
+                || total > max)
+            {
+                rc = NGX_DECLINED;
+            }
+        }
+
+        if (rc == NGX_OK) {
+            item = ngx_slab_alloc_locked(stripe->shpool,
+                       offsetof(ngx_http_lua_shdict_list_node_t, data)
+                       + fi.value_len);
+
+            if (item == NULL) {
+                rc = NGX_ABORT;
+
+            } else {
+                item->value_len = fi.value_len;
+                item->value_type = fi.value_type;
+
+                ngx_queue_insert_tail(&list->items, &item->queue);
+                list->nitems++;
+
+                rc = ngx_http_lua_shdict_load_read(f, item->data,
+                                                   fi.value_len);
+            }
+        }
+
+        if (rc != NGX_OK) {
+            ngx_http_lua_shdict_remove_node(stripe, sd);
+            return rc;
+        }
+    }
+
+    f->count++;
+
+    return NGX_OK;
+}
+
+
+/*
+ * checks the type and the length of a value or a list item read from a
+ * snapshot, before it is trusted to allocate or read anything
+ */
+
+static ngx_int_t
+ngx_http_lua_shdict_load_check(ngx_uint_t type, size_t len, size_t max)
+{
+    switch (type) {
+    case LUA_TBOOLEAN:
+        return len == sizeof(u_char) ? NGX_OK : NGX_DECLINED;
+
+    case LUA_TNUMBER:
+        return len == sizeof(lua_Number) ? NGX_OK : NGX_DECLINED;
+
+    case LUA_TSTRING:
+        return len <= max ? NGX_OK : NGX_DECLINED;
+
+    default:
+        return NGX_DECLINED;
+    }
+}
+
+
+/*
+ * reads len bytes to dst, or skips them when dst is NULL; a zero len
+ * refills the buffer once it has been consumed
+ */
+
+static ngx_int_t
+ngx_http_lua_shdict_load_read(ngx_http_lua_shdict_file_t *f, void *dst,
+    size_t len)
+{
+    size_t    n;
+    ssize_t   rc;
+    u_char   *p = dst;
+
+    do {
+        if (f->pos == f->last) {
+            rc = ngx_read_fd(f->fd, f->start, f->end - f->start);
+
+            if (rc == -1) {
+                ngx_log_error(NGX_LOG_CRIT, f->log, ngx_errno,
+                              ngx_read_fd_n " \"%V\" failed", f->name);
+                return NGX_ERROR;
+            }
+
+            f->pos = f->start;
+            f->last = f->start + rc;
+
+            if (rc == 0) {
+                return len ? NGX_DECLINED : NGX_OK;
+            }
+        }
+
+        n = ngx_min(len, (size_t) (f->last - f->pos));
+
+        if (p) {
+            p = ngx_cpymem(p, f->pos, n);
+        }
+
+        f->pos += n;
+        len -= n;
+
+    } while (len);
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_lua_shdict_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t          **p;
+    ngx_http_lua_shdict_node_t   *sdn, *sdnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            sdn = (ngx_http_lua_shdict_node_t *) &node->color;
+            sdnt = (ngx_http_lua_shdict_node_t *) &temp->color;
+
+            p = (ngx_memn2cmp(sdn->data, sdnt->data, sdn->key_len,
+                sdnt->key_len) < 0) ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_int_t
+ngx_http_lua_shdict_lookup(ngx_http_lua_shdict_stripe_t *stripe,
+    ngx_uint_t hash, u_char *kdata, size_t klen,
+    ngx_http_lua_shdict_node_t **sdp)
+{
+    ngx_int_t                    rc;
+    ngx_time_t                  *tp;
+    uint64_t                     now;
+    int64_t                      ms;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_lua_shdict_node_t  *sd;
+
+    if (stripe->buckets) {
+
+        for (node = *ngx_http_lua_shdict_get_bucket(stripe, hash);
+             node;
+             node = node->left)
+        {
+            if (node->key != hash) {
+                continue;
+            }
+
+            sd = (ngx_http_lua_shdict_node_t *) &node->color;
+
+            if (ngx_memn2cmp(kdata, sd->data, klen, (size_t) sd->key_len)
+                == 0)
+            {
+                goto found;
+            }
+        }
+
+        *sdp = NULL;
+
+        return NGX_DECLINED;
+    }
+
+    node = stripe->rbtree.root;
+    sentinel = stripe->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        sd = (ngx_http_lua_shdict_node_t *) &node->color;
+
+        rc = ngx_memn2cmp(kdata, sd->data, klen, (size_t) sd->key_len);
+
+        if (rc == 0) {
+            goto found;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    *sdp = NULL;
+
+    return NGX_DECLINED;
+
+found:
+
+    ngx_queue_remove(&sd->queue);
+    ngx_queue_insert_head(&stripe->queue, &sd->queue);
+
+    *sdp = sd;
+
+    dd("node expires: %lld", (long long) sd->expires);
+
+    if (sd->generation != stripe->generation) {
+        dd("node flushed");
+        return NGX_DONE;
+    }
+
+    if (sd->expires != 0) {
+        tp = ngx_timeofday();
+
+        now = (uint64_t) tp->sec * 1000 + tp->msec;
+        ms = sd->expires - now;
+
+        dd("time to live: %lld", (long long) ms);
+
+        if (ms < 0) {
+            dd("node already expired");
+            return NGX_DONE;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static int
+ngx_http_lua_shdict_expire(ngx_http_lua_shdict_stripe_t *stripe, ngx_uint_t n)
+{
+    ngx_time_t                  *tp;
+    uint64_t                     now;
+    ngx_queue_t                 *q;
+    ngx_http_lua_shdict_node_t  *sd;
+    int                          freed = 0;
+
+    tp = ngx_timeofday();
+
+    now = (uint64_t) tp->sec * 1000 + tp->msec;
+
+    /*
+     * n == 1 deletes one or two expired entries
+     * n == 0 deletes oldest entry by force
+     *        and one or two zero rate entries
+     */
+
+    while (n < 3) {
+
+        if (ngx_queue_empty(&stripe->queue)) {
+            return freed;
+        }
+
+        q = ngx_queue_last(&stripe->queue);
+
+        sd = ngx_queue_data(q, ngx_http_lua_shdict_node_t, queue);
+
+        if (n++ != 0 && !ngx_http_lua_shdict_expired(stripe, sd, now)) {
+            return freed;
+        }
+
+        if (ngx_http_lua_shdict_expired(stripe, sd, now)) {
+            stripe->reclaimed++;
+
+        } else {
+            stripe->evicted++;
+        }
+
+        ngx_http_lua_shdict_remove_node(stripe, sd);
+
+        freed++;
+    }
+
+    return freed;
+}
+
+
+void
+ngx_http_lua_inject_shdict_api(ngx_http_lua_main_conf_t *lmcf, lua_State *L)
+{
+    ngx_http_lua_shdict_ctx_t   *ctx;
+    ngx_uint_t                   i;
+    ngx_shm_zone_t             **zone;
+
+    if (lmcf->shm_zones != NULL) {
+        lua_createtable(L, 0, lmcf->shm_zones->nelts /* nrec */);
+                /* ngx.shared */
+
+        lua_createtable(L, 0 /* narr */, 22 /* nrec */); /* shared mt */
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_get);
+        lua_setfield(L, -2, "get");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_set);
+        lua_setfield(L, -2, "set");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_add);
+        lua_setfield(L, -2, "add");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_replace);
+        lua_setfield(L, -2, "replace");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_incr);
+        lua_setfield(L, -2, "incr");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_decr);
+        lua_setfield(L, -2, "decr");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_min);
+        lua_setfield(L, -2, "min");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_max);
+        lua_setfield(L, -2, "max");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_cas);
+        lua_setfield(L, -2, "cas");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_delete);
+        lua_setfield(L, -2, "delete");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_flush_all);
+        lua_setfield(L, -2, "flush_all");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_flush_expired);
+        lua_setfield(L, -2, "flush_expired");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_get_multi);
+        lua_setfield(L, -2, "get_multi");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_set_multi);
+        lua_setfield(L, -2, "set_multi");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_stats);
+        lua_setfield(L, -2, "stats");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_get_keys);
+        lua_setfield(L, -2, "get_keys");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_lpush);
+        lua_setfield(L, -2, "lpush");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_rpush);
+        lua_setfield(L, -2, "rpush");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_lpop);
+        lua_setfield(L, -2, "lpop");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_rpop);
+        lua_setfield(L, -2, "rpop");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_llen);
+        lua_setfield(L, -2, "llen");
+
+        lua_pushvalue(L, -1); /* shared mt mt */
+        lua_setfield(L, -2, "__index"); /* shared mt */
+
+        zone = lmcf->shm_zones->elts;
+
+        for (i = 0; i < lmcf->shm_zones->nelts; i++) {
+            ctx = zone[i]->data;
+
+            lua_pushlstring(L, (char *) ctx->name.data, ctx->name.len);
+                /* shared mt key */
+
+            lua_pushlightuserdata(L, zone[i]); /* shared mt key ud */
+            lua_pushvalue(L, -3); /* shared mt key ud mt */
+            lua_setmetatable(L, -2); /* shared mt key ud */
+            lua_rawset(L, -4); /* shared mt */
+        }
+
+        lua_pop(L, 1); /* shared */
+
+    } else {
+        lua_newtable(L);    /* ngx.shared */
+    }
+
+    lua_setfield(L, -2, "shared");
+}
+
+
+static int
+ngx_http_lua_shdict_get(lua_State *L)
+{
+    int                            n;
+    ngx_str_t                      name;
+    ngx_str_t                      key;
+    uint32_t                       hash;
+    ngx_int_t                      rc;
+    ngx_http_lua_shdict_ctx_t     *ctx;
+    ngx_http_lua_shdict_stripe_t  *stripe;
+    ngx_http_lua_shdict_node_t    *sd;
+    ngx_str_t                      value;
+    int                            value_type;
+    lua_Number                     num;
+    u_char                         c;
+    ngx_shm_zone_t                *zone;
+    uint32_t                       user_flags = 0;
+
+    n = lua_gettop(L);
+
+    if (n != 2) {
+        return luaL_error(L, "expecting exactly two arguments, "
+                "but only seen %d", n);
+    }
+
+    luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+
+    zone = lua_touserdata(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad user data for the ngx_shm_zone_t pointer");
+    }
+
+    ctx = zone->data;
+
+    name = ctx->name;
+
+    key.data = (u_char *) luaL_checklstring(L, 2, &key.len);
+
+    if (key.len == 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    if (key.len > 65535) {
+        return luaL_error(L,
+                          "the key argument is more than 65535 bytes: \"%s\"",
+                          key.data);
+    }
+
+    hash = ngx_http_lua_shdict_hash(ctx, key.data, key.len);
+
+    stripe = ngx_http_lua_shdict_get_stripe(ctx, hash);
+
+#if (NGX_DEBUG)
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                   "fetching key \"%V\" in shared dict \"%V\"", &key, &name);
+#endif /* NGX_DEBUG */
+
+    ngx_shmtx_lock(&stripe->shpool->mutex);
+
+#if 1
+    ngx_http_lua_shdict_expire(stripe, 1);
+#endif
+
+    rc = ngx_http_lua_shdict_lookup(stripe, hash, key.data, key.len, &sd);
+
+    dd("shdict lookup returns %d", (int) rc);
+
+    if (rc == NGX_DECLINED || rc == NGX_DONE) {
+        stripe->misses++;
+        ngx_shmtx_unlock(&stripe->shpool->mutex);
+        lua_pushnil(L);
+        return 1;
+    }
+
+    stripe->hits++;
+
+    /* rc == NGX_OK */
+
+    value_type = sd->value_type;
+
+    dd("data: %p", sd->data);
     dd("key len: %d", (int) sd->key_len);
 
-    value.data = sd->data + sd->key_len;
-    value.len = (size_t) sd->value_len;
+    value.data = sd->data + sd->key_len;
+    value.len = (size_t) sd->value_len;
+
+    switch (value_type) {
+    case LUA_TSTRING:
+
+        lua_pushlstring(L, (char *) value.data, value.len);
+        break;
+
+    case LUA_TNUMBER:
+
+        if (value.len != sizeof(lua_Number)) {
+
+            ngx_shmtx_unlock(&stripe->shpool->mutex);
+
+            return luaL_error(L, "bad lua number value size found for key %s "
+                    "in shared_dict %s: %lu", key.data, name.data,
+                    (unsigned long) value.len);
+        }
+
+        num = *(lua_Number *) value.data;
+
+        lua_pushnumber(L, num);
+        break;
+
+    case LUA_TBOOLEAN:
+
+        if (value.len != sizeof(u_char)) {
+
+            ngx_shmtx_unlock(&stripe->shpool->mutex);
+
+            return luaL_error(L, "bad lua boolean value size found for key %s "
+                    "in shared_dict %s: %lu", key.data, name.data,
+                    (unsigned long) value.len);
+        }
+
+        c = *value.data;
+
+        lua_pushboolean(L, c ? 1 : 0);
+        break;
+
+    case NGX_HTTP_LUA_SHDICT_TLIST:
+
+        ngx_shmtx_unlock(&stripe->shpool->mutex);
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "value is a list");
+        return 2;
+
+    default:
+
+        ngx_shmtx_unlock(&stripe->shpool->mutex);
+
+        return luaL_error(L, "bad value type found for key %s in "
+                "shared_dict %s: %d", key.data, name.data,
+                value_type);
+    }
+
+    user_flags = sd->user_flags;
+
+    ngx_shmtx_unlock(&stripe->shpool->mutex);
+
+    if (user_flags) {
+        lua_pushinteger(L, (lua_Integer) user_flags);
+        return 2;
+    }
+
+    return 1;
+}
+
+
+static int
+ngx_http_lua_shdict_get_multi(lua_State *L)
+{
+    int                            n;
+    ngx_str_t                      key;
+    uint32_t                       hash;
+    ngx_int_t                      rc;
+    ngx_uint_t                     i, nkeys;
+    ngx_http_lua_shdict_ctx_t     *ctx;
+    ngx_http_lua_shdict_stripe_t  *stripe, *locked;
+    ngx_http_lua_shdict_node_t    *sd;
+    ngx_shm_zone_t                *zone;
+
+    n = lua_gettop(L);
+
+    if (n != 2) {
+        return luaL_error(L, "expecting exactly two arguments, "
+                "but only seen %d", n);
+    }
+
+    luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+
+    zone = lua_touserdata(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad user data for the ngx_shm_zone_t pointer");
+    }
+
+    ctx = zone->data;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    nkeys = lua_objlen(L, 2);
+
+    /* validate all the keys before taking any lock */
+
+    for (i = 1; i <= nkeys; i++) {
+        lua_rawgeti(L, 2, i);
+
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            return luaL_error(L, "bad key at index %d: string expected, "
+                              "got %s", (int) i, luaL_typename(L, -1));
+        }
+
+        if (lua_objlen(L, -1) > 65535) {
+            return luaL_error(L, "the key at index %d is more than 65535 "
+                              "bytes", (int) i);
+        }
+
+        lua_pop(L, 1);
+    }
+
+    lua_createtable(L, 0, nkeys);
+
+    locked = NULL;
+
+    for (i = 1; i <= nkeys; i++) {
+        lua_rawgeti(L, 2, i); /* res key */
+
+        key.data = (u_char *) lua_tolstring(L, -1, &key.len);
+
+        if (key.len == 0) {
+            lua_pop(L, 1);
+            continue;
+        }
+
+        hash = ngx_http_lua_shdict_hash(ctx, key.data, key.len);
+
+        stripe = ngx_http_lua_shdict_get_stripe(ctx, hash);
+
+        if (stripe != locked) {
+            if (locked) {
+                ngx_shmtx_unlock(&locked->shpool->mutex);
+            }
+
+            ngx_shmtx_lock(&stripe->shpool->mutex);
+
+            ngx_http_lua_shdict_expire(stripe, 1);
+
+            locked = stripe;
+        }
+
+        rc = ngx_http_lua_shdict_lookup(stripe, hash, key.data, key.len, &sd);
+
+        if (rc != NGX_OK) {
+            stripe->misses++;
+            lua_pop(L, 1);
+            continue;
+        }
+
+        stripe->hits++;
+
+        if (sd->value_type == NGX_HTTP_LUA_SHDICT_TLIST) {
+            lua_pop(L, 1);
+            continue;
+        }
+
+        if (ngx_http_lua_shdict_push_value(L, sd) != NGX_OK) {
+            ngx_shmtx_unlock(&stripe->shpool->mutex);
+
+            return luaL_error(L, "bad value found for key %s in "
+                              "shared_dict %s", key.data, ctx->name.data);
+        }
+
+        lua_rawset(L, -3); /* res */
+    }
+
+    if (locked) {
+        ngx_shmtx_unlock(&locked->shpool->mutex);
+    }
+
+    return 1;
+}
+
+
+static int
+ngx_http_lua_shdict_set_multi(lua_State *L)
+{
+    int                            n;
+    ngx_str_t                      key;
+    uint32_t                       hash;
+    ngx_int_t                      rc;
+    ngx_http_lua_shdict_ctx_t     *ctx;
+    ngx_http_lua_shdict_stripe_t  *stripe, *locked;
+    ngx_str_t                      value;
+    int                            value_type;
+    lua_Number                     num;
+    u_char                         c;
+    lua_Number                     exptime = 0;
+    ngx_shm_zone_t                *zone;
+    char                          *err;
+    int                            forcible = 0;
+    uint32_t                       user_flags = 0;
+
+    n = lua_gettop(L);
+
+    if (n < 2 || n > 4) {
+        return luaL_error(L, "expecting 2, 3 or 4 arguments, "
+                "but seen %d", n);
+    }
+
+    luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+
+    zone = lua_touserdata(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad user data for the ngx_shm_zone_t pointer");
+    }
+
+    ctx = zone->data;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    if (n >= 3) {
+        exptime = luaL_checknumber(L, 3);
+        if (exptime < 0) {
+            exptime = 0;
+        }
+    }
+
+    if (n == 4) {
+        user_flags = (uint32_t) luaL_checkinteger(L, 4);
+    }
+
+    lua_settop(L, 2);
+
+    /* validate all the pairs before taking any lock */
+
+    lua_pushnil(L);
+    while (lua_next(L, 2) != 0) {
+        if (lua_type(L, -2) != LUA_TSTRING) {
+            return luaL_error(L, "bad key type: string expected, got %s",
+                              luaL_typename(L, -2));
+        }
+
+        key.data = (u_char *) lua_tolstring(L, -2, &key.len);
+
+        if (key.len == 0) {
+            return luaL_error(L, "attempt to use empty keys");
+        }
+
+        if (key.len > 65535) {
+            return luaL_error(L, "the key argument is more than 65535 "
+                              "bytes: %d", (int) key.len);
+        }
+
+        value_type = lua_type(L, -1);
+
+        if (value_type != LUA_TSTRING
+            && value_type != LUA_TNUMBER
+            && value_type != LUA_TBOOLEAN)
+        {
+            return luaL_error(L, "unsupported value type for key \"%s\" in "
+                              "shared_dict \"%s\": %s", key.data,
+                              ctx->name.data, lua_typename(L, value_type));
+        }
+
+        lua_pop(L, 1);
+    }
+
+    locked = NULL;
+
+    lua_pushnil(L);
+    while (lua_next(L, 2) != 0) {
+        key.data = (u_char *) lua_tolstring(L, -2, &key.len);
+
+        value_type = lua_type(L, -1);
+
+        switch (value_type) {
+        case LUA_TSTRING:
+            value.data = (u_char *) lua_tolstring(L, -1, &value.len);
+            break;
+
+        case LUA_TNUMBER:
+            value.len = sizeof(lua_Number);
+            num = lua_tonumber(L, -1);
+            value.data = (u_char *) &num;
+            break;
+
+        default: /* LUA_TBOOLEAN */
+            value.len = sizeof(u_char);
+            c = lua_toboolean(L, -1) ? 1 : 0;
+            value.data = &c;
+            break;
+        }
+
+        hash = ngx_http_lua_shdict_hash(ctx, key.data, key.len);
+
+        stripe = ngx_http_lua_shdict_get_stripe(ctx, hash);
+
+        if (stripe != locked) {
+            if (locked) {
+                ngx_shmtx_unlock(&locked->shpool->mutex);
+            }
+
+            ngx_shmtx_lock(&stripe->shpool->mutex);
+
+            locked = stripe;
+        }
+
+        rc = ngx_http_lua_shdict_set_locked(ctx, stripe, hash, &key,
+                                            value_type, &value, exptime,
+                                            user_flags, 0, &forcible, &err);
+
+        if (rc != NGX_OK) {
+            ngx_shmtx_unlock(&stripe->shpool->mutex);
+
+            lua_pushboolean(L, 0);
+            lua_pushstring(L, err);
+            lua_pushboolean(L, forcible);
+            return 3;
+        }
+
+        lua_pop(L, 1);
+    }
+
+    if (locked) {
+        ngx_shmtx_unlock(&locked->shpool->mutex);
+    }
+
+    lua_pushboolean(L, 1);
+    lua_pushnil(L);
+    lua_pushboolean(L, forcible);
+    return 3;
+}
+
+
+static ngx_int_t
+ngx_http_lua_shdict_push_value(lua_State *L, ngx_http_lua_shdict_node_t *sd)
+{
+    u_char      *data;
+    lua_Number   num;
+
+    data = sd->data + sd->key_len;
+
+    switch (sd->value_type) {
+    case LUA_TSTRING:
+        lua_pushlstring(L, (char *) data, sd->value_len);
+        break;
+
+    case LUA_TNUMBER:
+        if (sd->value_len != sizeof(lua_Number)) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(&num, data, sizeof(lua_Number));
+
+        lua_pushnumber(L, num);
+        break;
+
+    case LUA_TBOOLEAN:
+        if (sd->value_len != sizeof(u_char)) {
+            return NGX_ERROR;
+        }
+
+        lua_pushboolean(L, *data ? 1 : 0);
+        break;
+
+    default:
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static int
+ngx_http_lua_shdict_delete(lua_State *L)
+{
+    int             n;
+
+    n = lua_gettop(L);
+
+    if (n != 2) {
+        return luaL_error(L, "expecting 2 arguments, "
+                "but only seen %d", n);
+    }
+
+    lua_pushnil(L);
+
+    return ngx_http_lua_shdict_set_helper(L, 0);
+}
+
+
+static int
+ngx_http_lua_shdict_flush_all(lua_State *L)
+{
+    ngx_uint_t                     i;
+    int                            n;
+    ngx_http_lua_shdict_ctx_t     *ctx;
+    ngx_http_lua_shdict_stripe_t  *stripe;
+    ngx_shm_zone_t                *zone;
+
+    n = lua_gettop(L);
+
+    if (n != 1) {
+        return luaL_error(L, "expecting 1 argument, "
+                "but seen %d", n);
+    }
+
+    luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+
+    zone = lua_touserdata(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad user data for the ngx_shm_zone_t pointer");
+    }
+
+    ctx = zone->data;
+
+    for (i = 0; i < ctx->sh->nstripes; i++) {
+        stripe = &ctx->sh->stripes[i];
+
+        /*
+         * all the existing nodes become expired at once, to be freed
+         * later by set operations, the sweeper or flush_expired()
+         */
+
+        ngx_shmtx_lock(&stripe->shpool->mutex);
+
+        stripe->generation++;
+
+        ngx_shmtx_unlock(&stripe->shpool->mutex);
+    }
+
+    return 0;
+}
+
+
+static int
+ngx_http_lua_shdict_flush_expired(lua_State *L)
+{
+    int                               n;
+    ngx_int_t                         rc;
+    ngx_uint_t                        i, cursor;
+    ngx_time_t                       *tp;
+    ngx_shm_zone_t                   *zone;
+    ngx_http_lua_shdict_ctx_t        *ctx;
+    ngx_http_lua_shdict_stripe_t     *stripe;
+    ngx_http_lua_shdict_sweep_ctx_t   sw;
+
+    n = lua_gettop(L);
+
+    if (n != 1 && n != 2) {
+        return luaL_error(L, "expecting 1 or 2 argument(s), "
+                "but seen %d", n);
+    }
+
+    luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+
+    zone = lua_touserdata(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad user data for the ngx_shm_zone_t pointer");
+    }
+
+    ctx = zone->data;
+
+    sw.max = 0;
+
+    if (n == 2) {
+        n = luaL_checkint(L, 2);
+        sw.max = n > 0 ? (ngx_uint_t) n : 0;
+    }
+
+    tp = ngx_timeofday();
+
+    sw.now = (uint64_t) tp->sec * 1000 + tp->msec;
+    sw.freed = 0;
+
+    for (i = 0; i < ctx->sh->nstripes; i++) {
+        stripe = &ctx->sh->stripes[i];
+        cursor = 0;
+
+        /* the mutex is released between the batches */
+
+        do {
+            ngx_shmtx_lock(&stripe->shpool->mutex);
+
+            rc = ngx_http_lua_shdict_walk(stripe, &cursor,
+                                          NGX_HTTP_LUA_SHDICT_SWEEP_BATCH,
+                                          ngx_http_lua_shdict_sweep_node,
+                                          &sw);
+
+            ngx_shmtx_unlock(&stripe->shpool->mutex);
+
+            if (sw.max && sw.freed >= sw.max) {
+                goto done;
+            }
+
+        } while (rc == NGX_AGAIN);
+    }
+
+done:
+
+    lua_pushnumber(L, (lua_Number) sw.freed);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_shdict_stats(lua_State *L)
+{
+    int                                n;
+    ngx_shm_zone_t                    *zone;
+    ngx_http_lua_shared_dict_stats_t   stats;
+
+    n = lua_gettop(L);
+
+    if (n != 1) {
+        return luaL_error(L, "expecting 1 argument, "
+                "but seen %d", n);
+    }
+
+    luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+
+    zone = lua_touserdata(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad user data for the ngx_shm_zone_t pointer");
+    }
+
+    ngx_http_lua_shared_dict_get_stats(zone, &stats);
+
+    lua_createtable(L, 0 /* narr */, 8 /* nrec */);
+
+    lua_pushnumber(L, (lua_Number) stats.keys);
+    lua_setfield(L, -2, "keys");
+
+    lua_pushnumber(L, (lua_Number) stats.hits);
+    lua_setfield(L, -2, "hits");
+
+    lua_pushnumber(L, (lua_Number) stats.misses);
+    lua_setfield(L, -2, "misses");
+
+    lua_pushnumber(L, (lua_Number) stats.sets);
+    lua_setfield(L, -2, "sets");
+
+    lua_pushnumber(L, (lua_Number) stats.evicted);
+    lua_setfield(L, -2, "evicted");
+
+    lua_pushnumber(L, (lua_Number) stats.reclaimed);
+    lua_setfield(L, -2, "reclaimed");
+
+    lua_pushnumber(L, (lua_Number) stats.pages);
+    lua_setfield(L, -2, "pages");
+
+    lua_pushnumber(L, (lua_Number) stats.free_pages);
+    lua_setfield(L, -2, "free_pages");
+
+    return 1;
+}
+
+
+/*
+ * the cursor combines the stripe number, in its upper bits, with the
+ * position within the stripe, which fits into 32 bits for both indexes
+ */
+
+static int
+ngx_http_lua_shdict_get_keys(lua_State *L)
+{
+    int                                  n;
+    double                               pos;
+    ngx_int_t                            rc;
+    ngx_uint_t                           i, cursor, max, chunk;
+    ngx_time_t                          *tp;
+    ngx_shm_zone_t                      *zone;
+    ngx_http_lua_shdict_ctx_t           *ctx;
+    ngx_http_lua_shdict_stripe_t        *stripe;
+    ngx_http_lua_shdict_get_keys_ctx_t   gk;
+
+    n = lua_gettop(L);
+
+    if (n < 1 || n > 3) {
+        return luaL_error(L, "expecting 1, 2 or 3 arguments, "
+                "but seen %d", n);
+    }
+
+    luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+
+    zone = lua_touserdata(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad user data for the ngx_shm_zone_t pointer");
+    }
+
+    ctx = zone->data;
+
+    max = NGX_HTTP_LUA_SHDICT_GET_KEYS_MAX;
+
+    if (n >= 2 && !lua_isnil(L, 2)) {
+        rc = luaL_checkint(L, 2);
+        max = rc > 0 ? (ngx_uint_t) rc : 0;
+    }
+
+    pos = 0;
+
+    if (n == 3 && !lua_isnil(L, 3)) {
+        pos = luaL_checknumber(L, 3);
+
+        if (pos < 0) {
+            return luaL_argerror(L, 3, "bad cursor");
+        }
+    }
+
+    i = (ngx_uint_t) (pos / 4294967296.0);
+    cursor = (ngx_uint_t) (pos - (double) i * 4294967296.0);
+
+    lua_createtable(L, max ? (int) ngx_min(max, 1024) : 0, 0);
+
+    tp = ngx_timeofday();
+
+    gk.lua = L;
+    gk.now = (uint64_t) tp->sec * 1000 + tp->msec;
+    gk.count = 0;
+
+    while (i < ctx->sh->nstripes) {
+        stripe = &ctx->sh->stripes[i];
+
+        chunk = NGX_HTTP_LUA_SHDICT_GET_KEYS_CHUNK;
+
+        if (max && max - gk.count < chunk) {
+            chunk = max - gk.count;
+        }
+
+        /* the mutex is released between the chunks */
+
+        ngx_shmtx_lock(&stripe->shpool->mutex);
+
+        rc = ngx_http_lua_shdict_walk(stripe, &cursor, chunk,
+                                      ngx_http_lua_shdict_get_keys_node, &gk);
+
+        ngx_shmtx_unlock(&stripe->shpool->mutex);
+
+        if (rc == NGX_DONE) {
+            i++;
+            cursor = 0;
+        }
+
+        if (max && gk.count >= max) {
+            break;
+        }
+    }
+
+    if (i >= ctx->sh->nstripes) {
+        lua_pushnil(L);
+
+    } else {
+        lua_pushnumber(L, (double) i * 4294967296.0 + (double) cursor);
+    }
+
+    return 2;
+}
+
+
+static void
+ngx_http_lua_shdict_get_keys_node(ngx_http_lua_shdict_stripe_t *stripe,
+    ngx_rbtree_node_t *node, void *data)
+{
+    ngx_http_lua_shdict_get_keys_ctx_t  *gk = data;
+
+    ngx_http_lua_shdict_node_t  *sd;
+
+    sd = (ngx_http_lua_shdict_node_t *) &node->color;
+
+    if (ngx_http_lua_shdict_expired(stripe, sd, gk->now)) {
+        return;
+    }
+
+    lua_pushlstring(gk->lua, (char *) sd->data, sd->key_len);
+    lua_rawseti(gk->lua, -2, (int) ++gk->count);
+}
+
+
+void
+ngx_http_lua_shared_dict_get_stats(ngx_shm_zone_t *zone,
+    ngx_http_lua_shared_dict_stats_t *stats)
+{
+    ngx_uint_t                     i;
+    ngx_slab_page_t               *page;
+    ngx_slab_pool_t               *sp;
+    ngx_http_lua_shdict_ctx_t     *ctx;
+    ngx_http_lua_shdict_stripe_t  *stripe;
+
+    ctx = zone->data;
+
+    ngx_memzero(stats, sizeof(ngx_http_lua_shared_dict_stats_t));
+
+    for (i = 0; i < ctx->sh->nstripes; i++) {
+        stripe = &ctx->sh->stripes[i];
+        sp = stripe->shpool;
+
+        ngx_shmtx_lock(&sp->mutex);
+
+        stats->keys += stripe->keys;
+        stats->hits += stripe->hits;
+        stats->misses += stripe->misses;
+        stats->sets += stripe->sets;
+        stats->evicted += stripe->evicted;
+        stats->reclaimed += stripe->reclaimed;
+
+        stats->pages += (sp->end - sp->start) / ngx_pagesize;
+
+        for (page = sp->free.next; page != &sp->free; page = page->next) {
+            stats->free_pages += page->slab;
+        }
+
+        ngx_shmtx_unlock(&sp->mutex);
+    }
+}
+
+
+static int
+ngx_http_lua_shdict_add(lua_State *L)
+{
+    return ngx_http_lua_shdict_set_helper(L, NGX_HTTP_LUA_SHDICT_ADD);
+}
+
+
+static int
+ngx_http_lua_shdict_replace(lua_State *L)
+{
+    return ngx_http_lua_shdict_set_helper(L, NGX_HTTP_LUA_SHDICT_REPLACE);
+}
+
+
+static int
+ngx_http_lua_shdict_set(lua_State *L)
+{
+    return ngx_http_lua_shdict_set_helper(L, 0);
+}
+
+
+static int
+ngx_http_lua_shdict_set_helper(lua_State *L, int flags)
+{
+    int                            n;
+    ngx_str_t                      name;
+    ngx_str_t                      key;
+    uint32_t                       hash;
+    ngx_int_t                      rc;
+    ngx_http_lua_shdict_ctx_t     *ctx;
+    ngx_http_lua_shdict_stripe_t  *stripe;
+    ngx_str_t                      value;
+    int                            value_type;
+    lua_Number                     num;
+    u_char                         c;
+    lua_Number                     exptime = 0;
+    ngx_shm_zone_t                *zone;
+    char                          *err;
+    int                            forcible = 0;
+                         /* indicates whether to foricibly override other
+                          * valid entries */
+    int32_t                        user_flags = 0;
+
+    n = lua_gettop(L);
+
+    if (n != 3 && n != 4 && n != 5) {
+        return luaL_error(L, "expecting 3, 4 or 5 arguments, "
+                "but only seen %d", n);
+    }
+
+    luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+
+    zone = lua_touserdata(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad user data for the ngx_shm_zone_t pointer");
+    }
+
+    ctx = zone->data;
+
+    name = ctx->name;
+
+    key.data = (u_char *) luaL_checklstring(L, 2, &key.len);
+
+    if (key.len == 0) {
+        return luaL_error(L, "attempt to use empty keys");
+    }
+
+    if (key.len > 65535) {
+        return luaL_error(L,
+                      "the key argument is more than 65535 bytes: %d",
+                      (int) key.len);
+    }
+
+    hash = ngx_http_lua_shdict_hash(ctx, key.data, key.len);
+
+    stripe = ngx_http_lua_shdict_get_stripe(ctx, hash);
+
+    value_type = lua_type(L, 3);
+
+    switch (value_type) {
+    case LUA_TSTRING:
+        value.data = (u_char *) lua_tolstring(L, 3, &value.len);
+        break;
+
+    case LUA_TNUMBER:
+        value.len = sizeof(lua_Number);
+        num = lua_tonumber(L, 3);
+        value.data = (u_char *) &num;
+        break;
+
+    case LUA_TBOOLEAN:
+        value.len = sizeof(u_char);
+        c = lua_toboolean(L, 3) ? 1 : 0;
+        value.data = &c;
+        break;
+
+    case LUA_TNIL:
+        if (flags & (NGX_HTTP_LUA_SHDICT_ADD|NGX_HTTP_LUA_SHDICT_REPLACE)) {
+            return luaL_error(L, "attempt to add or replace nil values");
+        }
+
+        value.len = 0;
+        value.data = NULL;
+        break;
+
+    default:
+        return luaL_error(L, "unsupported value type for key \"%s\" in "
+                "shared_dict \"%s\": %s", key.data, name.data,
+                lua_typename(L, value_type));
+    }
+
+    if (n >= 4) {
+        exptime = luaL_checknumber(L, 4);
+        if (exptime < 0) {
+            exptime = 0;
+        }
+    }
+
+    if (n == 5) {
+        user_flags = (uint32_t) luaL_checkinteger(L, 5);
+    }
+
+    dd("looking up key %s in shared dict %s", key.data, name.data);
+
+    ngx_shmtx_lock(&stripe->shpool->mutex);
+
+    rc = ngx_http_lua_shdict_set_locked(ctx, stripe, hash, &key, value_type,
+                                        &value, exptime, user_flags, flags,
+                                        &forcible, &err);
+
+    ngx_shmtx_unlock(&stripe->shpool->mutex);
+
+    if (rc != NGX_OK) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, err);
+        lua_pushboolean(L, forcible);
+        return 3;
+    }
+
+    lua_pushboolean(L, 1);
+    lua_pushnil(L);
+    lua_pushboolean(L, forcible);
+    return 3;
+}
+
+
+/*
+ * allocates from a locked stripe, evicting up to 30 least recently used
+ * items when the stripe is full
+ */
+
+static void *
+ngx_http_lua_shdict_alloc_locked(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_http_lua_shdict_stripe_t *stripe, size_t size, int *forcible)
+{
+    int     i;
+    void   *p;
+
+    p = ngx_slab_alloc_locked(stripe->shpool, size);
+    if (p != NULL) {
+        return p;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+        "lua shared dict: overriding non-expired items due to memory "
+        "shortage in \"%V\"", &ctx->name);
+
+    for (i = 0; i < 30; i++) {
+        if (ngx_http_lua_shdict_expire(stripe, 0) == 0) {
+            break;
+        }
+
+        *forcible = 1;
+
+        p = ngx_slab_alloc_locked(stripe->shpool, size);
+        if (p != NULL) {
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * stores a key-value pair into the stripe whose mutex is already held by
+ * the caller; returns NGX_DECLINED with *err set when the pair cannot be
+ * stored
+ */
+
+static ngx_int_t
+ngx_http_lua_shdict_set_locked(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_http_lua_shdict_stripe_t *stripe, uint32_t hash, ngx_str_t *key,
+    int value_type, ngx_str_t *value, lua_Number exptime,
+    uint32_t user_flags, int flags, int *forcible, char **err)
+{
+    ngx_int_t                    rc;
+    ngx_http_lua_shdict_node_t  *sd;
+
+#if 1
+    ngx_http_lua_shdict_expire(stripe, 1);
+#endif
+
+    rc = ngx_http_lua_shdict_lookup(stripe, hash, key->data, key->len, &sd);
+
+    dd("shdict lookup returned %d", (int) rc);
+
+    if (flags & NGX_HTTP_LUA_SHDICT_REPLACE) {
+
+        if (rc == NGX_DECLINED || rc == NGX_DONE) {
+            *err = "not found";
+            return NGX_DECLINED;
+        }
+
+        /* rc == NGX_OK */
+    }
+
+    if (flags & NGX_HTTP_LUA_SHDICT_ADD) {
+
+        if (rc == NGX_OK) {
+            *err = "exists";
+            return NGX_DECLINED;
+        }
+
+        /* rc == NGX_DONE (exists but expired) or NGX_DECLINED */
+    }
+
+    if (rc == NGX_DECLINED) {
+        sd = NULL;
+    }
+
+    return ngx_http_lua_shdict_store_locked(ctx, stripe, hash, key, sd,
+                                            value_type, value, exptime,
+                                            user_flags, forcible, err);
+}
+
+
+/*
+ * stores a value for a key that the caller has already looked up in the
+ * locked stripe, sd being the node found for it, expired or not, or NULL.
+ * a value without data removes the node
+ */
 
-    switch (value_type) {
-    case LUA_TSTRING:
+static ngx_int_t
+ngx_http_lua_shdict_store_locked(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_http_lua_shdict_stripe_t *stripe, uint32_t hash, ngx_str_t *key,
+    ngx_http_lua_shdict_node_t *sd, int value_type, ngx_str_t *value,
+    lua_Number exptime, uint32_t user_flags, int *forcible, char **err)
+{
+    size_t              n;
+    u_char             *p;
+    ngx_rbtree_node_t  *node;
+    ngx_time_t         *tp;
 
-        lua_pushlstring(L, (char *) value.data, value.len);
-        break;
+    if (sd) {
 
-    case LUA_TNUMBER:
+        if (value->data
+            && value->len == (size_t) sd->value_len
+            && sd->value_type != NGX_HTTP_LUA_SHDICT_TLIST)
+        {
 
-        if (value.len != sizeof(lua_Number)) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                "lua shared dict set: found old entry and value size matched, "
+                "reusing it");
 
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            ngx_queue_remove(&sd->queue);
+            ngx_queue_insert_head(&stripe->queue, &sd->queue);
 
-            return luaL_error(L, "bad lua number value size found for key %s "
-                    "in shared_dict %s: %lu", key.data, name.data,
-                    (unsigned long) value.len);
+            goto update;
         }
 
-        num = *(lua_Number *) value.data;
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+            "lua shared dict set: found old entry bug value size NOT matched, "
+            "removing it first");
 
-        lua_pushnumber(L, num);
-        break;
+        ngx_http_lua_shdict_remove_node(stripe, sd);
+    }
 
-    case LUA_TBOOLEAN:
+    if (value->data == NULL) {
+        return NGX_OK;
+    }
 
-        if (value.len != sizeof(u_char)) {
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+        "lua shared dict set: creating a new entry");
 
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
+    n = offsetof(ngx_rbtree_node_t, color)
+        + offsetof(ngx_http_lua_shdict_node_t, data)
+        + key->len
+        + value->len;
 
-            return luaL_error(L, "bad lua boolean value size found for key %s "
-                    "in shared_dict %s: %lu", key.data, name.data,
-                    (unsigned long) value.len);
-        }
+    node = ngx_http_lua_shdict_alloc_locked(ctx, stripe, n, forcible);
 
-        c = *value.data;
+    if (node == NULL) {
+        *err = "no memory";
+        return NGX_DECLINED;
+    }
 
-        lua_pushboolean(L, c ? 1 : 0);
-        break;
+    sd = (ngx_http_lua_shdict_node_t *) &node->color;
 
-    default:
+    node->key = hash;
+    sd->key_len = key->len;
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+    /* the rbtree compares the keys of colliding hashes */
+    ngx_memcpy(sd->data, key->data, key->len);
 
-        return luaL_error(L, "bad value type found for key %s in "
-                "shared_dict %s: %d", key.data, name.data,
-                value_type);
-    }
+    ngx_http_lua_shdict_insert_node(stripe, node);
 
-    user_flags = sd->user_flags;
+    ngx_queue_insert_head(&stripe->queue, &sd->queue);
 
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
+update:
 
-    if (user_flags) {
-        lua_pushinteger(L, (lua_Integer) user_flags);
-        return 2;
+    sd->key_len = key->len;
+
+    if (exptime > 0) {
+        tp = ngx_timeofday();
+        sd->expires = (uint64_t) tp->sec * 1000 + tp->msec
+                + exptime * 1000;
+
+    } else {
+        sd->expires = 0;
     }
 
-    return 1;
+    sd->user_flags = user_flags;
+    sd->generation = stripe->generation;
+
+    sd->value_len = (uint32_t) value->len;
+
+    dd("setting value type to %d", value_type);
+
+    sd->value_type = value_type;
+
+    p = ngx_copy(sd->data, key->data, key->len);
+    ngx_memcpy(p, value->data, value->len);
+
+    stripe->sets++;
+
+    return NGX_OK;
 }
 
 
 static int
-ngx_http_lua_shdict_delete(lua_State *L)
+ngx_http_lua_shdict_incr(lua_State *L)
 {
-    int             n;
+    return ngx_http_lua_shdict_arith_helper(L, NGX_HTTP_LUA_SHDICT_INCR);
+}
+
+
+static int
+ngx_http_lua_shdict_decr(lua_State *L)
+{
+    return ngx_http_lua_shdict_arith_helper(L, NGX_HTTP_LUA_SHDICT_DECR);
+}
+
+
+static int
+ngx_http_lua_shdict_min(lua_State *L)
+{
+    return ngx_http_lua_shdict_arith_helper(L, NGX_HTTP_LUA_SHDICT_MIN);
+}
+
+
+static int
+ngx_http_lua_shdict_max(lua_State *L)
+{
+    return ngx_http_lua_shdict_arith_helper(L, NGX_HTTP_LUA_SHDICT_MAX);
+}
+
+
+/*
+ * the optional fourth argument is the initial value of missing keys for
+ * incr, the floor for decr and the expiration time of new keys for
+ * min and max, which always create missing keys
+ */
+
+static int
+ngx_http_lua_shdict_arith_helper(lua_State *L, int op)
+{
+    int                            n;
+    ngx_str_t                      key;
+    uint32_t                       hash;
+    ngx_int_t                      rc;
+    ngx_http_lua_shdict_ctx_t     *ctx;
+    ngx_http_lua_shdict_stripe_t  *stripe;
+    ngx_http_lua_shdict_node_t    *sd;
+    lua_Number                     num;
+    u_char                        *p;
+    ngx_shm_zone_t                *zone;
+    lua_Number                     value, arg, exptime;
+    ngx_str_t                      init;
+    char                          *err;
+    int                            forcible = 0;
 
     n = lua_gettop(L);
 
-    if (n != 2) {
-        return luaL_error(L, "expecting 2 arguments, "
+    if (n != 3 && n != 4) {
+        return luaL_error(L, "expecting 3 or 4 arguments, "
                 "but only seen %d", n);
     }
 
+    luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+
+    zone = lua_touserdata(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad user data for the ngx_shm_zone_t pointer");
+    }
+
+    ctx = zone->data;
+
+    key.data = (u_char *) luaL_checklstring(L, 2, &key.len);
+
+    if (key.len == 0) {
+        return luaL_error(L, "attempt to use empty keys");
+    }
+
+    if (key.len > 65535) {
+        return luaL_error(L,
+                      "the key argument is more than 65535 bytes: %d",
+                      (int) key.len);
+    }
+
+    hash = ngx_http_lua_shdict_hash(ctx, key.data, key.len);
+
+    stripe = ngx_http_lua_shdict_get_stripe(ctx, hash);
+
+    value = luaL_checknumber(L, 3);
+
+    arg = (n == 4) ? luaL_checknumber(L, 4) : 0;
+
+    dd("looking up key %.*s in shared dict %.*s", (int) key.len, key.data,
+       (int) ctx->name.len, ctx->name.data);
+
+    ngx_shmtx_lock(&stripe->shpool->mutex);
+
+#if 1
+    ngx_http_lua_shdict_expire(stripe, 1);
+#endif
+
+    rc = ngx_http_lua_shdict_lookup(stripe, hash, key.data, key.len, &sd);
+
+    dd("shdict lookup returned %d", (int) rc);
+
+    if (rc == NGX_DECLINED || rc == NGX_DONE) {
+
+        switch (op) {
+
+        case NGX_HTTP_LUA_SHDICT_INCR:
+            if (n == 3) {
+                goto not_found;
+            }
+
+            num = arg + value;
+            exptime = 0;
+            break;
+
+        case NGX_HTTP_LUA_SHDICT_MIN:
+        case NGX_HTTP_LUA_SHDICT_MAX:
+            num = value;
+            exptime = arg;
+            break;
+
+        default: /* NGX_HTTP_LUA_SHDICT_DECR */
+            goto not_found;
+        }
+
+        init.data = (u_char *) &num;
+        init.len = sizeof(lua_Number);
+
+        if (rc == NGX_DECLINED) {
+            sd = NULL;
+        }
+
+        rc = ngx_http_lua_shdict_store_locked(ctx, stripe, hash, &key, sd,
+                                              LUA_TNUMBER, &init, exptime, 0,
+                                              &forcible, &err);
+
+        ngx_shmtx_unlock(&stripe->shpool->mutex);
+
+        if (rc != NGX_OK) {
+            lua_pushnil(L);
+            lua_pushstring(L, err);
+            lua_pushboolean(L, forcible);
+            return 3;
+        }
+
+        lua_pushnumber(L, num);
+        lua_pushnil(L);
+        lua_pushboolean(L, forcible);
+        return 3;
+    }
+
+    /* rc == NGX_OK */
+
+    if (sd->value_type != LUA_TNUMBER || sd->value_len != sizeof(lua_Number)) {
+        ngx_shmtx_unlock(&stripe->shpool->mutex);
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "not a number");
+        return 2;
+    }
+
+    ngx_queue_remove(&sd->queue);
+    ngx_queue_insert_head(&stripe->queue, &sd->queue);
+
+    dd("setting value type to %d", (int) sd->value_type);
+
+    p = sd->data + key.len;
+
+    ngx_memcpy(&num, p, sizeof(lua_Number));
+
+    switch (op) {
+
+    case NGX_HTTP_LUA_SHDICT_INCR:
+        num += value;
+        break;
+
+    case NGX_HTTP_LUA_SHDICT_DECR:
+        num -= value;
+
+        if (n == 4 && num < arg) {
+            num = arg;
+        }
+
+        break;
+
+    case NGX_HTTP_LUA_SHDICT_MIN:
+        if (value < num) {
+            num = value;
+        }
+
+        break;
+
+    default: /* NGX_HTTP_LUA_SHDICT_MAX */
+        if (value > num) {
+            num = value;
+        }
+
+        break;
+    }
+
+    ngx_memcpy(p, (lua_Number *) &num, sizeof(lua_Number));
+
+    ngx_shmtx_unlock(&stripe->shpool->mutex);
+
+    lua_pushnumber(L, num);
     lua_pushnil(L);
+    return 2;
 
-    return ngx_http_lua_shdict_set_helper(L, 0);
+not_found:
+
+    ngx_shmtx_unlock(&stripe->shpool->mutex);
+
+    lua_pushnil(L);
+    lua_pushliteral(L, "not found");
+    return 2;
 }
 
 
 static int
-ngx_http_lua_shdict_flush_all(lua_State *L)
+ngx_http_lua_shdict_cas(lua_State *L)
 {
-    ngx_queue_t                 *q;
-    ngx_http_lua_shdict_node_t  *sd;
-    int                          n;
-    ngx_http_lua_shdict_ctx_t   *ctx;
-    ngx_shm_zone_t              *zone;
+    int                            n;
+    ngx_str_t                      key;
+    uint32_t                       hash;
+    ngx_int_t                      rc;
+    ngx_http_lua_shdict_ctx_t     *ctx;
+    ngx_http_lua_shdict_stripe_t  *stripe;
+    ngx_http_lua_shdict_node_t    *sd;
+    ngx_str_t                      old, value;
+    int                            old_type, value_type;
+    lua_Number                     old_num, num;
+    u_char                         old_c, c;
+    lua_Number                     exptime = 0;
+    ngx_shm_zone_t                *zone;
+    char                          *err;
+    int                            forcible = 0;
+    uint32_t                       user_flags = 0;
 
     n = lua_gettop(L);
 
-    if (n != 1) {
-        return luaL_error(L, "expecting 1 argument, "
-                "but seen %d", n);
+    if (n < 4 || n > 6) {
+        return luaL_error(L, "expecting 4, 5 or 6 arguments, "
+                "but only seen %d", n);
     }
 
     luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
 
-    zone = lua_touserdata(L, 1);
-    if (zone == NULL) {
-        return luaL_error(L, "bad user data for the ngx_shm_zone_t pointer");
+    zone = lua_touserdata(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad user data for the ngx_shm_zone_t pointer");
+    }
+
+    ctx = zone->data;
+
+    key.data = (u_char *) luaL_checklstring(L, 2, &key.len);
+
+    if (key.len == 0) {
+        return luaL_error(L, "attempt to use empty keys");
+    }
+
+    if (key.len > 65535) {
+        return luaL_error(L,
+                      "the key argument is more than 65535 bytes: %d",
+                      (int) key.len);
+    }
+
+    if (ngx_http_lua_shdict_check_value(L, 3, &old_type, &old, &old_num,
+                                        &old_c)
+        != NGX_OK
+        || ngx_http_lua_shdict_check_value(L, 4, &value_type, &value, &num,
+                                           &c)
+           != NGX_OK)
+    {
+        return luaL_error(L, "unsupported value type for key \"%s\" in "
+                "shared_dict \"%s\"", key.data, ctx->name.data);
+    }
+
+    if (n >= 5) {
+        exptime = luaL_checknumber(L, 5);
+        if (exptime < 0) {
+            exptime = 0;
+        }
+    }
+
+    if (n == 6) {
+        user_flags = (uint32_t) luaL_checkinteger(L, 6);
+    }
+
+    hash = ngx_http_lua_shdict_hash(ctx, key.data, key.len);
+
+    stripe = ngx_http_lua_shdict_get_stripe(ctx, hash);
+
+    ngx_shmtx_lock(&stripe->shpool->mutex);
+
+#if 1
+    ngx_http_lua_shdict_expire(stripe, 1);
+#endif
+
+    rc = ngx_http_lua_shdict_lookup(stripe, hash, key.data, key.len, &sd);
+
+    dd("shdict lookup returned %d", (int) rc);
+
+    if (rc == NGX_OK) {
+
+        if (old_type == LUA_TNIL) {
+            err = "exists";
+            goto failed;
+        }
+
+        if (sd->value_type != old_type
+            || sd->value_len != old.len
+            || ngx_memcmp(sd->data + sd->key_len, old.data, old.len) != 0)
+        {
+            err = "changed";
+            goto failed;
+        }
+
+    } else {
+
+        if (old_type != LUA_TNIL) {
+            err = "not found";
+            goto failed;
+        }
+
+        if (rc == NGX_DECLINED) {
+            sd = NULL;
+        }
     }
 
-    ctx = zone->data;
+    rc = ngx_http_lua_shdict_store_locked(ctx, stripe, hash, &key, sd,
+                                          value_type, &value, exptime,
+                                          user_flags, &forcible, &err);
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
+    ngx_shmtx_unlock(&stripe->shpool->mutex);
 
-    for (q = ngx_queue_head(&ctx->sh->queue);
-         q != ngx_queue_sentinel(&ctx->sh->queue);
-         q = ngx_queue_next(q))
-    {
-        sd = ngx_queue_data(q, ngx_http_lua_shdict_node_t, queue);
-        sd->expires = 1;
+    if (rc != NGX_OK) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, err);
+        lua_pushboolean(L, forcible);
+        return 3;
     }
 
-    ngx_http_lua_shdict_expire(ctx, 0);
+    lua_pushboolean(L, 1);
+    lua_pushnil(L);
+    lua_pushboolean(L, forcible);
+    return 3;
+
+failed:
 
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    ngx_shmtx_unlock(&stripe->shpool->mutex);
 
-    return 0;
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, err);
+    lua_pushboolean(L, 0);
+    return 3;
 }
 
 
-static int
-ngx_http_lua_shdict_add(lua_State *L)
+/*
+ * converts the Lua value at index to the representation stored in the
+ * zone, using *num and *c as the storage of numbers and booleans
+ */
+
+static ngx_int_t
+ngx_http_lua_shdict_check_value(lua_State *L, int index, int *value_type,
+    ngx_str_t *value, lua_Number *num, u_char *c)
 {
-    return ngx_http_lua_shdict_set_helper(L, NGX_HTTP_LUA_SHDICT_ADD);
+    *value_type = lua_type(L, index);
+
+    switch (*value_type) {
+    case LUA_TSTRING:
+        value->data = (u_char *) lua_tolstring(L, index, &value->len);
+        break;
+
+    case LUA_TNUMBER:
+        value->len = sizeof(lua_Number);
+        *num = lua_tonumber(L, index);
+        value->data = (u_char *) num;
+        break;
+
+    case LUA_TBOOLEAN:
+        value->len = sizeof(u_char);
+        *c = lua_toboolean(L, index) ? 1 : 0;
+        value->data = c;
+        break;
+
+    case LUA_TNIL:
+        value->len = 0;
+        value->data = NULL;
+        break;
+
+    default:
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
 }
 
 
 static int
-ngx_http_lua_shdict_replace(lua_State *L)
+ngx_http_lua_shdict_lpush(lua_State *L)
 {
-    return ngx_http_lua_shdict_set_helper(L, NGX_HTTP_LUA_SHDICT_REPLACE);
+    return ngx_http_lua_shdict_push_helper(L, NGX_HTTP_LUA_SHDICT_LEFT);
 }
 
 
 static int
-ngx_http_lua_shdict_set(lua_State *L)
+ngx_http_lua_shdict_rpush(lua_State *L)
 {
-    return ngx_http_lua_shdict_set_helper(L, 0);
+    return ngx_http_lua_shdict_push_helper(L, NGX_HTTP_LUA_SHDICT_RIGHT);
 }
 
 
 static int
-ngx_http_lua_shdict_set_helper(lua_State *L, int flags)
+ngx_http_lua_shdict_push_helper(lua_State *L, int flags)
 {
-    int                          i, n;
-    ngx_str_t                    name;
-    ngx_str_t                    key;
-    uint32_t                     hash;
-    ngx_int_t                    rc;
-    ngx_http_lua_shdict_ctx_t   *ctx;
-    ngx_http_lua_shdict_node_t  *sd;
-    ngx_str_t                    value;
-    int                          value_type;
-    lua_Number                   num;
-    u_char                       c;
-    lua_Number                   exptime = 0;
-    u_char                      *p;
-    ngx_rbtree_node_t           *node;
-    ngx_time_t                  *tp;
-    ngx_shm_zone_t              *zone;
-    int                          forcible = 0;
-                         /* indicates whether to foricibly override other
-                          * valid entries */
-    int32_t                      user_flags = 0;
+    int                               n;
+    ngx_str_t                         key;
+    uint32_t                          hash;
+    ngx_int_t                         rc;
+    ngx_http_lua_shdict_ctx_t        *ctx;
+    ngx_http_lua_shdict_stripe_t     *stripe;
+    ngx_http_lua_shdict_node_t       *sd;
+    ngx_str_t                         value;
+    int                               value_type;
+    lua_Number                        num;
+    size_t                            size;
+    ngx_rbtree_node_t                *node;
+    ngx_shm_zone_t                   *zone;
+    ngx_http_lua_shdict_list_t       *list;
+    ngx_http_lua_shdict_list_node_t  *item;
+    int                               forcible = 0;
 
     n = lua_gettop(L);
 
-    if (n != 3 && n != 4 && n != 5) {
-        return luaL_error(L, "expecting 3, 4 or 5 arguments, "
+    if (n != 3) {
+        return luaL_error(L, "expecting 3 arguments, "
                 "but only seen %d", n);
     }
 
@@ -594,8 +3557,6 @@ ngx_http_lua_shdict_set_helper(lua_State *L, int flags)
 
     ctx = zone->data;
 
-    name = ctx->name;
-
     key.data = (u_char *) luaL_checklstring(L, 2, &key.len);
 
     if (key.len == 0) {
@@ -608,7 +3569,9 @@ ngx_http_lua_shdict_set_helper(lua_State *L, int flags)
                       (int) key.len);
     }
 
-    hash = ngx_crc32_short(key.data, key.len);
+    hash = ngx_http_lua_shdict_hash(ctx, key.data, key.len);
+
+    stripe = ngx_http_lua_shdict_get_stripe(ctx, hash);
 
     value_type = lua_type(L, 3);
 
@@ -623,259 +3586,276 @@ ngx_http_lua_shdict_set_helper(lua_State *L, int flags)
         value.data = (u_char *) &num;
         break;
 
-    case LUA_TBOOLEAN:
-        value.len = sizeof(u_char);
-        c = lua_toboolean(L, 3) ? 1 : 0;
-        value.data = &c;
-        break;
-
-    case LUA_TNIL:
-        if (flags & (NGX_HTTP_LUA_SHDICT_ADD|NGX_HTTP_LUA_SHDICT_REPLACE)) {
-            return luaL_error(L, "attempt to add or replace nil values");
-        }
-
-        value.len = 0;
-        value.data = NULL;
-        break;
-
     default:
-        return luaL_error(L, "unsupported value type for key \"%s\" in "
-                "shared_dict \"%s\": %s", key.data, name.data,
+        return luaL_error(L, "unsupported list item type for key \"%s\" in "
+                "shared_dict \"%s\": %s", key.data, ctx->name.data,
                 lua_typename(L, value_type));
     }
 
-    if (n >= 4) {
-        exptime = luaL_checknumber(L, 4);
-        if (exptime < 0) {
-            exptime = 0;
-        }
-    }
+    ngx_shmtx_lock(&stripe->shpool->mutex);
 
-    if (n == 5) {
-        user_flags = (uint32_t) luaL_checkinteger(L, 5);
-    }
+#if 1
+    ngx_http_lua_shdict_expire(stripe, 1);
+#endif
 
-    dd("looking up key %s in shared dict %s", key.data, name.data);
+    /*
+     * allocate the item before looking the list up, so that the LRU
+     * items evicted to make room for it can never include the list
+     */
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
+    item = ngx_http_lua_shdict_alloc_locked(ctx, stripe,
+                offsetof(ngx_http_lua_shdict_list_node_t, data) + value.len,
+                &forcible);
 
-#if 1
-    ngx_http_lua_shdict_expire(ctx, 1);
-#endif
+    if (item == NULL) {
+        ngx_shmtx_unlock(&stripe->shpool->mutex);
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "no memory");
+        return 2;
+    }
 
-    rc = ngx_http_lua_shdict_lookup(zone, hash, key.data, key.len,
-            &sd);
+    item->value_type = (uint8_t) value_type;
+    item->value_len = (uint32_t) value.len;
+    ngx_memcpy(item->data, value.data, value.len);
+
+    rc = ngx_http_lua_shdict_lookup(stripe, hash, key.data, key.len, &sd);
 
     dd("shdict lookup returned %d", (int) rc);
 
-    if (flags & NGX_HTTP_LUA_SHDICT_REPLACE) {
+    if (rc == NGX_OK && sd->value_type != NGX_HTTP_LUA_SHDICT_TLIST) {
+        ngx_slab_free_locked(stripe->shpool, item);
 
-        if (rc == NGX_DECLINED || rc == NGX_DONE) {
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
+        ngx_shmtx_unlock(&stripe->shpool->mutex);
 
-            lua_pushboolean(L, 0);
-            lua_pushliteral(L, "not found");
-            lua_pushboolean(L, forcible);
-            return 3;
-        }
+        lua_pushnil(L);
+        lua_pushliteral(L, "value not a list");
+        return 2;
+    }
 
-        /* rc == NGX_OK */
+    if (rc == NGX_DONE) {
+        /* exists but expired */
+
+        ngx_http_lua_shdict_remove_node(stripe, sd);
 
-        goto replace;
+        rc = NGX_DECLINED;
     }
 
-    if (flags & NGX_HTTP_LUA_SHDICT_ADD) {
+    if (rc == NGX_DECLINED) {
 
-        if (rc == NGX_OK) {
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
+        size = offsetof(ngx_rbtree_node_t, color)
+               + offsetof(ngx_http_lua_shdict_node_t, data)
+               + key.len
+               + NGX_ALIGNMENT
+               + sizeof(ngx_http_lua_shdict_list_t);
 
-            lua_pushboolean(L, 0);
-            lua_pushliteral(L, "exists");
-            lua_pushboolean(L, forcible);
-            return 3;
-        }
+        node = ngx_http_lua_shdict_alloc_locked(ctx, stripe, size, &forcible);
 
-        if (rc == NGX_DONE) {
-            /* exists but expired */
+        if (node == NULL) {
+            ngx_slab_free_locked(stripe->shpool, item);
+
+            ngx_shmtx_unlock(&stripe->shpool->mutex);
 
-            dd("go to replace");
-            goto replace;
+            lua_pushnil(L);
+            lua_pushliteral(L, "no memory");
+            return 2;
         }
 
-        /* rc == NGX_DECLINED */
+        sd = (ngx_http_lua_shdict_node_t *) &node->color;
 
-        dd("go to insert");
-        goto insert;
-    }
+        node->key = hash;
+        sd->key_len = key.len;
+        sd->expires = 0;
+        sd->user_flags = 0;
+        sd->value_len = sizeof(ngx_http_lua_shdict_list_t);
+        sd->value_type = NGX_HTTP_LUA_SHDICT_TLIST;
+        sd->generation = stripe->generation;
 
-    if (rc == NGX_OK || rc == NGX_DONE) {
+        ngx_memcpy(sd->data, key.data, key.len);
 
-        if (value_type == LUA_TNIL) {
-            goto remove;
-        }
+        list = ngx_http_lua_shdict_get_list(sd);
 
-replace:
-        if (value.data && value.len == (size_t) sd->value_len) {
+        ngx_queue_init(&list->items);
+        list->nitems = 0;
 
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                "lua shared dict set: found old entry and value size matched, "
-                "reusing it");
+        ngx_http_lua_shdict_insert_node(stripe, node);
 
-            ngx_queue_remove(&sd->queue);
-            ngx_queue_insert_head(&ctx->sh->queue, &sd->queue);
+        ngx_queue_insert_head(&stripe->queue, &sd->queue);
+    }
 
-            sd->key_len = key.len;
+    list = ngx_http_lua_shdict_get_list(sd);
 
-            if (exptime > 0) {
-                tp = ngx_timeofday();
-                sd->expires = (uint64_t) tp->sec * 1000 + tp->msec
-                        + exptime * 1000;
+    if (flags & NGX_HTTP_LUA_SHDICT_LEFT) {
+        ngx_queue_insert_head(&list->items, &item->queue);
 
-            } else {
-                sd->expires = 0;
-            }
+    } else {
+        ngx_queue_insert_tail(&list->items, &item->queue);
+    }
 
-            sd->user_flags = user_flags;
+    list->nitems++;
 
-            sd->value_len = (uint32_t) value.len;
+    num = (lua_Number) list->nitems;
 
-            dd("setting value type to %d", value_type);
+    stripe->sets++;
 
-            sd->value_type = value_type;
+    ngx_shmtx_unlock(&stripe->shpool->mutex);
 
-            p = ngx_copy(sd->data, key.data, key.len);
-            ngx_memcpy(p, value.data, value.len);
+    lua_pushnumber(L, num);
+    return 1;
+}
 
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
 
-            lua_pushboolean(L, 1);
-            lua_pushnil(L);
-            lua_pushboolean(L, forcible);
-            return 3;
-        }
+static int
+ngx_http_lua_shdict_lpop(lua_State *L)
+{
+    return ngx_http_lua_shdict_pop_helper(L, NGX_HTTP_LUA_SHDICT_LEFT);
+}
 
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-            "lua shared dict set: found old entry bug value size NOT matched, "
-            "removing it first");
 
-remove:
-        ngx_queue_remove(&sd->queue);
+static int
+ngx_http_lua_shdict_rpop(lua_State *L)
+{
+    return ngx_http_lua_shdict_pop_helper(L, NGX_HTTP_LUA_SHDICT_RIGHT);
+}
 
-        node = (ngx_rbtree_node_t *)
-                   ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
 
-        ngx_rbtree_delete(&ctx->sh->rbtree, node);
+static int
+ngx_http_lua_shdict_pop_helper(lua_State *L, int flags)
+{
+    int                               n;
+    ngx_str_t                         key;
+    uint32_t                          hash;
+    ngx_int_t                         rc;
+    ngx_http_lua_shdict_ctx_t        *ctx;
+    ngx_http_lua_shdict_stripe_t     *stripe;
+    ngx_http_lua_shdict_node_t       *sd;
+    lua_Number                        num;
+    ngx_queue_t                      *q;
+    ngx_shm_zone_t                   *zone;
+    ngx_http_lua_shdict_list_t       *list;
+    ngx_http_lua_shdict_list_node_t  *item;
 
-        ngx_slab_free_locked(ctx->shpool, node);
+    n = lua_gettop(L);
 
+    if (n != 2) {
+        return luaL_error(L, "expecting 2 arguments, "
+                "but only seen %d", n);
     }
 
-insert:
-    /* rc == NGX_DECLINED or value size unmatch */
+    luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
 
-    if (value.data == NULL) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+    zone = lua_touserdata(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad user data for the ngx_shm_zone_t pointer");
+    }
 
-        lua_pushboolean(L, 1);
-        lua_pushnil(L);
-        lua_pushboolean(L, 0);
-        return 3;
+    ctx = zone->data;
+
+    key.data = (u_char *) luaL_checklstring(L, 2, &key.len);
+
+    if (key.len == 0) {
+        return luaL_error(L, "attempt to use empty keys");
     }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-        "lua shared dict set: creating a new entry");
+    if (key.len > 65535) {
+        return luaL_error(L,
+                      "the key argument is more than 65535 bytes: %d",
+                      (int) key.len);
+    }
 
-    n = offsetof(ngx_rbtree_node_t, color)
-        + offsetof(ngx_http_lua_shdict_node_t, data)
-        + key.len
-        + value.len;
+    hash = ngx_http_lua_shdict_hash(ctx, key.data, key.len);
 
-    node = ngx_slab_alloc_locked(ctx->shpool, n);
+    stripe = ngx_http_lua_shdict_get_stripe(ctx, hash);
 
-    if (node == NULL) {
+    ngx_shmtx_lock(&stripe->shpool->mutex);
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-            "lua shared dict set: overriding non-expired items due to memory "
-            "shortage for entry \"%V\"", &name);
+#if 1
+    ngx_http_lua_shdict_expire(stripe, 1);
+#endif
 
-        for (i = 0; i < 30; i++) {
-            if (ngx_http_lua_shdict_expire(ctx, 0) == 0) {
-                break;
-            }
+    rc = ngx_http_lua_shdict_lookup(stripe, hash, key.data, key.len, &sd);
 
-            forcible = 1;
+    dd("shdict lookup returned %d", (int) rc);
 
-            node = ngx_slab_alloc_locked(ctx->shpool, n);
-            if (node != NULL) {
-                goto allocated;
-            }
-        }
+    if (rc == NGX_DECLINED || rc == NGX_DONE) {
+        ngx_shmtx_unlock(&stripe->shpool->mutex);
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        lua_pushnil(L);
+        return 1;
+    }
 
-        lua_pushboolean(L, 0);
-        lua_pushliteral(L, "no memory");
-        lua_pushboolean(L, forcible);
-        return 3;
+    /* rc == NGX_OK */
+
+    if (sd->value_type != NGX_HTTP_LUA_SHDICT_TLIST) {
+        ngx_shmtx_unlock(&stripe->shpool->mutex);
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "value not a list");
+        return 2;
     }
 
-allocated:
-    sd = (ngx_http_lua_shdict_node_t *) &node->color;
+    list = ngx_http_lua_shdict_get_list(sd);
 
-    node->key = hash;
-    sd->key_len = key.len;
+    /* empty lists are removed right away */
 
-    if (exptime > 0) {
-        tp = ngx_timeofday();
-        sd->expires = (uint64_t) tp->sec * 1000 + tp->msec
-                + exptime * 1000;
+    if (flags & NGX_HTTP_LUA_SHDICT_LEFT) {
+        q = ngx_queue_head(&list->items);
 
     } else {
-        sd->expires = 0;
+        q = ngx_queue_last(&list->items);
     }
 
-    sd->user_flags = user_flags;
+    item = ngx_queue_data(q, ngx_http_lua_shdict_list_node_t, queue);
+
+    switch (item->value_type) {
+    case LUA_TSTRING:
+        lua_pushlstring(L, (char *) item->data, item->value_len);
+        break;
 
-    sd->value_len = (uint32_t) value.len;
+    case LUA_TNUMBER:
+        ngx_memcpy(&num, item->data, sizeof(lua_Number));
+        lua_pushnumber(L, num);
+        break;
 
-    dd("setting value type to %d", value_type);
+    default:
+        ngx_shmtx_unlock(&stripe->shpool->mutex);
 
-    sd->value_type = value_type;
+        return luaL_error(L, "bad list item type found for key %s in "
+                "shared_dict %s: %d", key.data, ctx->name.data,
+                (int) item->value_type);
+    }
 
-    p = ngx_copy(sd->data, key.data, key.len);
-    ngx_memcpy(p, value.data, value.len);
+    ngx_queue_remove(q);
 
-    ngx_rbtree_insert(&ctx->sh->rbtree, node);
+    ngx_slab_free_locked(stripe->shpool, item);
 
-    ngx_queue_insert_head(&ctx->sh->queue, &sd->queue);
+    if (--list->nitems == 0) {
+        ngx_http_lua_shdict_remove_node(stripe, sd);
+    }
 
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    ngx_shmtx_unlock(&stripe->shpool->mutex);
 
-    lua_pushboolean(L, 1);
-    lua_pushnil(L);
-    lua_pushboolean(L, forcible);
-    return 3;
+    return 1;
 }
 
 
 static int
-ngx_http_lua_shdict_incr(lua_State *L)
+ngx_http_lua_shdict_llen(lua_State *L)
 {
-    int                          n;
-    ngx_str_t                    key;
-    uint32_t                     hash;
-    ngx_int_t                    rc;
-    ngx_http_lua_shdict_ctx_t   *ctx;
-    ngx_http_lua_shdict_node_t  *sd;
-    lua_Number                   num;
-    u_char                      *p;
-    ngx_shm_zone_t              *zone;
-    lua_Number                   value;
+    int                            n;
+    ngx_str_t                      key;
+    uint32_t                       hash;
+    ngx_int_t                      rc;
+    ngx_http_lua_shdict_ctx_t     *ctx;
+    ngx_http_lua_shdict_stripe_t  *stripe;
+    ngx_http_lua_shdict_node_t    *sd;
+    lua_Number                     num;
+    ngx_shm_zone_t                *zone;
 
     n = lua_gettop(L);
 
-    if (n != 3) {
-        return luaL_error(L, "expecting 3 arguments, "
+    if (n != 2) {
+        return luaL_error(L, "expecting 2 arguments, "
                 "but only seen %d", n);
     }
 
@@ -900,59 +3880,37 @@ ngx_http_lua_shdict_incr(lua_State *L)
                       (int) key.len);
     }
 
-    hash = ngx_crc32_short(key.data, key.len);
-
-    value = luaL_checknumber(L, 3);
+    hash = ngx_http_lua_shdict_hash(ctx, key.data, key.len);
 
-    dd("looking up key %.*s in shared dict %.*s", (int) key.len, key.data,
-       (int) ctx->name.len, ctx->name.data);
+    stripe = ngx_http_lua_shdict_get_stripe(ctx, hash);
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
+    ngx_shmtx_lock(&stripe->shpool->mutex);
 
 #if 1
-    ngx_http_lua_shdict_expire(ctx, 1);
+    ngx_http_lua_shdict_expire(stripe, 1);
 #endif
 
-    rc = ngx_http_lua_shdict_lookup(zone, hash, key.data, key.len,
-            &sd);
-
-    dd("shdict lookup returned %d", (int) rc);
+    rc = ngx_http_lua_shdict_lookup(stripe, hash, key.data, key.len, &sd);
 
     if (rc == NGX_DECLINED || rc == NGX_DONE) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        ngx_shmtx_unlock(&stripe->shpool->mutex);
 
-        lua_pushnil(L);
-        lua_pushliteral(L, "not found");
-        return 2;
+        lua_pushnumber(L, 0);
+        return 1;
     }
 
-    /* rc == NGX_OK */
-
-    if (sd->value_type != LUA_TNUMBER || sd->value_len != sizeof(lua_Number)) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+    if (sd->value_type != NGX_HTTP_LUA_SHDICT_TLIST) {
+        ngx_shmtx_unlock(&stripe->shpool->mutex);
 
         lua_pushnil(L);
-        lua_pushliteral(L, "not a number");
+        lua_pushliteral(L, "value not a list");
         return 2;
     }
 
-    ngx_queue_remove(&sd->queue);
-    ngx_queue_insert_head(&ctx->sh->queue, &sd->queue);
-
-    dd("setting value type to %d", (int) sd->value_type);
-
-    p = sd->data + key.len;
-
-    num = *(lua_Number *) p;
-
-    num += value;
-
-    ngx_memcpy(p, (lua_Number *) &num, sizeof(lua_Number));
+    num = (lua_Number) ngx_http_lua_shdict_get_list(sd)->nitems;
 
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    ngx_shmtx_unlock(&stripe->shpool->mutex);
 
     lua_pushnumber(L, num);
-    lua_pushnil(L);
-    return 2;
+    return 1;
 }
-
@@ -5,6 +5,19 @@
 #include "ngx_http_lua_common.h"
 
 
+#define NGX_HTTP_LUA_SHDICT_MAX_STRIPES     256
+
+#define NGX_HTTP_LUA_SHDICT_INDEX_RBTREE    0
+#define NGX_HTTP_LUA_SHDICT_INDEX_HASH      1
+
+/* value type of list nodes, not clashing with the Lua types stored */
+#define NGX_HTTP_LUA_SHDICT_TLIST           LUA_TTABLE
+
+#define ngx_http_lua_shdict_get_list(sd)                                     \
+    ((ngx_http_lua_shdict_list_t *)                                          \
+         ngx_align_ptr((sd)->data + (sd)->key_len, NGX_ALIGNMENT))
+
+
 typedef struct {
     u_char                       color;
     u_char                       dummy;
@@ -14,28 +27,112 @@ typedef struct {
     uint8_t                      value_type;
     uint32_t                     value_len;
     uint32_t                     user_flags;
+    uint32_t                     generation;
     u_char                       data[1];
 } ngx_http_lua_shdict_node_t;
 
 
+/* the value of a node whose value_type is NGX_HTTP_LUA_SHDICT_TLIST */
+typedef struct {
+    ngx_queue_t                  items;
+    ngx_uint_t                   nitems;
+} ngx_http_lua_shdict_list_t;
+
+
+typedef struct {
+    ngx_queue_t                  queue;
+    uint32_t                     value_len;
+    uint8_t                      value_type;
+    u_char                       data[1];
+} ngx_http_lua_shdict_list_node_t;
+
+
+/* an independently locked partition of a shared dict zone */
 typedef struct {
     ngx_rbtree_t                  rbtree;
     ngx_rbtree_node_t             sentinel;
     ngx_queue_t                   queue;
+    ngx_slab_pool_t              *shpool;
+
+    /* hash index, chained through ngx_rbtree_node_t.left */
+    ngx_rbtree_node_t           **buckets;
+    ngx_uint_t                    nbuckets;
+
+    uint32_t                      generation; /* bumped by flush_all() */
+
+    ngx_uint_t                    keys;
+    ngx_uint_t                    hits;
+    ngx_uint_t                    misses;
+    ngx_uint_t                    sets;
+    ngx_uint_t                    reclaimed; /* expired entries freed */
+    ngx_uint_t                    evicted;   /* valid entries freed by LRU */
+} ngx_http_lua_shdict_stripe_t;
+
+
+typedef struct {
+    ngx_uint_t                    nstripes;
+    ngx_uint_t                    index;
+
+    ngx_atomic_t                  sweeper;  /* pid of the sweeping worker */
+    uint64_t                      sweep_time;
+    uint64_t                      sweep_start;
+    ngx_uint_t                    sweep_stripe;
+    ngx_uint_t                    sweep_cursor;
+    ngx_flag_t                    sweep_unfinished;
+
+    ngx_atomic_t                  persister; /* pid of the snapshot writer */
+    uint64_t                      persist_time;
+    uint64_t                      persist_beat; /* last slice written */
+
+    ngx_http_lua_shdict_stripe_t  stripes[1];
 } ngx_http_lua_shdict_shctx_t;
 
 
+/* a buffered snapshot file being written or read */
+typedef struct {
+    ngx_fd_t                      fd;
+    ngx_str_t                    *name;
+    ngx_log_t                    *log;
+    u_char                       *start;
+    u_char                       *pos;
+    u_char                       *last;
+    u_char                       *end;
+    uint64_t                      now;
+    ngx_uint_t                    count;
+    ngx_int_t                     rc;
+    ngx_uint_t                    stripe;   /* the write cursor */
+    ngx_uint_t                    cursor;
+    ngx_msec_t                    started;
+} ngx_http_lua_shdict_file_t;
+
+
 typedef struct {
     ngx_http_lua_shdict_shctx_t  *sh;
     ngx_slab_pool_t              *shpool;
     ngx_str_t                     name;
     ngx_http_lua_main_conf_t     *main_conf;
     ngx_log_t                    *log;
+    ngx_uint_t                    nstripes; /* as configured */
+    ngx_uint_t                    index;    /* as configured */
+    ngx_msec_t                    sweep_interval;
+    ngx_msec_t                    sweep_threshold;
+    ngx_event_t                   sweep_event;
+    ngx_str_t                     persist;
+    ngx_str_t                     persist_temp;
+    ngx_msec_t                    persist_interval;
+    ngx_event_t                   persist_event;
+    ngx_http_lua_shdict_file_t   *persist_file; /* unfinished snapshot */
 } ngx_http_lua_shdict_ctx_t;
 
 
 ngx_int_t ngx_http_lua_shdict_init_zone(ngx_shm_zone_t *shm_zone, void *data);
 
+ngx_int_t ngx_http_lua_shdict_init_process(ngx_cycle_t *cycle,
+    ngx_http_lua_main_conf_t *lmcf);
+
+void ngx_http_lua_shdict_exit_master(ngx_cycle_t *cycle,
+    ngx_http_lua_main_conf_t *lmcf);
+
 void ngx_http_lua_shdict_rbtree_insert_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
 
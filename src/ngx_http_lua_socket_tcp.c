@@ -8,12 +8,39 @@
 #include "ngx_http_lua_util.h"
 #include "ngx_http_lua_output.h"
 #include "ngx_http_lua_contentby.h"
+#include "ngx_http_lua_resolver.h"
+
+
+#if (NGX_LINUX) && defined(SPLICE_F_MOVE)
+#define NGX_HTTP_LUA_HAVE_SPLICE  1
+#endif
+
+
+/* the state of building the chain of buffers to send */
+typedef struct {
+    ngx_http_request_t          *request;
+    ngx_http_lua_ctx_t          *ctx;
+    ngx_chain_t                 *copy;  /* holds the copied fragments */
+    ngx_buf_t                   *run;   /* last copied fragments */
+    u_char                      *pos;   /* free memory in copy */
+    ngx_chain_t                **last;  /* NULL while measuring */
+    size_t                       small;
+    int                          anchors; /* stack index of the table */
+    int                          nanchors;
+    unsigned                     copy_linked:1;
+} ngx_http_lua_socket_tcp_bufs_t;
 
 
 static int ngx_http_lua_socket_tcp(lua_State *L);
 static int ngx_http_lua_socket_tcp_connect(lua_State *L);
 static int ngx_http_lua_socket_tcp_receive(lua_State *L);
+static int ngx_http_lua_socket_tcp_receivemany(lua_State *L);
+static int ngx_http_lua_socket_tcp_receiveto(lua_State *L);
 static int ngx_http_lua_socket_tcp_send(lua_State *L);
+static ngx_chain_t *ngx_http_lua_socket_tcp_send_chain(ngx_http_request_t *r,
+    ngx_http_lua_ctx_t *ctx, lua_State *L);
+static ngx_int_t ngx_http_lua_socket_tcp_add_bufs(lua_State *L, int index,
+    ngx_http_lua_socket_tcp_bufs_t *bufs);
 static int ngx_http_lua_socket_tcp_close(lua_State *L);
 static int ngx_http_lua_socket_tcp_setoption(lua_State *L);
 static int ngx_http_lua_socket_tcp_settimeout(lua_State *L);
@@ -49,6 +76,9 @@ static void ngx_http_lua_socket_read_handler(ngx_http_request_t *r,
     ngx_http_lua_socket_tcp_upstream_t *u);
 static int ngx_http_lua_socket_tcp_receive_retval_handler(ngx_http_request_t *r,
     ngx_http_lua_socket_tcp_upstream_t *u, lua_State *L);
+static int ngx_http_lua_socket_tcp_receivemany_retval_handler(
+    ngx_http_request_t *r, ngx_http_lua_socket_tcp_upstream_t *u,
+    lua_State *L);
 static ngx_int_t ngx_http_lua_socket_read_line(void *data, ssize_t bytes);
 static void ngx_http_lua_socket_resolve_handler(ngx_resolver_ctx_t *ctx);
 static int ngx_http_lua_socket_resolve_retval_handler(ngx_http_request_t *r,
@@ -58,6 +88,25 @@ static int ngx_http_lua_socket_error_retval_handler(ngx_http_request_t *r,
 static ngx_int_t ngx_http_lua_socket_read_all(void *data, ssize_t bytes);
 static ngx_int_t ngx_http_lua_socket_read_until(void *data, ssize_t bytes);
 static ngx_int_t ngx_http_lua_socket_read_chunk(void *data, ssize_t bytes);
+static ngx_int_t ngx_http_lua_socket_read_many(void *data, ssize_t bytes);
+static ngx_int_t ngx_http_lua_socket_read_stream(void *data, ssize_t bytes);
+static ngx_int_t ngx_http_lua_socket_write_stream(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_upstream_t *u, u_char *p, size_t size);
+static void ngx_http_lua_socket_update_digests(
+    ngx_http_lua_socket_tcp_stream_t *stream, u_char *p, size_t size);
+static int ngx_http_lua_socket_tcp_receiveto_retval_handler(
+    ngx_http_request_t *r, ngx_http_lua_socket_tcp_upstream_t *u,
+    lua_State *L);
+static int ngx_http_lua_socket_tcp_proxy(lua_State *L);
+static void ngx_http_lua_socket_proxy_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_upstream_t *u);
+static ngx_int_t ngx_http_lua_socket_proxy_pump(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_proxy_t *p);
+static int ngx_http_lua_socket_proxy_retval_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_upstream_t *u, lua_State *L);
+#if (NGX_HTTP_LUA_HAVE_SPLICE)
+static void ngx_http_lua_socket_proxy_cleanup(void *data);
+#endif
 static int ngx_http_lua_socket_tcp_receiveuntil(lua_State *L);
 static int ngx_http_lua_socket_receiveuntil_iterator(lua_State *L);
 static ngx_int_t ngx_http_lua_socket_compile_pattern(u_char *data, size_t len,
@@ -68,18 +117,32 @@ static void ngx_http_lua_req_socket_rev_handler(ngx_http_request_t *r);
 static int ngx_http_lua_socket_tcp_getreusedtimes(lua_State *L);
 static int ngx_http_lua_socket_tcp_setkeepalive(lua_State *L);
 static ngx_int_t ngx_http_lua_get_keepalive_peer(ngx_http_request_t *r,
-    lua_State *L, int key_index,
+    lua_State *L, int key_index, ngx_int_t pool_size, ngx_int_t backlog,
     ngx_http_lua_socket_tcp_upstream_t *u);
+static void ngx_http_lua_socket_keepalive_reuse(
+    ngx_http_lua_socket_pool_t *spool, ngx_http_lua_socket_tcp_upstream_t *u);
+static int ngx_http_lua_socket_tcp_connect_helper(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_upstream_t *u, lua_State *L);
+static int ngx_http_lua_socket_tcp_wait_connect_retval_handler(
+    ngx_http_request_t *r, ngx_http_lua_socket_tcp_upstream_t *u,
+    lua_State *L);
+static void ngx_http_lua_socket_tcp_wait_connect_handler(ngx_event_t *ev);
 static void ngx_http_lua_socket_keepalive_dummy_handler(ngx_event_t *ev);
 static ngx_int_t ngx_http_lua_socket_keepalive_close_handler(ngx_event_t *ev);
 static void ngx_http_lua_socket_keepalive_rev_handler(ngx_event_t *ev);
+static ngx_http_lua_socket_pool_t *ngx_http_lua_socket_create_pool(
+    lua_State *L, ngx_http_request_t *r, ngx_str_t *key, ngx_uint_t pool_size);
+static void ngx_http_lua_socket_release_pool(ngx_log_t *log,
+    ngx_http_lua_socket_pool_t *spool);
 static void ngx_http_lua_socket_free_pool(ngx_log_t *log,
     ngx_http_lua_socket_pool_t *spool);
 static int ngx_http_lua_socket_tcp_upstream_destroy(lua_State *L);
 static int ngx_http_lua_socket_downstream_destroy(lua_State *L);
 static ngx_int_t ngx_http_lua_socket_push_input_data(ngx_http_request_t *r,
     ngx_http_lua_ctx_t *ctx, ngx_http_lua_socket_tcp_upstream_t *u,
-    lua_State *L);
+    ngx_http_lua_socket_tcp_many_t *many, lua_State *L);
+static void ngx_http_lua_socket_push_data(lua_State *L,
+    ngx_http_lua_socket_tcp_many_t *many, u_char *p, size_t size);
 static ngx_int_t ngx_http_lua_socket_add_pending_data(ngx_http_request_t *r,
     ngx_http_lua_socket_tcp_upstream_t *u, u_char *pos, size_t len, u_char *pat,
     int prefix, int old_state);
@@ -87,13 +150,110 @@ static ngx_int_t ngx_http_lua_socket_add_input_buffer(ngx_http_request_t *r,
     ngx_http_lua_socket_tcp_upstream_t *u);
 static ngx_int_t ngx_http_lua_socket_insert_buffer(ngx_http_request_t *r,
     ngx_http_lua_socket_tcp_upstream_t *u, u_char *pat, size_t prefix);
+static ngx_int_t ngx_http_lua_socket_tcp_resolved(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_upstream_t *u, in_addr_t *addrs,
+    ngx_uint_t naddrs);
+static ngx_int_t ngx_http_lua_socket_tcp_set_addr(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_upstream_t *u);
+static ngx_int_t ngx_http_lua_socket_tcp_connect_next(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_upstream_t *u);
+static ngx_flag_t ngx_http_lua_socket_addr_failed(in_addr_t addr,
+    in_port_t port);
+static void ngx_http_lua_socket_addr_connected(
+    ngx_http_lua_socket_tcp_upstream_t *u);
+static ngx_chain_t *ngx_http_lua_socket_get_recv_buf(ngx_log_t *log,
+    size_t size);
+static ngx_chain_t *ngx_http_lua_socket_alloc_recv_buf(ngx_log_t *log,
+    size_t size);
+static void ngx_http_lua_socket_release_recv_bufs(ngx_log_t *log,
+    ngx_chain_t *cl, size_t size);
 static ngx_int_t ngx_http_lua_test_expect(ngx_http_request_t *r);
+static const char *ngx_http_lua_socket_tcp_sockopt_value(lua_State *L,
+    int index, ngx_uint_t opt, int *value);
+static ngx_int_t ngx_http_lua_socket_tcp_set_sockopt(ngx_connection_t *c,
+    ngx_uint_t opt, int value);
 
 
 enum {
     SOCKET_CTX_INDEX = 1,
     SOCKET_TIMEOUT_INDEX = 2,
-    SOCKET_KEY_INDEX = 3
+    SOCKET_KEY_INDEX = 3,
+    SOCKET_SEND_DATA_INDEX = 4,
+    SOCKET_PATTERN_INDEX = 5
+};
+
+
+/* smaller fragments are cheaper to copy than to pass to writev() */
+#define NGX_HTTP_LUA_SOCKET_ZEROCOPY_MIN  128
+
+/* receive buffers kept by the current worker for later cosocket reads */
+#define NGX_HTTP_LUA_SOCKET_FREE_RECV_BUFS_MAX  64
+
+
+/* slots of the per-worker table of addresses that failed to connect */
+#define NGX_HTTP_LUA_SOCKET_FAILED_ADDRS  64
+
+
+/* the options accepted by tcpsock:setoption() and tcpsock:connect() */
+typedef struct {
+    ngx_str_t                  name;
+    int                        level;
+    int                        option;
+    unsigned                   flag:1;  /* takes a boolean */
+} ngx_http_lua_socket_tcp_option_t;
+
+
+static ngx_http_lua_socket_tcp_option_t  ngx_http_lua_socket_tcp_options[] = {
+
+    { ngx_string("tcp_nodelay"), IPPROTO_TCP, TCP_NODELAY, 1 },
+
+#if defined(TCP_CORK)
+    { ngx_string("tcp_cork"), IPPROTO_TCP, TCP_CORK, 1 },
+#elif defined(TCP_NOPUSH)
+    { ngx_string("tcp_cork"), IPPROTO_TCP, TCP_NOPUSH, 1 },
+#endif
+
+    { ngx_string("keepalive"), SOL_SOCKET, SO_KEEPALIVE, 1 },
+
+#if defined(TCP_KEEPIDLE)
+    { ngx_string("keepidle"), IPPROTO_TCP, TCP_KEEPIDLE, 0 },
+#endif
+
+#if defined(TCP_KEEPINTVL)
+    { ngx_string("keepintvl"), IPPROTO_TCP, TCP_KEEPINTVL, 0 },
+#endif
+
+#if defined(TCP_KEEPCNT)
+    { ngx_string("keepcnt"), IPPROTO_TCP, TCP_KEEPCNT, 0 },
+#endif
+
+    { ngx_string("rcvbuf"), SOL_SOCKET, SO_RCVBUF, 0 },
+    { ngx_string("sndbuf"), SOL_SOCKET, SO_SNDBUF, 0 },
+
+    { ngx_null_string, 0, 0, 0 }
+};
+
+
+#define NGX_HTTP_LUA_SOCKET_TCP_NOPTIONS                                      \
+    (sizeof(ngx_http_lua_socket_tcp_options)                                  \
+     / sizeof(ngx_http_lua_socket_tcp_option_t) - 1)
+
+
+/* SO_RCVBUF goes to ngx_event_connect_peer() to be set before connecting */
+#define ngx_http_lua_socket_tcp_is_rcvbuf(i)                                  \
+    (ngx_http_lua_socket_tcp_options[i].level == SOL_SOCKET                   \
+     && ngx_http_lua_socket_tcp_options[i].option == SO_RCVBUF)
+
+
+static ngx_chain_t  *ngx_http_lua_socket_free_recv_bufs = NULL;
+static ngx_uint_t    ngx_http_lua_socket_nfree_recv_bufs = 0;
+
+static ngx_http_lua_socket_failed_addr_t
+    ngx_http_lua_socket_failed_addrs[NGX_HTTP_LUA_SOCKET_FAILED_ADDRS];
+
+/* the keys of the receiveto() digests table, by digest type */
+static char  *ngx_http_lua_socket_digest_names[] = {
+    "md5", "sha1", "crc32"
 };
 
 
@@ -106,11 +266,14 @@ ngx_http_lua_inject_socket_tcp_api(ngx_log_t *log, lua_State *L)
 {
     ngx_int_t         rc;
 
-    lua_createtable(L, 0, 3 /* nrec */);    /* ngx.socket */
+    lua_createtable(L, 0, 5 /* nrec */);    /* ngx.socket */
 
     lua_pushcfunction(L, ngx_http_lua_socket_tcp);
     lua_setfield(L, -2, "tcp");
 
+    lua_pushcfunction(L, ngx_http_lua_socket_tcp_proxy);
+    lua_setfield(L, -2, "proxy");
+
     {
         const char    buf[] = "local sock = ngx.socket.tcp()"
                    " local ok, err = sock:connect(...)"
@@ -132,7 +295,7 @@ ngx_http_lua_inject_socket_tcp_api(ngx_log_t *log, lua_State *L)
 
     /* {{{req socket object metatable */
     lua_pushlightuserdata(L, &ngx_http_lua_req_socket_metatable_key);
-    lua_createtable(L, 0 /* narr */, 4 /* nrec */);
+    lua_createtable(L, 0 /* narr */, 5 /* nrec */);
 
     lua_pushcfunction(L, ngx_http_lua_socket_tcp_receive);
     lua_setfield(L, -2, "receive");
@@ -140,6 +303,9 @@ ngx_http_lua_inject_socket_tcp_api(ngx_log_t *log, lua_State *L)
     lua_pushcfunction(L, ngx_http_lua_socket_tcp_receiveuntil);
     lua_setfield(L, -2, "receiveuntil");
 
+    lua_pushcfunction(L, ngx_http_lua_socket_tcp_receiveto);
+    lua_setfield(L, -2, "receiveto");
+
     lua_pushcfunction(L, ngx_http_lua_socket_tcp_settimeout);
     lua_setfield(L, -2, "settimeout"); /* ngx socket mt */
 
@@ -151,7 +317,7 @@ ngx_http_lua_inject_socket_tcp_api(ngx_log_t *log, lua_State *L)
 
     /* {{{tcp object metatable */
     lua_pushlightuserdata(L, &ngx_http_lua_tcp_socket_metatable_key);
-    lua_createtable(L, 0 /* narr */, 10 /* nrec */);
+    lua_createtable(L, 0 /* narr */, 12 /* nrec */);
 
     lua_pushcfunction(L, ngx_http_lua_socket_tcp_connect);
     lua_setfield(L, -2, "connect");
@@ -159,6 +325,12 @@ ngx_http_lua_inject_socket_tcp_api(ngx_log_t *log, lua_State *L)
     lua_pushcfunction(L, ngx_http_lua_socket_tcp_receive);
     lua_setfield(L, -2, "receive");
 
+    lua_pushcfunction(L, ngx_http_lua_socket_tcp_receivemany);
+    lua_setfield(L, -2, "receivemany");
+
+    lua_pushcfunction(L, ngx_http_lua_socket_tcp_receiveto);
+    lua_setfield(L, -2, "receiveto");
+
     lua_pushcfunction(L, ngx_http_lua_socket_tcp_receiveuntil);
     lua_setfield(L, -2, "receiveuntil");
 
@@ -242,21 +414,21 @@ ngx_http_lua_socket_tcp_connect(lua_State *L)
     ngx_http_lua_ctx_t          *ctx;
     ngx_str_t                    host;
     int                          port;
-    ngx_resolver_ctx_t          *rctx, temp;
-    ngx_http_core_loc_conf_t    *clcf;
-    int                          saved_top;
     int                          n;
     u_char                      *p;
     size_t                       len;
-    ngx_url_t                    url;
     ngx_int_t                    rc;
     ngx_http_lua_loc_conf_t     *llcf;
     ngx_peer_connection_t       *pc;
     int                          timeout;
     unsigned                     custom_pool;
     int                          key_index;
+    ngx_int_t                    pool_size;
+    ngx_int_t                    backlog;
     const char                  *msg;
+    ngx_uint_t                   i, nsockopts;
 
+    ngx_http_lua_socket_tcp_sockopt_t       *sockopts;
     ngx_http_lua_socket_tcp_upstream_t      *u;
 
     n = lua_gettop(L);
@@ -299,11 +471,83 @@ ngx_http_lua_socket_tcp_connect(lua_State *L)
 
     key_index = 2;
     custom_pool = 0;
+    pool_size = NGX_CONF_UNSET;
+    backlog = NGX_CONF_UNSET;
+    sockopts = NULL;
+    nsockopts = 0;
 
     if (lua_type(L, n) == LUA_TTABLE) {
 
         /* found the last optional option table */
 
+        lua_getfield(L, n, "pool_size");
+
+        if (!lua_isnil(L, -1)) {
+            if (lua_type(L, -1) != LUA_TNUMBER) {
+                msg = lua_pushfstring(L, "bad \"pool_size\" option type: %s",
+                                      luaL_typename(L, -1));
+                luaL_argerror(L, n, msg);
+            }
+
+            pool_size = (ngx_int_t) lua_tointeger(L, -1);
+
+            if (pool_size <= 0) {
+                msg = lua_pushfstring(L, "bad \"pool_size\" option value: %d",
+                                      (int) pool_size);
+                luaL_argerror(L, n, msg);
+            }
+        }
+
+        lua_pop(L, 1);
+
+        lua_getfield(L, n, "backlog");
+
+        if (!lua_isnil(L, -1)) {
+            if (lua_type(L, -1) != LUA_TNUMBER) {
+                msg = lua_pushfstring(L, "bad \"backlog\" option type: %s",
+                                      luaL_typename(L, -1));
+                luaL_argerror(L, n, msg);
+            }
+
+            backlog = (ngx_int_t) lua_tointeger(L, -1);
+
+            if (backlog < 0) {
+                msg = lua_pushfstring(L, "bad \"backlog\" option value: %d",
+                                      (int) backlog);
+                luaL_argerror(L, n, msg);
+            }
+        }
+
+        lua_pop(L, 1);
+
+        /* socket options for the new connections made by this call */
+
+        for (i = 0; ngx_http_lua_socket_tcp_options[i].name.len; i++) {
+            lua_getfield(L, n,
+                         (char *) ngx_http_lua_socket_tcp_options[i].name.data);
+
+            if (!lua_isnil(L, -1)) {
+                if (sockopts == NULL) {
+                    sockopts = ngx_palloc(r->pool,
+                                          NGX_HTTP_LUA_SOCKET_TCP_NOPTIONS
+                                  * sizeof(ngx_http_lua_socket_tcp_sockopt_t));
+                    if (sockopts == NULL) {
+                        return luaL_error(L, "out of memory");
+                    }
+                }
+
+                msg = ngx_http_lua_socket_tcp_sockopt_value(L, -1, i,
+                                                &sockopts[nsockopts].value);
+                if (msg) {
+                    luaL_argerror(L, n, msg);
+                }
+
+                sockopts[nsockopts++].index = i;
+            }
+
+            lua_pop(L, 1);
+        }
+
         lua_getfield(L, n, "pool");
 
         switch (lua_type(L, -1)) {
@@ -320,6 +564,11 @@ ngx_http_lua_socket_tcp_connect(lua_State *L)
 
             break;
 
+        case LUA_TNIL:
+            /* remove the option table to build the default pool name */
+            lua_settop(L, n - 1);
+            break;
+
         default:
             msg = lua_pushfstring(L, "bad \"pool\" option type: %s",
                                   luaL_typename(L, -1));
@@ -373,7 +622,7 @@ ngx_http_lua_socket_tcp_connect(lua_State *L)
             return luaL_error(L, "attempt to re-connect a request socket");
         }
 
-        if (u->peer.connection) {
+        if (u->peer.connection || u->cleanup) {
             ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                            "lua tcp socket reconnect without shutting down");
 
@@ -406,6 +655,9 @@ ngx_http_lua_socket_tcp_connect(lua_State *L)
 
     u->conf = llcf;
 
+    u->host = host;
+    u->port = (in_port_t) port;
+
     pc = &u->peer;
 
     pc->log = r->connection->log;
@@ -413,6 +665,16 @@ ngx_http_lua_socket_tcp_connect(lua_State *L)
 
     dd("lua peer connection log: %p", pc->log);
 
+    u->sockopts = sockopts;
+    u->nsockopts = nsockopts;
+
+    for (i = 0; i < nsockopts; i++) {
+        if (ngx_http_lua_socket_tcp_is_rcvbuf(sockopts[i].index)) {
+            /* so that the larger TCP window scale is negotiated */
+            pc->rcvbuf = sockopts[i].value;
+        }
+    }
+
     lua_rawgeti(L, 1, SOCKET_TIMEOUT_INDEX);
     timeout = (ngx_int_t) lua_tointeger(L, -1);
     lua_pop(L, 1);
@@ -430,7 +692,8 @@ ngx_http_lua_socket_tcp_connect(lua_State *L)
 
     r->connection->single_connection = 0;
 
-    rc = ngx_http_lua_get_keepalive_peer(r, L, key_index, u);
+    rc = ngx_http_lua_get_keepalive_peer(r, L, key_index, pool_size, backlog,
+                                         u);
 
     if (rc == NGX_OK) {
         lua_pushinteger(L, 1);
@@ -443,24 +706,79 @@ ngx_http_lua_socket_tcp_connect(lua_State *L)
         return 2;
     }
 
+    if (rc == NGX_BUSY) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "too many waiting connect operations");
+        return 2;
+    }
+
+    if (rc == NGX_AGAIN) {
+        /* queued until the pool has room for us */
+
+        u->waiting = 1;
+        u->prepare_retvals =
+                        ngx_http_lua_socket_tcp_wait_connect_retval_handler;
+
+        ctx->data = u;
+        ctx->socket_busy = 1;
+        ctx->socket_ready = 0;
+
+        if (ctx->entered_content_phase) {
+            r->write_event_handler = ngx_http_lua_content_wev_handler;
+        }
+
+        return lua_yield(L, 0);
+    }
+
     /* rc == NGX_DECLINED */
 
+    rc = ngx_http_lua_socket_tcp_connect_helper(r, u, L);
+    if (rc == NGX_AGAIN) {
+        return lua_yield(L, 0);
+    }
+
+    return rc;
+}
+
+
+/* resolves u->host and starts connecting to it, returning either the number
+ * of values pushed onto the Lua stack or NGX_AGAIN if we have to wait */
+
+static int
+ngx_http_lua_socket_tcp_connect_helper(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_upstream_t *u, lua_State *L)
+{
+    ngx_http_lua_ctx_t          *ctx;
+    ngx_resolver_ctx_t          *rctx, temp;
+    ngx_http_core_loc_conf_t    *clcf;
+    int                          saved_top;
+    int                          n;
+    ngx_url_t                    url;
+    ngx_int_t                    rc;
+    in_addr_t                   *addrs;
+    ngx_uint_t                   naddrs;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
     ngx_memzero(&url, sizeof(ngx_url_t));
 
-    url.url.len = host.len;
-    url.url.data = host.data;
-    url.default_port = port;
+    url.url.len = u->host.len;
+    url.url.data = u->host.data;
+    url.default_port = u->port;
     url.no_resolve = 1;
 
     if (ngx_parse_url(r->pool, &url) != NGX_OK) {
+        ngx_http_lua_socket_tcp_finalize(r, u);
+
         lua_pushnil(L);
 
         if (url.err) {
             lua_pushfstring(L, "failed to parse host name \"%s\": %s",
-                            host.data, url.err);
+                            u->host.data, url.err);
 
         } else {
-            lua_pushfstring(L, "failed to parse host name \"%s\"", host.data);
+            lua_pushfstring(L, "failed to parse host name \"%s\"",
+                            u->host.data);
         }
 
         return 2;
@@ -471,9 +789,16 @@ ngx_http_lua_socket_tcp_connect(lua_State *L)
 
     u->resolved = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_resolved_t));
     if (u->resolved == NULL) {
-        return luaL_error(L, "out of memory");
+        ngx_http_lua_socket_tcp_finalize(r, u);
+        lua_pushnil(L);
+        lua_pushliteral(L, "out of memory");
+        return 2;
     }
 
+    u->addrs = NULL;
+    u->naddrs = 0;
+    u->addr_index = 0;
+
     if (url.addrs && url.addrs[0].sockaddr) {
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "lua tcp socket network address given directly");
@@ -484,14 +809,26 @@ ngx_http_lua_socket_tcp_connect(lua_State *L)
         u->resolved->host = url.addrs[0].name;
 
     } else {
-        u->resolved->host = host;
-        u->resolved->port = (in_port_t) port;
+        u->resolved->host = u->host;
+        u->resolved->port = u->port;
+    }
+
+    if (u->resolved->sockaddr == NULL
+        && ngx_http_lua_resolver_cache_lookup(r, &u->host, &addrs, &naddrs)
+           == NGX_OK)
+    {
+        if (ngx_http_lua_socket_tcp_resolved(r, u, addrs, naddrs) != NGX_OK) {
+            ngx_http_lua_socket_tcp_finalize(r, u);
+            lua_pushnil(L);
+            lua_pushliteral(L, "out of memory");
+            return 2;
+        }
     }
 
     if (u->resolved->sockaddr) {
         rc = ngx_http_lua_socket_resolve_retval_handler(r, u, L);
         if (rc == NGX_AGAIN) {
-            return lua_yield(L, 0);
+            return NGX_AGAIN;
         }
 
         return rc;
@@ -499,10 +836,11 @@ ngx_http_lua_socket_tcp_connect(lua_State *L)
 
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
-    temp.name = host;
+    temp.name = u->host;
     rctx = ngx_resolve_start(clcf->resolver, &temp);
     if (rctx == NULL) {
         u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_RESOLVER;
+        ngx_http_lua_socket_tcp_finalize(r, u);
         lua_pushnil(L);
         lua_pushliteral(L, "failed to start the resolver");
         return 2;
@@ -510,12 +848,14 @@ ngx_http_lua_socket_tcp_connect(lua_State *L)
 
     if (rctx == NGX_NO_RESOLVER) {
         u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_RESOLVER;
+        ngx_http_lua_socket_tcp_finalize(r, u);
         lua_pushnil(L);
-        lua_pushfstring(L, "no resolver defined to resolve \"%s\"", host.data);
+        lua_pushfstring(L, "no resolver defined to resolve \"%s\"",
+                        u->host.data);
         return 2;
     }
 
-    rctx->name = host;
+    rctx->name = u->host;
     rctx->type = NGX_RESOLVE_A;
     rctx->handler = ngx_http_lua_socket_resolve_handler;
     rctx->data = u;
@@ -532,21 +872,27 @@ ngx_http_lua_socket_tcp_connect(lua_State *L)
         u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_RESOLVER;
 
         u->resolved->ctx = NULL;
+        ngx_http_lua_socket_tcp_finalize(r, u);
         lua_pushnil(L);
-        lua_pushfstring(L, "%s could not be resolved", host.data);
+        lua_pushfstring(L, "%s could not be resolved", u->host.data);
 
         return 2;
     }
 
     if (u->waiting == 1) {
         /* resolved and already connecting */
-        return lua_yield(L, 0);
+        return NGX_AGAIN;
     }
 
     n = lua_gettop(L) - saved_top;
     if (n) {
         /* errors occurred during resolving or connecting
          * or already connected */
+
+        if (u->ft_type) {
+            ngx_http_lua_socket_tcp_finalize(r, u);
+        }
+
         return n;
     }
 
@@ -563,7 +909,77 @@ ngx_http_lua_socket_tcp_connect(lua_State *L)
         r->write_event_handler = ngx_http_lua_content_wev_handler;
     }
 
-    return lua_yield(L, 0);
+    return NGX_AGAIN;
+}
+
+
+static int
+ngx_http_lua_socket_tcp_wait_connect_retval_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_upstream_t *u, lua_State *L)
+{
+    ngx_int_t                    rc;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua tcp socket wait connect retval handler");
+
+    if (u->ft_type) {
+        return ngx_http_lua_socket_error_retval_handler(r, u, L);
+    }
+
+    if (u->peer.connection) {
+        /* we were handed an idle connection from the pool */
+        lua_pushinteger(L, 1);
+        return 1;
+    }
+
+    rc = ngx_http_lua_socket_tcp_connect_helper(r, u, L);
+    if (rc == NGX_AGAIN) {
+        return NGX_AGAIN;
+    }
+
+    return rc;
+}
+
+
+static void
+ngx_http_lua_socket_tcp_wait_connect_handler(ngx_event_t *ev)
+{
+    ngx_connection_t                *c;
+    ngx_http_request_t              *r;
+    ngx_http_log_ctx_t              *ctx;
+    ngx_http_lua_socket_pool_t      *spool;
+
+    ngx_http_lua_socket_tcp_upstream_t  *u;
+
+    u = ev->data;
+    r = u->request;
+    c = r->connection;
+
+    ctx = c->log->data;
+    ctx->current_request = r;
+
+    if (u->wait_connect) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "lua tcp socket wait connect timed out");
+
+        spool = u->socket_pool;
+
+        ngx_queue_remove(&u->wait_queue);
+        spool->nwaiting--;
+
+        u->wait_connect = 0;
+        u->socket_pool = NULL;
+
+        ngx_http_lua_socket_handle_error(r, u, NGX_HTTP_LUA_SOCKET_FT_TIMEOUT);
+
+    } else {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "lua tcp socket wait connect resumed");
+
+        ngx_http_lua_socket_handle_success(r, u);
+    }
+
+    ngx_http_run_posted_requests(c);
 }
 
 
@@ -575,10 +991,6 @@ ngx_http_lua_socket_resolve_handler(ngx_resolver_ctx_t *ctx)
     ngx_http_lua_ctx_t                  *lctx;
     lua_State                           *L;
     ngx_http_lua_socket_tcp_upstream_t  *u;
-    u_char                              *p;
-    size_t                               len;
-    struct sockaddr_in                  *sin;
-    ngx_uint_t                           i;
     unsigned                             waiting;
 
     u = ctx->data;
@@ -641,19 +1053,12 @@ ngx_http_lua_socket_resolve_handler(ngx_resolver_ctx_t *ctx)
         return;
     }
 
-    if (ur->naddrs == 1) {
-        i = 0;
-
-    } else {
-        i = ngx_random() % ur->naddrs;
-    }
-
-    dd("selected addr index: %d", (int) i);
-
-    len = NGX_INET_ADDRSTRLEN + sizeof(":65536") - 1;
+    ngx_http_lua_resolver_cache_update(r, &ctx->name, ctx->addrs,
+                                       ctx->naddrs);
 
-    p = ngx_pnalloc(r->pool, len + sizeof(struct sockaddr_in));
-    if (p == NULL) {
+    if (ngx_http_lua_socket_tcp_resolved(r, u, ctx->addrs, ctx->naddrs)
+        != NGX_OK)
+    {
         u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_RESOLVER;
 
         lua_pushnil(L);
@@ -661,23 +1066,6 @@ ngx_http_lua_socket_resolve_handler(ngx_resolver_ctx_t *ctx)
         return;
     }
 
-    sin = (struct sockaddr_in *) &p[len];
-    ngx_memzero(sin, sizeof(struct sockaddr_in));
-
-    len = ngx_inet_ntop(AF_INET, &ur->addrs[i], p, NGX_INET_ADDRSTRLEN);
-    len = ngx_sprintf(&p[len], ":%d", ur->port) - p;
-
-    sin->sin_family = AF_INET;
-    sin->sin_port = htons(ur->port);
-    sin->sin_addr.s_addr = ur->addrs[i];
-
-    ur->sockaddr = (struct sockaddr *) sin;
-    ur->socklen = sizeof(struct sockaddr_in);
-
-    ur->host.data = p;
-    ur->host.len = len;
-    ur->naddrs = 1;
-
     ur->ctx = NULL;
 
     ngx_resolve_name_done(ctx);
@@ -705,6 +1093,9 @@ ngx_http_lua_socket_resolve_retval_handler(ngx_http_request_t *r,
     ngx_http_cleanup_t              *cln;
     ngx_http_upstream_resolved_t    *ur;
     ngx_int_t                        rc;
+    ngx_msec_t                       timeout;
+    ngx_msec_int_t                   left;
+    ngx_uint_t                       i, opt;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "lua tcp socket resolve retval handler");
@@ -766,8 +1157,14 @@ ngx_http_lua_socket_resolve_retval_handler(ngx_http_request_t *r,
 
     if (rc == NGX_DECLINED) {
         dd("socket errno: %d", (int) ngx_socket_errno);
-        u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_ERROR;
         u->socket_errno = ngx_socket_errno;
+
+        if (ngx_http_lua_socket_tcp_connect_next(r, u) == NGX_OK) {
+            u->socket_errno = 0;
+            return ngx_http_lua_socket_resolve_retval_handler(r, u, L);
+        }
+
+        u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_ERROR;
         return ngx_http_lua_socket_error_retval_handler(r, u, L);
     }
 
@@ -777,6 +1174,22 @@ ngx_http_lua_socket_resolve_retval_handler(ngx_http_request_t *r,
 
     c->data = u;
 
+    for (i = 0; i < u->nsockopts; i++) {
+        opt = u->sockopts[i].index;
+
+        if (ngx_http_lua_socket_tcp_is_rcvbuf(opt)) {
+            continue;
+        }
+
+        if (ngx_http_lua_socket_tcp_set_sockopt(c, opt, u->sockopts[i].value)
+            != NGX_OK)
+        {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_socket_errno,
+                          "lua tcp socket setsockopt(\"%V\") failed",
+                          &ngx_http_lua_socket_tcp_options[opt].name);
+        }
+    }
+
     c->write->handler = ngx_http_lua_socket_tcp_handler;
     c->read->handler = ngx_http_lua_socket_tcp_handler;
 
@@ -807,6 +1220,8 @@ ngx_http_lua_socket_resolve_retval_handler(ngx_http_request_t *r,
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "lua tcp socket connected: fd:%d", (int) c->fd);
 
+        ngx_http_lua_socket_addr_connected(u);
+
         /* We should delete the current write/read event
          * here because the socket object may not be used immediately
          * on the Lua land, thus causing hot spin around level triggered
@@ -837,17 +1252,32 @@ ngx_http_lua_socket_resolve_retval_handler(ngx_http_request_t *r,
 
     /* rc == NGX_AGAIN */
 
-    ngx_add_timer(c->write, u->connect_timeout);
+    timeout = u->connect_timeout;
 
-    if (ctx->entered_content_phase) {
-        r->write_event_handler = ngx_http_lua_content_wev_handler;
-    }
+    if (u->naddrs > 1) {
 
-    u->waiting = 1;
-    u->prepare_retvals = ngx_http_lua_socket_tcp_connect_retval_handler;
+        /* leave the addresses not tried yet their share of the timeout */
 
-    ctx->data = u;
-    ctx->socket_busy = 1;
+        left = (ngx_msec_int_t) (u->connect_deadline - ngx_current_msec);
+
+        timeout = left > 0 ? left / (u->naddrs - u->addr_index) : 0;
+
+        if (timeout == 0) {
+            timeout = 1;
+        }
+    }
+
+    ngx_add_timer(c->write, timeout);
+
+    if (ctx->entered_content_phase) {
+        r->write_event_handler = ngx_http_lua_content_wev_handler;
+    }
+
+    u->waiting = 1;
+    u->prepare_retvals = ngx_http_lua_socket_tcp_connect_retval_handler;
+
+    ctx->data = u;
+    ctx->socket_busy = 1;
     ctx->socket_ready = 0;
 
     if (ctx->entered_content_phase) {
@@ -858,6 +1288,200 @@ ngx_http_lua_socket_resolve_retval_handler(ngx_http_request_t *r,
 }
 
 
+/*
+ * the addresses are tried in turn from a random one on, but those
+ * that failed to connect recently in this worker are tried last
+ */
+
+static ngx_int_t
+ngx_http_lua_socket_tcp_resolved(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_upstream_t *u, in_addr_t *addrs,
+    ngx_uint_t naddrs)
+{
+    in_addr_t                            addr;
+    ngx_uint_t                           i, n, start;
+    ngx_http_upstream_resolved_t        *ur;
+
+    ur = u->resolved;
+
+    u->addrs = ngx_palloc(r->pool, naddrs * sizeof(in_addr_t));
+    if (u->addrs == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (naddrs == 1) {
+        start = 0;
+
+    } else {
+        start = ngx_random() % naddrs;
+    }
+
+    dd("selected addr index: %d", (int) start);
+
+    n = 0;
+
+    for (i = 0; i < naddrs; i++) {
+        addr = addrs[(start + i) % naddrs];
+
+        if (!ngx_http_lua_socket_addr_failed(addr, ur->port)) {
+            u->addrs[n++] = addr;
+        }
+    }
+
+    for (i = 0; i < naddrs; i++) {
+        addr = addrs[(start + i) % naddrs];
+
+        if (ngx_http_lua_socket_addr_failed(addr, ur->port)) {
+            u->addrs[n++] = addr;
+        }
+    }
+
+    u->naddrs = naddrs;
+    u->addr_index = 0;
+    u->connect_deadline = ngx_current_msec + u->connect_timeout;
+
+    if (ngx_http_lua_socket_tcp_set_addr(r, u) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ur->naddrs = 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_socket_tcp_set_addr(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_upstream_t *u)
+{
+    u_char                              *p;
+    size_t                               len;
+    in_addr_t                            addr;
+    struct sockaddr_in                  *sin;
+    ngx_http_upstream_resolved_t        *ur;
+
+    ur = u->resolved;
+    addr = u->addrs[u->addr_index];
+
+    len = NGX_INET_ADDRSTRLEN + sizeof(":65536") - 1;
+
+    p = ngx_pnalloc(r->pool, len + sizeof(struct sockaddr_in));
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    sin = (struct sockaddr_in *) &p[len];
+    ngx_memzero(sin, sizeof(struct sockaddr_in));
+
+    len = ngx_inet_ntop(AF_INET, &addr, p, NGX_INET_ADDRSTRLEN);
+    len = ngx_sprintf(&p[len], ":%d", ur->port) - p;
+
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(ur->port);
+    sin->sin_addr.s_addr = addr;
+
+    ur->sockaddr = (struct sockaddr *) sin;
+    ur->socklen = sizeof(struct sockaddr_in);
+
+    ur->host.data = p;
+    ur->host.len = len;
+
+    return NGX_OK;
+}
+
+
+/*
+ * remembers that the current address failed to connect, and moves on
+ * to the next resolved address, if there is one and the connect timeout
+ * has not expired yet
+ */
+
+static ngx_int_t
+ngx_http_lua_socket_tcp_connect_next(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_upstream_t *u)
+{
+    in_port_t                            port;
+    ngx_http_lua_socket_failed_addr_t   *fa;
+
+    if (u->naddrs == 0) {
+        return NGX_DECLINED;
+    }
+
+    port = u->resolved->port;
+
+    if (u->conf->connect_cooldown) {
+        fa = &ngx_http_lua_socket_failed_addrs[(u->addrs[u->addr_index] ^ port)
+                                            % NGX_HTTP_LUA_SOCKET_FAILED_ADDRS];
+
+        fa->addr = u->addrs[u->addr_index];
+        fa->port = port;
+        fa->expires = ngx_current_msec + u->conf->connect_cooldown;
+    }
+
+    if (u->addr_index + 1 >= u->naddrs
+        || (ngx_msec_int_t) (u->connect_deadline - ngx_current_msec) <= 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                  "lua tcp socket failed to connect to %V, "
+                  "trying the next address", &u->resolved->host);
+
+    if (u->peer.connection) {
+        ngx_close_connection(u->peer.connection);
+        u->peer.connection = NULL;
+    }
+
+    u->addr_index++;
+
+    if (ngx_http_lua_socket_tcp_set_addr(r, u) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_flag_t
+ngx_http_lua_socket_addr_failed(in_addr_t addr, in_port_t port)
+{
+    ngx_http_lua_socket_failed_addr_t   *fa;
+
+    fa = &ngx_http_lua_socket_failed_addrs[(addr ^ port)
+                                           % NGX_HTTP_LUA_SOCKET_FAILED_ADDRS];
+
+    return fa->addr == addr && fa->port == port
+           && (ngx_msec_int_t) (fa->expires - ngx_current_msec) > 0;
+}
+
+
+/* forgets an earlier failure of the address just connected to */
+
+static void
+ngx_http_lua_socket_addr_connected(ngx_http_lua_socket_tcp_upstream_t *u)
+{
+    in_addr_t                            addr;
+    in_port_t                            port;
+    ngx_http_lua_socket_failed_addr_t   *fa;
+
+    if (u->naddrs == 0) {
+        return;
+    }
+
+    addr = u->addrs[u->addr_index];
+    port = u->resolved->port;
+
+    fa = &ngx_http_lua_socket_failed_addrs[(addr ^ port)
+                                           % NGX_HTTP_LUA_SOCKET_FAILED_ADDRS];
+
+    if (fa->addr == addr && fa->port == port) {
+        fa->addr = INADDR_NONE;
+        fa->port = 0;
+    }
+}
+
+
 static int
 ngx_http_lua_socket_error_retval_handler(ngx_http_request_t *r,
     ngx_http_lua_socket_tcp_upstream_t *u, lua_State *L)
@@ -1041,11 +1665,8 @@ ngx_http_lua_socket_tcp_receive(lua_State *L)
 
     if (u->bufs_in == NULL) {
         u->bufs_in =
-            ngx_http_lua_chains_get_free_buf(r->connection->log, r->pool,
-                                             &ctx->free_recv_bufs,
-                                             u->conf->buffer_size,
-                                             (ngx_buf_tag_t)
-                                             &ngx_http_lua_module);
+            ngx_http_lua_socket_get_recv_buf(r->connection->log,
+                                             u->conf->buffer_size);
 
         if (u->bufs_in == NULL) {
             return luaL_error(L, "out of memory");
@@ -1136,6 +1757,64 @@ ngx_http_lua_socket_read_chunk(void *data, ssize_t bytes)
     return NGX_AGAIN;
 }
 
+static ngx_int_t
+ngx_http_lua_socket_read_many(void *data, ssize_t bytes)
+{
+    ngx_http_lua_socket_tcp_many_t          *many = data;
+
+    ngx_http_lua_socket_tcp_upstream_t      *u;
+    ngx_http_lua_socket_tcp_item_t          *item;
+    ngx_chain_t                             *cl;
+    ngx_int_t                                rc;
+    size_t                                   size;
+
+    u = many->upstream;
+
+    for ( ;; ) {
+        rc = many->input_filter(many->input_filter_ctx, bytes);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        size = 0;
+        for (cl = u->bufs_in; cl; cl = cl->next) {
+            size += cl->buf->last - cl->buf->pos;
+        }
+
+        item = &many->items[many->done++];
+
+        item->len = size - many->received;
+
+        /* the input filters expect the data not read yet to follow the
+         * data received right away, so we keep the gap left by the line
+         * breaks or the delimiter in the buffer and skip it later */
+
+        item->skip = u->buffer.pos - u->buf_in->buf->last;
+        u->buf_in->buf->last = u->buffer.pos;
+
+        many->received = size + item->skip;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, u->request->connection->log, 0,
+                       "lua tcp socket read item %ui of %ui",
+                       many->done, many->n);
+
+        if (many->done == many->n) {
+            return NGX_OK;
+        }
+
+        /* go on with the next item in the data already read */
+
+        u->rest = u->length;
+
+        bytes = u->buffer.last - u->buffer.pos;
+
+        if (bytes == 0 && !u->eof) {
+            return NGX_AGAIN;
+        }
+    }
+}
+
+
 
 static ngx_int_t
 ngx_http_lua_socket_read_all(void *data, ssize_t bytes)
@@ -1308,6 +1987,12 @@ ngx_http_lua_socket_tcp_read(ngx_http_request_t *r,
             break;
         }
 
+        if (u->stream && u->stream->paused) {
+            /* resumed by the write event handler of the request */
+            rc = NGX_AGAIN;
+            break;
+        }
+
         size = b->end - b->last;
 
         if (size == 0) {
@@ -1429,7 +2114,7 @@ ngx_http_lua_socket_tcp_read(ngx_http_request_t *r,
         return NGX_ERROR;
     }
 
-    if (rev->active) {
+    if (rev->active && !(u->stream && u->stream->paused)) {
         ngx_add_timer(rev, u->read_timeout);
 
     } else if (rev->timer_set) {
@@ -1441,25 +2126,25 @@ ngx_http_lua_socket_tcp_read(ngx_http_request_t *r,
 
 
 static int
-ngx_http_lua_socket_tcp_send(lua_State *L)
+ngx_http_lua_socket_tcp_receivemany(lua_State *L)
 {
-    ngx_int_t                            rc;
     ngx_http_request_t                  *r;
-    u_char                              *p;
-    size_t                               len;
-    ngx_http_core_loc_conf_t            *clcf;
-    ngx_chain_t                         *cl;
-    ngx_http_lua_ctx_t                  *ctx;
     ngx_http_lua_socket_tcp_upstream_t  *u;
-    int                                  type;
-    const char                          *msg;
-    ngx_buf_t                           *b;
+    ngx_http_lua_socket_tcp_many_t      *many;
+    ngx_int_t                            rc;
+    ngx_http_lua_ctx_t                  *ctx;
+    int                                  n;
+    ngx_str_t                            pat;
+    lua_Integer                          bytes;
+    lua_Integer                          items;
+    char                                *p;
 
-    /* TODO: add support for the optional "i" and "j" arguments */
+    ngx_http_lua_socket_compiled_pattern_t     *cp;
 
-    if (lua_gettop(L) != 2) {
-        return luaL_error(L, "expecting 2 arguments (including the object), "
-                          "but got %d", lua_gettop(L));
+    n = lua_gettop(L);
+    if (n != 2 && n != 3) {
+        return luaL_error(L, "expecting 2 or 3 arguments "
+                          "(including the object), but got %d", n);
     }
 
     lua_pushlightuserdata(L, &ngx_http_lua_request_key);
@@ -1467,15 +2152,23 @@ ngx_http_lua_socket_tcp_send(lua_State *L)
     r = lua_touserdata(L, -1);
     lua_pop(L, 1);
 
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua tcp socket calling receivemany() method");
+
     luaL_checktype(L, 1, LUA_TTABLE);
 
+    items = luaL_checkinteger(L, 2);
+    if (items <= 0) {
+        return luaL_argerror(L, 2, "bad number of items");
+    }
+
     lua_rawgeti(L, 1, SOCKET_CTX_INDEX);
     u = lua_touserdata(L, -1);
     lua_pop(L, 1);
 
     if (u == NULL || u->peer.connection == NULL || u->ft_type || u->eof) {
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "attempt to send data on a closed socket: u:%p, c:%p, "
+                      "attempt to receive data on a closed socket: u:%p, c:%p, "
                       "ft:%ui eof:%ud",
                       u, u ? u->peer.connection : NULL, u ? u->ft_type : 0,
                       u ? u->eof : 0);
@@ -1491,63 +2184,1254 @@ ngx_http_lua_socket_tcp_send(lua_State *L)
         return 2;
     }
 
-    if (u->is_downstream) {
-        return luaL_error(L, "attempt to write to request sockets");
-    }
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua tcp socket receive %i items, read timeout: %M",
+                   (ngx_int_t) items, u->read_timeout);
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua tcp socket send timeout: %M", u->send_timeout);
+    many = u->many;
 
-    type = lua_type(L, 2);
-    switch (type) {
-        case LUA_TNUMBER:
-        case LUA_TSTRING:
-            lua_tolstring(L, 2, &len);
-            break;
+    if (many == NULL) {
+        many = ngx_pcalloc(r->pool, sizeof(ngx_http_lua_socket_tcp_many_t));
+        if (many == NULL) {
+            return luaL_error(L, "out of memory");
+        }
 
-        case LUA_TTABLE:
-            len = ngx_http_lua_calc_strlen_in_table(L, 2, 2, 1 /* strict */);
-            break;
+        u->many = many;
+    }
 
-        default:
-            msg = lua_pushfstring(L, "string, number, boolean, nil, "
-                    "or array table expected, got %s",
-                    lua_typename(L, type));
+    if (many->nalloc < (ngx_uint_t) items) {
+        many->items = ngx_palloc(r->pool, (size_t) items
+                                 * sizeof(ngx_http_lua_socket_tcp_item_t));
+        if (many->items == NULL) {
+            return luaL_error(L, "out of memory");
+        }
 
-            return luaL_argerror(L, 2, msg);
+        many->nalloc = (ngx_uint_t) items;
     }
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    many->input_filter = ngx_http_lua_socket_read_line;
+    many->input_filter_ctx = u;
 
-    cl = ngx_http_lua_chains_get_free_buf(r->connection->log, r->pool,
-                                          &ctx->free_bufs, len,
-                                          (ngx_buf_tag_t)
-                                          &ngx_http_lua_module);
+    u->length = 0;
+    u->rest = 0;
 
-    if (cl == NULL) {
-        return luaL_error(L, "out of memory");
-    }
+    if (n == 3) {
+        switch (lua_type(L, 3)) {
+        case LUA_TSTRING:
+            pat.data = (u_char *) lua_tolstring(L, 3, &pat.len);
+            if (pat.len != 2 || pat.data[0] != '*' || pat.data[1] != 'l') {
+                p = (char *) lua_pushfstring(L, "bad pattern argument: %s",
+                                             (char *) pat.data);
 
-    b = cl->buf;
+                return luaL_argerror(L, 3, p);
+            }
 
-    switch (type) {
-        case LUA_TNUMBER:
-        case LUA_TSTRING:
-            p = (u_char *) lua_tolstring(L, -1, &len);
-            b->last = ngx_copy(b->last, (u_char *) p, len);
             break;
 
-        case LUA_TTABLE:
-            b->last = ngx_http_lua_copy_str_in_table(L, -1, b->last);
+        case LUA_TNUMBER:
+            bytes = lua_tointeger(L, 3);
+            if (bytes < 0) {
+                return luaL_argerror(L, 3, "bad pattern argument");
+            }
+
+            many->input_filter = ngx_http_lua_socket_read_chunk;
+            u->length = (size_t) bytes;
+            u->rest = u->length;
+
             break;
 
-        default:
-            return luaL_error(L, "impossible to reach here");
-    }
+        case LUA_TFUNCTION:
+            if (lua_tocfunction(L, 3)
+                != ngx_http_lua_socket_receiveuntil_iterator)
+            {
+                return luaL_argerror(L, 3, "bad pattern argument");
+            }
 
-    u->request_bufs = cl;
+            /* an iterator returned by the receiveuntil() method */
 
-    u->request_len = len;
+            lua_getupvalue(L, 3, 1);
+
+            if (!lua_rawequal(L, -1, 1)) {
+                return luaL_argerror(L, 3, "iterator of another socket");
+            }
+
+            lua_getupvalue(L, 3, 2);
+            lua_getupvalue(L, 3, 3);
+
+            cp = lua_touserdata(L, -1);
+
+            cp->upstream = u;
+            cp->pattern.data = (u_char *) lua_tolstring(L, -2,
+                                                        &cp->pattern.len);
+            cp->state = 0;
+
+            lua_pop(L, 3);
+
+            many->input_filter = ngx_http_lua_socket_read_until;
+            many->input_filter_ctx = cp;
+
+            break;
+
+        default:
+            return luaL_argerror(L, 3, "bad pattern argument");
+            break;
+        }
+    }
+
+    /* keep the compiled pattern alive while we are waiting */
+
+    lua_settop(L, 3);
+    lua_rawseti(L, 1, SOCKET_PATTERN_INDEX);
+
+    many->upstream = u;
+    many->n = (ngx_uint_t) items;
+    many->done = 0;
+    many->received = 0;
+
+    u->input_filter = ngx_http_lua_socket_read_many;
+    u->input_filter_ctx = many;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+    if (u->bufs_in == NULL) {
+        u->bufs_in =
+            ngx_http_lua_socket_get_recv_buf(r->connection->log,
+                                             u->conf->buffer_size);
+
+        if (u->bufs_in == NULL) {
+            return luaL_error(L, "out of memory");
+        }
+
+        u->buf_in = u->bufs_in;
+        u->buffer = *u->buf_in->buf;
+    }
+
+    u->waiting = 0;
+
+    rc = ngx_http_lua_socket_tcp_read(r, u);
+
+    if (rc == NGX_ERROR || rc == NGX_OK) {
+        return ngx_http_lua_socket_tcp_receivemany_retval_handler(r, u, L);
+    }
+
+    /* rc == NGX_AGAIN */
+
+    u->read_event_handler = ngx_http_lua_socket_read_handler;
+    u->write_event_handler = ngx_http_lua_socket_dummy_handler;
+
+    if (ctx->entered_content_phase) {
+        r->write_event_handler = ngx_http_lua_content_wev_handler;
+    }
+
+    u->waiting = 1;
+    u->prepare_retvals = ngx_http_lua_socket_tcp_receivemany_retval_handler;
+
+    ctx->data = u;
+    ctx->socket_busy = 1;
+    ctx->socket_ready = 0;
+
+    return lua_yield(L, 0);
+}
+
+
+static int
+ngx_http_lua_socket_tcp_receiveto(lua_State *L)
+{
+    ngx_http_request_t                  *r;
+    ngx_http_lua_socket_tcp_upstream_t  *u;
+    ngx_http_lua_socket_tcp_stream_t    *stream;
+    ngx_http_lua_ctx_t                  *ctx;
+    ngx_http_core_loc_conf_t            *clcf;
+    ngx_temp_file_t                     *tf;
+    ngx_int_t                            rc;
+    ngx_str_t                            target;
+    lua_Integer                          bytes;
+    int                                  n, digests;
+    ngx_uint_t                           i;
+    ngx_flag_t                           sized;
+
+    n = lua_gettop(L);
+    if (n < 2 || n > 4) {
+        return luaL_error(L, "expecting 2 to 4 arguments "
+                          "(including the object), but got %d", n);
+    }
+
+    lua_pushlightuserdata(L, &ngx_http_lua_request_key);
+    lua_rawget(L, LUA_GLOBALSINDEX);
+    r = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua tcp socket calling receiveto() method");
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    target.data = (u_char *) luaL_checklstring(L, 2, &target.len);
+
+    if (!(target.len == sizeof("output") - 1
+          && ngx_strncmp(target.data, "output", target.len) == 0)
+        && !(target.len == sizeof("file") - 1
+             && ngx_strncmp(target.data, "file", target.len) == 0)
+        && !(target.len == sizeof("discard") - 1
+             && ngx_strncmp(target.data, "discard", target.len) == 0))
+    {
+        return luaL_argerror(L, 2, "bad target argument");
+    }
+
+    digests = 0;
+
+    if (n > 2 && lua_type(L, n) == LUA_TTABLE) {
+        digests = n;
+
+    } else if (n == 4) {
+        return luaL_argerror(L, 4, "table expected");
+    }
+
+    bytes = 0;
+    sized = 0;
+
+    if (n > 2 && n != digests) {
+        bytes = luaL_checkinteger(L, 3);
+        if (bytes < 0) {
+            return luaL_argerror(L, 3, "bad size argument");
+        }
+
+        sized = 1;
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+    if (target.data[0] == 'o' && ctx->eof) {
+        return luaL_error(L, "seen eof already");
+    }
+
+    lua_rawgeti(L, 1, SOCKET_CTX_INDEX);
+    u = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (u == NULL || u->peer.connection == NULL || u->ft_type || u->eof) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "attempt to receive data on a closed socket: u:%p, c:%p, "
+                      "ft:%ui eof:%ud",
+                      u, u ? u->peer.connection : NULL, u ? u->ft_type : 0,
+                      u ? u->eof : 0);
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (u->waiting) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "socket busy");
+        return 2;
+    }
+
+    stream = u->stream;
+
+    if (stream == NULL) {
+        stream = ngx_pcalloc(r->pool, sizeof(ngx_http_lua_socket_tcp_stream_t));
+        if (stream == NULL) {
+            return luaL_error(L, "out of memory");
+        }
+
+        u->stream = stream;
+    }
+
+    stream->temp_file = NULL;
+    stream->received = 0;
+    stream->paused = 0;
+    stream->discard = (target.data[0] == 'd');
+
+    for (i = 0; i < NGX_HTTP_LUA_DIGEST_TYPES; i++) {
+        stream->digests[i] = NULL;
+
+        if (digests == 0) {
+            continue;
+        }
+
+        lua_getfield(L, digests, ngx_http_lua_socket_digest_names[i]);
+
+        if (lua_toboolean(L, -1)) {
+#if !(NGX_HAVE_SHA1)
+            if (i == NGX_HTTP_LUA_DIGEST_SHA1) {
+                return luaL_error(L, "sha1 support is missing in nginx");
+            }
+#endif
+
+            if (stream->digest_slots == NULL) {
+                stream->digest_slots = ngx_palloc(r->pool,
+                                              sizeof(ngx_http_lua_digest_t)
+                                              * NGX_HTTP_LUA_DIGEST_TYPES);
+                if (stream->digest_slots == NULL) {
+                    return luaL_error(L, "out of memory");
+                }
+            }
+
+            stream->digests[i] = &stream->digest_slots[i];
+            ngx_http_lua_digest_init(stream->digests[i], i);
+        }
+
+        lua_pop(L, 1);
+    }
+
+    if (target.data[0] == 'f') {
+        tf = ngx_pcalloc(r->pool, sizeof(ngx_temp_file_t));
+        if (tf == NULL) {
+            return luaL_error(L, "out of memory");
+        }
+
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        tf->file.fd = NGX_INVALID_FILE;
+        tf->file.log = r->connection->log;
+        tf->path = clcf->client_body_temp_path;
+        tf->pool = r->pool;
+
+        /* removed with the request pool unless renamed by then */
+        tf->clean = 1;
+
+        if (ngx_create_temp_file(&tf->file, tf->path, tf->pool,
+                                 tf->persistent, tf->clean, tf->access)
+            != NGX_OK)
+        {
+            lua_pushnil(L);
+            lua_pushliteral(L, "failed to create temporary file");
+            return 2;
+        }
+
+        stream->temp_file = tf;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua tcp socket receive %i bytes to the %V",
+                   (ngx_int_t) bytes, &target);
+
+    u->input_filter = ngx_http_lua_socket_read_stream;
+    u->input_filter_ctx = u;
+    u->length = (size_t) bytes;
+    u->rest = u->length;
+
+    if (u->bufs_in == NULL) {
+        u->bufs_in =
+            ngx_http_lua_socket_get_recv_buf(r->connection->log,
+                                             u->conf->buffer_size);
+
+        if (u->bufs_in == NULL) {
+            return luaL_error(L, "out of memory");
+        }
+
+        u->buf_in = u->bufs_in;
+        u->buffer = *u->buf_in->buf;
+    }
+
+    if (sized && bytes == 0) {
+        return ngx_http_lua_socket_tcp_receiveto_retval_handler(r, u, L);
+    }
+
+    u->waiting = 0;
+
+    rc = ngx_http_lua_socket_tcp_read(r, u);
+
+    if (rc == NGX_ERROR || rc == NGX_OK) {
+        return ngx_http_lua_socket_tcp_receiveto_retval_handler(r, u, L);
+    }
+
+    /* rc == NGX_AGAIN */
+
+    u->read_event_handler = ngx_http_lua_socket_read_handler;
+    u->write_event_handler = ngx_http_lua_socket_dummy_handler;
+
+    if (ctx->entered_content_phase) {
+        r->write_event_handler = ngx_http_lua_content_wev_handler;
+    }
+
+    u->waiting = 1;
+    u->prepare_retvals = ngx_http_lua_socket_tcp_receiveto_retval_handler;
+
+    ctx->data = u;
+    ctx->socket_busy = 1;
+    ctx->socket_ready = 0;
+
+    return lua_yield(L, 0);
+}
+
+
+/*
+ * passes the data read on to the response body or the temporary file, or
+ * drops it, right away so that the receive buffer can be reused for the
+ * next read, without ever turning the data into Lua strings.
+ */
+
+static ngx_int_t
+ngx_http_lua_socket_read_stream(void *data, ssize_t bytes)
+{
+    ngx_http_lua_socket_tcp_upstream_t      *u = data;
+
+    ngx_buf_t                   *b;
+    size_t                       size;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, u->request->connection->log, 0,
+                   "lua tcp socket read stream %z", bytes);
+
+    if (bytes == 0) {
+        if (u->length) {
+            u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_CLOSED;
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+    }
+
+    b = &u->buffer;
+
+    size = (size_t) bytes;
+
+    if (u->length && size > u->rest) {
+        size = u->rest;
+    }
+
+    ngx_http_lua_socket_update_digests(u->stream, b->pos, size);
+
+    if (ngx_http_lua_socket_write_stream(u->request, u, b->pos, size)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    b->pos += size;
+    u->stream->received += size;
+
+    if (b->pos == b->last) {
+        b->pos = b->start;
+        b->last = b->start;
+    }
+
+    if (u->length) {
+        u->rest -= size;
+
+        if (u->rest == 0) {
+            return NGX_OK;
+        }
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static ngx_int_t
+ngx_http_lua_socket_write_stream(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_upstream_t *u, u_char *p, size_t size)
+{
+    ngx_int_t                            rc;
+    ngx_buf_t                            buf;
+    ngx_chain_t                         *cl, out;
+    ngx_event_t                         *wev;
+    ngx_buf_tag_t                        tag;
+    ngx_http_lua_ctx_t                  *ctx;
+    ngx_http_core_loc_conf_t            *clcf;
+    ngx_http_lua_socket_tcp_stream_t    *stream;
+
+    stream = u->stream;
+
+    if (stream->discard) {
+        return NGX_OK;
+    }
+
+    if (stream->temp_file) {
+        ngx_memzero(&buf, sizeof(ngx_buf_t));
+
+        buf.pos = p;
+        buf.last = p + size;
+        buf.memory = 1;
+
+        out.buf = &buf;
+        out.next = NULL;
+
+        if (ngx_write_chain_to_temp_file(stream->temp_file, &out)
+            == NGX_ERROR)
+        {
+            u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_ERROR;
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+    /* the data is copied because the receive buffer is reused right away,
+     * while the output filters may hold the buffers sent for a while */
+
+    tag = (ngx_buf_tag_t) stream;
+
+    cl = ngx_http_lua_chains_get_free_buf(r->connection->log, r->pool,
+                                          &stream->free_bufs, size, tag);
+    if (cl == NULL) {
+        u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_NOMEM;
+        return NGX_ERROR;
+    }
+
+    cl->buf->last = ngx_copy(cl->buf->last, p, size);
+
+    /* do not let the write filter wait for postpone_output */
+    cl->buf->flush = 1;
+
+    rc = ngx_http_lua_send_chain_link(r, ctx, cl);
+
+    if (rc == NGX_ERROR || rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_ERROR;
+        return NGX_ERROR;
+    }
+
+    if (!ctx->out) {
+#if nginx_version >= 1001004
+        ngx_chain_update_chains(r->pool,
+#else
+        ngx_chain_update_chains(
+#endif
+                                &stream->free_bufs, &stream->busy_bufs, &cl,
+                                tag);
+    }
+
+    if (!r->connection->buffered) {
+        return NGX_OK;
+    }
+
+    /* stop reading until the downstream has taken the data, which
+     * keeps the memory used constant for slow clients */
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua tcp socket stream paused: buffered 0x%uxd",
+                   (int) r->connection->buffered);
+
+    stream->paused = 1;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    wev = r->connection->write;
+
+    if (!wev->delayed) {
+        ngx_add_timer(wev, clcf->send_timeout);
+    }
+
+    if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+        u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_ERROR;
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_lua_socket_update_digests(ngx_http_lua_socket_tcp_stream_t *stream,
+    u_char *p, size_t size)
+{
+    ngx_uint_t       i;
+
+    for (i = 0; i < NGX_HTTP_LUA_DIGEST_TYPES; i++) {
+        if (stream->digests[i]) {
+            ngx_http_lua_digest_update(stream->digests[i], p, size);
+        }
+    }
+}
+
+
+static int
+ngx_http_lua_socket_tcp_proxy(lua_State *L)
+{
+    ngx_http_request_t                  *r;
+    ngx_http_lua_ctx_t                  *ctx;
+    ngx_int_t                            rc;
+    int                                  n;
+    ngx_flag_t                           splice;
+    const char                          *msg;
+    ngx_http_lua_socket_tcp_proxy_t     *p;
+    ngx_http_lua_socket_tcp_stream_t    *stream;
+    ngx_http_lua_socket_tcp_upstream_t  *u, *down;
+#if (NGX_HTTP_LUA_HAVE_SPLICE)
+    ngx_pool_cleanup_t                  *cln;
+#endif
+
+    n = lua_gettop(L);
+    if (n != 2 && n != 3) {
+        return luaL_error(L, "expecting 2 or 3 arguments, but got %d", n);
+    }
+
+    lua_pushlightuserdata(L, &ngx_http_lua_request_key);
+    lua_rawget(L, LUA_GLOBALSINDEX);
+    r = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (r == NULL) {
+        return luaL_error(L, "no request found");
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (ctx == NULL) {
+        return luaL_error(L, "no ctx found");
+    }
+
+    ngx_http_lua_check_context(L, ctx, NGX_HTTP_LUA_CONTEXT_REWRITE
+                               | NGX_HTTP_LUA_CONTEXT_ACCESS
+                               | NGX_HTTP_LUA_CONTEXT_CONTENT);
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    splice = 1;
+
+    if (n == 3) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+
+        lua_getfield(L, 3, "splice");
+
+        if (!lua_isnil(L, -1)) {
+            if (lua_type(L, -1) != LUA_TBOOLEAN) {
+                msg = lua_pushfstring(L, "bad \"splice\" option type: %s",
+                                      luaL_typename(L, -1));
+                return luaL_argerror(L, 3, msg);
+            }
+
+            splice = lua_toboolean(L, -1);
+        }
+
+        lua_pop(L, 1);
+    }
+
+    if (ctx->eof) {
+        return luaL_error(L, "seen eof already");
+    }
+
+    lua_rawgeti(L, 1, SOCKET_CTX_INDEX);
+    down = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    lua_rawgeti(L, 2, SOCKET_CTX_INDEX);
+    u = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (down == NULL || !down->is_downstream) {
+        return luaL_argerror(L, 1, "request socket expected");
+    }
+
+    if (u == NULL || u->is_downstream) {
+        return luaL_argerror(L, 2, "cosocket expected");
+    }
+
+    if (down->peer.connection == NULL || down->ft_type || down->eof
+        || u->peer.connection == NULL || u->ft_type || u->eof)
+    {
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (down->waiting || u->waiting) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "socket busy");
+        return 2;
+    }
+
+    p = ngx_pcalloc(r->pool, sizeof(ngx_http_lua_socket_tcp_proxy_t));
+    if (p == NULL) {
+        return luaL_error(L, "out of memory");
+    }
+
+    p->downstream = down;
+    p->upstream = u;
+
+#if (NGX_HTTP_LUA_HAVE_SPLICE)
+
+#if (NGX_HTTP_SSL)
+    if (r->connection->ssl) {
+        splice = 0;
+    }
+#endif
+
+    if (splice) {
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (cln == NULL) {
+            return luaL_error(L, "out of memory");
+        }
+
+        if (pipe(p->pipe) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                          "pipe() failed");
+            return luaL_error(L, "pipe() failed");
+        }
+
+        cln->handler = ngx_http_lua_socket_proxy_cleanup;
+        cln->data = p;
+
+        if (ngx_nonblocking(p->pipe[0]) == -1
+            || ngx_nonblocking(p->pipe[1]) == -1)
+        {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                          ngx_nonblocking_n " failed");
+            return luaL_error(L, ngx_nonblocking_n " failed");
+        }
+
+        p->splice = 1;
+    }
+
+#endif
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua tcp socket proxy, splice: %d", (int) p->splice);
+
+    /* the upstream data goes to the output like with receiveto() */
+
+    stream = u->stream;
+
+    if (stream == NULL) {
+        stream = ngx_pcalloc(r->pool, sizeof(ngx_http_lua_socket_tcp_stream_t));
+        if (stream == NULL) {
+            return luaL_error(L, "out of memory");
+        }
+
+        u->stream = stream;
+    }
+
+    /* nothing is left over from an earlier receiveto() */
+
+    stream->temp_file = NULL;
+    stream->received = 0;
+    stream->paused = 0;
+    stream->discard = 0;
+
+    ngx_memzero(stream->digests, sizeof(stream->digests));
+
+    u->input_filter = ngx_http_lua_socket_read_stream;
+    u->input_filter_ctx = u;
+    u->length = 0;
+    u->rest = 0;
+
+    if (u->bufs_in == NULL) {
+        u->bufs_in = ngx_http_lua_socket_get_recv_buf(r->connection->log,
+                                                      u->conf->buffer_size);
+        if (u->bufs_in == NULL) {
+            return luaL_error(L, "out of memory");
+        }
+
+        u->buf_in = u->bufs_in;
+        u->buffer = *u->buf_in->buf;
+    }
+
+    /* the request body data goes through the request socket's buffer,
+     * after the data it has received but not returned yet */
+
+    if (down->bufs_in == NULL) {
+        down->bufs_in = ngx_http_lua_socket_get_recv_buf(r->connection->log,
+                                                     down->conf->buffer_size);
+        if (down->bufs_in == NULL) {
+            return luaL_error(L, "out of memory");
+        }
+
+        down->buf_in = down->bufs_in;
+        down->buffer = *down->buf_in->buf;
+    }
+
+    u->proxy = p;
+
+    rc = ngx_http_lua_socket_proxy_pump(r, p);
+
+    if (rc == NGX_ERROR) {
+        u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_ERROR;
+        return ngx_http_lua_socket_proxy_retval_handler(r, u, L);
+    }
+
+    u->waiting = 0;
+
+    rc = ngx_http_lua_socket_tcp_read(r, u);
+
+    if (rc == NGX_ERROR || rc == NGX_OK) {
+        return ngx_http_lua_socket_proxy_retval_handler(r, u, L);
+    }
+
+    /* rc == NGX_AGAIN */
+
+    /* the request socket's read events come here too because they are
+     * dispatched to the socket in ctx->data */
+
+    u->read_event_handler = ngx_http_lua_socket_proxy_handler;
+    u->write_event_handler = ngx_http_lua_socket_proxy_handler;
+
+    if (ctx->entered_content_phase) {
+        r->write_event_handler = ngx_http_lua_content_wev_handler;
+    }
+
+    u->waiting = 1;
+    u->prepare_retvals = ngx_http_lua_socket_proxy_retval_handler;
+
+    ctx->data = u;
+    ctx->socket_busy = 1;
+    ctx->socket_ready = 0;
+
+    return lua_yield(L, 0);
+}
+
+
+static void
+ngx_http_lua_socket_proxy_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_upstream_t *u)
+{
+    ngx_connection_t                    *c, *uc;
+    ngx_http_lua_socket_tcp_proxy_t     *p;
+
+    c = r->connection;
+    uc = u->peer.connection;
+    p = u->proxy;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "lua tcp socket proxy handler");
+
+    if (uc->read->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "lua tcp socket read timed out");
+
+        ngx_http_lua_socket_handle_error(r, u, NGX_HTTP_LUA_SOCKET_FT_TIMEOUT);
+        return;
+    }
+
+    if (uc->write->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "lua tcp socket write timed out");
+
+        ngx_http_lua_socket_handle_error(r, u, NGX_HTTP_LUA_SOCKET_FT_TIMEOUT);
+        return;
+    }
+
+    if (c->read->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "lua tcp socket proxy client read timed out");
+
+        ngx_http_lua_socket_handle_error(r, u, NGX_HTTP_LUA_SOCKET_FT_TIMEOUT);
+        return;
+    }
+
+    if (!p->body_done) {
+        if (ngx_http_lua_socket_proxy_pump(r, p) == NGX_ERROR) {
+            ngx_http_lua_socket_handle_error(r, u,
+                                             NGX_HTTP_LUA_SOCKET_FT_ERROR);
+            return;
+        }
+    }
+
+    if (uc->read->timer_set) {
+        ngx_del_timer(uc->read);
+    }
+
+    (void) ngx_http_lua_socket_tcp_read(r, u);
+}
+
+
+/*
+ * sends the request body to the upstream as it arrives, in a buffer of
+ * lua_socket_buffer_size, or through a pipe by splice(2) where possible,
+ * so the body data is never copied into the user space.
+ */
+
+static ngx_int_t
+ngx_http_lua_socket_proxy_pump(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_proxy_t *p)
+{
+    ssize_t                              n;
+    size_t                               size;
+    ngx_buf_t                           *b;
+    ngx_connection_t                    *c, *uc;
+    ngx_http_request_body_t             *rb;
+    ngx_http_lua_socket_tcp_upstream_t  *u;
+
+    c = r->connection;
+    rb = r->request_body;
+    u = p->upstream;
+    uc = u->peer.connection;
+    b = &p->downstream->buffer;
+
+    for ( ;; ) {
+
+        if (b->pos < b->last) {
+            n = uc->send(uc, b->pos, b->last - b->pos);
+
+            if (n == NGX_ERROR) {
+                u->socket_errno = ngx_socket_errno;
+                return NGX_ERROR;
+            }
+
+            if (n == NGX_AGAIN || n == 0) {
+                goto wait_upstream;
+            }
+
+            b->pos += n;
+            p->sent += n;
+
+            if (uc->write->timer_set) {
+                ngx_del_timer(uc->write);
+            }
+
+            continue;
+        }
+
+        b->pos = b->start;
+        b->last = b->start;
+
+#if (NGX_HTTP_LUA_HAVE_SPLICE)
+        if (p->piped) {
+            n = splice(p->pipe[0], NULL, uc->fd, NULL, p->piped,
+                       SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            if (n == -1) {
+                if (ngx_errno == NGX_EAGAIN) {
+                    uc->write->ready = 0;
+                    goto wait_upstream;
+                }
+
+                u->socket_errno = ngx_errno;
+                return NGX_ERROR;
+            }
+
+            p->piped -= n;
+            p->sent += n;
+
+            if (uc->write->timer_set) {
+                ngx_del_timer(uc->write);
+            }
+
+            continue;
+        }
+#endif
+
+        if (rb->rest == 0) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                           "lua tcp socket proxy sent the request body: %O",
+                           p->sent);
+
+            p->body_done = 1;
+
+            if (c->read->timer_set) {
+                ngx_del_timer(c->read);
+            }
+
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            return NGX_OK;
+        }
+
+        size = r->header_in->last - r->header_in->pos;
+
+        if (size) {
+            /* the body data read together with the request header */
+
+            if ((off_t) size > rb->rest) {
+                size = (size_t) rb->rest;
+            }
+
+            if (size > (size_t) (b->end - b->last)) {
+                size = b->end - b->last;
+            }
+
+            b->last = ngx_copy(b->last, r->header_in->pos, size);
+
+            r->header_in->pos += size;
+            r->request_length += size;
+            rb->rest -= size;
+
+            continue;
+        }
+
+        if (c->read->active && !c->read->ready) {
+            goto wait_downstream;
+        }
+
+        size = b->end - b->last;
+
+        if ((off_t) size > rb->rest) {
+            size = (size_t) rb->rest;
+        }
+
+#if (NGX_HTTP_LUA_HAVE_SPLICE)
+        if (p->splice) {
+            n = splice(c->fd, NULL, p->pipe[1], NULL, size,
+                       SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            if (n == -1) {
+                if (ngx_errno == NGX_EAGAIN) {
+                    c->read->ready = 0;
+                    goto wait_downstream;
+                }
+
+                u->socket_errno = ngx_errno;
+                return NGX_ERROR;
+            }
+
+            if (n == 0) {
+                u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_CLOSED;
+                return NGX_ERROR;
+            }
+
+            p->piped = n;
+
+            r->request_length += n;
+            rb->rest -= n;
+
+            if (c->read->timer_set) {
+                ngx_del_timer(c->read);
+            }
+
+            continue;
+        }
+#endif
+
+        n = c->recv(c, b->last, size);
+
+        if (n == NGX_AGAIN) {
+            goto wait_downstream;
+        }
+
+        if (n == NGX_ERROR) {
+            u->socket_errno = ngx_socket_errno;
+            return NGX_ERROR;
+        }
+
+        if (n == 0) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                           "lua tcp socket proxy client closed prematurely");
+
+            u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_CLOSED;
+            return NGX_ERROR;
+        }
+
+        b->last += n;
+
+        r->request_length += n;
+        rb->rest -= n;
+
+        if (c->read->timer_set) {
+            ngx_del_timer(c->read);
+        }
+    }
+
+wait_upstream:
+
+    if (ngx_handle_write_event(uc->write, 0) != NGX_OK
+        || ngx_handle_read_event(c->read, 0) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_add_timer(uc->write, u->send_timeout);
+
+    return NGX_AGAIN;
+
+wait_downstream:
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK
+        || ngx_handle_write_event(uc->write, 0) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_add_timer(c->read, p->downstream->read_timeout);
+
+    return NGX_AGAIN;
+}
+
+
+static int
+ngx_http_lua_socket_proxy_retval_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_upstream_t *u, lua_State *L)
+{
+    ngx_connection_t                    *c;
+    ngx_http_lua_socket_tcp_proxy_t     *p;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua tcp socket proxy return value handler");
+
+    p = u->proxy;
+    u->proxy = NULL;
+
+    u->stream->paused = 0;
+
+    c = r->connection;
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    if (u->ft_type) {
+        return ngx_http_lua_socket_error_retval_handler(r, u, L);
+    }
+
+    if (u->peer.connection->write->timer_set) {
+        ngx_del_timer(u->peer.connection->write);
+    }
+
+    u->buf_in->buf->pos = u->buffer.pos;
+    u->buf_in->buf->last = u->buffer.pos;
+
+    lua_pushnumber(L, (lua_Number) p->sent);
+    lua_pushnumber(L, (lua_Number) u->stream->received);
+    return 2;
+}
+
+
+#if (NGX_HTTP_LUA_HAVE_SPLICE)
+
+static void
+ngx_http_lua_socket_proxy_cleanup(void *data)
+{
+    ngx_http_lua_socket_tcp_proxy_t     *p = data;
+
+    if (close(p->pipe[0]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "close() pipe failed");
+    }
+
+    if (close(p->pipe[1]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "close() pipe failed");
+    }
+}
+
+#endif
+
+
+static int
+ngx_http_lua_socket_tcp_send(lua_State *L)
+{
+    ngx_int_t                            rc;
+    ngx_http_request_t                  *r;
+    u_char                              *p;
+    size_t                               len;
+    ngx_http_core_loc_conf_t            *clcf;
+    ngx_chain_t                         *cl;
+    ngx_http_lua_ctx_t                  *ctx;
+    ngx_http_lua_socket_tcp_upstream_t  *u;
+    int                                  type;
+    const char                          *msg;
+    ngx_buf_t                           *b;
+    unsigned                             zerocopy;
+
+    /* TODO: add support for the optional "i" and "j" arguments */
+
+    if (lua_gettop(L) != 2) {
+        return luaL_error(L, "expecting 2 arguments (including the object), "
+                          "but got %d", lua_gettop(L));
+    }
+
+    lua_pushlightuserdata(L, &ngx_http_lua_request_key);
+    lua_rawget(L, LUA_GLOBALSINDEX);
+    r = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    lua_rawgeti(L, 1, SOCKET_CTX_INDEX);
+    u = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (u == NULL || u->peer.connection == NULL || u->ft_type || u->eof) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "attempt to send data on a closed socket: u:%p, c:%p, "
+                      "ft:%ui eof:%ud",
+                      u, u ? u->peer.connection : NULL, u ? u->ft_type : 0,
+                      u ? u->eof : 0);
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (u->waiting) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "socket busy");
+        return 2;
+    }
+
+    if (u->is_downstream) {
+        return luaL_error(L, "attempt to write to request sockets");
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua tcp socket send timeout: %M", u->send_timeout);
+
+    type = lua_type(L, 2);
+    switch (type) {
+        case LUA_TNUMBER:
+        case LUA_TSTRING:
+            lua_tolstring(L, 2, &len);
+            break;
+
+        case LUA_TTABLE:
+            len = ngx_http_lua_calc_strlen_in_table(L, 2, 2, 1 /* strict */);
+            break;
+
+        default:
+            msg = lua_pushfstring(L, "string, number, boolean, nil, "
+                    "or array table expected, got %s",
+                    lua_typename(L, type));
+
+            return luaL_argerror(L, 2, msg);
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+    zerocopy = (type != LUA_TNUMBER && len >= NGX_HTTP_LUA_SOCKET_ZEROCOPY_MIN);
+
+    if (zerocopy) {
+        cl = ngx_http_lua_socket_tcp_send_chain(r, ctx, L);
+
+        if (cl == NULL) {
+            return luaL_error(L, "out of memory");
+        }
+
+        goto send;
+    }
+
+    cl = ngx_http_lua_chains_get_free_buf(r->connection->log, r->pool,
+                                          &ctx->free_bufs, len,
+                                          (ngx_buf_tag_t)
+                                          &ngx_http_lua_module);
+
+    if (cl == NULL) {
+        return luaL_error(L, "out of memory");
+    }
+
+    b = cl->buf;
+
+    switch (type) {
+        case LUA_TNUMBER:
+        case LUA_TSTRING:
+            p = (u_char *) lua_tolstring(L, -1, &len);
+            b->last = ngx_copy(b->last, (u_char *) p, len);
+            break;
+
+        case LUA_TTABLE:
+            b->last = ngx_http_lua_copy_str_in_table(L, -1, b->last);
+            break;
+
+        default:
+            return luaL_error(L, "impossible to reach here");
+    }
+
+    lua_pushnil(L);
+
+send:
+
+    /*
+     * the table of the Lua strings that the buffers point to is referenced
+     * by the socket object until the next send() call
+     */
+
+    lua_rawseti(L, 1, SOCKET_SEND_DATA_INDEX);
+
+    u->request_bufs = cl;
+
+    u->request_len = len;
     u->request_sent = 0;
     u->ft_type = 0;
 
@@ -1567,37 +3451,213 @@ ngx_http_lua_socket_tcp_send(lua_State *L)
         u->writer.pool = r->pool;
     }
 
-#if 1
-    u->waiting = 0;
-#endif
+#if 1
+    u->waiting = 0;
+#endif
+
+    rc = ngx_http_lua_socket_send(r, u);
+
+    dd("socket send returned %d", (int) rc);
+
+    if (rc == NGX_ERROR) {
+        return ngx_http_lua_socket_error_retval_handler(r, u, L);
+    }
+
+    if (rc == NGX_OK) {
+        lua_pushinteger(L, len);
+        return 1;
+    }
+
+    /* rc == NGX_AGAIN */
+
+    if (ctx->entered_content_phase) {
+        r->write_event_handler = ngx_http_lua_content_wev_handler;
+    }
+
+    u->waiting = 1;
+    u->prepare_retvals = ngx_http_lua_socket_tcp_send_retval_handler;
+
+    ctx->data = u;
+    ctx->socket_busy = 1;
+    ctx->socket_ready = 0;
+
+    return lua_yield(L, 0);
+}
+
+
+/*
+ * turns the string or (nested) table of fragments at the top of the stack
+ * into a chain of buffers. fragments of at least
+ * NGX_HTTP_LUA_SOCKET_ZEROCOPY_MIN bytes are not copied: their buffers
+ * point straight into the Lua strings, which are collected into a new
+ * table left on the top of the stack for the caller to keep referenced
+ * until they have been sent, because the tables holding them may change
+ * meanwhile. smaller fragments and numbers are copied into a single
+ * buffer of "small" bytes in total
+ */
+
+static ngx_chain_t *
+ngx_http_lua_socket_tcp_send_chain(ngx_http_request_t *r,
+    ngx_http_lua_ctx_t *ctx, lua_State *L)
+{
+    int                               index;
+    ngx_chain_t                      *out;
+    ngx_http_lua_socket_tcp_bufs_t    bufs;
+
+    ngx_memzero(&bufs, sizeof(ngx_http_lua_socket_tcp_bufs_t));
+
+    bufs.request = r;
+    bufs.ctx = ctx;
+
+    index = lua_gettop(L);
+
+    /* the first pass only measures the fragments to copy */
+
+    (void) ngx_http_lua_socket_tcp_add_bufs(L, index, &bufs);
+
+    if (bufs.small) {
+        bufs.copy = ngx_http_lua_chains_get_free_buf(r->connection->log,
+                                                     r->pool,
+                                                     &ctx->free_bufs,
+                                                     bufs.small,
+                                                     (ngx_buf_tag_t)
+                                                     &ngx_http_lua_module);
+        if (bufs.copy == NULL) {
+            return NULL;
+        }
+
+        bufs.pos = bufs.copy->buf->start;
+    }
+
+    out = NULL;
+    bufs.last = &out;
+
+    lua_newtable(L);
+    bufs.anchors = lua_gettop(L);
+
+    if (ngx_http_lua_socket_tcp_add_bufs(L, index, &bufs) != NGX_OK) {
+        return NULL;
+    }
+
+    return out;
+}
+
+
+static ngx_int_t
+ngx_http_lua_socket_tcp_add_bufs(lua_State *L, int index,
+    ngx_http_lua_socket_tcp_bufs_t *bufs)
+{
+    int           i, n;
+    u_char       *p;
+    size_t        len;
+    unsigned      copy;
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    if (index < 0) {
+        index = lua_gettop(L) + index + 1;
+    }
+
+    if (lua_type(L, index) == LUA_TTABLE) {
+        /* the table has been validated by ngx_http_lua_calc_strlen_in_table */
+
+        n = lua_objlen(L, index);
+
+        for (i = 1; i <= n; i++) {
+            lua_rawgeti(L, index, i);
+
+            if (ngx_http_lua_socket_tcp_add_bufs(L, -1, bufs) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            lua_pop(L, 1);
+        }
+
+        return NGX_OK;
+    }
+
+    p = (u_char *) lua_tolstring(L, index, &len);
+
+    if (len == 0) {
+        return NGX_OK;
+    }
+
+    /* numbers are converted on the stack only, so they are always copied */
+
+    copy = (lua_type(L, index) != LUA_TSTRING
+            || len < NGX_HTTP_LUA_SOCKET_ZEROCOPY_MIN);
+
+    if (bufs->last == NULL) {
+        /* measuring */
+
+        if (copy) {
+            bufs->small += len;
+        }
+
+        return NGX_OK;
+    }
+
+    if (copy) {
 
-    rc = ngx_http_lua_socket_send(r, u);
+        if (bufs->run == NULL) {
 
-    dd("socket send returned %d", (int) rc);
+            if (!bufs->copy_linked) {
+                cl = bufs->copy;
+                bufs->copy_linked = 1;
 
-    if (rc == NGX_ERROR) {
-        return ngx_http_lua_socket_error_retval_handler(r, u, L);
-    }
+            } else {
+                cl = ngx_http_lua_chains_get_free_buf(
+                         bufs->request->connection->log,
+                         bufs->request->pool, &bufs->ctx->free_bufs, 0,
+                         (ngx_buf_tag_t) &ngx_http_lua_module);
+                if (cl == NULL) {
+                    return NGX_ERROR;
+                }
+            }
 
-    if (rc == NGX_OK) {
-        lua_pushinteger(L, len);
-        return 1;
+            bufs->run = cl->buf;
+            bufs->run->pos = bufs->pos;
+            bufs->run->last = bufs->pos;
+
+            *bufs->last = cl;
+            bufs->last = &cl->next;
+        }
+
+        bufs->run->last = ngx_cpymem(bufs->run->last, p, len);
+        bufs->pos = bufs->run->last;
+
+        return NGX_OK;
     }
 
-    /* rc == NGX_AGAIN */
+    /*
+     * the buffer keeps its own memory between start and end, which
+     * ngx_chain_update_chains() and ngx_http_lua_chains_get_free_buf()
+     * recycle, so the Lua string is never written to
+     */
 
-    if (ctx->entered_content_phase) {
-        r->write_event_handler = ngx_http_lua_content_wev_handler;
+    cl = ngx_http_lua_chains_get_free_buf(bufs->request->connection->log,
+                                          bufs->request->pool,
+                                          &bufs->ctx->free_bufs, 0,
+                                          (ngx_buf_tag_t)
+                                          &ngx_http_lua_module);
+    if (cl == NULL) {
+        return NGX_ERROR;
     }
 
-    u->waiting = 1;
-    u->prepare_retvals = ngx_http_lua_socket_tcp_send_retval_handler;
+    b = cl->buf;
 
-    ctx->data = u;
-    ctx->socket_busy = 1;
-    ctx->socket_ready = 0;
+    b->pos = p;
+    b->last = p + len;
 
-    return lua_yield(L, 0);
+    lua_pushvalue(L, index);
+    lua_rawseti(L, bufs->anchors, ++bufs->nanchors);
+
+    *bufs->last = cl;
+    bufs->last = &cl->next;
+
+    bufs->run = NULL;
+
+    return NGX_OK;
 }
 
 
@@ -1635,7 +3695,7 @@ ngx_http_lua_socket_tcp_receive_retval_handler(ngx_http_request_t *r,
         dd("u->bufs_in: %p", u->bufs_in);
 
         if (u->bufs_in) {
-            rc = ngx_http_lua_socket_push_input_data(r, ctx, u, L);
+            rc = ngx_http_lua_socket_push_input_data(r, ctx, u, NULL, L);
             if (rc == NGX_ERROR) {
                 lua_pushnil(L);
                 lua_pushliteral(L, "out of memory");
@@ -1654,17 +3714,106 @@ ngx_http_lua_socket_tcp_receive_retval_handler(ngx_http_request_t *r,
         return n + 1;
     }
 
-    rc = ngx_http_lua_socket_push_input_data(r, ctx, u, L);
+    rc = ngx_http_lua_socket_push_input_data(r, ctx, u, NULL, L);
+    if (rc == NGX_ERROR) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "out of memory");
+        return 2;
+    }
+
+    return 1;
+}
+
+static int
+ngx_http_lua_socket_tcp_receivemany_retval_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_upstream_t *u, lua_State *L)
+{
+    ngx_int_t                    rc;
+    ngx_http_lua_ctx_t          *ctx;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua tcp socket receivemany return value handler");
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+    /* the items received completely so far */
+
+    rc = ngx_http_lua_socket_push_input_data(r, ctx, u, u->many, L);
     if (rc == NGX_ERROR) {
         lua_pushnil(L);
         lua_pushliteral(L, "out of memory");
         return 2;
     }
 
+    if (u->ft_type) {
+        (void) ngx_http_lua_socket_error_retval_handler(r, u, L);
+
+        lua_pushvalue(L, -3);
+        lua_remove(L, -4);
+        return 3;
+    }
+
     return 1;
 }
 
 
+static int
+ngx_http_lua_socket_tcp_receiveto_retval_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_upstream_t *u, lua_State *L)
+{
+    int                                  n;
+    ngx_uint_t                           i;
+    ngx_http_lua_socket_tcp_stream_t    *stream;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua tcp socket receiveto return value handler");
+
+    stream = u->stream;
+    stream->paused = 0;
+
+    if (u->ft_type) {
+        n = ngx_http_lua_socket_error_retval_handler(r, u, L);
+        lua_pushnumber(L, (lua_Number) stream->received);
+        return n + 1;
+    }
+
+    /* leave the data following the bytes wanted to the next reads */
+
+    u->buf_in->buf->pos = u->buffer.pos;
+    u->buf_in->buf->last = u->buffer.pos;
+
+    lua_pushnumber(L, (lua_Number) stream->received);
+    n = 1;
+
+    if (stream->temp_file) {
+        lua_pushlstring(L, (char *) stream->temp_file->file.name.data,
+                        stream->temp_file->file.name.len);
+        n++;
+    }
+
+    for (i = 0; i < NGX_HTTP_LUA_DIGEST_TYPES; i++) {
+        if (stream->digests[i]) {
+            break;
+        }
+    }
+
+    if (i == NGX_HTTP_LUA_DIGEST_TYPES) {
+        return n;
+    }
+
+    lua_createtable(L, 0 /* narr */, NGX_HTTP_LUA_DIGEST_TYPES /* nrec */);
+
+    for ( /* void */ ; i < NGX_HTTP_LUA_DIGEST_TYPES; i++) {
+        if (stream->digests[i]) {
+            ngx_http_lua_digest_final(L, stream->digests[i]);
+            lua_setfield(L, -2, ngx_http_lua_socket_digest_names[i]);
+        }
+    }
+
+    return n + 1;
+}
+
+
 static int
 ngx_http_lua_socket_tcp_close(lua_State *L)
 {
@@ -1715,8 +3864,145 @@ ngx_http_lua_socket_tcp_close(lua_State *L)
 static int
 ngx_http_lua_socket_tcp_setoption(lua_State *L)
 {
-    /* TODO */
-    return 0;
+    ngx_http_request_t          *r;
+    ngx_str_t                    name;
+    ngx_uint_t                   i;
+    int                          value;
+    const char                  *msg;
+    u_char                       errstr[NGX_MAX_ERROR_STR];
+    u_char                      *p;
+
+    ngx_http_lua_socket_tcp_option_t    *opt;
+    ngx_http_lua_socket_tcp_upstream_t  *u;
+
+    if (lua_gettop(L) != 3) {
+        return luaL_error(L, "expecting 3 arguments "
+                          "(including the object) but seen %d", lua_gettop(L));
+    }
+
+    lua_pushlightuserdata(L, &ngx_http_lua_request_key);
+    lua_rawget(L, LUA_GLOBALSINDEX);
+    r = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (r == NULL) {
+        return luaL_error(L, "no request found");
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    name.data = (u_char *) luaL_checklstring(L, 2, &name.len);
+
+    for (i = 0; ngx_http_lua_socket_tcp_options[i].name.len; i++) {
+        opt = &ngx_http_lua_socket_tcp_options[i];
+
+        if (name.len == opt->name.len
+            && ngx_strncmp(name.data, opt->name.data, name.len) == 0)
+        {
+            break;
+        }
+    }
+
+    if (ngx_http_lua_socket_tcp_options[i].name.len == 0) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "unsupported option: %s", (char *) name.data);
+        return 2;
+    }
+
+    msg = ngx_http_lua_socket_tcp_sockopt_value(L, 3, i, &value);
+    if (msg) {
+        return luaL_argerror(L, 3, msg);
+    }
+
+    lua_rawgeti(L, 1, SOCKET_CTX_INDEX);
+    u = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (u == NULL || u->peer.connection == NULL || u->ft_type || u->eof) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (ngx_http_lua_socket_tcp_set_sockopt(u->peer.connection, i, value)
+        != NGX_OK)
+    {
+#if (nginx_version >= 1000000)
+        p = ngx_strerror(ngx_socket_errno, errstr, sizeof(errstr));
+#else
+        p = ngx_strerror_r(ngx_socket_errno, errstr, sizeof(errstr));
+#endif
+        ngx_strlow(errstr, errstr, p - errstr);
+
+        lua_pushnil(L);
+        lua_pushlstring(L, (char *) errstr, p - errstr);
+        return 2;
+    }
+
+    lua_pushinteger(L, 1);
+    return 1;
+}
+
+
+/* checks the option value at the index and converts it to a C int */
+
+static const char *
+ngx_http_lua_socket_tcp_sockopt_value(lua_State *L, int index, ngx_uint_t opt,
+    int *value)
+{
+    lua_Number                          n;
+    ngx_http_lua_socket_tcp_option_t   *o;
+
+    o = &ngx_http_lua_socket_tcp_options[opt];
+
+    if (o->flag) {
+        if (lua_type(L, index) != LUA_TBOOLEAN) {
+            return lua_pushfstring(L, "bad \"%s\" option type: %s",
+                                   (char *) o->name.data,
+                                   luaL_typename(L, index));
+        }
+
+        *value = lua_toboolean(L, index);
+        return NULL;
+    }
+
+    if (lua_type(L, index) != LUA_TNUMBER) {
+        return lua_pushfstring(L, "bad \"%s\" option type: %s",
+                               (char *) o->name.data, luaL_typename(L, index));
+    }
+
+    n = lua_tonumber(L, index);
+
+    if (n <= 0 || n > NGX_MAX_INT32_VALUE) {
+        return lua_pushfstring(L, "bad \"%s\" option value: %f",
+                               (char *) o->name.data, n);
+    }
+
+    *value = (int) n;
+    return NULL;
+}
+
+
+static ngx_int_t
+ngx_http_lua_socket_tcp_set_sockopt(ngx_connection_t *c, ngx_uint_t opt,
+    int value)
+{
+    ngx_http_lua_socket_tcp_option_t   *o;
+
+    o = &ngx_http_lua_socket_tcp_options[opt];
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "lua tcp socket set option \"%V\" to %d: fd:%d",
+                   &o->name, value, (int) c->fd);
+
+    if (setsockopt(c->fd, o->level, o->option, (const void *) &value,
+                   sizeof(int))
+        == -1)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
 }
 
 
@@ -2017,6 +4303,10 @@ ngx_http_lua_socket_connected_handler(ngx_http_request_t *r,
 
     if (c->write->timedout) {
 
+        if (ngx_http_lua_socket_tcp_connect_next(r, u) == NGX_OK) {
+            goto next;
+        }
+
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
                       "lua tcp socket connect timed out");
 
@@ -2030,6 +4320,10 @@ ngx_http_lua_socket_connected_handler(ngx_http_request_t *r,
 
     rc = ngx_http_lua_socket_test_connect(c);
     if (rc != NGX_OK) {
+        if (ngx_http_lua_socket_tcp_connect_next(r, u) == NGX_OK) {
+            goto next;
+        }
+
         if (rc > 0) {
             u->socket_errno = (ngx_err_t) rc;
         }
@@ -2041,6 +4335,8 @@ ngx_http_lua_socket_connected_handler(ngx_http_request_t *r,
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "lua tcp socket connected");
 
+    ngx_http_lua_socket_addr_connected(u);
+
     /* We should delete the current write/read event
      * here because the socket object may not be used immediately
      * on the Lua land, thus causing hot spin around level triggered
@@ -2056,6 +4352,15 @@ ngx_http_lua_socket_connected_handler(ngx_http_request_t *r,
         return;
     }
 
+    ngx_http_lua_socket_handle_success(r, u);
+    return;
+
+next:
+
+    /* resume the Lua thread to connect to the next address */
+
+    u->prepare_retvals = ngx_http_lua_socket_resolve_retval_handler;
+
     ngx_http_lua_socket_handle_success(r, u);
 }
 
@@ -2081,28 +4386,15 @@ ngx_http_lua_socket_tcp_finalize(ngx_http_request_t *r,
     ngx_http_lua_socket_tcp_upstream_t *u)
 {
     ngx_http_lua_socket_pool_t          *spool;
-    ngx_chain_t                         *cl;
-    ngx_chain_t                        **ll;
-    ngx_http_lua_ctx_t                  *ctx;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "lua finalize socket");
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
-
-    if (ctx && u->bufs_in) {
-
-        ll = &u->bufs_in;
-        for (cl = u->bufs_in; cl; cl = cl->next) {
-            dd("bufs_in chain: %p, next %p", cl, cl->next);
-            cl->buf->pos = cl->buf->last;
-            ll = &cl->next;
-        }
+    if (u->bufs_in) {
+        dd("free recv bufs: %p", u->bufs_in);
 
-        dd("ctx: %p", ctx);
-        dd("free recv bufs: %p", ctx->free_recv_bufs);
-        *ll = ctx->free_recv_bufs;
-        ctx->free_recv_bufs = u->bufs_in;
+        ngx_http_lua_socket_release_recv_bufs(r->connection->log, u->bufs_in,
+                                              u->conf->buffer_size);
         u->bufs_in = NULL;
         u->buf_in = NULL;
         ngx_memzero(&u->buffer, sizeof(ngx_buf_t));
@@ -2119,6 +4411,20 @@ ngx_http_lua_socket_tcp_finalize(ngx_http_request_t *r,
         return;
     }
 
+    if (u->wait_event.timer_set) {
+        ngx_del_timer(&u->wait_event);
+    }
+
+    spool = u->socket_pool;
+
+    if (u->wait_connect) {
+        ngx_queue_remove(&u->wait_queue);
+        spool->nwaiting--;
+
+        u->wait_connect = 0;
+        u->socket_pool = NULL;
+    }
+
     if (u->resolved && u->resolved->ctx) {
         ngx_resolve_name_done(u->resolved->ctx);
         u->resolved->ctx = NULL;
@@ -2134,21 +4440,15 @@ ngx_http_lua_socket_tcp_finalize(ngx_http_request_t *r,
 
         ngx_close_connection(u->peer.connection);
         u->peer.connection = NULL;
+    }
 
-        if (!u->reused) {
-            return;
-        }
-
-        spool = u->socket_pool;
-        if (spool == NULL) {
-            return;
-        }
+    if (u->pooled) {
+        u->pooled = 0;
+        u->socket_pool = NULL;
 
         spool->active_connections--;
 
-        if (spool->active_connections == 0) {
-            ngx_http_lua_socket_free_pool(r->connection->log, spool);
-        }
+        ngx_http_lua_socket_release_pool(r->connection->log, spool);
     }
 }
 
@@ -2375,11 +4675,8 @@ ngx_http_lua_socket_receiveuntil_iterator(lua_State *L)
 
     if (u->bufs_in == NULL) {
         u->bufs_in =
-            ngx_http_lua_chains_get_free_buf(r->connection->log, r->pool,
-                                             &ctx->free_recv_bufs,
-                                             u->conf->buffer_size,
-                                             (ngx_buf_tag_t)
-                                             &ngx_http_lua_module);
+            ngx_http_lua_socket_get_recv_buf(r->connection->log,
+                                             u->conf->buffer_size);
 
         if (u->bufs_in == NULL) {
             return luaL_error(L, "out of memory");
@@ -2534,8 +4831,10 @@ ngx_http_lua_socket_read_until(void *data, ssize_t bytes)
     ngx_http_request_t                      *r;
     ngx_buf_t                               *b;
     u_char                                   c;
+    u_char                                  *p;
     u_char                                  *pat;
     size_t                                   pat_len;
+    size_t                                   n;
     int                                      i;
     int                                      state, old_state;
     ngx_http_lua_dfa_edge_t                 *edge;
@@ -2561,6 +4860,56 @@ ngx_http_lua_socket_read_until(void *data, ssize_t bytes)
 
     i = 0;
     while (i < bytes) {
+
+        if (state == 0) {
+
+            /*
+             * skip the bytes that cannot start a match with memchr(),
+             * which is vectorized by most libc implementations, and
+             * compare the whole pattern at once when it is in the
+             * buffer; the DFA below is only stepped through for
+             * mismatches and for the matches crossing buffer edges
+             */
+
+            n = bytes - i;
+
+            if (u->length && n > u->rest) {
+                n = u->rest;
+            }
+
+            p = memchr(b->pos + i, pat[0], n);
+
+            if (p) {
+                n = p - (b->pos + i);
+            }
+
+            u->buf_in->buf->last += n;
+            i += n;
+
+            if (u->length) {
+                u->rest -= n;
+
+                if (u->rest == 0) {
+                    cp->state = 0;
+                    b->pos += i;
+                    return NGX_OK;
+                }
+            }
+
+            if (p == NULL) {
+                continue;
+            }
+
+            if (pat_len > 1
+                && (size_t) (bytes - i) >= pat_len
+                && ngx_memcmp(p, pat, pat_len - 1) == 0)
+            {
+                /* let the last byte complete the match below */
+                i += pat_len - 1;
+                state = pat_len - 1;
+            }
+        }
+
         c = b->pos[i];
 
         dd("%d: read char %d, state: %d", i, c, state);
@@ -2923,17 +5272,13 @@ ngx_http_lua_socket_tcp_getreusedtimes(lua_State *L)
 
 static int ngx_http_lua_socket_tcp_setkeepalive(lua_State *L)
 {
-    ngx_http_lua_main_conf_t            *lmcf;
     ngx_http_lua_loc_conf_t             *llcf;
     ngx_http_lua_socket_tcp_upstream_t  *u;
     ngx_connection_t                    *c;
     ngx_http_lua_socket_pool_t          *spool;
-    size_t                               size;
     ngx_str_t                            key;
-    ngx_uint_t                           i;
     ngx_queue_t                         *q;
     ngx_peer_connection_t               *pc;
-    u_char                              *p;
     ngx_http_request_t                  *r;
     ngx_msec_t                           timeout;
     ngx_uint_t                           pool_size;
@@ -2941,7 +5286,7 @@ static int ngx_http_lua_socket_tcp_setkeepalive(lua_State *L)
     ngx_int_t                            rc;
     ngx_buf_t                           *b;
 
-    ngx_http_lua_socket_pool_item_t     *items, *item;
+    ngx_http_lua_socket_pool_item_t     *item;
 
     n = lua_gettop(L);
 
@@ -3044,40 +5389,18 @@ static int ngx_http_lua_socket_tcp_setkeepalive(lua_State *L)
             return 2;
         }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "lua tcp socket connection pool size: %ui", pool_size);
-
-        size = sizeof(ngx_http_lua_socket_pool_t) + key.len
-                + sizeof(ngx_http_lua_socket_pool_item_t)
-                * pool_size;
-
-        spool = lua_newuserdata(L, size);
+        spool = ngx_http_lua_socket_create_pool(L, r, &key, pool_size);
         if (spool == NULL) {
             return luaL_error(L, "out of memory");
         }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
-                       "lua tcp socket keepalive create connection pool for key"
-                       " \"%s\"", lua_tostring(L, -2));
-
-        lua_rawset(L, -3);
-
-        lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
-
-        spool->conf = lmcf;
-        spool->active_connections = 0;
-
-        ngx_queue_init(&spool->cache);
-        ngx_queue_init(&spool->free);
-
-        p = ngx_copy(spool->key, key.data, key.len);
-        *p++ = '\0';
-
-        items = (ngx_http_lua_socket_pool_item_t *) p;
+    } else if (n == 3) {
+        pool_size = luaL_checkinteger(L, 3);
 
-        for (i = 0; i < pool_size; i++) {
-            ngx_queue_insert_head(&spool->free, &items[i].queue);
-            items[i].socket_pool = spool;
+        if (pool_size != spool->size) {
+            ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                          "lua tcp socket pool \"%s\" keeps its size %ui, "
+                          "ignoring %ui", spool->key, spool->size, pool_size);
         }
     }
 
@@ -3101,10 +5424,15 @@ static int ngx_http_lua_socket_tcp_setkeepalive(lua_State *L)
     item->connection = c;
     ngx_queue_insert_head(&spool->cache, q);
 
-    if (!u->reused) {
+    if (!u->pooled) {
         spool->active_connections++;
     }
 
+    /* the pool owns the connection from now on */
+
+    u->socket_pool = NULL;
+    u->pooled = 0;
+
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "lua tcp socket clear current socket connection");
 
@@ -3172,6 +5500,10 @@ static int ngx_http_lua_socket_tcp_setkeepalive(lua_State *L)
     ngx_http_lua_socket_tcp_finalize(r, u);
 #endif
 
+    if (spool->nwaiting) {
+        ngx_http_lua_socket_release_pool(r->connection->log, spool);
+    }
+
     lua_pushinteger(L, 1);
     return 1;
 }
@@ -3179,15 +5511,15 @@ static int ngx_http_lua_socket_tcp_setkeepalive(lua_State *L)
 
 static ngx_int_t
 ngx_http_lua_get_keepalive_peer(ngx_http_request_t *r, lua_State *L,
-    int key_index, ngx_http_lua_socket_tcp_upstream_t *u)
+    int key_index, ngx_int_t pool_size, ngx_int_t backlog,
+    ngx_http_lua_socket_tcp_upstream_t *u)
 {
-    ngx_http_lua_socket_pool_item_t     *item;
     ngx_http_lua_socket_pool_t          *spool;
+    ngx_http_lua_loc_conf_t             *llcf;
     ngx_http_cleanup_t                  *cln;
-    ngx_queue_t                         *q;
+    ngx_str_t                            key;
     int                                  top;
     ngx_peer_connection_t               *pc;
-    ngx_connection_t                    *c;
 
     top = lua_gettop(L);
 
@@ -3206,86 +5538,170 @@ ngx_http_lua_get_keepalive_peer(ngx_http_request_t *r, lua_State *L,
     lua_rawget(L, -2);
 
     spool = lua_touserdata(L, -1);
-    if (spool == NULL) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
-                       "lua tcp socket keepalive connection pool not found");
-        lua_settop(L, top);
-        return NGX_DECLINED;
-    }
+    lua_settop(L, top);
 
-    u->socket_pool = spool;
+    if (spool == NULL) {
+        if (pool_size == NGX_CONF_UNSET && backlog == NGX_CONF_UNSET) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                           "lua tcp socket keepalive connection pool "
+                           "not found");
+            return NGX_DECLINED;
+        }
 
-    if (!ngx_queue_empty(&spool->cache)) {
-        q = ngx_queue_head(&spool->cache);
+        if (pool_size == NGX_CONF_UNSET) {
+            llcf = ngx_http_get_module_loc_conf(r, ngx_http_lua_module);
+            pool_size = llcf->pool_size;
+        }
 
-        item = ngx_queue_data(q, ngx_http_lua_socket_pool_item_t, queue);
-        c = item->connection;
+        key.data = (u_char *) lua_tolstring(L, key_index, &key.len);
 
-        ngx_queue_remove(q);
-        ngx_queue_insert_head(&spool->free, q);
+        spool = ngx_http_lua_socket_create_pool(L, r, &key,
+                                                (ngx_uint_t) pool_size);
+        if (spool == NULL) {
+            return NGX_ERROR;
+        }
 
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
-                       "lua tcp socket get keepalive peer: using connection %p,"
-                       " fd:%d", c, c->fd);
+    } else if (pool_size != NGX_CONF_UNSET
+               && (ngx_uint_t) pool_size != spool->size)
+    {
+        ngx_log_error(NGX_LOG_WARN, pc->log, 0,
+                      "lua tcp socket pool \"%s\" keeps its size %ui, "
+                      "ignoring %i", spool->key, spool->size, pool_size);
+    }
 
-        c->idle = 0;
-        c->log = pc->log;
-        c->read->log = pc->log;
-        c->write->log = pc->log;
-        c->data = u;
+    if (backlog != NGX_CONF_UNSET) {
+        spool->max_active = spool->size;
+        spool->backlog = (ngx_uint_t) backlog;
 
-#if 1
-        c->write->handler = ngx_http_lua_socket_tcp_handler;
-        c->read->handler = ngx_http_lua_socket_tcp_handler;
-#endif
+        if (spool->nwaiting) {
+            /* the limits may have just been raised */
+            ngx_http_lua_socket_release_pool(pc->log, spool);
+        }
+    }
 
-        if (c->read->timer_set) {
-            ngx_del_timer(c->read);
+    if (u->cleanup == NULL) {
+        cln = ngx_http_cleanup_add(r, 0);
+        if (cln == NULL) {
+            u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_ERROR;
+            return NGX_ERROR;
         }
 
-        pc->connection = c;
-        pc->cached = 1;
+        cln->handler = ngx_http_lua_socket_tcp_cleanup;
+        cln->data = u;
+        u->cleanup = &cln->handler;
+    }
 
-        u->reused = item->reused + 1;
+    if (!ngx_queue_empty(&spool->cache)) {
+        ngx_http_lua_socket_keepalive_reuse(spool, u);
+        return NGX_OK;
+    }
 
-        u->writer.out = NULL;
-        u->writer.last = &u->writer.out;
-        u->writer.connection = c;
-        u->writer.limit = 0;
-        u->request_sent = 0;
+    if (spool->max_active
+        && spool->active_connections >= spool->max_active)
+    {
+        if (spool->nwaiting >= spool->backlog) {
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                           "lua tcp socket keepalive: too many waiting "
+                           "connect operations (active: %ui, waiting: %ui)",
+                           spool->active_connections, spool->nwaiting);
+            return NGX_BUSY;
+        }
 
-#if 1
-        u->write_event_handler = ngx_http_lua_socket_dummy_handler;
-        u->read_event_handler = ngx_http_lua_socket_dummy_handler;
-#endif
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "lua tcp socket keepalive: connection pool full, "
+                       "queuing connect operation (waiting: %ui)",
+                       spool->nwaiting);
 
-        if (u->cleanup == NULL) {
-            cln = ngx_http_cleanup_add(r, 0);
-            if (cln == NULL) {
-                u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_ERROR;
-                lua_settop(L, top);
-                return NGX_ERROR;
-            }
+        ngx_queue_insert_tail(&spool->wait_connect, &u->wait_queue);
+        spool->nwaiting++;
 
-            cln->handler = ngx_http_lua_socket_tcp_cleanup;
-            cln->data = u;
-            u->cleanup = &cln->handler;
-        }
+        u->socket_pool = spool;
+        u->wait_connect = 1;
 
-        lua_settop(L, top);
+        u->wait_event.handler = ngx_http_lua_socket_tcp_wait_connect_handler;
+        u->wait_event.data = u;
+        u->wait_event.log = pc->log;
 
-        return NGX_OK;
+        ngx_add_timer(&u->wait_event, u->connect_timeout);
+
+        return NGX_AGAIN;
     }
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "lua tcp socket keepalive: connection pool empty");
 
-    lua_settop(L, top);
+    /* the new connection counts against the pool from now on */
+
+    spool->active_connections++;
+
+    u->socket_pool = spool;
+    u->pooled = 1;
 
     return NGX_DECLINED;
 }
 
 
+static void
+ngx_http_lua_socket_keepalive_reuse(ngx_http_lua_socket_pool_t *spool,
+    ngx_http_lua_socket_tcp_upstream_t *u)
+{
+    ngx_http_lua_socket_pool_item_t     *item;
+    ngx_queue_t                         *q;
+    ngx_peer_connection_t               *pc;
+    ngx_connection_t                    *c;
+
+    pc = &u->peer;
+
+    q = ngx_queue_head(&spool->cache);
+
+    item = ngx_queue_data(q, ngx_http_lua_socket_pool_item_t, queue);
+    c = item->connection;
+
+    ngx_queue_remove(q);
+    ngx_queue_insert_head(&spool->free, q);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "lua tcp socket get keepalive peer: using connection %p,"
+                   " fd:%d", c, c->fd);
+
+    c->idle = 0;
+    c->log = pc->log;
+    c->read->log = pc->log;
+    c->write->log = pc->log;
+    c->data = u;
+
+#if 1
+    c->write->handler = ngx_http_lua_socket_tcp_handler;
+    c->read->handler = ngx_http_lua_socket_tcp_handler;
+#endif
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    pc->connection = c;
+    pc->cached = 1;
+
+    u->reused = item->reused + 1;
+
+    /* the idle connection was counted already */
+
+    u->socket_pool = spool;
+    u->pooled = 1;
+
+    u->writer.out = NULL;
+    u->writer.last = &u->writer.out;
+    u->writer.connection = c;
+    u->writer.limit = 0;
+    u->request_sent = 0;
+
+#if 1
+    u->write_event_handler = ngx_http_lua_socket_dummy_handler;
+    u->read_event_handler = ngx_http_lua_socket_dummy_handler;
+#endif
+}
+
+
 static void
 ngx_http_lua_socket_keepalive_dummy_handler(ngx_event_t *ev)
 {
@@ -3358,14 +5774,120 @@ close:
     dd("keepalive: active connections: %u",
             (unsigned) spool->active_connections);
 
-    if (spool->active_connections == 0) {
-        ngx_http_lua_socket_free_pool(ev->log, spool);
-    }
+    ngx_http_lua_socket_release_pool(ev->log, spool);
 
     return NGX_DECLINED;
 }
 
 
+static ngx_http_lua_socket_pool_t *
+ngx_http_lua_socket_create_pool(lua_State *L, ngx_http_request_t *r,
+    ngx_str_t *key, ngx_uint_t pool_size)
+{
+    ngx_http_lua_socket_pool_t          *spool;
+    ngx_http_lua_socket_pool_item_t     *items;
+    ngx_uint_t                           i;
+    size_t                               size;
+    u_char                              *p;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua tcp socket connection pool size: %ui", pool_size);
+
+    size = sizeof(ngx_http_lua_socket_pool_t) + key->len
+            + sizeof(ngx_http_lua_socket_pool_item_t)
+            * pool_size;
+
+    lua_pushlightuserdata(L, &ngx_http_lua_socket_pool_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushlstring(L, (char *) key->data, key->len);
+
+    spool = lua_newuserdata(L, size);
+    if (spool == NULL) {
+        lua_pop(L, 2);
+        return NULL;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua tcp socket keepalive create connection pool for key"
+                   " \"%s\"", lua_tostring(L, -2));
+
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+
+    spool->conf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
+    spool->active_connections = 0;
+    spool->size = pool_size;
+    spool->max_active = 0;
+    spool->backlog = 0;
+    spool->nwaiting = 0;
+
+    ngx_queue_init(&spool->cache);
+    ngx_queue_init(&spool->free);
+    ngx_queue_init(&spool->wait_connect);
+
+    p = ngx_copy(spool->key, key->data, key->len);
+    *p++ = '\0';
+
+    items = (ngx_http_lua_socket_pool_item_t *) p;
+
+    for (i = 0; i < pool_size; i++) {
+        ngx_queue_insert_head(&spool->free, &items[i].queue);
+        items[i].socket_pool = spool;
+    }
+
+    return spool;
+}
+
+
+/* hands idle connections and free slots to the queued connect operations
+ * in FIFO order, and frees the pool once nothing refers to it any more */
+
+static void
+ngx_http_lua_socket_release_pool(ngx_log_t *log,
+    ngx_http_lua_socket_pool_t *spool)
+{
+    ngx_queue_t                         *q;
+
+    ngx_http_lua_socket_tcp_upstream_t  *u;
+
+    while (spool->nwaiting) {
+        q = ngx_queue_head(&spool->wait_connect);
+        u = ngx_queue_data(q, ngx_http_lua_socket_tcp_upstream_t, wait_queue);
+
+        if (!ngx_queue_empty(&spool->cache)) {
+            ngx_http_lua_socket_keepalive_reuse(spool, u);
+
+        } else if (spool->active_connections < spool->max_active) {
+            spool->active_connections++;
+            u->pooled = 1;
+
+        } else {
+            break;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "lua tcp socket keepalive: resuming connect operation "
+                       "for \"%s\"", spool->key);
+
+        ngx_queue_remove(q);
+        spool->nwaiting--;
+        u->wait_connect = 0;
+
+        /* resume it from the event loop rather than from our caller */
+
+        if (u->wait_event.timer_set) {
+            ngx_del_timer(&u->wait_event);
+        }
+
+        ngx_add_timer(&u->wait_event, 0);
+    }
+
+    if (spool->active_connections == 0) {
+        ngx_http_lua_socket_free_pool(log, spool);
+    }
+}
+
+
 static void
 ngx_http_lua_socket_free_pool(ngx_log_t *log, ngx_http_lua_socket_pool_t *spool)
 {
@@ -3449,13 +5971,24 @@ ngx_http_lua_req_socket_cleanup(void *data)
     if (u->peer.connection) {
         u->peer.connection = NULL;
     }
+
+    /* reads that succeed never finalize the request socket */
+
+    if (u->bufs_in) {
+        ngx_http_lua_socket_release_recv_bufs(u->request->connection->log,
+                                              u->bufs_in,
+                                              u->conf->buffer_size);
+        u->bufs_in = NULL;
+        u->buf_in = NULL;
+        ngx_memzero(&u->buffer, sizeof(ngx_buf_t));
+    }
 }
 
 
 static ngx_int_t
 ngx_http_lua_socket_push_input_data(ngx_http_request_t *r,
     ngx_http_lua_ctx_t *ctx, ngx_http_lua_socket_tcp_upstream_t *u,
-    lua_State *L)
+    ngx_http_lua_socket_tcp_many_t *many, lua_State *L)
 {
     ngx_chain_t             *cl;
     ngx_chain_t            **ll;
@@ -3466,7 +5999,7 @@ ngx_http_lua_socket_push_input_data(ngx_http_request_t *r,
     u_char                  *last;
 
     if (!u->bufs_in) {
-        lua_pushliteral(L, "");
+        ngx_http_lua_socket_push_data(L, many, (u_char *) "", 0);
         return NGX_OK;
     }
 
@@ -3490,14 +6023,14 @@ ngx_http_lua_socket_push_input_data(ngx_http_request_t *r,
     dd("size: %d, nbufs: %d", (int) size, (int) nbufs);
 
     if (size == 0) {
-        lua_pushliteral(L, "");
+        ngx_http_lua_socket_push_data(L, many, (u_char *) "", 0);
 
         goto done;
     }
 
     if (nbufs == 1) {
         b = u->buf_in->buf;
-        lua_pushlstring(L, (char *) b->pos, b->last - b->pos);
+        ngx_http_lua_socket_push_data(L, many, b->pos, b->last - b->pos);
 
         dd("copying input data chunk from %p: \"%.*s\"", u->buf_in,
             (int) (b->last - b->pos), b->pos);
@@ -3509,7 +6042,7 @@ ngx_http_lua_socket_push_input_data(ngx_http_request_t *r,
 
     dd("WARN: allocate a big memory: %d", (int) size);
 
-    p = ngx_palloc(r->pool, size);
+    p = ngx_alloc(size, r->connection->log);
     if (p == NULL) {
         return NGX_ERROR;
     }
@@ -3523,16 +6056,17 @@ ngx_http_lua_socket_push_input_data(ngx_http_request_t *r,
             (int) (b->last - b->pos), b->pos);
     }
 
-    lua_pushlstring(L, (char *) p, size);
+    ngx_http_lua_socket_push_data(L, many, p, size);
 
-    ngx_pfree(r->pool, p);
+    ngx_free(p);
 
 done:
     if (nbufs > 1 && ll) {
         dd("recycle buffers: %d", (int) (nbufs - 1));
 
-        *ll = ctx->free_recv_bufs;
-        ctx->free_recv_bufs = u->bufs_in;
+        *ll = NULL;
+        ngx_http_lua_socket_release_recv_bufs(r->connection->log, u->bufs_in,
+                                              u->conf->buffer_size);
         u->bufs_in = u->buf_in;
     }
 
@@ -3549,20 +6083,38 @@ done:
 }
 
 
+/* pushes the string, or the table of the items received by receivemany() */
+
+static void
+ngx_http_lua_socket_push_data(lua_State *L,
+    ngx_http_lua_socket_tcp_many_t *many, u_char *p, size_t size)
+{
+    ngx_uint_t               i;
+
+    if (many == NULL) {
+        lua_pushlstring(L, (char *) p, size);
+        return;
+    }
+
+    lua_createtable(L, many->done, 0);
+
+    for (i = 0; i < many->done; i++) {
+        lua_pushlstring(L, (char *) p, many->items[i].len);
+        lua_rawseti(L, -2, i + 1);
+
+        p += many->items[i].len + many->items[i].skip;
+    }
+}
+
+
 static ngx_int_t
 ngx_http_lua_socket_add_input_buffer(ngx_http_request_t *r,
     ngx_http_lua_socket_tcp_upstream_t *u)
 {
     ngx_chain_t             *cl;
-    ngx_http_lua_ctx_t      *ctx;
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
-
-    cl = ngx_http_lua_chains_get_free_buf(r->connection->log, r->pool,
-                                          &ctx->free_recv_bufs,
-                                          u->conf->buffer_size,
-                                          (ngx_buf_tag_t)
-                                          &ngx_http_lua_module);
+    cl = ngx_http_lua_socket_get_recv_buf(r->connection->log,
+                                          u->conf->buffer_size);
 
     if (cl == NULL) {
         return NGX_ERROR;
@@ -3613,25 +6165,17 @@ static ngx_int_t ngx_http_lua_socket_insert_buffer(ngx_http_request_t *r,
     ngx_http_lua_socket_tcp_upstream_t *u, u_char *pat, size_t prefix)
 {
     ngx_chain_t             *cl, *new_cl, **ll;
-    ngx_http_lua_ctx_t      *ctx;
-    size_t                   size;
     ngx_buf_t               *b;
 
     if (prefix <= u->conf->buffer_size) {
-        size = u->conf->buffer_size;
+        new_cl = ngx_http_lua_socket_get_recv_buf(r->connection->log,
+                                                  u->conf->buffer_size);
 
     } else {
-        size = prefix;
+        new_cl = ngx_http_lua_socket_alloc_recv_buf(r->connection->log,
+                                                    prefix);
     }
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
-
-    new_cl = ngx_http_lua_chains_get_free_buf(r->connection->log, r->pool,
-                                          &ctx->free_recv_bufs,
-                                          size,
-                                          (ngx_buf_tag_t)
-                                          &ngx_http_lua_module);
-
     if (new_cl == NULL) {
         return NGX_ERROR;
     }
@@ -3670,6 +6214,127 @@ static ngx_int_t ngx_http_lua_socket_insert_buffer(ngx_http_request_t *r,
 }
 
 
+/*
+ * receive buffers are allocated from the heap rather than from the request
+ * pool, so that they can outlive the request and be reused by the next
+ * cosocket read in the same worker
+ */
+
+static ngx_chain_t *
+ngx_http_lua_socket_get_recv_buf(ngx_log_t *log, size_t size)
+{
+    ngx_chain_t             *cl;
+    ngx_buf_t               *b;
+
+    /*
+     * size is always a lua_socket_buffer_size, so the buffers cached for
+     * smaller ones are dropped rather than left to block the list
+     */
+
+    for ( ;; ) {
+        cl = ngx_http_lua_socket_free_recv_bufs;
+
+        if (cl == NULL) {
+            break;
+        }
+
+        ngx_http_lua_socket_free_recv_bufs = cl->next;
+        ngx_http_lua_socket_nfree_recv_bufs--;
+
+        if ((size_t) (cl->buf->end - cl->buf->start) >= size) {
+            break;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "lua tcp socket free recv buf %p, size %uz",
+                       cl, (size_t) (cl->buf->end - cl->buf->start));
+
+        ngx_free(cl);
+    }
+
+    if (cl) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "lua tcp socket reuse recv buf %p, size %uz",
+                       cl, (size_t) (cl->buf->end - cl->buf->start));
+
+        cl->next = NULL;
+
+        b = cl->buf;
+        b->pos = b->start;
+        b->last = b->start;
+
+        return cl;
+    }
+
+    return ngx_http_lua_socket_alloc_recv_buf(log, size);
+}
+
+
+static ngx_chain_t *
+ngx_http_lua_socket_alloc_recv_buf(ngx_log_t *log, size_t size)
+{
+    ngx_chain_t             *cl;
+    ngx_buf_t               *b;
+
+    cl = ngx_alloc(sizeof(ngx_chain_t) + sizeof(ngx_buf_t) + size, log);
+    if (cl == NULL) {
+        return NULL;
+    }
+
+    b = (ngx_buf_t *) (cl + 1);
+
+    ngx_memzero(b, sizeof(ngx_buf_t));
+
+    b->start = (u_char *) (b + 1);
+    b->pos = b->start;
+    b->last = b->start;
+    b->end = b->start + size;
+    b->temporary = 1;
+    b->tag = (ngx_buf_tag_t) &ngx_http_lua_module;
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    return cl;
+}
+
+
+/*
+ * only the buffers of the given lua_socket_buffer_size are kept, which
+ * leaves out the larger ones made for long pattern prefixes
+ */
+
+static void
+ngx_http_lua_socket_release_recv_bufs(ngx_log_t *log, ngx_chain_t *cl,
+    size_t size)
+{
+    ngx_chain_t             *next;
+
+    for ( /* void */ ; cl; cl = next) {
+        next = cl->next;
+
+        if ((size_t) (cl->buf->end - cl->buf->start) != size
+            || ngx_http_lua_socket_nfree_recv_bufs
+               >= NGX_HTTP_LUA_SOCKET_FREE_RECV_BUFS_MAX)
+        {
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                           "lua tcp socket free recv buf %p, size %uz",
+                           cl, (size_t) (cl->buf->end - cl->buf->start));
+
+            ngx_free(cl);
+            continue;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "lua tcp socket keep recv buf %p", cl);
+
+        cl->next = ngx_http_lua_socket_free_recv_bufs;
+        ngx_http_lua_socket_free_recv_bufs = cl;
+        ngx_http_lua_socket_nfree_recv_bufs++;
+    }
+}
+
+
 static ngx_int_t
 ngx_http_lua_test_expect(ngx_http_request_t *r)
 {
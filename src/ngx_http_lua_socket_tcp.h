@@ -3,6 +3,7 @@
 
 
 #include "ngx_http_lua_common.h"
+#include "ngx_http_lua_string.h"
 
 
 #define NGX_HTTP_LUA_SOCKET_FT_ERROR         0x0001
@@ -27,19 +28,98 @@ typedef void (*ngx_http_lua_socket_tcp_upstream_handler_pt)(
           ngx_http_request_t *r, ngx_http_lua_socket_tcp_upstream_t *u);
 
 
+typedef struct {
+    size_t                               len;
+    size_t                               skip; /* line breaks or delimiter */
+} ngx_http_lua_socket_tcp_item_t;
+
+
+/* the state of receiving several responses in a single run */
+typedef struct {
+    ngx_http_lua_socket_tcp_upstream_t  *upstream;
+
+    ngx_int_t                          (*input_filter)(void *data,
+                                                       ssize_t bytes);
+    void                                *input_filter_ctx;
+
+    ngx_http_lua_socket_tcp_item_t      *items;    /* the done ones */
+    ngx_uint_t                           nalloc;
+    ngx_uint_t                           n;        /* items wanted */
+    ngx_uint_t                           done;
+    size_t                               received; /* bytes of done items */
+} ngx_http_lua_socket_tcp_many_t;
+
+
+/* the state of receiving data straight into the response or a file */
+typedef struct {
+    ngx_temp_file_t                     *temp_file; /* NULL for "output" */
+    off_t                                received;
+
+    ngx_chain_t                         *free_bufs;
+    ngx_chain_t                         *busy_bufs;
+
+    /* digests of the data received, updated in place, by type */
+    ngx_http_lua_digest_t               *digests[NGX_HTTP_LUA_DIGEST_TYPES];
+
+    /* the states the digests point to, allocated on first use */
+    ngx_http_lua_digest_t               *digest_slots;
+
+    unsigned                             paused:1; /* downstream is busy */
+    unsigned                             discard:1;
+} ngx_http_lua_socket_tcp_stream_t;
+
+
+/* the state of relaying a request body and a cosocket's response */
+typedef struct {
+    ngx_http_lua_socket_tcp_upstream_t  *downstream;
+    ngx_http_lua_socket_tcp_upstream_t  *upstream;
+
+    off_t                                sent;  /* to the upstream */
+
+    ngx_fd_t                             pipe[2]; /* for splice(2) */
+    size_t                               piped;   /* bytes in the pipe */
+
+    unsigned                             splice:1;
+    unsigned                             body_done:1;
+} ngx_http_lua_socket_tcp_proxy_t;
+
+
 typedef struct {
     ngx_http_lua_main_conf_t          *conf;
     ngx_uint_t                         active_connections;
+    ngx_uint_t                         size;
+
+    ngx_uint_t                         max_active; /* 0 means unlimited */
+    ngx_uint_t                         backlog;
+    ngx_uint_t                         nwaiting;
 
     /* queues of ngx_http_lua_socket_pool_item_t: */
     ngx_queue_t                        cache;
     ngx_queue_t                        free;
 
+    /* queue of ngx_http_lua_socket_tcp_upstream_t waiting to connect */
+    ngx_queue_t                        wait_connect;
+
     u_char                             key[1];
 
 } ngx_http_lua_socket_pool_t;
 
 
+/* a socket option to set on the newly established connections */
+typedef struct {
+    ngx_uint_t                         index; /* in the option table */
+    int                                value;
+} ngx_http_lua_socket_tcp_sockopt_t;
+
+
+/* an address that failed to connect recently */
+typedef struct {
+    in_addr_t                          addr;
+    in_port_t                          port;
+    ngx_msec_t                         expires;
+} ngx_http_lua_socket_failed_addr_t;
+
+
 struct ngx_http_lua_socket_tcp_upstream_s {
     ngx_http_lua_socket_tcp_retval_handler          prepare_retvals;
     ngx_http_lua_socket_tcp_upstream_handler_pt     read_event_handler;
@@ -47,6 +127,11 @@ struct ngx_http_lua_socket_tcp_upstream_s {
 
     ngx_http_lua_socket_pool_t      *socket_pool;
 
+    ngx_queue_t                      wait_queue; /* in wait_connect */
+    ngx_event_t                      wait_event;
+    ngx_str_t                        host;
+    in_port_t                        port;
+
     ngx_http_lua_loc_conf_t         *conf;
     ngx_http_cleanup_pt             *cleanup;
     ngx_http_request_t              *request;
@@ -58,6 +143,14 @@ struct ngx_http_lua_socket_tcp_upstream_s {
 
     ngx_http_upstream_resolved_t    *resolved;
 
+    in_addr_t                       *addrs;  /* resolved, in the order tried */
+    ngx_uint_t                       naddrs;
+    ngx_uint_t                       addr_index;
+    ngx_msec_t                       connect_deadline;
+
+    ngx_http_lua_socket_tcp_sockopt_t  *sockopts;
+    ngx_uint_t                       nsockopts;
+
     ngx_chain_t                     *bufs_in; /* input data buffers */
     ngx_chain_t                     *buf_in; /* last input data buffer */
     ngx_buf_t                        buffer; /* receive buffer */
@@ -74,6 +167,10 @@ struct ngx_http_lua_socket_tcp_upstream_s {
     ngx_int_t                      (*input_filter)(void *data, ssize_t bytes);
     void                            *input_filter_ctx;
 
+    ngx_http_lua_socket_tcp_many_t  *many;
+    ngx_http_lua_socket_tcp_stream_t  *stream;
+    ngx_http_lua_socket_tcp_proxy_t   *proxy;
+
     ssize_t                          recv_bytes;
     size_t                           request_len;
     ngx_chain_t                     *request_bufs;
@@ -85,6 +182,9 @@ struct ngx_http_lua_socket_tcp_upstream_s {
     unsigned                         waiting:1;
     unsigned                         eof:1;
     unsigned                         is_downstream:1;
+
+    unsigned                         pooled:1; /* counted in socket_pool */
+    unsigned                         wait_connect:1;
 };
 
 
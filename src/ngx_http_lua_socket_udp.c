@@ -9,15 +9,20 @@
 #include "ngx_http_lua_util.h"
 #include "ngx_http_lua_contentby.h"
 #include "ngx_http_lua_output.h"
+#include "ngx_http_lua_resolver.h"
 
 
 #define UDP_MAX_DATAGRAM_SIZE 8192
+#define UDP_MAX_BATCH 64
+#define UDP_MAX_NOWAIT_PEERS 64
 
 
 static int ngx_http_lua_socket_udp(lua_State *L);
 static int ngx_http_lua_socket_udp_setpeername(lua_State *L);
 static int ngx_http_lua_socket_udp_send(lua_State *L);
 static int ngx_http_lua_socket_udp_receive(lua_State *L);
+static int ngx_http_lua_socket_udp_send_batch(lua_State *L);
+static int ngx_http_lua_socket_udp_receive_batch(lua_State *L);
 static int ngx_http_lua_socket_udp_settimeout(lua_State *L);
 static void ngx_http_lua_socket_udp_finalize(ngx_http_request_t *r,
     ngx_http_lua_socket_udp_upstream_t *u);
@@ -25,6 +30,9 @@ static int ngx_http_lua_socket_udp_upstream_destroy(lua_State *L);
 static int ngx_http_lua_socket_resolve_retval_handler(ngx_http_request_t *r,
     ngx_http_lua_socket_udp_upstream_t *u, lua_State *L);
 static void ngx_http_lua_socket_resolve_handler(ngx_resolver_ctx_t *ctx);
+static ngx_int_t ngx_http_lua_socket_udp_resolved(ngx_http_request_t *r,
+    ngx_http_lua_socket_udp_upstream_t *u, in_addr_t *addrs,
+    ngx_uint_t naddrs);
 static int ngx_http_lua_socket_error_retval_handler(ngx_http_request_t *r,
     ngx_http_lua_socket_udp_upstream_t *u, lua_State *L);
 static void ngx_http_lua_socket_udp_handle_error(ngx_http_request_t *r,
@@ -35,6 +43,13 @@ static void ngx_http_lua_socket_dummy_handler(ngx_http_request_t *r,
     ngx_http_lua_socket_udp_upstream_t *u);
 static int ngx_http_lua_socket_udp_receive_retval_handler(ngx_http_request_t *r,
     ngx_http_lua_socket_udp_upstream_t *u, lua_State *L);
+static int ngx_http_lua_socket_udp_receive_batch_retval_handler(
+    ngx_http_request_t *r, ngx_http_lua_socket_udp_upstream_t *u,
+    lua_State *L);
+static ngx_uint_t ngx_http_lua_socket_udp_send_dgrams(
+    ngx_http_lua_socket_udp_upstream_t *u, struct iovec *iov, ngx_uint_t n);
+static ssize_t ngx_http_lua_socket_udp_recv_dgrams(
+    ngx_http_lua_socket_udp_upstream_t *u);
 static ngx_int_t ngx_http_lua_socket_udp_read(ngx_http_request_t *r,
     ngx_http_lua_socket_udp_upstream_t *u);
 static void ngx_http_lua_socket_udp_read_handler(ngx_http_request_t *r,
@@ -43,17 +58,41 @@ static void ngx_http_lua_socket_udp_handle_success(ngx_http_request_t *r,
     ngx_http_lua_socket_udp_upstream_t *u);
 static ngx_int_t ngx_http_lua_udp_connect(ngx_udp_connection_t *uc);
 static int ngx_http_lua_socket_udp_close(lua_State *L);
+static int ngx_http_lua_socket_udp_setkeepalive(lua_State *L);
+static int ngx_http_lua_socket_udp_getreusedtimes(lua_State *L);
+static ngx_int_t ngx_http_lua_socket_udp_get_keepalive_peer(
+    ngx_http_request_t *r, lua_State *L, int key_index,
+    ngx_http_lua_socket_udp_upstream_t *u);
+static ngx_http_lua_socket_udp_pool_t *ngx_http_lua_socket_udp_create_pool(
+    lua_State *L, ngx_http_request_t *r, ngx_str_t *key,
+    ngx_uint_t pool_size);
+static void ngx_http_lua_socket_udp_keepalive_dummy_handler(ngx_event_t *ev);
+static void ngx_http_lua_socket_udp_keepalive_rev_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_lua_socket_udp_keepalive_close_handler(
+    ngx_event_t *ev);
+static int ngx_http_lua_socket_udp_send_nowait(lua_State *L);
+static int ngx_http_lua_socket_udp_nowait_error(lua_State *L, ngx_err_t err);
+static int ngx_http_lua_socket_udp_nowait_destroy(lua_State *L);
 
 
 enum {
     SOCKET_CTX_INDEX = 1,
-    SOCKET_TIMEOUT_INDEX = 2
+    SOCKET_TIMEOUT_INDEX = 2,
+    SOCKET_KEY_INDEX = 3
 };
 
 
 static char ngx_http_lua_socket_udp_metatable_key;
+static char ngx_http_lua_socket_udp_nowait_key;
 static u_char ngx_http_lua_socket_udp_buffer[UDP_MAX_DATAGRAM_SIZE];
 
+/* the sockets of udp_send(), never closed before the worker exits */
+static ngx_uint_t ngx_http_lua_socket_udp_nowait_n;
+
+/* for receive_batch(), allocated on first use */
+static u_char *ngx_http_lua_socket_udp_batch_buffer;
+static size_t ngx_http_lua_socket_udp_batch_lens[UDP_MAX_BATCH];
+
 
 void
 ngx_http_lua_inject_socket_udp_api(ngx_log_t *log, lua_State *L)
@@ -63,9 +102,17 @@ ngx_http_lua_inject_socket_udp_api(ngx_log_t *log, lua_State *L)
     lua_pushcfunction(L, ngx_http_lua_socket_udp);
     lua_setfield(L, -2, "udp"); /* ngx socket */
 
+    lua_pushcfunction(L, ngx_http_lua_socket_udp_send_nowait);
+    lua_setfield(L, -2, "udp_send"); /* ngx socket */
+
+    /* the per-worker sockets of ngx.socket.udp_send, keyed by peer */
+    lua_pushlightuserdata(L, &ngx_http_lua_socket_udp_nowait_key);
+    lua_newtable(L);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
     /* udp socket object metatable */
     lua_pushlightuserdata(L, &ngx_http_lua_socket_udp_metatable_key);
-    lua_createtable(L, 0 /* narr */, 4 /* nrec */);
+    lua_createtable(L, 0 /* narr */, 12 /* nrec */);
 
     lua_pushcfunction(L, ngx_http_lua_socket_udp_setpeername);
     lua_setfield(L, -2, "setpeername"); /* ngx socket mt */
@@ -76,12 +123,24 @@ ngx_http_lua_inject_socket_udp_api(ngx_log_t *log, lua_State *L)
     lua_pushcfunction(L, ngx_http_lua_socket_udp_receive);
     lua_setfield(L, -2, "receive");
 
+    lua_pushcfunction(L, ngx_http_lua_socket_udp_send_batch);
+    lua_setfield(L, -2, "send_batch");
+
+    lua_pushcfunction(L, ngx_http_lua_socket_udp_receive_batch);
+    lua_setfield(L, -2, "receive_batch");
+
     lua_pushcfunction(L, ngx_http_lua_socket_udp_settimeout);
     lua_setfield(L, -2, "settimeout"); /* ngx socket mt */
 
     lua_pushcfunction(L, ngx_http_lua_socket_udp_close);
     lua_setfield(L, -2, "close"); /* ngx socket mt */
 
+    lua_pushcfunction(L, ngx_http_lua_socket_udp_setkeepalive);
+    lua_setfield(L, -2, "setkeepalive");
+
+    lua_pushcfunction(L, ngx_http_lua_socket_udp_getreusedtimes);
+    lua_setfield(L, -2, "getreusedtimes");
+
     lua_pushvalue(L, -1);
     lua_setfield(L, -2, "__index");
     lua_rawset(L, LUA_REGISTRYINDEX);
@@ -149,6 +208,8 @@ ngx_http_lua_socket_udp_setpeername(lua_State *L)
     ngx_http_lua_loc_conf_t     *llcf;
     ngx_udp_connection_t        *uc;
     int                          timeout;
+    in_addr_t                   *addrs;
+    ngx_uint_t                   naddrs;
 
     ngx_http_lua_socket_udp_upstream_t      *u;
 
@@ -264,6 +325,34 @@ ngx_http_lua_socket_udp_setpeername(lua_State *L)
         u->read_timeout = u->conf->read_timeout;
     }
 
+    /* the pool key is "host:port" or the unix domain socket path */
+
+    lua_pushvalue(L, 2);
+
+    if (n == 3) {
+        lua_pushliteral(L, ":");
+        lua_pushvalue(L, 3);
+        lua_concat(L, 3);
+    }
+
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, 1, SOCKET_KEY_INDEX);
+
+    rc = ngx_http_lua_socket_udp_get_keepalive_peer(r, L, -1, u);
+
+    lua_pop(L, 1);
+
+    if (rc == NGX_ERROR) {
+        return luaL_error(L, "out of memory");
+    }
+
+    if (rc == NGX_OK) {
+        lua_pushinteger(L, 1);
+        return 1;
+    }
+
+    /* rc == NGX_DECLINED */
+
     ngx_memzero(&url, sizeof(ngx_url_t));
 
     url.url.len = host.len;
@@ -304,6 +393,15 @@ ngx_http_lua_socket_udp_setpeername(lua_State *L)
         u->resolved->port = (in_port_t) port;
     }
 
+    if (u->resolved->sockaddr == NULL
+        && ngx_http_lua_resolver_cache_lookup(r, &host, &addrs, &naddrs)
+           == NGX_OK)
+    {
+        if (ngx_http_lua_socket_udp_resolved(r, u, addrs, naddrs) != NGX_OK) {
+            return luaL_error(L, "out of memory");
+        }
+    }
+
     if (u->resolved->sockaddr) {
         rc = ngx_http_lua_socket_resolve_retval_handler(r, u, L);
         if (rc == NGX_AGAIN) {
@@ -391,10 +489,6 @@ ngx_http_lua_socket_resolve_handler(ngx_resolver_ctx_t *ctx)
     ngx_http_lua_ctx_t                  *lctx;
     lua_State                           *L;
     ngx_http_lua_socket_udp_upstream_t  *u;
-    u_char                              *p;
-    size_t                               len;
-    struct sockaddr_in                  *sin;
-    ngx_uint_t                           i;
     unsigned                             waiting;
 
     u = ctx->data;
@@ -459,11 +553,56 @@ ngx_http_lua_socket_resolve_handler(ngx_resolver_ctx_t *ctx)
         return;
     }
 
-    if (ur->naddrs == 1) {
+    ngx_http_lua_resolver_cache_update(r, &ctx->name, ctx->addrs,
+                                       ctx->naddrs);
+
+    if (ngx_http_lua_socket_udp_resolved(r, u, ctx->addrs, ctx->naddrs)
+        != NGX_OK)
+    {
+        u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_RESOLVER;
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "out of memory");
+        return;
+    }
+
+    ur->ctx = NULL;
+
+    ngx_resolve_name_done(ctx);
+
+    u->waiting = 0;
+
+    if (waiting) {
+        lctx->udp_socket_busy = 0;
+        lctx->udp_socket_ready = 1;
+        r->write_event_handler(r);
+
+    } else {
+        (void) ngx_http_lua_socket_resolve_retval_handler(r, u, L);
+    }
+}
+
+
+/* picks one of the resolved addresses randomly */
+
+static ngx_int_t
+ngx_http_lua_socket_udp_resolved(ngx_http_request_t *r,
+    ngx_http_lua_socket_udp_upstream_t *u, in_addr_t *addrs,
+    ngx_uint_t naddrs)
+{
+    u_char                              *p;
+    size_t                               len;
+    struct sockaddr_in                  *sin;
+    ngx_uint_t                           i;
+    ngx_http_upstream_resolved_t        *ur;
+
+    ur = u->resolved;
+
+    if (naddrs == 1) {
         i = 0;
 
     } else {
-        i = ngx_random() % ur->naddrs;
+        i = ngx_random() % naddrs;
     }
 
     dd("selected addr index: %d", (int) i);
@@ -472,22 +611,18 @@ ngx_http_lua_socket_resolve_handler(ngx_resolver_ctx_t *ctx)
 
     p = ngx_pnalloc(r->pool, len + sizeof(struct sockaddr_in));
     if (p == NULL) {
-        u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_RESOLVER;
-
-        lua_pushnil(L);
-        lua_pushliteral(L, "out of memory");
-        return;
+        return NGX_ERROR;
     }
 
     sin = (struct sockaddr_in *) &p[len];
     ngx_memzero(sin, sizeof(struct sockaddr_in));
 
-    len = ngx_inet_ntop(AF_INET, &ur->addrs[i], p, NGX_INET_ADDRSTRLEN);
+    len = ngx_inet_ntop(AF_INET, &addrs[i], p, NGX_INET_ADDRSTRLEN);
     len = ngx_sprintf(&p[len], ":%d", ur->port) - p;
 
     sin->sin_family = AF_INET;
     sin->sin_port = htons(ur->port);
-    sin->sin_addr.s_addr = ur->addrs[i];
+    sin->sin_addr.s_addr = addrs[i];
 
     ur->sockaddr = (struct sockaddr *) sin;
     ur->socklen = sizeof(struct sockaddr_in);
@@ -496,20 +631,7 @@ ngx_http_lua_socket_resolve_handler(ngx_resolver_ctx_t *ctx)
     ur->host.len = len;
     ur->naddrs = 1;
 
-    ur->ctx = NULL;
-
-    ngx_resolve_name_done(ctx);
-
-    u->waiting = 0;
-
-    if (waiting) {
-        lctx->udp_socket_busy = 0;
-        lctx->udp_socket_ready = 1;
-        r->write_event_handler(r);
-
-    } else {
-        (void) ngx_http_lua_socket_resolve_retval_handler(r, u, L);
-    }
+    return NGX_OK;
 }
 
 
@@ -829,6 +951,7 @@ ngx_http_lua_socket_udp_receive(lua_State *L)
     size = ngx_min(size, UDP_MAX_DATAGRAM_SIZE);
 
     u->recv_buf_size = size;
+    u->batch = 0;
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "lua udp socket receive buffer size: %uz", u->recv_buf_size);
@@ -891,432 +1014,1576 @@ ngx_http_lua_socket_udp_receive_retval_handler(ngx_http_request_t *r,
 
 
 static int
-ngx_http_lua_socket_udp_settimeout(lua_State *L)
+ngx_http_lua_socket_udp_send_batch(lua_State *L)
 {
-    int                     n;
-    ngx_int_t               timeout;
-
+    ngx_http_request_t                  *r;
     ngx_http_lua_socket_udp_upstream_t  *u;
+    int                                  i, ndgrams, type;
+    size_t                               len, size;
+    u_char                              *p, *buf;
+    const char                          *msg, *data;
+    ngx_uint_t                           n, nsent;
+    struct iovec                         iov[UDP_MAX_BATCH];
 
-    n = lua_gettop(L);
-
-    if (n != 2) {
-        return luaL_error(L, "ngx.socket settimout: expecting at least 2 "
-                          "arguments (including the object) but seen %d",
-                          lua_gettop(L));
+    if (lua_gettop(L) != 2) {
+        return luaL_error(L, "expecting 2 arguments (including the object), "
+                          "but got %d", lua_gettop(L));
     }
 
-    timeout = (ngx_int_t) lua_tonumber(L, 2);
+    lua_pushlightuserdata(L, &ngx_http_lua_request_key);
+    lua_rawget(L, LUA_GLOBALSINDEX);
+    r = lua_touserdata(L, -1);
+    lua_pop(L, 1);
 
-    lua_rawseti(L, 1, SOCKET_TIMEOUT_INDEX);
+    if (r == NULL) {
+        return luaL_error(L, "request object not found");
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checktype(L, 2, LUA_TTABLE);
 
     lua_rawgeti(L, 1, SOCKET_CTX_INDEX);
     u = lua_touserdata(L, -1);
+    lua_pop(L, 1);
 
-    if (u) {
-        if (timeout > 0) {
-            u->read_timeout = (ngx_msec_t) timeout;
+    if (u == NULL || u->udp_connection.connection == NULL || u->ft_type) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "attempt to send data on a closed socket: u:%p, c:%p, "
+                      "ft:%ui",
+                      u, u ? u->udp_connection.connection : NULL,
+                      u ? u->ft_type : 0);
 
-        } else {
-            u->read_timeout = u->conf->read_timeout;
-        }
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
     }
 
-    return 0;
-}
+    if (u->waiting) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "socket busy");
+        return 2;
+    }
 
+    ndgrams = lua_objlen(L, 2);
 
-static void
-ngx_http_lua_socket_udp_finalize(ngx_http_request_t *r,
-    ngx_http_lua_socket_udp_upstream_t *u)
-{
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua finalize socket");
+    /* the numbers and the tables have to be copied, the strings do not */
 
-    if (u->cleanup) {
-        *u->cleanup = NULL;
-        u->cleanup = NULL;
-    }
+    size = 0;
 
-    if (u->resolved && u->resolved->ctx) {
-        ngx_resolve_name_done(u->resolved->ctx);
-        u->resolved->ctx = NULL;
-    }
+    for (i = 1; i <= ndgrams; i++) {
+        lua_rawgeti(L, 2, i);
 
-    if (u->udp_connection.connection) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "lua close socket connection");
+        type = lua_type(L, -1);
+        switch (type) {
+            case LUA_TSTRING:
+                break;
 
-        ngx_close_connection(u->udp_connection.connection);
-        u->udp_connection.connection = NULL;
-    }
+            case LUA_TNUMBER:
+                lua_tolstring(L, -1, &len);
+                size += len;
+                break;
 
-    if (u->waiting) {
-        u->waiting = 0;
+            case LUA_TTABLE:
+                size += ngx_http_lua_calc_strlen_in_table(L, -1, 2,
+                                                          1 /* strict */);
+                break;
+
+            default:
+                msg = lua_pushfstring(L, "bad datagram #%d: string, number, "
+                                      "or array table expected, got %s",
+                                      i, lua_typename(L, type));
+
+                return luaL_argerror(L, 2, msg);
+        }
+
+        lua_pop(L, 1);
     }
-}
 
+    buf = size ? lua_newuserdata(L, size) : NULL;
 
-static int
-ngx_http_lua_socket_udp_upstream_destroy(lua_State *L)
-{
-    ngx_http_lua_socket_udp_upstream_t      *u;
+    u->ft_type = 0;
+    u->socket_errno = 0;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua udp socket send %d datagrams, %uz bytes copied",
+                   ndgrams, size);
+
+    p = buf;
+    n = 0;
+    nsent = 0;
+
+    for (i = 1; i <= ndgrams; i++) {
+        lua_rawgeti(L, 2, i);
+
+        switch (lua_type(L, -1)) {
+            case LUA_TSTRING:
+                /* the string stays referenced by the argument table */
+                data = lua_tolstring(L, -1, &len);
+                iov[n].iov_base = (void *) data;
+                iov[n].iov_len = len;
+                break;
+
+            case LUA_TNUMBER:
+                data = lua_tolstring(L, -1, &len);
+                ngx_memcpy(p, data, len);
+                iov[n].iov_base = p;
+                iov[n].iov_len = len;
+                p += len;
+                break;
+
+            default: /* LUA_TTABLE */
+                iov[n].iov_base = p;
+                p = ngx_http_lua_copy_str_in_table(L, -1, p);
+                iov[n].iov_len = p - (u_char *) iov[n].iov_base;
+                break;
+        }
 
-    dd("upstream destroy triggered by Lua GC");
+        lua_pop(L, 1);
 
-    u = lua_touserdata(L, 1);
-    if (u == NULL) {
-        return 0;
-    }
+        if (++n < UDP_MAX_BATCH && i < ndgrams) {
+            continue;
+        }
 
-    if (u->cleanup) {
-        ngx_http_lua_socket_udp_cleanup(u); /* it will clear u->cleanup */
-    }
+        nsent += ngx_http_lua_socket_udp_send_dgrams(u, iov, n);
 
-    return 0;
-}
+        if (u->ft_type || u->socket_errno) {
+            (void) ngx_http_lua_socket_error_retval_handler(r, u, L);
+            lua_pushinteger(L, nsent);
+            return 3;
+        }
 
+        n = 0;
+    }
 
-static void
-ngx_http_lua_socket_dummy_handler(ngx_http_request_t *r,
-    ngx_http_lua_socket_udp_upstream_t *u)
-{
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua udp socket dummy handler");
+    lua_pushinteger(L, nsent);
+    return 1;
 }
 
 
-static ngx_int_t
-ngx_http_lua_socket_udp_read(ngx_http_request_t *r,
-    ngx_http_lua_socket_udp_upstream_t *u)
+static ngx_uint_t
+ngx_http_lua_socket_udp_send_dgrams(ngx_http_lua_socket_udp_upstream_t *u,
+    struct iovec *iov, ngx_uint_t n)
 {
-    ngx_connection_t            *c;
-    ngx_event_t                 *rev;
-    ssize_t                      n;
+    ngx_connection_t        *c;
+    ngx_uint_t               i;
+#if (NGX_HTTP_LUA_HAVE_MMSG)
+    int                      rc;
+    ngx_err_t                err;
+    struct mmsghdr           msgs[UDP_MAX_BATCH];
+#else
+    ssize_t                  rc;
+#endif
 
     c = u->udp_connection.connection;
-    rev = c->read;
-
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "lua udp socket read data: waiting: %d", (int) u->waiting);
 
-    n = ngx_udp_recv(u->udp_connection.connection,
-                     ngx_http_lua_socket_udp_buffer, u->recv_buf_size);
+#if (NGX_HTTP_LUA_HAVE_MMSG)
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "lua udp recv returned %z", n);
+    ngx_memzero(msgs, n * sizeof(struct mmsghdr));
 
-    if (n >= 0) {
-        u->received = n;
-        ngx_http_lua_socket_udp_handle_success(r, u);
-        return NGX_OK;
+    for (i = 0; i < n; i++) {
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
     }
 
-    if (n == NGX_ERROR) {
-        u->socket_errno = ngx_socket_errno;
-        ngx_http_lua_socket_udp_handle_error(r, u,
-                                             NGX_HTTP_LUA_SOCKET_FT_ERROR);
-        return NGX_ERROR;
-    }
+    i = 0;
 
-    /* n == NGX_AGAIN */
+    while (i < n) {
+        rc = sendmmsg(c->fd, &msgs[i], n - i, 0);
 
-    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
-        ngx_http_lua_socket_udp_handle_error(r, u,
-                                             NGX_HTTP_LUA_SOCKET_FT_ERROR);
-        return NGX_ERROR;
-    }
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "sendmmsg: fd:%d %d of %ui", c->fd, rc, n - i);
 
-    if (rev->active) {
-        ngx_add_timer(rev, u->read_timeout);
+        if (rc == -1) {
+            err = ngx_socket_errno;
 
-    } else if (rev->timer_set) {
-        ngx_del_timer(rev);
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            u->socket_errno = err;
+            break;
+        }
+
+        i += rc;
     }
 
-    return NGX_AGAIN;
-}
+#else
 
+    for (i = 0; i < n; i++) {
+        rc = ngx_send(c, iov[i].iov_base, iov[i].iov_len);
 
-static void
-ngx_http_lua_socket_udp_read_handler(ngx_http_request_t *r,
-    ngx_http_lua_socket_udp_upstream_t *u)
-{
-    ngx_connection_t            *c;
+        if (rc == NGX_ERROR || rc == NGX_AGAIN) {
+            u->socket_errno = ngx_socket_errno;
+            break;
+        }
 
-    c = u->udp_connection.connection;
+        if (rc != (ssize_t) iov[i].iov_len) {
+            u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_PARTIALWRITE;
+            break;
+        }
+    }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua udp socket read handler");
+#endif
 
-    if (c->read->timedout) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "lua udp socket read timed out");
+    return i;
+}
+
+
+static int
+ngx_http_lua_socket_udp_receive_batch(lua_State *L)
+{
+    ngx_http_request_t                  *r;
+    ngx_http_lua_socket_udp_upstream_t  *u;
+    ngx_int_t                            rc;
+    ngx_http_lua_ctx_t                  *ctx;
+    ngx_int_t                            max;
+    size_t                               size;
+    lua_Number                           n;
+    const char                          *msg;
+    int                                  nargs;
+
+    nargs = lua_gettop(L);
+    if (nargs < 1 || nargs > 3) {
+        return luaL_error(L, "expecting 1, 2, or 3 arguments "
+                          "(including the object), but got %d", nargs);
+    }
+
+    lua_pushlightuserdata(L, &ngx_http_lua_request_key);
+    lua_rawget(L, LUA_GLOBALSINDEX);
+    r = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (r == NULL) {
+        return luaL_error(L, "request object not found");
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    lua_rawgeti(L, 1, SOCKET_CTX_INDEX);
+    u = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (u == NULL || u->udp_connection.connection == NULL || u->ft_type) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "attempt to receive data on a closed socket: u:%p, c:%p, "
+                      "ft:%ui",
+                      u, u ? u->udp_connection.connection : NULL,
+                      u ? u->ft_type : 0);
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (u->waiting) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "socket busy");
+        return 2;
+    }
+
+    max = (ngx_int_t) luaL_optnumber(L, 2, UDP_MAX_BATCH);
+
+    if (max <= 0) {
+        return luaL_argerror(L, 2, "positive number expected");
+    }
+
+    max = ngx_min(max, UDP_MAX_BATCH);
+
+    n = luaL_optnumber(L, 3, UDP_MAX_DATAGRAM_SIZE);
+
+    if (n <= 0 || n > UDP_MAX_DATAGRAM_SIZE) {
+        msg = lua_pushfstring(L, "bad size: %d, expecting 1 to %d",
+                              (int) n, UDP_MAX_DATAGRAM_SIZE);
+        return luaL_argerror(L, 3, msg);
+    }
+
+    size = (size_t) n;
+
+    if (ngx_http_lua_socket_udp_batch_buffer == NULL) {
+        ngx_http_lua_socket_udp_batch_buffer =
+                 ngx_alloc(UDP_MAX_BATCH * UDP_MAX_DATAGRAM_SIZE,
+                           r->connection->log);
+
+        if (ngx_http_lua_socket_udp_batch_buffer == NULL) {
+            lua_pushnil(L);
+            lua_pushliteral(L, "out of memory");
+            return 2;
+        }
+    }
+
+    u->recv_buf_size = size;
+    u->batch = (ngx_uint_t) max;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua udp socket receive at most %ui datagrams of %uz "
+                   "bytes", u->batch, u->recv_buf_size);
+
+    rc = ngx_http_lua_socket_udp_read(r, u);
+
+    if (rc == NGX_ERROR || rc == NGX_OK) {
+        return ngx_http_lua_socket_udp_receive_batch_retval_handler(r, u, L);
+    }
+
+    /* rc == NGX_AGAIN */
+
+    u->read_event_handler = ngx_http_lua_socket_udp_read_handler;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (ctx == NULL) {
+        return luaL_error(L, "no request ctx found");
+    }
+
+    if (ctx->entered_content_phase) {
+        r->write_event_handler = ngx_http_lua_content_wev_handler;
+    }
+
+    u->waiting = 1;
+    u->prepare_retvals = ngx_http_lua_socket_udp_receive_batch_retval_handler;
+
+    ctx->data = u;
+    ctx->udp_socket_busy = 1;
+    ctx->udp_socket_ready = 0;
+
+    return lua_yield(L, 0);
+}
+
+
+static int
+ngx_http_lua_socket_udp_receive_batch_retval_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_udp_upstream_t *u, lua_State *L)
+{
+    u_char                  *p;
+    ngx_uint_t               i;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua udp socket receive_batch return value handler: %uz",
+                   u->received);
+
+    if (u->ft_type) {
+        return ngx_http_lua_socket_error_retval_handler(r, u, L);
+    }
+
+    lua_createtable(L, u->received, 0);
+
+    p = ngx_http_lua_socket_udp_batch_buffer;
+
+    for (i = 0; i < u->received; i++) {
+        lua_pushlstring(L, (char *) p, ngx_http_lua_socket_udp_batch_lens[i]);
+        lua_rawseti(L, -2, i + 1);
+
+        p += u->recv_buf_size;
+    }
+
+    return 1;
+}
+
+
+static int
+ngx_http_lua_socket_udp_settimeout(lua_State *L)
+{
+    int                     n;
+    ngx_int_t               timeout;
+
+    ngx_http_lua_socket_udp_upstream_t  *u;
+
+    n = lua_gettop(L);
+
+    if (n != 2) {
+        return luaL_error(L, "ngx.socket settimout: expecting at least 2 "
+                          "arguments (including the object) but seen %d",
+                          lua_gettop(L));
+    }
+
+    timeout = (ngx_int_t) lua_tonumber(L, 2);
+
+    lua_rawseti(L, 1, SOCKET_TIMEOUT_INDEX);
+
+    lua_rawgeti(L, 1, SOCKET_CTX_INDEX);
+    u = lua_touserdata(L, -1);
+
+    if (u) {
+        if (timeout > 0) {
+            u->read_timeout = (ngx_msec_t) timeout;
+
+        } else {
+            u->read_timeout = u->conf->read_timeout;
+        }
+    }
+
+    return 0;
+}
+
+
+static void
+ngx_http_lua_socket_udp_finalize(ngx_http_request_t *r,
+    ngx_http_lua_socket_udp_upstream_t *u)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua finalize socket");
+
+    if (u->cleanup) {
+        *u->cleanup = NULL;
+        u->cleanup = NULL;
+    }
+
+    if (u->resolved && u->resolved->ctx) {
+        ngx_resolve_name_done(u->resolved->ctx);
+        u->resolved->ctx = NULL;
+    }
+
+    if (u->udp_connection.connection) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "lua close socket connection");
+
+        ngx_close_connection(u->udp_connection.connection);
+        u->udp_connection.connection = NULL;
+    }
+
+    if (u->waiting) {
+        u->waiting = 0;
+    }
+}
+
+
+static int
+ngx_http_lua_socket_udp_upstream_destroy(lua_State *L)
+{
+    ngx_http_lua_socket_udp_upstream_t      *u;
+
+    dd("upstream destroy triggered by Lua GC");
+
+    u = lua_touserdata(L, 1);
+    if (u == NULL) {
+        return 0;
+    }
+
+    if (u->cleanup) {
+        ngx_http_lua_socket_udp_cleanup(u); /* it will clear u->cleanup */
+    }
+
+    return 0;
+}
+
+
+static void
+ngx_http_lua_socket_dummy_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_udp_upstream_t *u)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua udp socket dummy handler");
+}
+
+
+static ngx_int_t
+ngx_http_lua_socket_udp_read(ngx_http_request_t *r,
+    ngx_http_lua_socket_udp_upstream_t *u)
+{
+    ngx_connection_t            *c;
+    ngx_event_t                 *rev;
+    ssize_t                      n;
+
+    c = u->udp_connection.connection;
+    rev = c->read;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "lua udp socket read data: waiting: %d", (int) u->waiting);
+
+    if (u->batch) {
+        n = ngx_http_lua_socket_udp_recv_dgrams(u);
+
+    } else {
+        n = ngx_udp_recv(u->udp_connection.connection,
+                         ngx_http_lua_socket_udp_buffer, u->recv_buf_size);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "lua udp recv returned %z", n);
+
+    if (n >= 0) {
+        u->received = n;
+        ngx_http_lua_socket_udp_handle_success(r, u);
+        return NGX_OK;
+    }
+
+    if (n == NGX_ERROR) {
+        u->socket_errno = ngx_socket_errno;
+        ngx_http_lua_socket_udp_handle_error(r, u,
+                                             NGX_HTTP_LUA_SOCKET_FT_ERROR);
+        return NGX_ERROR;
+    }
+
+    /* n == NGX_AGAIN */
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_http_lua_socket_udp_handle_error(r, u,
+                                             NGX_HTTP_LUA_SOCKET_FT_ERROR);
+        return NGX_ERROR;
+    }
+
+    if (rev->active) {
+        ngx_add_timer(rev, u->read_timeout);
+
+    } else if (rev->timer_set) {
+        ngx_del_timer(rev);
+    }
+
+    return NGX_AGAIN;
+}
+
+
+/*
+ * reads as many of the datagrams already queued on the socket as fit into
+ * u->batch slots, and returns their number, or NGX_AGAIN when there is
+ * none, like ngx_udp_recv() does for a single one
+ */
+
+static ssize_t
+ngx_http_lua_socket_udp_recv_dgrams(ngx_http_lua_socket_udp_upstream_t *u)
+{
+    u_char                  *p;
+    ssize_t                  n;
+    ngx_uint_t               i;
+    ngx_connection_t        *c;
+#if (NGX_HTTP_LUA_HAVE_MMSG)
+    ngx_err_t                err;
+    struct iovec             iov[UDP_MAX_BATCH];
+    struct mmsghdr           msgs[UDP_MAX_BATCH];
+#endif
+
+    c = u->udp_connection.connection;
+    p = ngx_http_lua_socket_udp_batch_buffer;
+
+#if (NGX_HTTP_LUA_HAVE_MMSG)
+
+    ngx_memzero(msgs, u->batch * sizeof(struct mmsghdr));
+
+    for (i = 0; i < u->batch; i++) {
+        iov[i].iov_base = p;
+        iov[i].iov_len = u->recv_buf_size;
+
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+
+        p += u->recv_buf_size;
+    }
+
+    do {
+        n = recvmmsg(c->fd, msgs, u->batch, 0, NULL);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "recvmmsg: fd:%d %z of %ui", c->fd, n, u->batch);
+
+        if (n >= 0) {
+            for (i = 0; i < (ngx_uint_t) n; i++) {
+                ngx_http_lua_socket_udp_batch_lens[i] = msgs[i].msg_len;
+            }
+
+            return n;
+        }
+
+        err = ngx_socket_errno;
+
+        if (err == NGX_EAGAIN || err == NGX_EINTR) {
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "recvmmsg() not ready");
+            n = NGX_AGAIN;
+
+        } else {
+            n = ngx_connection_error(c, err, "recvmmsg() failed");
+            break;
+        }
+
+    } while (err == NGX_EINTR);
+
+    c->read->ready = 0;
+
+    if (n == NGX_ERROR) {
+        c->read->error = 1;
+    }
+
+    return n;
+
+#else
+
+    for (i = 0; i < u->batch; i++) {
+        n = ngx_udp_recv(c, p, u->recv_buf_size);
+
+        if (n < 0) {
+            if (i == 0) {
+                return n;
+            }
+
+            break;
+        }
+
+        ngx_http_lua_socket_udp_batch_lens[i] = n;
+        p += u->recv_buf_size;
+    }
+
+    return i;
+
+#endif
+}
+
+
+static void
+ngx_http_lua_socket_udp_read_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_udp_upstream_t *u)
+{
+    ngx_connection_t            *c;
+
+    c = u->udp_connection.connection;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua udp socket read handler");
+
+    if (c->read->timedout) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "lua udp socket read timed out");
 
         ngx_http_lua_socket_udp_handle_error(r, u,
                                              NGX_HTTP_LUA_SOCKET_FT_TIMEOUT);
         return;
     }
 
-#if 1
+#if 1
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+#endif
+
+    (void) ngx_http_lua_socket_udp_read(r, u);
+}
+
+
+static void
+ngx_http_lua_socket_udp_handle_error(ngx_http_request_t *r,
+    ngx_http_lua_socket_udp_upstream_t *u, ngx_uint_t ft_type)
+{
+    ngx_http_lua_ctx_t          *ctx;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua udp socket handle error");
+
+    u->ft_type |= ft_type;
+
+#if 0
+    ngx_http_lua_socket_udp_finalize(r, u);
+#endif
+
+    u->read_event_handler = ngx_http_lua_socket_dummy_handler;
+
+    if (u->waiting) {
+        u->waiting = 0;
+
+        ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+        dd("setting socket_ready to 1");
+
+        ctx->udp_socket_busy = 0;
+        ctx->udp_socket_ready = 1;
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "lua udp socket waking up the current request");
+
+        r->write_event_handler(r);
+    }
+}
+
+
+static void
+ngx_http_lua_socket_udp_cleanup(void *data)
+{
+    ngx_http_lua_socket_udp_upstream_t  *u = data;
+
+    ngx_http_request_t  *r;
+
+    r = u->request;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "cleanup lua udp socket upstream request: \"%V\"", &r->uri);
+
+    ngx_http_lua_socket_udp_finalize(r, u);
+}
+
+
+static void
+ngx_http_lua_socket_udp_handler(ngx_event_t *ev)
+{
+    ngx_connection_t                *c;
+    ngx_http_request_t              *r;
+    ngx_http_log_ctx_t              *ctx;
+
+    ngx_http_lua_socket_udp_upstream_t  *u;
+
+    c = ev->data;
+    u = c->data;
+    r = u->request;
+    c = r->connection;
+
+    ctx = c->log->data;
+    ctx->current_request = r;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua udp socket handler for \"%V?%V\", wev %d", &r->uri,
+                   &r->args, (int) ev->write);
+
+    u->read_event_handler(r, u);
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_lua_socket_udp_handle_success(ngx_http_request_t *r,
+    ngx_http_lua_socket_udp_upstream_t *u)
+{
+    ngx_http_lua_ctx_t          *ctx;
+
+    u->read_event_handler = ngx_http_lua_socket_dummy_handler;
+
+    if (u->waiting) {
+        u->waiting = 0;
+
+        ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+        dd("setting socket_ready to 1");
+
+        ctx->udp_socket_busy = 0;
+        ctx->udp_socket_ready = 1;
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "lua udp socket waking up the current request");
+
+        r->write_event_handler(r);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_lua_udp_connect(ngx_udp_connection_t *uc)
+{
+    int                rc;
+    ngx_int_t          event;
+    ngx_event_t       *rev, *wev;
+    ngx_socket_t       s;
+    ngx_connection_t  *c;
+
+    s = ngx_socket(uc->sockaddr->sa_family, SOCK_DGRAM, 0);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, &uc->log, 0, "UDP socket %d", s);
+
+    if (s == -1) {
+        ngx_log_error(NGX_LOG_ALERT, &uc->log, ngx_socket_errno,
+                      ngx_socket_n " failed");
+        return NGX_ERROR;
+    }
+
+    c = ngx_get_connection(s, &uc->log);
+
+    if (c == NULL) {
+        if (ngx_close_socket(s) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, &uc->log, ngx_socket_errno,
+                          ngx_close_socket_n "failed");
+        }
+
+        return NGX_ERROR;
+    }
+
+    if (ngx_nonblocking(s) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, &uc->log, ngx_socket_errno,
+                      ngx_nonblocking_n " failed");
+
+        ngx_free_connection(c);
+
+        if (ngx_close_socket(s) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, &uc->log, ngx_socket_errno,
+                          ngx_close_socket_n " failed");
+        }
+
+        return NGX_ERROR;
+    }
+
+    rev = c->read;
+    wev = c->write;
+
+    rev->log = &uc->log;
+    wev->log = &uc->log;
+
+    uc->connection = c;
+
+    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+
+#if (NGX_THREADS)
+
+    /* TODO: lock event when call completion handler */
+
+    rev->lock = &c->lock;
+    wev->lock = &c->lock;
+    rev->own_lock = &c->lock;
+    wev->own_lock = &c->lock;
+
+#endif
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, &uc->log, 0,
+                   "connect to %V, fd:%d #%d", &uc->server, s, c->number);
+
+    rc = connect(s, uc->sockaddr, uc->socklen);
+
+    /* TODO: aio, iocp */
+
+    if (rc == -1) {
+        ngx_log_error(NGX_LOG_CRIT, &uc->log, ngx_socket_errno,
+                      "connect() failed");
+
+        return NGX_ERROR;
+    }
+
+    /* UDP sockets are always ready to write */
+    wev->ready = 1;
+
+    if (ngx_add_event) {
+
+        event = (ngx_event_flags & NGX_USE_CLEAR_EVENT) ?
+                    /* kqueue, epoll */                 NGX_CLEAR_EVENT:
+                    /* select, poll, /dev/poll */       NGX_LEVEL_EVENT;
+                    /* eventport event type has no meaning: oneshot only */
+
+        if (ngx_add_event(rev, NGX_READ_EVENT, event) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+    } else {
+        /* rtsig */
+
+        if (ngx_add_conn(c) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static int
+ngx_http_lua_socket_udp_close(lua_State *L)
+{
+    ngx_http_request_t                  *r;
+    ngx_http_lua_socket_udp_upstream_t  *u;
+
+    if (lua_gettop(L) != 1) {
+        return luaL_error(L, "expecting 1 argument "
+                          "(including the object) but seen %d", lua_gettop(L));
+    }
+
+    lua_pushlightuserdata(L, &ngx_http_lua_request_key);
+    lua_rawget(L, LUA_GLOBALSINDEX);
+    r = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    lua_rawgeti(L, 1, SOCKET_CTX_INDEX);
+    u = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (u == NULL
+        || u->udp_connection.connection == NULL
+        || u->ft_type)
+    {
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (u->waiting) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "socket busy");
+        return 2;
+    }
+
+    ngx_http_lua_socket_udp_finalize(r, u);
+
+    lua_pushinteger(L, 1);
+    return 1;
+}
+
+
+
+static int
+ngx_http_lua_socket_udp_setkeepalive(lua_State *L)
+{
+    ngx_http_request_t                  *r;
+    ngx_http_lua_socket_udp_upstream_t  *u;
+    ngx_http_lua_socket_udp_pool_t      *spool;
+    ngx_http_lua_socket_udp_pool_item_t *item;
+    ngx_http_lua_loc_conf_t             *llcf;
+    ngx_udp_connection_t                *uc;
+    ngx_connection_t                    *c;
+    ngx_queue_t                         *q;
+    ngx_str_t                            key;
+    ngx_msec_t                           timeout;
+    ngx_uint_t                           pool_size;
+    int                                  n;
+
+    n = lua_gettop(L);
+
+    if (n < 1 || n > 3) {
+        return luaL_error(L, "expecting 1 to 3 arguments "
+                          "(including the object), but got %d", n);
+    }
+
+    lua_pushlightuserdata(L, &ngx_http_lua_request_key);
+    lua_rawget(L, LUA_GLOBALSINDEX);
+    r = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (r == NULL) {
+        return luaL_error(L, "request object not found");
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    lua_rawgeti(L, 1, SOCKET_CTX_INDEX);
+    u = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (u == NULL || u->udp_connection.connection == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (u->waiting) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "socket busy");
+        return 2;
+    }
+
+    uc = &u->udp_connection;
+    c = uc->connection;
+
+    /* a receive timeout leaves the socket usable, and a late reply closes
+     * it once it is idle in the pool, but any other error does not */
+
+    if (c->read->error
+        || (u->ft_type & ~NGX_HTTP_LUA_SOCKET_FT_TIMEOUT))
+    {
+        lua_pushnil(L);
+        lua_pushliteral(L, "invalid connection");
+        return 2;
+    }
+
+    lua_rawgeti(L, 1, SOCKET_KEY_INDEX);
+    key.data = (u_char *) lua_tolstring(L, -1, &key.len);
+    if (key.data == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "key not found");
+        return 2;
+    }
+
+    lua_pushlightuserdata(L, &ngx_http_lua_socket_udp_pool_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, -2);
+    lua_rawget(L, -2);
+    spool = lua_touserdata(L, -1);
+    lua_pop(L, 3);
+
+    llcf = ngx_http_get_module_loc_conf(r, ngx_http_lua_module);
+
+    if (spool == NULL) {
+        /* create a new socket pool for the current peer key */
+
+        if (n == 3) {
+            pool_size = luaL_checkinteger(L, 3);
+
+        } else {
+            pool_size = llcf->pool_size;
+        }
+
+        if (pool_size == 0) {
+            lua_pushnil(L);
+            lua_pushliteral(L, "zero pool size");
+            return 2;
+        }
+
+        spool = ngx_http_lua_socket_udp_create_pool(L, r, &key, pool_size);
+        if (spool == NULL) {
+            return luaL_error(L, "out of memory");
+        }
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua udp socket set keepalive: saving connection %p", c);
+
+    if (ngx_queue_empty(&spool->free)) {
+
+        q = ngx_queue_last(&spool->cache);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_http_lua_socket_udp_pool_item_t, queue);
+
+        ngx_close_connection(item->connection);
+
+    } else {
+        q = ngx_queue_head(&spool->free);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_http_lua_socket_udp_pool_item_t, queue);
+    }
+
+    item->connection = c;
+    ngx_queue_insert_head(&spool->cache, q);
+
+    item->socklen = uc->socklen;
+    ngx_memcpy(&item->sockaddr, uc->sockaddr, uc->socklen);
+    item->reused = u->reused;
+
+    /* the pool owns the connection from now on */
+
+    uc->connection = NULL;
+
     if (c->read->timer_set) {
         ngx_del_timer(c->read);
     }
-#endif
 
-    (void) ngx_http_lua_socket_udp_read(r, u);
+    c->read->timedout = 0;
+
+    if (n >= 2) {
+        timeout = (ngx_msec_t) luaL_checkinteger(L, 2);
+
+    } else {
+        timeout = llcf->keepalive_timeout;
+    }
+
+    if (timeout) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "lua udp socket keepalive timeout: %M ms", timeout);
+
+        ngx_add_timer(c->read, timeout);
+    }
+
+    c->write->handler = ngx_http_lua_socket_udp_keepalive_dummy_handler;
+    c->read->handler = ngx_http_lua_socket_udp_keepalive_rev_handler;
+
+    c->data = item;
+    c->idle = 1;
+    c->log = ngx_cycle->log;
+    c->read->log = ngx_cycle->log;
+    c->write->log = ngx_cycle->log;
+
+    ngx_http_lua_socket_udp_finalize(r, u);
+
+    if (c->read->ready
+        && ngx_http_lua_socket_udp_keepalive_close_handler(c->read) != NGX_OK)
+    {
+        lua_pushnil(L);
+        lua_pushliteral(L, "connection in dubious state");
+        return 2;
+    }
+
+    lua_pushinteger(L, 1);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_socket_udp_getreusedtimes(lua_State *L)
+{
+    ngx_http_lua_socket_udp_upstream_t    *u;
+
+    if (lua_gettop(L) != 1) {
+        return luaL_error(L, "expecting 1 argument "
+                          "(including the object), but got %d", lua_gettop(L));
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    lua_rawgeti(L, 1, SOCKET_CTX_INDEX);
+    u = lua_touserdata(L, -1);
+
+    if (u == NULL || u->udp_connection.connection == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    lua_pushinteger(L, u->reused);
+    return 1;
+}
+
+
+static ngx_int_t
+ngx_http_lua_socket_udp_get_keepalive_peer(ngx_http_request_t *r,
+    lua_State *L, int key_index, ngx_http_lua_socket_udp_upstream_t *u)
+{
+    ngx_http_lua_socket_udp_pool_t      *spool;
+    ngx_http_lua_socket_udp_pool_item_t *item;
+    ngx_http_lua_ctx_t                  *ctx;
+    ngx_http_cleanup_t                  *cln;
+    ngx_udp_connection_t                *uc;
+    ngx_connection_t                    *c;
+    ngx_queue_t                         *q;
+    int                                  top;
+
+    top = lua_gettop(L);
+
+    if (key_index < 0) {
+        key_index = top + key_index + 1;
+    }
+
+    lua_pushlightuserdata(L, &ngx_http_lua_socket_udp_pool_key);
+    lua_rawget(L, LUA_REGISTRYINDEX); /* table */
+    lua_pushvalue(L, key_index); /* key */
+    lua_rawget(L, -2);
+
+    spool = lua_touserdata(L, -1);
+    lua_settop(L, top);
+
+    if (spool == NULL || ngx_queue_empty(&spool->cache)) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "lua udp socket keepalive: no idle connection");
+        return NGX_DECLINED;
+    }
+
+    q = ngx_queue_head(&spool->cache);
+    item = ngx_queue_data(q, ngx_http_lua_socket_udp_pool_item_t, queue);
+
+    uc = &u->udp_connection;
+
+    uc->sockaddr = ngx_palloc(r->pool, item->socklen);
+    if (uc->sockaddr == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(uc->sockaddr, &item->sockaddr, item->socklen);
+    uc->socklen = item->socklen;
+
+    if (u->cleanup == NULL) {
+        cln = ngx_http_cleanup_add(r, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln->handler = ngx_http_lua_socket_udp_cleanup;
+        cln->data = u;
+        u->cleanup = &cln->handler;
+    }
+
+    c = item->connection;
+
+    ngx_queue_remove(q);
+    ngx_queue_insert_head(&spool->free, q);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua udp socket get keepalive peer: using connection %p,"
+                   " fd:%d", c, c->fd);
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    c->idle = 0;
+    c->data = u;
+    c->pool = r->pool;
+    c->log = r->connection->log;
+    c->read->log = c->log;
+    c->write->log = c->log;
+
+    c->write->handler = NULL;
+    c->read->handler = ngx_http_lua_socket_udp_handler;
+
+    uc->connection = c;
+
+    u->reused = item->reused + 1;
+    u->read_event_handler = ngx_http_lua_socket_dummy_handler;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+    ctx->data = u;
+
+    return NGX_OK;
 }
 
 
-static void
-ngx_http_lua_socket_udp_handle_error(ngx_http_request_t *r,
-    ngx_http_lua_socket_udp_upstream_t *u, ngx_uint_t ft_type)
+static ngx_http_lua_socket_udp_pool_t *
+ngx_http_lua_socket_udp_create_pool(lua_State *L, ngx_http_request_t *r,
+    ngx_str_t *key, ngx_uint_t pool_size)
 {
-    ngx_http_lua_ctx_t          *ctx;
+    ngx_http_lua_socket_udp_pool_t      *spool;
+    ngx_http_lua_socket_udp_pool_item_t *items;
+    ngx_uint_t                           i;
+    size_t                               size;
+    u_char                              *p;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua udp socket handle error");
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua udp socket keepalive create connection pool for key"
+                   " \"%V\", size: %ui", key, pool_size);
 
-    u->ft_type |= ft_type;
+    size = sizeof(ngx_http_lua_socket_udp_pool_t) + key->len
+           + sizeof(ngx_http_lua_socket_udp_pool_item_t) * pool_size;
 
-#if 0
-    ngx_http_lua_socket_udp_finalize(r, u);
-#endif
+    lua_pushlightuserdata(L, &ngx_http_lua_socket_udp_pool_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushlstring(L, (char *) key->data, key->len);
 
-    u->read_event_handler = ngx_http_lua_socket_dummy_handler;
+    spool = lua_newuserdata(L, size);
+    if (spool == NULL) {
+        lua_pop(L, 2);
+        return NULL;
+    }
 
-    if (u->waiting) {
-        u->waiting = 0;
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
 
-        ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    spool->size = pool_size;
 
-        dd("setting socket_ready to 1");
+    ngx_queue_init(&spool->cache);
+    ngx_queue_init(&spool->free);
 
-        ctx->udp_socket_busy = 0;
-        ctx->udp_socket_ready = 1;
+    p = ngx_copy(spool->key, key->data, key->len);
+    *p++ = '\0';
 
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "lua udp socket waking up the current request");
+    items = (ngx_http_lua_socket_udp_pool_item_t *) p;
 
-        r->write_event_handler(r);
+    for (i = 0; i < pool_size; i++) {
+        ngx_queue_insert_head(&spool->free, &items[i].queue);
+        items[i].socket_pool = spool;
     }
+
+    return spool;
 }
 
 
 static void
-ngx_http_lua_socket_udp_cleanup(void *data)
+ngx_http_lua_socket_udp_keepalive_dummy_handler(ngx_event_t *ev)
 {
-    ngx_http_lua_socket_udp_upstream_t  *u = data;
-
-    ngx_http_request_t  *r;
-
-    r = u->request;
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "udp keepalive dummy handler");
+}
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "cleanup lua udp socket upstream request: \"%V\"", &r->uri);
 
-    ngx_http_lua_socket_udp_finalize(r, u);
+static void
+ngx_http_lua_socket_udp_keepalive_rev_handler(ngx_event_t *ev)
+{
+    (void) ngx_http_lua_socket_udp_keepalive_close_handler(ev);
 }
 
 
-static void
-ngx_http_lua_socket_udp_handler(ngx_event_t *ev)
+/*
+ * an idle connection is closed when it times out, and on any datagram or
+ * error queued on it, which would otherwise be taken for the reply to the
+ * next request that reuses it
+ */
+
+static ngx_int_t
+ngx_http_lua_socket_udp_keepalive_close_handler(ngx_event_t *ev)
 {
-    ngx_connection_t                *c;
-    ngx_http_request_t              *r;
-    ngx_http_log_ctx_t              *ctx;
+    ngx_http_lua_socket_udp_pool_item_t *item;
 
-    ngx_http_lua_socket_udp_upstream_t  *u;
+    int                n;
+    char               buf[1];
+    ngx_connection_t  *c;
 
     c = ev->data;
-    u = c->data;
-    r = u->request;
-    c = r->connection;
 
-    ctx = c->log->data;
-    ctx->current_request = r;
+    if (c->close) {
+        goto close;
+    }
 
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua udp socket handler for \"%V?%V\", wev %d", &r->uri,
-                   &r->args, (int) ev->write);
+    if (c->read->timedout) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                       "lua udp socket keepalive max idle timeout");
 
-    u->read_event_handler(r, u);
+        goto close;
+    }
 
-    ngx_http_run_posted_requests(c);
-}
+    n = recv(c->fd, buf, 1, MSG_PEEK);
 
+    if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+        /* stale event */
 
-static void
-ngx_http_lua_socket_udp_handle_success(ngx_http_request_t *r,
-    ngx_http_lua_socket_udp_upstream_t *u)
-{
-    ngx_http_lua_ctx_t          *ctx;
+        c->read->ready = 0;
 
-    u->read_event_handler = ngx_http_lua_socket_dummy_handler;
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            goto close;
+        }
 
-    if (u->waiting) {
-        u->waiting = 0;
+        return NGX_OK;
+    }
 
-        ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+close:
 
-        dd("setting socket_ready to 1");
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "lua udp socket keepalive close handler: fd:%d", c->fd);
 
-        ctx->udp_socket_busy = 0;
-        ctx->udp_socket_ready = 1;
+    item = c->data;
 
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "lua udp socket waking up the current request");
+    ngx_close_connection(c);
 
-        r->write_event_handler(r);
-    }
-}
+    ngx_queue_remove(&item->queue);
+    ngx_queue_insert_head(&item->socket_pool->free, &item->queue);
 
+    return NGX_DECLINED;
+}
 
-static ngx_int_t
-ngx_http_lua_udp_connect(ngx_udp_connection_t *uc)
-{
-    int                rc;
-    ngx_int_t          event;
-    ngx_event_t       *rev, *wev;
-    ngx_socket_t       s;
-    ngx_connection_t  *c;
 
-    s = ngx_socket(uc->sockaddr->sa_family, SOCK_DGRAM, 0);
+/*
+ * ngx.socket.udp_send(host, port, data) or ngx.socket.udp_send(path, data)
+ *
+ * sends a datagram on a socket connected once per worker and never closed,
+ * without a request, a resolver query, or any event: a datagram that the
+ * kernel does not take right away is dropped. so it never yields and can
+ * be used in every context with a request, including log_by_lua.
+ *
+ * the sockets get the smallest receive buffer as the replies are never
+ * read, and at most UDP_MAX_NOWAIT_PEERS sockets are opened.
+ */
 
-    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, &uc->log, 0, "UDP socket %d", s);
+static int
+ngx_http_lua_socket_udp_send_nowait(lua_State *L)
+{
+    int                      n, type, rcvbuf;
+    size_t                   len;
+    u_char                  *p;
+    const char              *msg;
+    ngx_http_request_t      *r;
+    ngx_int_t                port;
+    ngx_socket_t            *s;
+    ngx_err_t                err;
+    ssize_t                  sent;
+    in_addr_t                addr;
+    socklen_t                socklen;
+    struct sockaddr         *sa;
+    struct sockaddr_in       sin;
+#if (NGX_HAVE_UNIX_DOMAIN)
+    struct sockaddr_un       saun;
+#endif
 
-    if (s == -1) {
-        ngx_log_error(NGX_LOG_ALERT, &uc->log, ngx_socket_errno,
-                      ngx_socket_n " failed");
-        return NGX_ERROR;
+    n = lua_gettop(L);
+    if (n != 2 && n != 3) {
+        return luaL_error(L, "expecting 2 or 3 arguments, but got %d", n);
     }
 
-    c = ngx_get_connection(s, &uc->log);
+    /* a socket created by init_by_lua would be shared by all the workers */
 
-    if (c == NULL) {
-        if (ngx_close_socket(s) == -1) {
-            ngx_log_error(NGX_LOG_ALERT, &uc->log, ngx_socket_errno,
-                          ngx_close_socket_n "failed");
-        }
+    lua_pushlightuserdata(L, &ngx_http_lua_request_key);
+    lua_rawget(L, LUA_GLOBALSINDEX);
+    r = lua_touserdata(L, -1);
+    lua_pop(L, 1);
 
-        return NGX_ERROR;
+    if (r == NULL) {
+        return luaL_error(L, "no request found");
     }
 
-    if (ngx_nonblocking(s) == -1) {
-        ngx_log_error(NGX_LOG_ALERT, &uc->log, ngx_socket_errno,
-                      ngx_nonblocking_n " failed");
+    p = (u_char *) luaL_checklstring(L, 1, &len);
 
-        ngx_free_connection(c);
+    /* the key is "host:port" or the unix domain socket path */
 
-        if (ngx_close_socket(s) == -1) {
-            ngx_log_error(NGX_LOG_ALERT, &uc->log, ngx_socket_errno,
-                          ngx_close_socket_n " failed");
-        }
+    lua_pushvalue(L, 1);
 
-        return NGX_ERROR;
-    }
+    if (n == 3) {
+        port = luaL_checkinteger(L, 2);
 
-    rev = c->read;
-    wev = c->write;
+        lua_pushliteral(L, ":");
+        lua_pushvalue(L, 2);
+        lua_concat(L, 3);
 
-    rev->log = &uc->log;
-    wev->log = &uc->log;
+    } else {
+        port = 0;
+    }
 
-    uc->connection = c;
+    lua_pushlightuserdata(L, &ngx_http_lua_socket_udp_nowait_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, -2);
+    lua_rawget(L, -2);
 
-    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+    /* stack: args... key sockets socket? */
 
-#if (NGX_THREADS)
+    s = lua_touserdata(L, -1);
 
-    /* TODO: lock event when call completion handler */
+    if (s == NULL) {
+        lua_pop(L, 1);
 
-    rev->lock = &c->lock;
-    wev->lock = &c->lock;
-    rev->own_lock = &c->lock;
-    wev->own_lock = &c->lock;
+        if (ngx_http_lua_socket_udp_nowait_n >= UDP_MAX_NOWAIT_PEERS) {
+            lua_pushnil(L);
+            lua_pushliteral(L, "too many peers");
+            return 2;
+        }
 
+        if (n == 2) {
+#if (NGX_HAVE_UNIX_DOMAIN)
+            if (len <= sizeof("unix:") - 1
+                || ngx_strncasecmp(p, (u_char *) "unix:", sizeof("unix:") - 1)
+                   != 0
+                || len - (sizeof("unix:") - 1) >= sizeof(saun.sun_path))
+            {
+                lua_pushnil(L);
+                lua_pushfstring(L, "bad unix domain socket path \"%s\"", p);
+                return 2;
+            }
+
+            ngx_memzero(&saun, sizeof(struct sockaddr_un));
+
+            saun.sun_family = AF_UNIX;
+            ngx_memcpy(saun.sun_path, p + sizeof("unix:") - 1,
+                       len - (sizeof("unix:") - 1));
+
+            sa = (struct sockaddr *) &saun;
+            socklen = sizeof(struct sockaddr_un);
+#else
+            lua_pushnil(L);
+            lua_pushliteral(L, "unix domain sockets not supported");
+            return 2;
 #endif
 
-    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, &uc->log, 0,
-                   "connect to %V, fd:%d #%d", &uc->server, s, c->number);
+        } else {
+            if (port <= 0 || port > 65535) {
+                lua_pushnil(L);
+                lua_pushfstring(L, "bad port number: %d", (int) port);
+                return 2;
+            }
 
-    rc = connect(s, uc->sockaddr, uc->socklen);
+            addr = ngx_inet_addr(p, len);
 
-    /* TODO: aio, iocp */
+            if (addr == INADDR_NONE) {
+                lua_pushnil(L);
+                lua_pushfstring(L, "bad IP address \"%s\"", p);
+                return 2;
+            }
 
-    if (rc == -1) {
-        ngx_log_error(NGX_LOG_CRIT, &uc->log, ngx_socket_errno,
-                      "connect() failed");
+            ngx_memzero(&sin, sizeof(struct sockaddr_in));
 
-        return NGX_ERROR;
-    }
+            sin.sin_family = AF_INET;
+            sin.sin_port = htons((in_port_t) port);
+            sin.sin_addr.s_addr = addr;
 
-    /* UDP sockets are always ready to write */
-    wev->ready = 1;
+            sa = (struct sockaddr *) &sin;
+            socklen = sizeof(struct sockaddr_in);
+        }
 
-    if (ngx_add_event) {
+        s = lua_newuserdata(L, sizeof(ngx_socket_t));
 
-        event = (ngx_event_flags & NGX_USE_CLEAR_EVENT) ?
-                    /* kqueue, epoll */                 NGX_CLEAR_EVENT:
-                    /* select, poll, /dev/poll */       NGX_LEVEL_EVENT;
-                    /* eventport event type has no meaning: oneshot only */
+        *s = ngx_socket(sa->sa_family, SOCK_DGRAM, 0);
 
-        if (ngx_add_event(rev, NGX_READ_EVENT, event) != NGX_OK) {
-            return NGX_ERROR;
+        if (*s == (ngx_socket_t) -1) {
+            return ngx_http_lua_socket_udp_nowait_error(L, ngx_socket_errno);
         }
 
-    } else {
-        /* rtsig */
+        lua_createtable(L, 0 /* narr */, 1 /* nrec */); /* metatable */
+        lua_pushcfunction(L, ngx_http_lua_socket_udp_nowait_destroy);
+        lua_setfield(L, -2, "__gc");
+        lua_setmetatable(L, -2);
 
-        if (ngx_add_conn(c) == NGX_ERROR) {
-            return NGX_ERROR;
+        /* the replies are never read, so let the kernel drop them */
+
+        rcvbuf = 1;
+
+        if (ngx_nonblocking(*s) == -1
+            || setsockopt(*s, SOL_SOCKET, SO_RCVBUF, (const void *) &rcvbuf,
+                          sizeof(int))
+               == -1
+            || connect(*s, sa, socklen) == -1)
+        {
+            return ngx_http_lua_socket_udp_nowait_error(L, ngx_socket_errno);
         }
-    }
 
-    return NGX_OK;
-}
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "lua udp_send connected to \"%s\", fd:%d",
+                       lua_tostring(L, -3), *s);
 
+        /* stack: args... key sockets socket */
 
-static int
-ngx_http_lua_socket_udp_close(lua_State *L)
-{
-    ngx_http_request_t                  *r;
-    ngx_http_lua_socket_udp_upstream_t  *u;
+        lua_pushvalue(L, -3);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
 
-    if (lua_gettop(L) != 1) {
-        return luaL_error(L, "expecting 1 argument "
-                          "(including the object) but seen %d", lua_gettop(L));
+        ngx_http_lua_socket_udp_nowait_n++;
     }
 
-    lua_pushlightuserdata(L, &ngx_http_lua_request_key);
-    lua_rawget(L, LUA_GLOBALSINDEX);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    type = lua_type(L, n);
+    switch (type) {
+        case LUA_TNUMBER:
+        case LUA_TSTRING:
+            p = (u_char *) lua_tolstring(L, n, &len);
+            break;
 
-    luaL_checktype(L, 1, LUA_TTABLE);
+        case LUA_TTABLE:
+            len = ngx_http_lua_calc_strlen_in_table(L, n, n, 1 /* strict */);
 
-    lua_rawgeti(L, 1, SOCKET_CTX_INDEX);
-    u = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+            if (len <= UDP_MAX_DATAGRAM_SIZE) {
+                p = ngx_http_lua_socket_udp_buffer;
 
-    if (u == NULL
-        || u->udp_connection.connection == NULL
-        || u->ft_type)
-    {
-        lua_pushnil(L);
-        lua_pushliteral(L, "closed");
-        return 2;
+            } else {
+                p = lua_newuserdata(L, len);
+            }
+
+            (void) ngx_http_lua_copy_str_in_table(L, n, p);
+            break;
+
+        default:
+            msg = lua_pushfstring(L, "string, number, or array table "
+                                  "expected, got %s", lua_typename(L, type));
+
+            return luaL_argerror(L, n, msg);
     }
 
-    if (u->waiting) {
-        lua_pushnil(L);
-        lua_pushliteral(L, "socket busy");
-        return 2;
+    sent = send(*s, p, len, 0);
+
+    if (sent == -1 && ngx_socket_errno == NGX_ECONNREFUSED) {
+        /* the error was queued by an ICMP message about an earlier
+         * datagram, and this one has not been sent */
+
+        sent = send(*s, p, len, 0);
     }
 
-    ngx_http_lua_socket_udp_finalize(r, u);
+    if (sent == -1) {
+        err = ngx_socket_errno;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, err,
+                       "lua udp_send dropped %uz bytes, fd:%d", len, *s);
+
+        return ngx_http_lua_socket_udp_nowait_error(L, err);
+    }
 
     lua_pushinteger(L, 1);
     return 1;
 }
 
+
+static int
+ngx_http_lua_socket_udp_nowait_error(lua_State *L, ngx_err_t err)
+{
+    u_char           errstr[NGX_MAX_ERROR_STR];
+    u_char          *p;
+
+    lua_pushnil(L);
+
+#if (nginx_version >= 1000000)
+    p = ngx_strerror(err, errstr, sizeof(errstr));
+#else
+    p = ngx_strerror_r(err, errstr, sizeof(errstr));
+#endif
+
+    /* for compatibility with LuaSocket */
+    ngx_strlow(errstr, errstr, p - errstr);
+    lua_pushlstring(L, (char *) errstr, p - errstr);
+
+    return 2;
+}
+
+
+static int
+ngx_http_lua_socket_udp_nowait_destroy(lua_State *L)
+{
+    ngx_socket_t        *s;
+
+    s = lua_touserdata(L, 1);
+
+    if (s && *s != (ngx_socket_t) -1) {
+        (void) ngx_close_socket(*s);
+        *s = (ngx_socket_t) -1;
+    }
+
+    return 0;
+}
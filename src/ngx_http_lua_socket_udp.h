@@ -18,6 +18,33 @@ typedef void (*ngx_http_lua_socket_udp_upstream_handler_pt)(
           ngx_http_request_t *r, ngx_http_lua_socket_udp_upstream_t *u);
 
 
+/* the idle connections to one peer, kept across the requests */
+typedef struct {
+    ngx_uint_t                         size;
+
+    /* queues of ngx_http_lua_socket_udp_pool_item_t: */
+    ngx_queue_t                        cache;
+    ngx_queue_t                        free;
+
+    u_char                             key[1];
+
+} ngx_http_lua_socket_udp_pool_t;
+
+
+typedef struct {
+    ngx_http_lua_socket_udp_pool_t  *socket_pool;
+
+    ngx_queue_t                      queue;
+    ngx_connection_t                *connection;
+
+    socklen_t                        socklen;
+    struct sockaddr_storage          sockaddr;
+
+    ngx_uint_t                       reused;
+
+} ngx_http_lua_socket_udp_pool_item_t;
+
+
 struct ngx_http_lua_socket_udp_upstream_s {
     ngx_http_lua_socket_udp_retval_handler          prepare_retvals;
     ngx_http_lua_socket_udp_upstream_handler_pt     read_event_handler;
@@ -35,6 +62,9 @@ struct ngx_http_lua_socket_udp_upstream_s {
     ngx_err_t                        socket_errno;
     size_t                           received; /* for receive */
     size_t                           recv_buf_size;
+    ngx_uint_t                       batch; /* for receive_batch */
+
+    ngx_uint_t                       reused;
 
     unsigned                         waiting:1;
 };
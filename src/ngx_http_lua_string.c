@@ -47,6 +47,19 @@ static int ngx_http_lua_ngx_decode_args(lua_State *L);
 #if (NGX_OPENSSL)
 static int ngx_http_lua_ngx_hmac_sha1(lua_State *L);
 #endif
+static int ngx_http_lua_ngx_md5_new(lua_State *L);
+#if (NGX_HAVE_SHA1)
+static int ngx_http_lua_ngx_sha1_new(lua_State *L);
+#endif
+static int ngx_http_lua_ngx_crc32_new(lua_State *L);
+static int ngx_http_lua_digest_new(lua_State *L, ngx_uint_t type);
+static ngx_http_lua_digest_t *ngx_http_lua_digest_check(lua_State *L);
+static int ngx_http_lua_ngx_digest_update(lua_State *L);
+static int ngx_http_lua_ngx_digest_final(lua_State *L);
+static int ngx_http_lua_ngx_digest_reset(lua_State *L);
+
+
+static char ngx_http_lua_digest_metatable_key;
 
 
 void
@@ -94,6 +107,36 @@ ngx_http_lua_inject_string_api(lua_State *L)
     lua_pushcfunction(L, ngx_http_lua_ngx_hmac_sha1);
     lua_setfield(L, -2, "hmac_sha1");
 #endif
+
+    lua_pushcfunction(L, ngx_http_lua_ngx_md5_new);
+    lua_setfield(L, -2, "md5_new");
+
+#if (NGX_HAVE_SHA1)
+    lua_pushcfunction(L, ngx_http_lua_ngx_sha1_new);
+    lua_setfield(L, -2, "sha1_new");
+#endif
+
+    lua_pushcfunction(L, ngx_http_lua_ngx_crc32_new);
+    lua_setfield(L, -2, "crc32_new");
+
+    /* {{{ digest object metatable */
+    lua_pushlightuserdata(L, &ngx_http_lua_digest_metatable_key);
+    lua_createtable(L, 0 /* narr */, 4 /* nrec */);
+
+    lua_pushcfunction(L, ngx_http_lua_ngx_digest_update);
+    lua_setfield(L, -2, "update");
+
+    lua_pushcfunction(L, ngx_http_lua_ngx_digest_final);
+    lua_setfield(L, -2, "final");
+
+    lua_pushcfunction(L, ngx_http_lua_ngx_digest_reset);
+    lua_setfield(L, -2, "reset");
+
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    /* }}} */
 }
 
 
@@ -660,3 +703,222 @@ ngx_http_lua_ngx_hmac_sha1(lua_State *L)
 }
 #endif
 
+
+static int
+ngx_http_lua_ngx_md5_new(lua_State *L)
+{
+    return ngx_http_lua_digest_new(L, NGX_HTTP_LUA_DIGEST_MD5);
+}
+
+
+#if (NGX_HAVE_SHA1)
+static int
+ngx_http_lua_ngx_sha1_new(lua_State *L)
+{
+    return ngx_http_lua_digest_new(L, NGX_HTTP_LUA_DIGEST_SHA1);
+}
+#endif
+
+
+static int
+ngx_http_lua_ngx_crc32_new(lua_State *L)
+{
+    return ngx_http_lua_digest_new(L, NGX_HTTP_LUA_DIGEST_CRC32);
+}
+
+
+static int
+ngx_http_lua_digest_new(lua_State *L, ngx_uint_t type)
+{
+    ngx_http_lua_digest_t       *d;
+
+    if (lua_gettop(L) != 0) {
+        return luaL_error(L, "expecting zero arguments, but got %d",
+                          lua_gettop(L));
+    }
+
+    d = lua_newuserdata(L, sizeof(ngx_http_lua_digest_t));
+
+    ngx_http_lua_digest_init(d, type);
+
+    lua_pushlightuserdata(L, &ngx_http_lua_digest_metatable_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+
+static ngx_http_lua_digest_t *
+ngx_http_lua_digest_check(lua_State *L)
+{
+    ngx_http_lua_digest_t       *d;
+
+    d = lua_touserdata(L, 1);
+
+    if (d == NULL || !lua_getmetatable(L, 1)) {
+        luaL_argerror(L, 1, "digest object expected");
+        return NULL;
+    }
+
+    lua_pushlightuserdata(L, &ngx_http_lua_digest_metatable_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+
+    if (!lua_rawequal(L, -1, -2)) {
+        luaL_argerror(L, 1, "digest object expected");
+        return NULL;
+    }
+
+    lua_pop(L, 2);
+
+    return d;
+}
+
+
+/* also used by tcpsock:receiveto() for the digests of the data received */
+
+void
+ngx_http_lua_digest_init(ngx_http_lua_digest_t *d, ngx_uint_t type)
+{
+    d->type = type;
+
+    switch (type) {
+        case NGX_HTTP_LUA_DIGEST_MD5:
+            ngx_md5_init(&d->u.md5);
+            break;
+
+#if (NGX_HAVE_SHA1)
+        case NGX_HTTP_LUA_DIGEST_SHA1:
+            ngx_sha1_init(&d->u.sha1);
+            break;
+#endif
+
+        default: /* NGX_HTTP_LUA_DIGEST_CRC32 */
+            ngx_crc32_init(d->u.crc32);
+            break;
+    }
+
+    d->finalized = 0;
+}
+
+
+void
+ngx_http_lua_digest_update(ngx_http_lua_digest_t *d, u_char *p, size_t len)
+{
+    switch (d->type) {
+        case NGX_HTTP_LUA_DIGEST_MD5:
+            ngx_md5_update(&d->u.md5, p, len);
+            break;
+
+#if (NGX_HAVE_SHA1)
+        case NGX_HTTP_LUA_DIGEST_SHA1:
+            ngx_sha1_update(&d->u.sha1, p, len);
+            break;
+#endif
+
+        default: /* NGX_HTTP_LUA_DIGEST_CRC32 */
+            ngx_crc32_update(&d->u.crc32, p, len);
+            break;
+    }
+}
+
+
+/* pushes the binary md5 or sha1 digest, or the crc32 number */
+
+void
+ngx_http_lua_digest_final(lua_State *L, ngx_http_lua_digest_t *d)
+{
+    u_char                       md5_buf[MD5_DIGEST_LENGTH];
+#if (NGX_HAVE_SHA1)
+    u_char                       sha_buf[SHA_DIGEST_LENGTH];
+#endif
+
+    d->finalized = 1;
+
+    switch (d->type) {
+        case NGX_HTTP_LUA_DIGEST_MD5:
+            ngx_md5_final(md5_buf, &d->u.md5);
+            lua_pushlstring(L, (char *) md5_buf, sizeof(md5_buf));
+            break;
+
+#if (NGX_HAVE_SHA1)
+        case NGX_HTTP_LUA_DIGEST_SHA1:
+            ngx_sha1_final(sha_buf, &d->u.sha1);
+            lua_pushlstring(L, (char *) sha_buf, sizeof(sha_buf));
+            break;
+#endif
+
+        default: /* NGX_HTTP_LUA_DIGEST_CRC32 */
+            ngx_crc32_final(d->u.crc32);
+            lua_pushnumber(L, (lua_Number) d->u.crc32);
+            break;
+    }
+}
+
+
+static int
+ngx_http_lua_ngx_digest_update(lua_State *L)
+{
+    u_char                      *p;
+    size_t                       len;
+    ngx_http_lua_digest_t       *d;
+
+    if (lua_gettop(L) != 2) {
+        return luaL_error(L, "expecting 2 arguments (including the object), "
+                          "but got %d", lua_gettop(L));
+    }
+
+    d = ngx_http_lua_digest_check(L);
+
+    if (d->finalized) {
+        return luaL_error(L, "digest already finalized");
+    }
+
+    p = (u_char *) luaL_checklstring(L, 2, &len);
+
+    ngx_http_lua_digest_update(d, p, len);
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_ngx_digest_final(lua_State *L)
+{
+    ngx_http_lua_digest_t       *d;
+
+    if (lua_gettop(L) != 1) {
+        return luaL_error(L, "expecting 1 argument (including the object), "
+                          "but got %d", lua_gettop(L));
+    }
+
+    d = ngx_http_lua_digest_check(L);
+
+    if (d->finalized) {
+        return luaL_error(L, "digest already finalized");
+    }
+
+    ngx_http_lua_digest_final(L, d);
+
+    return 1;
+}
+
+
+static int
+ngx_http_lua_ngx_digest_reset(lua_State *L)
+{
+    ngx_http_lua_digest_t       *d;
+
+    if (lua_gettop(L) != 1) {
+        return luaL_error(L, "expecting 1 argument (including the object), "
+                          "but got %d", lua_gettop(L));
+    }
+
+    d = ngx_http_lua_digest_check(L);
+
+    ngx_http_lua_digest_init(d, d->type);
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
@@ -3,10 +3,42 @@
 
 
 #include "ngx_http_lua_common.h"
+#include <ngx_md5.h>
+#if (NGX_HAVE_SHA1)
+#include <ngx_sha1.h>
+#endif
+
+
+enum {
+    NGX_HTTP_LUA_DIGEST_MD5 = 0,
+    NGX_HTTP_LUA_DIGEST_SHA1,
+    NGX_HTTP_LUA_DIGEST_CRC32,
+    NGX_HTTP_LUA_DIGEST_TYPES
+};
+
+
+/* the state of an incremental digest */
+typedef struct {
+    ngx_uint_t                   type;
+
+    union {
+        ngx_md5_t                md5;
+#if (NGX_HAVE_SHA1)
+        ngx_sha1_t               sha1;
+#endif
+        uint32_t                 crc32;
+    } u;
+
+    unsigned                     finalized:1;
+} ngx_http_lua_digest_t;
 
 
 void ngx_http_lua_inject_string_api(lua_State *L);
 
+void ngx_http_lua_digest_init(ngx_http_lua_digest_t *d, ngx_uint_t type);
+void ngx_http_lua_digest_update(ngx_http_lua_digest_t *d, u_char *p,
+    size_t len);
+void ngx_http_lua_digest_final(lua_State *L, ngx_http_lua_digest_t *d);
 
-#endif /* NGX_HTTP_LUA_STRING_H */
 
+#endif /* NGX_HTTP_LUA_STRING_H */
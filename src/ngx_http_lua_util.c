@@ -41,6 +41,7 @@ char ngx_http_lua_code_cache_key;
 char ngx_http_lua_ctx_tables_key;
 char ngx_http_lua_regex_cache_key;
 char ngx_http_lua_socket_pool_key;
+char ngx_http_lua_socket_udp_pool_key;
 char ngx_http_lua_request_key;
 
 
@@ -525,6 +526,11 @@ ngx_http_lua_init_registry(ngx_conf_t *cf, lua_State *L)
     lua_newtable(L);
     lua_rawset(L, LUA_REGISTRYINDEX);
 
+    /* create the registry entry for the Lua udp socket pool table */
+    lua_pushlightuserdata(L, &ngx_http_lua_socket_udp_pool_key);
+    lua_newtable(L);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
 #if (NGX_PCRE)
     /* create the registry entry for the Lua precompiled regex object cache */
     lua_pushlightuserdata(L, &ngx_http_lua_regex_cache_key);
@@ -1174,6 +1180,18 @@ ngx_http_lua_wev_handler(ngx_http_request_t *r)
     }
 
     if (ctx->socket_busy && !ctx->socket_ready) {
+        tcp = ctx->data;
+
+        if (tcp->stream && tcp->stream->paused && !c->buffered) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                           "lua tcp socket stream resumed");
+
+            /* the client has taken the data received by receiveto() */
+
+            tcp->stream->paused = 0;
+            ngx_post_event(tcp->peer.connection->read, &ngx_posted_events);
+        }
+
         return NGX_DONE;
     }
 
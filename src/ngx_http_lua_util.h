@@ -25,6 +25,7 @@ extern char ngx_http_lua_regex_cache_key;
 /* char whose address we'll use as key in Lua vm registry for
  * socket connection pool table */
 extern char ngx_http_lua_socket_pool_key;
+extern char ngx_http_lua_socket_udp_pool_key;
 
 /* char whose address we'll use as key for the nginx request pointer */
 extern char ngx_http_lua_request_key;
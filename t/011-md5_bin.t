@@ -150,3 +150,37 @@ GET /md5_bin
 --- response_body
 d41d8cd98f00b204e9800998ecf8427e
 
+
+
+
+=== TEST 9: incremental md5 hash objects
+--- config
+    location /t {
+        content_by_lua '
+            local function hex(s)
+                return (string.gsub(s, ".", function (c)
+                    return string.format("%02x", string.byte(c))
+                end))
+            end
+
+            local md5 = ngx.md5_new()
+
+            for _, s in ipairs({"hel", "", "lo, ", "world"}) do
+                md5:update(s)
+            end
+
+            ngx.say(hex(md5:final()) == ngx.md5("hello, world"))
+
+            ngx.say(pcall(md5.update, md5, "hello"))
+
+            md5:reset()
+            md5:update("hello")
+            ngx.say(hex(md5:final()))
+        ';
+    }
+--- request
+GET /t
+--- response_body
+true
+false	digest already finalized
+5d41402abc4b2a76b9719d911017c592
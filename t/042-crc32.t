@@ -56,3 +56,27 @@ GET /test
 --- response_body
 0
 
+
+
+
+=== TEST 4: incremental crc32 hash objects
+--- config
+    location = /test {
+        content_by_lua '
+            local crc32 = ngx.crc32_new()
+
+            for _, s in ipairs({"hel", "", "lo, ", "world"}) do
+                crc32:update(s)
+            end
+
+            ngx.say(crc32:final() == ngx.crc32_long("hello, world"))
+
+            crc32:reset()
+            ngx.say(crc32:final())
+        ';
+    }
+--- request
+GET /test
+--- response_body
+true
+0
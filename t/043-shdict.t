@@ -1079,3 +1079,521 @@ GET /t
 nil nil
 nil nil
 
+
+
+
+=== TEST 45: striped zone, set and get
+--- http_config
+    lua_shared_dict dogs 1m stripes=4;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            for i = 1, 100 do
+                dogs:set("key" .. i, i)
+            end
+            local sum = 0
+            for i = 1, 100 do
+                sum = sum + dogs:get("key" .. i)
+            end
+            ngx.say("sum: ", sum)
+            ngx.say(dogs:incr("key7", 3))
+            dogs:delete("key8")
+            ngx.say(dogs:get("key8"))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+sum: 5050
+10nil
+nil
+
+
+
+=== TEST 46: striped zone, flush_all
+--- http_config
+    lua_shared_dict dogs 1m stripes=8;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            for i = 1, 50 do
+                dogs:set("key" .. i, "value" .. i)
+            end
+            dogs:flush_all()
+            local n = 0
+            for i = 1, 50 do
+                if dogs:get("key" .. i) then
+                    n = n + 1
+                end
+            end
+            ngx.say("found: ", n)
+            ngx.say(dogs:add("key1", "hello"))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+found: 0
+truenilfalse
+
+
+
+=== TEST 47: hash index, set, get, replace and delete
+--- http_config
+    lua_shared_dict dogs 1m index=hash;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            for i = 1, 200 do
+                dogs:set("key" .. i, i)
+            end
+            local sum = 0
+            for i = 1, 200 do
+                sum = sum + dogs:get("key" .. i)
+            end
+            ngx.say("sum: ", sum)
+            dogs:replace("key3", "hello")
+            ngx.say(dogs:get("key3"))
+            dogs:delete("key4")
+            ngx.say(dogs:get("key4"))
+            ngx.say(dogs:get("key5"))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+sum: 20100
+hello
+nil
+5
+
+
+
+=== TEST 48: hash index with stripes, expired keys
+--- http_config
+    lua_shared_dict dogs 1m index=hash stripes=4;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            for i = 1, 20 do
+                dogs:set("key" .. i, i, 0.001)
+            end
+            dogs:set("foo", "bar")
+            ngx.location.capture("/sleep/0.002")
+            local n = 0
+            for i = 1, 20 do
+                if dogs:get("key" .. i) then
+                    n = n + 1
+                end
+            end
+            ngx.say("found: ", n)
+            ngx.say(dogs:get("foo"))
+        ';
+    }
+    location ~ ^/sleep/(.+) {
+        echo_sleep $1;
+    }
+--- request
+GET /test
+--- response_body
+found: 0
+bar
+
+
+
+=== TEST 49: get_multi
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            dogs:set("foo", 32)
+            dogs:set("bar", "hello")
+            dogs:set("baz", true)
+            dogs:set("expired", 1, 0.001)
+            ngx.location.capture("/sleep/0.002")
+            local res = dogs:get_multi({"foo", "bar", "baz", "blah", "expired"})
+            local keys = {}
+            for k, v in pairs(res) do
+                table.insert(keys, k .. "=" .. tostring(v))
+            end
+            table.sort(keys)
+            ngx.say(table.concat(keys, " "))
+        ';
+    }
+    location ~ ^/sleep/(.+) {
+        echo_sleep $1;
+    }
+--- request
+GET /test
+--- response_body
+bar=hello baz=true foo=32
+
+
+
+=== TEST 50: set_multi
+--- http_config
+    lua_shared_dict dogs 1m stripes=2;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            dogs:set("foo", "old")
+            ngx.say(dogs:set_multi({ foo = 1, bar = "two", baz = false }))
+            ngx.say(dogs:get("foo"), " ", dogs:get("bar"), " ", dogs:get("baz"))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+truenilfalse
+1 two false
+
+
+
+=== TEST 51: set_multi with bad keys
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            local ok, err = pcall(dogs.set_multi, dogs, { foo = 1, "bar" })
+            ngx.say(ok, " ", err)
+            ngx.say(dogs:get("foo"))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+false bad key type: string expected, got number
+nil
+
+
+
+=== TEST 52: background sweeper reclaims expired items
+--- http_config
+    lua_shared_dict dogs 1m sweep=10ms;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            for i = 1, 10 do
+                dogs:set("key" .. i, i, 0.001)
+            end
+            dogs:set("foo", "bar")
+            ngx.location.capture("/sleep/0.1")
+            local stats = dogs:stats()
+            ngx.say("reclaimed: ", stats.reclaimed)
+            ngx.say("evicted: ", stats.evicted)
+            ngx.say("keys: ", stats.keys)
+        ';
+    }
+    location ~ ^/sleep/(.+) {
+        echo_sleep $1;
+    }
+--- request
+GET /test
+--- response_body
+reclaimed: 10
+evicted: 0
+keys: 1
+
+
+
+=== TEST 53: stats counts LRU evictions
+--- http_config
+    lua_shared_dict dogs 100k;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            local forcible
+            for i = 1, 20000 do
+                local ok, err, f = dogs:set("key" .. i, i)
+                if f then
+                    forcible = true
+                end
+            end
+            local stats = dogs:stats()
+            ngx.say("forcible: ", forcible)
+            ngx.say("evicted: ", stats.evicted > 0)
+        ';
+    }
+--- request
+GET /test
+--- response_body
+forcible: true
+evicted: true
+
+
+
+=== TEST 54: stats counts hits, misses and sets
+--- http_config
+    lua_shared_dict dogs 1m stripes=2;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            dogs:set("foo", 1)
+            dogs:set("bar", 2)
+            dogs:set("bar", 3)
+            dogs:get("foo")
+            dogs:get("baz")
+            dogs:get_multi({"foo", "bar", "blah"})
+            local stats = dogs:stats()
+            ngx.say("keys: ", stats.keys)
+            ngx.say("hits: ", stats.hits)
+            ngx.say("misses: ", stats.misses)
+            ngx.say("sets: ", stats.sets)
+            ngx.say("free: ", stats.free_pages > 0 and stats.free_pages <= stats.pages)
+        ';
+    }
+--- request
+GET /test
+--- response_body
+keys: 2
+hits: 3
+misses: 2
+sets: 3
+free: true
+
+
+
+=== TEST 55: lpush, rpush, lpop, rpop and llen
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            ngx.say(dogs:lpush("list", "b"))
+            ngx.say(dogs:lpush("list", "a"))
+            ngx.say(dogs:rpush("list", 3.5))
+            ngx.say(dogs:llen("list"))
+            ngx.say(dogs:lpop("list"))
+            ngx.say(dogs:rpop("list"))
+            ngx.say(dogs:rpop("list"))
+            ngx.say(dogs:rpop("list"))
+            ngx.say(dogs:llen("list"))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+1
+2
+3
+3
+a
+3.5
+b
+nil
+0
+
+
+
+=== TEST 56: list operations on a non-list value
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            dogs:set("foo", "bar")
+            ngx.say(dogs:lpush("foo", "a"))
+            ngx.say(dogs:lpop("foo"))
+            ngx.say(dogs:llen("foo"))
+            dogs:rpush("list", "a")
+            ngx.say(dogs:get("list"))
+            dogs:set("list", "value")
+            ngx.say(dogs:get("list"))
+            ngx.say(dogs:llen("list"))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+nilvalue not a list
+nilvalue not a list
+nilvalue not a list
+nilvalue is a list
+value
+nilvalue not a list
+
+
+
+=== TEST 57: incr with an init value
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            ngx.say(dogs:incr("foo", 1))
+            ngx.say(dogs:incr("foo", 2, 10))
+            ngx.say(dogs:incr("foo", 2, 10))
+            dogs:set("bar", "hello")
+            ngx.say(dogs:incr("bar", 2, 10))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+nilnot found
+12nilfalse
+14nil
+nilnot a number
+
+
+
+=== TEST 58: decr, min and max
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            ngx.say(dogs:decr("foo", 1))
+            dogs:set("foo", 3)
+            ngx.say(dogs:decr("foo", 2, 0))
+            ngx.say(dogs:decr("foo", 2, 0))
+            ngx.say(dogs:decr("foo", 2))
+            ngx.say(dogs:max("m", 5))
+            ngx.say(dogs:max("m", 3))
+            ngx.say(dogs:max("m", 7))
+            ngx.say(dogs:min("m", 8))
+            ngx.say(dogs:min("m", -1))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+nilnot found
+1nil
+0nil
+-2nil
+5nilfalse
+5nil
+7nil
+7nil
+-1nil
+
+
+
+=== TEST 59: cas
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            ngx.say(dogs:cas("foo", "a", "b"))
+            ngx.say(dogs:cas("foo", nil, "a"))
+            ngx.say(dogs:cas("foo", nil, "b"))
+            ngx.say(dogs:cas("foo", "b", "c"))
+            ngx.say(dogs:cas("foo", "a", 32))
+            ngx.say(dogs:get("foo"))
+            ngx.say(dogs:cas("foo", 32, "a longer value", 0, 5))
+            ngx.say(dogs:get("foo"))
+            ngx.say(dogs:cas("foo", "a longer value", nil))
+            ngx.say(dogs:get("foo"))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+falsenot foundfalse
+truenilfalse
+falseexistsfalse
+falsechangedfalse
+truenilfalse
+32
+truenilfalse
+a longer value5
+truenilfalse
+nil
+
+
+
+=== TEST 60: get_keys with a cursor
+--- http_config
+    lua_shared_dict dogs 1m stripes=4;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            for i = 1, 100 do
+                dogs:set("key" .. i, i)
+            end
+            dogs:set("expired", 1, 0.001)
+            ngx.location.capture("/sleep/0.002")
+
+            local seen, calls, total = {}, 0, 0
+            local keys, cursor
+            repeat
+                keys, cursor = dogs:get_keys(7, cursor)
+                calls = calls + 1
+                for _, k in ipairs(keys) do
+                    if seen[k] then
+                        ngx.say("duplicate ", k)
+                    end
+                    seen[k] = true
+                    total = total + 1
+                end
+            until cursor == nil
+            ngx.say("total: ", total, ", chunked: ", calls > 10)
+            ngx.say("all: ", #dogs:get_keys(0))
+            ngx.say("default: ", #dogs:get_keys())
+        ';
+    }
+    location ~ ^/sleep/(.+) {
+        echo_sleep $1;
+    }
+--- request
+GET /test
+--- response_body
+total: 100, chunked: true
+all: 100
+default: 100
+
+
+
+=== TEST 61: flush_all and flush_expired
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            for i = 1, 10 do
+                dogs:set("key" .. i, i)
+            end
+            dogs:flush_all()
+            ngx.say(dogs:get("key1"))
+            ngx.say(#dogs:get_keys(0))
+            ngx.say(dogs:stats().keys)
+            dogs:set("key2", "new")
+            ngx.say(dogs:get("key2"))
+            ngx.say(dogs:flush_expired(3))
+            ngx.say(dogs:flush_expired())
+            ngx.say(dogs:flush_expired())
+            ngx.say(dogs:stats().keys)
+        ';
+    }
+--- request
+GET /test
+--- response_body
+nil
+0
+10
+new
+3
+5
+0
+1
@@ -5,13 +5,14 @@ use Test::Nginx::Socket;
 
 repeat_each(2);
 
-plan tests => repeat_each() * 87;
+plan tests => repeat_each() * 130;
 
 our $HtmlDir = html_dir;
 
 $ENV{TEST_NGINX_CLIENT_PORT} ||= server_port();
 $ENV{TEST_NGINX_MEMCACHED_PORT} ||= 11211;
 $ENV{TEST_NGINX_RESOLVER} ||= '8.8.8.8';
+$ENV{TEST_NGINX_FAILOVER_PORT} ||= 1985;
 
 #log_level 'warn';
 log_level 'debug';
@@ -1974,3 +1975,623 @@ close: 1 nil
 --- no_error_log
 [error]
 
+
+
+
+=== TEST 33: send nested tables with large fragments
+--- config
+    server_tokens off;
+    location /t {
+        #set $port 5000;
+        set $port $TEST_NGINX_CLIENT_PORT;
+
+        content_by_lua '
+            local sock = ngx.socket.tcp()
+            local port = ngx.var.port
+            local ok, err = sock:connect("127.0.0.1", port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            local big = string.rep("a", 200)
+            local body = {big, "-", 32, "-", {big, {"b", big}}, "\\n"}
+
+            local req = {"POST /foo HTTP/1.0\\r\\nHost: localhost\\r\\n",
+                         "Content-Length: ", 2 + 3 * 200 + 3 + 1, "\\r\\n",
+                         "Connection: close\\r\\n\\r\\n", body}
+
+            local bytes, err = sock:send(req)
+            if not bytes then
+                ngx.say("failed to send request: ", err)
+                return
+            end
+
+            ngx.say("request sent: ", bytes)
+
+            local data, err = sock:receive("*a")
+            if not data then
+                ngx.say("failed to receive: ", err)
+                return
+            end
+
+            local got = string.match(data, "\\r\\n\\r\\n(.*)$")
+            ngx.say("echoed: ", got == table.concat({big, "-32-", big, "b", big, "\\n"}))
+
+            sock:close()
+        ';
+    }
+
+    location /foo {
+        content_by_lua '
+            ngx.req.read_body()
+            ngx.print(ngx.req.get_body_data())
+        ';
+    }
+--- request
+GET /t
+--- response_body
+request sent: 685
+echoed: true
+--- no_error_log
+[error]
+
+
+
+=== TEST 34: receivemany lines from pipelined requests
+--- config
+    server_tokens off;
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+
+        content_by_lua '
+            local sock = ngx.socket.tcp()
+            local port = ngx.var.port
+            local ok, err = sock:connect("127.0.0.1", port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            local bytes, err = sock:send{"set a 0 0 1\\r\\nx\\r\\n",
+                                         "set b 0 0 1\\r\\ny\\r\\n",
+                                         "get a b\\r\\n"}
+            if not bytes then
+                ngx.say("failed to send request: ", err)
+                return
+            end
+
+            ngx.say("request sent: ", bytes)
+
+            local lines, err = sock:receivemany(7)
+            if not lines then
+                ngx.say("failed to receive: ", err)
+                return
+            end
+
+            ngx.say("received: ", table.concat(lines, "|"))
+
+            sock:close()
+        ';
+    }
+--- request
+GET /t
+--- response_body
+request sent: 41
+received: STORED|STORED|VALUE a 0 1|x|VALUE b 0 1|y|END
+--- no_error_log
+[error]
+
+
+
+=== TEST 35: receivemany with a receiveuntil iterator
+--- config
+    server_tokens off;
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+
+        content_by_lua '
+            local sock = ngx.socket.tcp()
+            local port = ngx.var.port
+            local ok, err = sock:connect("127.0.0.1", port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            local bytes, err = sock:send{"set a 0 0 1\\r\\nx\\r\\n",
+                                         "get a\\r\\n", "get a\\r\\n"}
+            if not bytes then
+                ngx.say("failed to send request: ", err)
+                return
+            end
+
+            local line, err = sock:receive()
+            ngx.say("stored: ", line)
+
+            local reader = sock:receiveuntil("END\\r\\n")
+
+            local items, err = sock:receivemany(2, reader)
+            if not items then
+                ngx.say("failed to receive: ", err)
+                return
+            end
+
+            for i, item in ipairs(items) do
+                ngx.say(i, ": ", (string.gsub(item, "\\r\\n", "|")))
+            end
+
+            sock:close()
+        ';
+    }
+--- request
+GET /t
+--- response_body
+stored: STORED
+1: VALUE a 0 1|x|
+2: VALUE a 0 1|x|
+--- no_error_log
+[error]
+
+
+
+=== TEST 36: receivemany sized items, and a timeout
+--- config
+    server_tokens off;
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+
+        content_by_lua '
+            local sock = ngx.socket.tcp()
+            local port = ngx.var.port
+            local ok, err = sock:connect("127.0.0.1", port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            local bytes, err = sock:send("set a 0 0 1\\r\\nx\\r\\nget a\\r\\n")
+            if not bytes then
+                ngx.say("failed to send request: ", err)
+                return
+            end
+
+            local line, err = sock:receive()
+            ngx.say("stored: ", line)
+
+            local items, err = sock:receivemany(3, 7)
+            if not items then
+                ngx.say("failed to receive: ", err)
+                return
+            end
+
+            for i, item in ipairs(items) do
+                ngx.say(i, ": ", (string.gsub(item, "\\r\\n", "|")))
+            end
+
+            sock:send("version\\r\\n")
+            sock:settimeout(100)
+
+            local items, err, partial = sock:receivemany(2)
+            ngx.say("items: ", tostring(items), ", err: ", err, ", partial: ", #partial,
+                    " ", string.sub(partial[1], 1, 7))
+
+            sock:close()
+        ';
+    }
+--- request
+GET /t
+--- response_body
+stored: STORED
+1: VALUE a
+2:  0 1|x
+3: |END|
+items: nil, err: timeout, partial: 1 VERSION
+--- no_error_log
+[error]
+
+
+
+=== TEST 37: lua_socket_connect_cooldown
+--- config
+    server_tokens off;
+    lua_socket_connect_cooldown 1s;
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+
+        content_by_lua '
+            local sock = ngx.socket.tcp()
+            local port = ngx.var.port
+            local ok, err = sock:connect("127.0.0.1", port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            ngx.say("connected: ", ok)
+
+            sock:close()
+        ';
+    }
+--- request
+GET /t
+--- response_body
+connected: 1
+--- no_error_log
+[error]
+
+
+
+=== TEST 38: lua_socket_resolver_cache
+--- http_config
+    lua_socket_resolver_cache 30s;
+--- config
+    server_tokens off;
+    resolver $TEST_NGINX_RESOLVER;
+    location /t {
+        content_by_lua '
+            for i = 1, 2 do
+                local sock = ngx.socket.tcp()
+                local ok, err = sock:connect("agentzh.org", 80)
+                if not ok then
+                    ngx.say("failed to connect: ", err)
+                    return
+                end
+
+                ngx.say("connected: ", ok)
+
+                sock:close()
+            end
+        ';
+    }
+--- request
+GET /t
+--- response_body
+connected: 1
+connected: 1
+--- error_log
+lua resolver cache hit: "agentzh.org"
+
+
+
+=== TEST 39: setoption and socket options in connect
+--- config
+    server_tokens off;
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+
+        content_by_lua '
+            local sock = ngx.socket.tcp()
+            local port = ngx.var.port
+            local ok, err = sock:connect("127.0.0.1", port,
+                                         { tcp_nodelay = true,
+                                           keepalive = true,
+                                           rcvbuf = 65536 })
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            ngx.say("connected: ", ok)
+
+            ok, err = sock:setoption("tcp_cork", true)
+            ngx.say("cork: ", ok, " ", err)
+
+            local bytes, err = sock:send("flush_all\\r\\n")
+            if not bytes then
+                ngx.say("failed to send request: ", err)
+                return
+            end
+
+            ok, err = sock:setoption("tcp_cork", false)
+            ngx.say("uncork: ", ok, " ", err)
+
+            local line, err = sock:receive()
+            ngx.say("received: ", line, " ", err)
+
+            ok, err = sock:setoption("foo", 1)
+            ngx.say("foo: ", ok, " ", err)
+
+            sock:close()
+
+            ok, err = sock:setoption("tcp_nodelay", true)
+            ngx.say("closed: ", ok, " ", err)
+        ';
+    }
+--- request
+GET /t
+--- response_body
+connected: 1
+cork: 1 nil
+uncork: 1 nil
+received: OK nil
+foo: nil unsupported option: foo
+closed: nil closed
+--- no_error_log
+[error]
+
+
+
+=== TEST 40: receiveto the output
+--- config
+    server_tokens off;
+    location /t {
+        set $port $TEST_NGINX_CLIENT_PORT;
+
+        content_by_lua '
+            local sock = ngx.socket.tcp()
+            local port = ngx.var.port
+            local ok, err = sock:connect("127.0.0.1", port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            ngx.say("connected: ", ok)
+
+            local req = "GET /foo HTTP/1.0\\r\\nHost: localhost\\r\\nConnection: close\\r\\n\\r\\n"
+
+            local bytes, err = sock:send(req)
+            if not bytes then
+                ngx.say("failed to send request: ", err)
+                return
+            end
+
+            local read_headers = sock:receiveuntil("\\r\\n\\r\\n")
+            local headers, err = read_headers()
+            if not headers then
+                ngx.say("failed to receive headers: ", err)
+                return
+            end
+
+            bytes, err = sock:receiveto("output")
+            ngx.say("received: ", bytes, " ", err)
+
+            sock:close()
+        ';
+    }
+
+    location /foo {
+        content_by_lua 'ngx.say("hello, world")';
+        more_clear_headers Date;
+    }
+--- request
+GET /t
+--- response_body
+connected: 1
+hello, world
+received: 13 nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 41: receiveto a file with a size
+--- config
+    server_tokens off;
+    location /t {
+        set $port $TEST_NGINX_CLIENT_PORT;
+
+        content_by_lua '
+            local sock = ngx.socket.tcp()
+            local port = ngx.var.port
+            local ok, err = sock:connect("127.0.0.1", port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            local req = "GET /foo HTTP/1.0\\r\\nHost: localhost\\r\\nConnection: close\\r\\n\\r\\n"
+
+            local bytes, err = sock:send(req)
+            if not bytes then
+                ngx.say("failed to send request: ", err)
+                return
+            end
+
+            local read_headers = sock:receiveuntil("\\r\\n\\r\\n")
+            local headers, err = read_headers()
+            if not headers then
+                ngx.say("failed to receive headers: ", err)
+                return
+            end
+
+            local bytes, path = sock:receiveto("file", 5)
+            if not bytes then
+                ngx.say("failed to receive: ", path)
+                return
+            end
+
+            ngx.say("received: ", bytes)
+
+            local f = io.open(path)
+            ngx.say("file: ", f:read("*a"))
+            f:close()
+
+            local line, err = sock:receive()
+            ngx.say("rest: ", line, " ", err)
+
+            sock:close()
+        ';
+    }
+
+    location /foo {
+        content_by_lua 'ngx.say("hello, world")';
+        more_clear_headers Date;
+    }
+--- request
+GET /t
+--- response_body
+received: 5
+file: hello
+rest: , world nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 42: receive buffers reused by the next cosocket
+--- config
+    server_tokens off;
+    location /t {
+        set $port $TEST_NGINX_CLIENT_PORT;
+
+        content_by_lua '
+            for i = 1, 2 do
+                local sock = ngx.socket.tcp()
+                local ok, err = sock:connect("127.0.0.1", ngx.var.port)
+                if not ok then
+                    ngx.say("failed to connect: ", err)
+                    return
+                end
+
+                sock:send("GET /foo HTTP/1.0\\r\\nHost: localhost\\r\\n\\r\\n")
+
+                local line, err = sock:receive()
+                ngx.say("received: ", line)
+
+                sock:close()
+            end
+        ';
+    }
+
+    location /foo {
+        echo foo;
+    }
+--- request
+GET /t
+--- response_body
+received: HTTP/1.1 200 OK
+received: HTTP/1.1 200 OK
+--- error_log
+lua tcp socket reuse recv buf
+--- no_error_log
+[error]
+
+
+
+=== TEST 43: at most 64 receive buffers kept
+--- config
+    server_tokens off;
+    location /t {
+        set $port $TEST_NGINX_CLIENT_PORT;
+        lua_socket_buffer_size 1k;
+
+        content_by_lua '
+            local sock = ngx.socket.tcp()
+            local ok, err = sock:connect("127.0.0.1", ngx.var.port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            sock:send("GET /foo HTTP/1.0\\r\\nHost: localhost\\r\\n\\r\\n")
+
+            local data, err = sock:receive("*a")
+            if not data then
+                ngx.say("failed to receive: ", err)
+                return
+            end
+
+            ngx.say("received: ", #data > 100000)
+
+            sock:close()
+        ';
+    }
+
+    location /foo {
+        content_by_lua 'ngx.print(string.rep("a", 100000))';
+    }
+--- request
+GET /t
+--- response_body
+received: true
+--- error_log
+lua tcp socket free recv buf
+--- no_error_log
+[error]
+
+
+
+=== TEST 44: fail over to the next address, and try it last afterwards
+--- http_config
+    server {
+        listen 127.0.0.1:$TEST_NGINX_FAILOVER_PORT;
+    }
+--- config
+    server_tokens off;
+    resolver 127.0.0.1:1953;
+    lua_socket_connect_cooldown 10s;
+    location /t {
+        content_by_lua '
+            local n = 0
+            for i = 1, 20 do
+                local sock = ngx.socket.tcp()
+                local ok, err = sock:connect("failover.test",
+                                             $TEST_NGINX_FAILOVER_PORT)
+                if not ok then
+                    ngx.say("failed to connect: ", err)
+                    return
+                end
+
+                n = n + 1
+                sock:close()
+            end
+
+            ngx.say("connected: ", n)
+        ';
+    }
+--- udp_listen: 1953
+--- udp_reply eval
+# 127.0.0.2 refuses the connections, 127.0.0.1 accepts them
+sub {
+    my $req = shift;
+    my $answer = "";
+    for my $ip ("127.0.0.2", "127.0.0.1") {
+        $answer .= pack("nnnNn", 0xc00c, 1, 1, 3600, 4)
+                   . pack("C4", split /\./, $ip);
+    }
+    return substr($req, 0, 2) . pack("nnnnn", 0x8180, 1, 2, 0, 0)
+           . substr($req, 12) . $answer;
+}
+--- request
+GET /t
+--- response_body
+connected: 20
+--- grep_error_log: trying the next address
+--- grep_error_log_out
+trying the next address
+--- no_error_log
+[error]
+
+
+
+=== TEST 45: a different size for an existing pool is ignored with a warning
+--- config
+    server_tokens off;
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+
+        content_by_lua '
+            for _, size in ipairs({10, 20}) do
+                local sock = ngx.socket.tcp()
+                local ok, err = sock:connect("127.0.0.1", ngx.var.port)
+                if not ok then
+                    ngx.say("failed to connect: ", err)
+                    return
+                end
+
+                local ok, err = sock:setkeepalive(0, size)
+                ngx.say("setkeepalive: ", ok, " ", err)
+            end
+        ';
+    }
+--- request
+GET /t
+--- response_body
+setkeepalive: 1 nil
+setkeepalive: 1 nil
+--- error_log eval
+qr/lua tcp socket pool "127\.0\.0\.1:\d+" keeps its size 10, ignoring 20/
+--- no_error_log
+[error]
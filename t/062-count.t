@@ -35,7 +35,7 @@ __DATA__
 --- request
 GET /test
 --- response_body
-ngx: 88
+ngx: 91
 --- no_error_log
 [error]
 
@@ -56,7 +56,7 @@ ngx: 88
 --- request
 GET /test
 --- response_body
-88
+91
 --- no_error_log
 [error]
 
@@ -84,7 +84,7 @@ GET /test
 --- request
 GET /test
 --- response_body
-n = 88
+n = 91
 --- no_error_log
 [error]
 
@@ -213,7 +213,7 @@ n = 2
 --- request
 GET /test
 --- response_body
-n = 3
+n = 5
 --- no_error_log
 [error]
 
@@ -234,7 +234,7 @@ n = 3
 --- request
 GET /test
 --- response_body
-n = 10
+n = 11
 --- no_error_log
 [error]
 
@@ -255,7 +255,7 @@ n = 10
 --- request
 GET /test
 --- response_body
-n = 4
+n = 5
 --- no_error_log
 [error]
 
@@ -279,7 +279,7 @@ n = 4
 --- request
 GET /test
 --- response_body
-n = 8
+n = 22
 --- no_error_log
 [error]
 
@@ -301,5 +301,5 @@ GET /t
 --- response_body_like: 404 Not Found
 --- error_code: 404
 --- error_log
-ngx. entry count: 88
+ngx. entry count: 91
 
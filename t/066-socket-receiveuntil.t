@@ -1330,3 +1330,51 @@ ok
 --- no_error_log
 [error]
 
+
+
+
+=== TEST 20: long patterns with near misses, with and without size
+--- config
+    location /t {
+        content_by_lua '
+            local sock, err = ngx.req.socket()
+            if not sock then
+                ngx.say("failed to get req socket: ", err)
+                return
+            end
+
+            local reader = sock:receiveuntil("--abcdefghijklmnopqrstuvwxyz")
+
+            local data, err, part = reader()
+            if not data then
+                ngx.say("failed to read: ", err, " [", part, "]")
+                return
+            end
+
+            ngx.say("read: ", data)
+
+            while true do
+                local data, err = reader(4)
+                if not data then
+                    ngx.say("done: ", err)
+                    break
+                end
+
+                ngx.say("chunk: ", data)
+            end
+
+            ngx.say("rest: ", (sock:receive(3)))
+        ';
+    }
+--- request
+POST /t
+hello --abcdefghijklmno world--abcdefghijklmnopqrstuvwxyz0123456789--abcdefghijklmnopqrstuvwxyzend
+--- response_body
+read: hello --abcdefghijklmno world
+chunk: 0123
+chunk: 4567
+chunk: 89
+done: nil
+rest: end
+--- no_error_log
+[error]
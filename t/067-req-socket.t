@@ -5,12 +5,13 @@ use Test::Nginx::Socket;
 
 repeat_each(2);
 
-plan tests => repeat_each() * (blocks() * 3 + 3);
+plan tests => repeat_each() * (blocks() * 3 + 4);
 
 our $HtmlDir = html_dir;
 
 $ENV{TEST_NGINX_CLIENT_PORT} ||= server_port();
-#$ENV{TEST_NGINX_MEMCACHED_PORT} ||= 11211;
+$ENV{TEST_NGINX_MEMCACHED_PORT} ||= 11211;
+$ENV{TEST_NGINX_SLOW_PORT} ||= 1985;
 
 no_long_string();
 #no_diff();
@@ -521,3 +522,277 @@ Expect: 100-Continue
 --- no_error_log
 [error]
 
+
+
+
+=== TEST 8: proxy the request body to memcached
+--- config
+    server_tokens off;
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+
+        content_by_lua '
+            local reqsock, err = ngx.req.socket()
+            if not reqsock then
+                ngx.say("failed to get the request socket: ", err)
+                return
+            end
+
+            local sock = ngx.socket.tcp()
+            local ok, err = sock:connect("127.0.0.1", ngx.var.port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            local sent, received = ngx.socket.proxy(reqsock, sock)
+            ngx.say("sent: ", sent, ", received: ", received)
+
+            sock:close()
+        ';
+    }
+--- request eval
+"POST /t
+set foo 0 0 5\r
+hello\r
+get foo\r
+quit\r
+"
+--- response_body eval
+"STORED\r
+VALUE foo 0 5\r
+hello\r
+END\r
+sent: 37, received: 35
+"
+--- no_error_log
+[error]
+
+
+
+=== TEST 9: checksum the request body with receiveto
+--- config
+    location /t {
+        content_by_lua '
+            local sock, err = ngx.req.socket()
+            if not sock then
+                ngx.say("failed to get the request socket: ", err)
+                return
+            end
+
+            local bytes, sums = sock:receiveto("discard", 5, {md5 = true})
+            if not bytes then
+                ngx.say("failed to receive: ", sums)
+                return
+            end
+
+            ngx.say("received ", bytes, ", md5: ",
+                    sums.md5 == ngx.md5_bin("hello"))
+
+            local bytes, sums = sock:receiveto("discard",
+                                               {crc32 = true, sha1 = true})
+            if not bytes then
+                ngx.say("failed to receive: ", sums)
+                return
+            end
+
+            ngx.say("received ", bytes, ", crc32: ",
+                    sums.crc32 == ngx.crc32_long(", world"), ", sha1: ",
+                    sums.sha1 == ngx.sha1_bin(", world"), ", md5: ",
+                    sums.md5)
+        ';
+    }
+--- request
+POST /t
+hello, world
+--- response_body
+received 5, md5: true
+received 7, crc32: true, sha1: true, md5: nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 10: receive buffers returned after a request socket read
+--- config
+    location /t {
+        content_by_lua '
+            local sock, err = ngx.req.socket()
+            if not sock then
+                ngx.say("failed to get the request socket: ", err)
+                return
+            end
+
+            local data, err = sock:receive(5)
+            ngx.say("received: ", data)
+        ';
+    }
+--- request
+POST /t
+hello world
+--- response_body
+received: hello
+--- error_log
+lua tcp socket keep recv buf
+
+
+
+=== TEST 11: proxy a request body larger than the header buffer
+--- config
+    server_tokens off;
+    client_header_buffer_size 1k;
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+
+        content_by_lua '
+            local reqsock, err = ngx.req.socket()
+            if not reqsock then
+                ngx.say("failed to get the request socket: ", err)
+                return
+            end
+
+            local sock = ngx.socket.tcp()
+            local ok, err = sock:connect("127.0.0.1", ngx.var.port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            local sent, received = ngx.socket.proxy(reqsock, sock)
+            ngx.say("sent: ", sent, ", received: ", received)
+
+            sock:close()
+        ';
+    }
+--- request eval
+"POST /t
+set foo 0 0 100000\r
+" . ("a" x 100000) . "\r
+quit\r
+"
+--- response_body eval
+"STORED\r
+sent: 100028, received: 8
+"
+--- error_log
+lua tcp socket proxy, splice: 1
+--- no_error_log
+[error]
+
+
+
+=== TEST 12: proxy to a slow reader
+--- http_config
+    server {
+        listen 127.0.0.1:$TEST_NGINX_SLOW_PORT rcvbuf=4k;
+
+        location /slow {
+            content_by_lua '
+                local sock = ngx.req.socket()
+                local n = 0
+
+                while true do
+                    local data, err, partial = sock:receive(4096)
+                    if not data then
+                        n = n + #partial
+                        break
+                    end
+
+                    n = n + #data
+                    ngx.sleep(0.001)
+                end
+
+                ngx.say("received: ", n)
+            ';
+        }
+    }
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua '
+            local reqsock, err = ngx.req.socket()
+            if not reqsock then
+                ngx.say("failed to get the request socket: ", err)
+                return
+            end
+
+            local sock = ngx.socket.tcp()
+            local ok, err = sock:connect("127.0.0.1",
+                                         $TEST_NGINX_SLOW_PORT)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            local sent, received = ngx.socket.proxy(reqsock, sock)
+            ngx.say("sent: ", sent, ", received: ", received ~= nil)
+
+            sock:close()
+        ';
+    }
+--- request eval
+"POST /t
+POST /slow HTTP/1.0\r
+Content-Length: 200000\r
+\r
+" . ("a" x 200000)
+--- response_body_like chop
+^HTTP/1\.1 200 OK\r\n.*\r\n\r\nreceived: 200000
+sent: 200047, received: true$
+--- no_error_log
+[error]
+
+
+
+=== TEST 13: proxy after receiveto("discard") on the same cosocket
+--- config
+    server_tokens off;
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+
+        content_by_lua '
+            local reqsock, err = ngx.req.socket()
+            if not reqsock then
+                ngx.say("failed to get the request socket: ", err)
+                return
+            end
+
+            local sock = ngx.socket.tcp()
+            local ok, err = sock:connect("127.0.0.1", ngx.var.port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            local bytes, err = sock:send("set foo 0 0 5\\r\\nhello\\r\\n")
+            if not bytes then
+                ngx.say("failed to send: ", err)
+                return
+            end
+
+            -- "STORED\\r\\n"
+            local bytes, err = sock:receiveto("discard", 8, {md5 = true})
+            if not bytes then
+                ngx.say("failed to receive: ", err)
+                return
+            end
+
+            local sent, received = ngx.socket.proxy(reqsock, sock)
+            ngx.say("sent: ", sent, ", received: ", received)
+
+            sock:close()
+        ';
+    }
+--- request eval
+"POST /t
+get foo\r
+quit\r
+"
+--- response_body eval
+"VALUE foo 0 5\r
+hello\r
+END\r
+sent: 15, received: 27
+"
+--- no_error_log
+[error]
@@ -1344,3 +1344,165 @@ GET /t
 --- error_log
 bad argument #3 to 'connect' (bad "pool" option type: boolean)
 
+
+
+
+=== TEST 22: backlog 0: no more active connections than pool_size
+--- config
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+        content_by_lua '
+            local port = ngx.var.port
+            local opts = {pool_size = 1, backlog = 0}
+
+            local function connect(sock, n)
+                local ok, err = sock:connect("127.0.0.1", port, opts)
+                if not ok then
+                    ngx.say(n, ": failed to connect: ", err)
+                    return
+                end
+
+                ngx.say(n, ": connected: ", ok, ", reused: ",
+                        sock:getreusedtimes())
+            end
+
+            local sock1 = ngx.socket.tcp()
+            local sock2 = ngx.socket.tcp()
+
+            connect(sock1, 1)
+            connect(sock2, 2)
+
+            local ok, err = sock1:setkeepalive()
+            if not ok then
+                ngx.say("failed to set reusable: ", err)
+            end
+
+            connect(sock2, 3)
+            sock2:close()
+        ';
+    }
+--- request
+GET /t
+--- response_body
+1: connected: 1, reused: 0
+2: failed to connect: too many waiting connect operations
+3: connected: 1, reused: 1
+--- no_error_log
+[error]
+--- error_log eval
+["lua tcp socket keepalive create connection pool for key",
+"lua tcp socket keepalive: too many waiting connect operations"]
+
+
+
+=== TEST 23: queued connect resumed with the connection put back
+--- config
+    location = /t {
+        content_by_lua '
+            local res1, res2 = ngx.location.capture_multi{{"/a"}, {"/b"}}
+            ngx.print(res1.body)
+            ngx.print(res2.body)
+        ';
+    }
+
+    location = /a {
+        content_by_lua '
+            local sock = ngx.socket.tcp()
+            local ok, err = sock:connect("127.0.0.1", $TEST_NGINX_MEMCACHED_PORT,
+                                         {pool = "q", pool_size = 1, backlog = 1})
+            if not ok then
+                ngx.say("a: failed to connect: ", err)
+                return
+            end
+
+            ngx.say("a: connected: ", ok, ", reused: ", sock:getreusedtimes())
+
+            ngx.sleep(0.1)
+
+            local ok, err = sock:setkeepalive()
+            if not ok then
+                ngx.say("a: failed to set reusable: ", err)
+            end
+        ';
+    }
+
+    location = /b {
+        content_by_lua '
+            local sock = ngx.socket.tcp()
+            local ok, err = sock:connect("127.0.0.1", $TEST_NGINX_MEMCACHED_PORT,
+                                         {pool = "q", pool_size = 1, backlog = 1})
+            if not ok then
+                ngx.say("b: failed to connect: ", err)
+                return
+            end
+
+            ngx.say("b: connected: ", ok, ", reused: ", sock:getreusedtimes())
+
+            sock:close()
+        ';
+    }
+--- request
+GET /t
+--- response_body
+a: connected: 1, reused: 0
+b: connected: 1, reused: 1
+--- no_error_log
+[error]
+--- error_log eval
+["lua tcp socket keepalive: connection pool full, queuing connect operation",
+qr/lua tcp socket keepalive: resuming connect operation for "q"/]
+
+
+
+=== TEST 24: queued connect timed out
+--- config
+    location = /t {
+        content_by_lua '
+            local res1, res2 = ngx.location.capture_multi{{"/a"}, {"/b"}}
+            ngx.print(res1.body)
+            ngx.print(res2.body)
+        ';
+    }
+
+    location = /a {
+        content_by_lua '
+            local sock = ngx.socket.tcp()
+            local ok, err = sock:connect("127.0.0.1", $TEST_NGINX_MEMCACHED_PORT,
+                                         {pool = "t", pool_size = 1, backlog = 1})
+            if not ok then
+                ngx.say("a: failed to connect: ", err)
+                return
+            end
+
+            ngx.say("a: connected: ", ok, ", reused: ", sock:getreusedtimes())
+
+            ngx.sleep(0.2)
+
+            sock:close()
+        ';
+    }
+
+    location = /b {
+        content_by_lua '
+            local sock = ngx.socket.tcp()
+            sock:settimeout(50)
+            local ok, err = sock:connect("127.0.0.1", $TEST_NGINX_MEMCACHED_PORT,
+                                         {pool = "t", pool_size = 1, backlog = 1})
+            if not ok then
+                ngx.say("b: failed to connect: ", err)
+                return
+            end
+
+            ngx.say("b: connected: ", ok)
+        ';
+    }
+--- request
+GET /t
+--- response_body
+a: connected: 1, reused: 0
+b: failed to connect: timeout
+--- no_error_log
+[error]
+--- error_log eval
+["lua tcp socket keepalive: connection pool full, queuing connect operation",
+"lua tcp socket wait connect timed out"]
@@ -50,3 +50,28 @@ GET /sha1
 --- response_body
 2jmj7l5rSw0yVb/vlWAYkK/YBwk=
 
+
+
+
+=== TEST 4: incremental sha1 hash objects
+--- config
+    location = /sha1 {
+        content_by_lua '
+            local sha1 = ngx.sha1_new()
+
+            for _, s in ipairs({"hel", "", "lo, ", "world"}) do
+                sha1:update(s)
+            end
+
+            ngx.say(sha1:final() == ngx.sha1_bin("hello, world"))
+
+            sha1:reset()
+            sha1:update("hello")
+            ngx.say(ngx.encode_base64(sha1:final()))
+        ';
+    }
+--- request
+GET /sha1
+--- response_body
+true
+qvTGHdzF6KLavt4PO0gs2a6pQ00=
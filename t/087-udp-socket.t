@@ -5,7 +5,7 @@ use Test::Nginx::Socket;
 
 repeat_each(10);
 
-plan tests => repeat_each() * (3 * blocks() + 4);
+plan tests => repeat_each() * (3 * blocks() + 5);
 
 our $HtmlDir = html_dir;
 
@@ -492,3 +492,285 @@ GET /t
 --- error_log
 lua udp socket receive buffer size: 1400
 
+
+
+
+=== TEST 9: send_batch and receive_batch
+--- config
+    server_tokens off;
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+
+        content_by_lua '
+            local udp = ngx.socket.udp()
+
+            udp:settimeout(1000) -- 1 sec
+
+            local ok, err = udp:setpeername("127.0.0.1", ngx.var.port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            local n, err = udp:send_batch{
+                "\\0\\1\\0\\0\\0\\1\\0\\0version\\r\\n",
+                {"\\0\\2\\0\\0\\0\\1\\0\\0", "flush_all\\r\\n"},
+            }
+            if not n then
+                ngx.say("failed to send: ", err)
+                return
+            end
+
+            ngx.say("sent ", n)
+
+            local replies = {}
+            while #replies < 2 do
+                local dgrams, err = udp:receive_batch(10)
+                if not dgrams then
+                    ngx.say("failed to receive data: ", err)
+                    return
+                end
+
+                for _, dgram in ipairs(dgrams) do
+                    replies[#replies + 1] = dgram
+                end
+            end
+
+            table.sort(replies)
+
+            ngx.say("received ", #replies, ": ", string.byte(replies[1], 2),
+                    " ", string.byte(replies[2], 2), " ",
+                    string.sub(replies[2], 9, 10))
+        ';
+    }
+--- request
+GET /t
+--- response_body
+sent 2
+received 2: 1 2 OK
+--- no_error_log
+[error]
+
+
+
+=== TEST 10: setkeepalive and reuse the connection
+--- config
+    server_tokens off;
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+
+        content_by_lua '
+            local reused = {}
+
+            for i = 1, 2 do
+                local udp = ngx.socket.udp()
+
+                udp:settimeout(1000) -- 1 sec
+
+                local ok, err = udp:setpeername("127.0.0.1", ngx.var.port)
+                if not ok then
+                    ngx.say("failed to connect: ", err)
+                    return
+                end
+
+                reused[i] = udp:getreusedtimes()
+
+                local ok, err = udp:send("\\0\\1\\0\\0\\0\\1\\0\\0flush_all\\r\\n")
+                if not ok then
+                    ngx.say("failed to send: ", err)
+                    return
+                end
+
+                local data, err = udp:receive()
+                if not data then
+                    ngx.say("failed to receive data: ", err)
+                    return
+                end
+
+                ngx.say("received ", #data, " bytes")
+
+                local ok, err = udp:setkeepalive()
+                ngx.say("setkeepalive: ", ok, " ", err)
+            end
+
+            ngx.say("reused once more: ", reused[2] - reused[1])
+        ';
+    }
+--- request
+GET /t
+--- response_body
+received 12 bytes
+setkeepalive: 1 nil
+received 12 bytes
+setkeepalive: 1 nil
+reused once more: 1
+--- no_error_log
+[error]
+
+
+
+=== TEST 11: udp_send in log_by_lua
+--- config
+    server_tokens off;
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+
+        echo ok;
+
+        log_by_lua '
+            local port = tonumber(ngx.var.port)
+            for i = 1, 2 do
+                local ok, err = ngx.socket.udp_send("127.0.0.1", port,
+                    {"\\0\\1\\0\\0\\0\\1\\0\\0", "version\\r\\n"})
+                if not ok then
+                    ngx.log(ngx.ERR, "failed to send: ", err)
+                end
+            end
+
+            local ok, err = ngx.socket.udp_send("localhost", port, "hi")
+            ngx.log(ngx.WARN, "udp_send to a host name: ", err)
+        ';
+    }
+--- request
+GET /t
+--- response_body
+ok
+--- error_log
+udp_send to a host name: bad IP address "localhost"
+--- no_error_log
+[error]
+
+
+
+=== TEST 12: an idle connection is closed when a stray datagram arrives
+--- config
+    server_tokens off;
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+
+        content_by_lua '
+            local udp = ngx.socket.udp()
+
+            local ok, err = udp:setpeername("127.0.0.1", ngx.var.port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            -- the reply is left unread and arrives in the pool
+            local ok, err = udp:send("\\0\\1\\0\\0\\0\\1\\0\\0flush_all\\r\\n")
+            if not ok then
+                ngx.say("failed to send: ", err)
+                return
+            end
+
+            local ok, err = udp:setkeepalive()
+            ngx.say("setkeepalive: ", ok, " ", err)
+
+            ngx.sleep(0.1)
+
+            udp = ngx.socket.udp()
+
+            local ok, err = udp:setpeername("127.0.0.1", ngx.var.port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            ngx.say("reused: ", udp:getreusedtimes())
+
+            udp:close()
+        ';
+    }
+--- request
+GET /t
+--- response_body
+setkeepalive: 1 nil
+reused: 0
+--- no_error_log
+[error]
+
+
+
+=== TEST 13: the least recently used connection is closed when the pool is full
+--- config
+    server_tokens off;
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+
+        content_by_lua '
+            local function connect()
+                local udp = ngx.socket.udp()
+
+                local ok, err = udp:setpeername("127.0.0.1", ngx.var.port)
+                if not ok then
+                    ngx.say("failed to connect: ", err)
+                    ngx.exit(200)
+                end
+
+                return udp
+            end
+
+            local a = connect()
+            a:setkeepalive(0, 1)
+
+            local b = connect()     -- takes a over
+            local c = connect()     -- a new one
+
+            ngx.say("b: ", b:getreusedtimes(), ", c: ", c:getreusedtimes())
+
+            b:setkeepalive(0, 1)
+            c:setkeepalive(0, 1)    -- evicts b
+
+            local d = connect()
+            ngx.say("d: ", d:getreusedtimes())
+
+            local e = connect()
+            ngx.say("e: ", e:getreusedtimes())
+
+            d:close()
+            e:close()
+        ';
+    }
+--- request
+GET /t
+--- response_body
+b: 1, c: 0
+d: 1
+e: 0
+--- no_error_log
+[error]
+
+
+
+=== TEST 14: receive_batch with a bad size
+--- config
+    server_tokens off;
+    location /t {
+        set $port $TEST_NGINX_MEMCACHED_PORT;
+
+        content_by_lua '
+            local udp = ngx.socket.udp()
+
+            local ok, err = udp:setpeername("127.0.0.1", ngx.var.port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            for _, size in ipairs({0, -1, 8193}) do
+                local ok, err = pcall(udp.receive_batch, udp, 10, size)
+                ngx.say(ok, " ", string.match(err, "bad size: [-%d]+"))
+            end
+
+            udp:close()
+        ';
+    }
+--- request
+GET /t
+--- response_body
+false bad size: 0
+false bad size: -1
+false bad size: 8193
+--- no_error_log
+[error]
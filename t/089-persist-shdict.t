@@ -0,0 +1,166 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+repeat_each(1);
+
+plan tests => repeat_each() * (blocks() * 3);
+
+$ENV{TEST_NGINX_PERSIST_FILE} ||= "/tmp/ngx_lua_persist_test.dict";
+
+unlink $ENV{TEST_NGINX_PERSIST_FILE};
+
+$ENV{TEST_NGINX_DAMAGED_FILE} ||= "/tmp/ngx_lua_persist_damaged.dict";
+
+# a string item followed by a list of no items
+
+open my $out, ">$ENV{TEST_NGINX_DAMAGED_FILE}" or die $!;
+print $out pack("a8 L L", "NGXLSHD1", 0x01020304, 0),
+           pack("Q L L S C C x4", 0, 3, 0, 3, 4, 0), "foo", "bar",
+           pack("Q L L S C C x4", 0, 0, 0, 4, 5, 0), "list";
+close $out;
+
+#no_diff();
+no_long_string();
+
+no_shuffle();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: save the fields in shdict
+--- http_config
+    lua_shared_dict dogs 1m persist=$TEST_NGINX_PERSIST_FILE;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            dogs:set("foo", 32)
+            dogs:set("bah", "hello", 0, 7)
+            dogs:set("expired", true, 0.001)
+            dogs:set("cat", false, 100)
+            dogs:rpush("list", "a")
+            dogs:rpush("list", 2)
+            ngx.say(dogs:get("foo"))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+32
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: load the fields in shdict after a restart
+--- http_config
+    lua_shared_dict dogs 1m persist=$TEST_NGINX_PERSIST_FILE;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            ngx.say(dogs:get("foo"))
+            ngx.say(dogs:get("bah"))
+            ngx.say(dogs:get("expired"))
+            ngx.say(dogs:get("cat"))
+            ngx.say(dogs:lpop("list"))
+            ngx.say(dogs:lpop("list"))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+32
+hello7
+nil
+false
+a
+2
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: striped hash-indexed zone
+--- http_config
+    lua_shared_dict dogs 1m stripes=4 index=hash persist=$TEST_NGINX_PERSIST_FILE;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            ngx.say(dogs:get("foo"))
+            ngx.say(dogs:get("bah"))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+32
+hello7
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: a damaged snapshot with an empty list
+--- http_config
+    lua_shared_dict dogs 1m persist=$TEST_NGINX_DAMAGED_FILE persist_interval=0;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            ngx.say(dogs:get("foo"))
+            ngx.say(dogs:llen("list"))
+            ngx.say(dogs:lpop("list"))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+bar
+0
+nil
+--- error_log
+is damaged, truncated or from another platform, loaded 1 items only
+
+
+
+=== TEST 5: periodic snapshots written by a worker
+--- http_config
+    lua_shared_dict dogs 4m persist=$TEST_NGINX_PERSIST_FILE persist_interval=1s;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            for i = 1, 10000 do
+                dogs:set("key" .. i, i)
+            end
+
+            os.remove("$TEST_NGINX_PERSIST_FILE")
+
+            ngx.sleep(3)
+
+            local f = io.open("$TEST_NGINX_PERSIST_FILE", "rb")
+            if not f then
+                ngx.say("no snapshot")
+                return
+            end
+
+            ngx.say(f:read(8))
+            f:close()
+        ';
+    }
+--- request
+GET /test
+--- response_body
+NGXLSHD1
+--- timeout: 5
+--- no_error_log
+[error]
@@ -0,0 +1,105 @@
+#!/bin/bash
+
+# measures the throughput of tcpsock:receiveuntil() on a multipart stream
+# with a long boundary, read through a cosocket from a static file.
+#
+# usage: util/bench-receiveuntil.sh [size-in-MB] [rounds]
+#
+# it expects the nginx binary built by util/build.sh in work/sbin/, or
+# the one given by the NGINX environment variable, so that two builds
+# can be compared on the same data.
+
+size=${1:-16}
+rounds=${2:-10}
+port=${PORT:-1984}
+
+root=$(cd ${0%/*}/.. && echo $PWD)
+nginx=${NGINX:-$root/work/sbin/nginx}
+prefix=$root/work/bench
+mkdir -p $prefix/{conf,logs,html}
+
+boundary="----------------------------bench$(printf '%020d' 0)"
+
+# parts of 1 KB to 64 KB with bytes of the boundary sprinkled in, so
+# that the matcher sees plenty of partial matches
+perl -e '
+    my ($boundary, $size) = @ARGV;
+    my $total = 0;
+    srand(1);
+    while ($total < $size * 1024 * 1024) {
+        my $len = 1024 + int(rand(63 * 1024));
+        my $part = join "", map { chr(97 + int(rand(26))) } 1 .. $len;
+        substr($part, int(rand($len - 16)), 16) = substr($boundary, 0, 16);
+        print "--$boundary\r\ncontent-type: text/plain\r\n\r\n$part\r\n";
+        $total += $len;
+    }
+    print "--$boundary--\r\n";
+' "$boundary" $size > $prefix/html/multipart
+
+cat > $prefix/conf/nginx.conf <<END
+worker_processes 1;
+error_log logs/error.log warn;
+pid logs/nginx.pid;
+events { worker_connections 1024; }
+http {
+    access_log off;
+    lua_socket_buffer_size 16k;
+    server {
+        listen $port;
+        location = /multipart {
+            root html;
+        }
+        location = /t {
+            content_by_lua '
+                local sock = ngx.socket.tcp()
+                local ok, err = sock:connect("127.0.0.1", $port)
+                if not ok then
+                    ngx.say("failed to connect: ", err)
+                    return
+                end
+
+                sock:send("GET /multipart HTTP/1.0\\\\r\\\\n\\\\r\\\\n")
+
+                local read_headers = sock:receiveuntil("\\\\r\\\\n\\\\r\\\\n")
+                read_headers()
+
+                local reader = sock:receiveuntil("\\\\r\\\\n--$boundary")
+
+                ngx.update_time()
+                local start = ngx.now()
+                local parts, bytes = 0, 0
+
+                while true do
+                    local data, err = reader(8192)
+                    if err then
+                        break
+                    end
+
+                    if data then
+                        bytes = bytes + #data
+                    else
+                        parts = parts + 1
+                    end
+                end
+
+                ngx.update_time()
+                ngx.say(parts, " ", bytes, " ", ngx.now() - start)
+                sock:close()
+            ';
+        }
+    }
+}
+END
+
+$nginx -p $prefix/ -c conf/nginx.conf || exit 1
+sleep 1
+
+printf "%-8s %8s %12s %10s\n" round parts bytes "MB/sec"
+
+for ((i = 1; i <= rounds; i++)); do
+    curl -s http://127.0.0.1:$port/t | awk -v i=$i '
+        { printf "%-8d %8d %12d %10.1f\n", i, $1, $2,
+                 $3 > 0 ? $2 / $3 / 1048576 : 0 }'
+done
+
+kill -QUIT $(cat $prefix/logs/nginx.pid)
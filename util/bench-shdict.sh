@@ -0,0 +1,74 @@
+#!/bin/bash
+
+# measures ngx.shared.DICT incr/get throughput against the number of
+# nginx worker processes, with and without lock striping.
+#
+# usage: util/bench-shdict.sh [max-workers] [stripes]
+#
+# it expects the nginx binary built by util/build.sh in work/sbin/ and
+# the "ab" tool in PATH.
+
+max_workers=${1:-8}
+stripes=${2:-16}
+ops=200
+requests=${REQUESTS:-20000}
+concurrency=${CONCURRENCY:-64}
+port=${PORT:-1984}
+
+root=$(cd ${0%/*}/.. && echo $PWD)
+nginx=$root/work/sbin/nginx
+prefix=$root/work/bench
+mkdir -p $prefix/{conf,logs}
+
+run() {
+    local workers=$1
+    local zone_args=$2
+
+    cat > $prefix/conf/nginx.conf <<END
+worker_processes $workers;
+error_log logs/error.log warn;
+pid logs/nginx.pid;
+events { worker_connections 1024; }
+http {
+    access_log off;
+    lua_shared_dict bench 64m $zone_args;
+    server {
+        listen $port;
+        location = /t {
+            content_by_lua '
+                local d = ngx.shared.bench
+                for i = 1, $ops do
+                    local k = "k" .. (i % 1000)
+                    if not d:incr(k, 1) then
+                        d:add(k, 0)
+                    end
+                    d:get(k)
+                end
+                ngx.say("ok")
+            ';
+        }
+    }
+}
+END
+
+    $nginx -p $prefix/ -c conf/nginx.conf || exit 1
+    sleep 1
+
+    local rps=$(ab -q -k -n $requests -c $concurrency \
+                   http://127.0.0.1:$port/t 2>/dev/null \
+                | awk '/^Requests per second/ { print $4 }')
+
+    kill -QUIT $(cat $prefix/logs/nginx.pid)
+    sleep 1
+
+    # each request does one incr and one get per iteration
+    echo "$rps" | awk -v ops=$ops '{ printf "%d", $1 * ops * 2 }'
+}
+
+printf "%-8s %16s %16s\n" workers "ops/sec" "ops/sec (stripes=$stripes)"
+
+for ((w = 1; w <= max_workers; w *= 2)); do
+    plain=$(run $w "")
+    striped=$(run $w "stripes=$stripes")
+    printf "%-8d %16s %16s\n" $w $plain $striped
+done